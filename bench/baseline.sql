@@ -0,0 +1,3 @@
+-- Same reads as hot_hit.sql, without the cache.
+\set g random(1, :groups - 1)
+SELECT count(*), sum(length(val)) FROM items_nocache WHERE grp = :g;
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Run pgc_fdw_cache_bench() from several sessions at once, and report the
+# result of each session and their aggregate.
+#
+#   bench/cache_bench.sh [-c clients] [-n ntuples] [-w width] [-i iterations]
+#                        [-z compression] [psql options]
+#
+# The database must have the pgc_fdw extension, and the fdb cluster file of
+# the server must point at the cluster to measure, e.g. a local fdbserver.
+
+clients=1
+ntuples=10000
+width=100
+iterations=20
+compression=none
+
+while getopts c:n:w:i:z: opt; do
+	case $opt in
+	c) clients=$OPTARG ;;
+	n) ntuples=$OPTARG ;;
+	w) width=$OPTARG ;;
+	i) iterations=$OPTARG ;;
+	z) compression=$OPTARG ;;
+	*) echo "usage: $0 [-c clients] [-n ntuples] [-w width] [-i iterations] [-z compression] [psql options]" >&2
+	   exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+# status has no MB/s nor bytes per tuple, keep the columns aligned for awk
+sql="select op, runs, tuples_per_sec, coalesce(mb_per_sec, 0), p50_ms, p99_ms,
+	coalesce(round(bytes_per_tuple::numeric, 1)::text, '-')
+	from pgc_fdw_cache_bench($ntuples, $width, $iterations, '$compression')"
+
+i=0
+while [ $i -lt "$clients" ]; do
+	psql -X -q -A -t -F ' ' -v ON_ERROR_STOP=1 -c "$sql" "$@" > "$out/$i" &
+	i=$((i + 1))
+done
+
+status=0
+for pid in $(jobs -p); do
+	wait "$pid" || status=1
+done
+if [ $status -ne 0 ]; then
+	echo "a session failed" >&2
+	exit 1
+fi
+
+echo "clients=$clients ntuples=$ntuples width=$width iterations=$iterations compression=$compression"
+echo
+echo "per session:"
+printf '%-8s %6s %14s %10s %10s %10s %10s\n' op runs tuples/s MB/s p50_ms p99_ms B/tuple
+for f in "$out"/*; do
+	awk '{ printf "%-8s %6d %14.0f %10.2f %10.3f %10.3f %10s\n", $1, $2, $3, $4, $5, $6, $7 }' "$f"
+done
+
+# Aggregate throughput is the sum over sessions, latency the worst session.
+echo
+echo "aggregate:"
+cat "$out"/* | awk '
+	{ tps[$1] += $3; mbs[$1] += $4; if ($5 > p50[$1]) p50[$1] = $5; if ($6 > p99[$1]) p99[$1] = $6; bpt[$1] = $7 }
+	END {
+		n = split("populate status retrieve", ops, " ")
+		for (i = 1; i <= n; i++) {
+			op = ops[i]
+			printf "%-8s %14.0f %10.2f %10.3f %10.3f %10s\n", op, tps[op], mbs[op], p50[op], p99[op], bpt[op]
+		}
+	}'
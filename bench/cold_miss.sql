@@ -0,0 +1,4 @@
+-- Every read has a query of its own, all misses: remote query plus populate.
+\set g random(1, :groups - 1)
+\set lo random(1, 1000000000)
+SELECT count(*), sum(length(val)) FROM items_cached WHERE grp = :g AND id > -:lo;
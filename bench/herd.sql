@@ -0,0 +1,4 @@
+-- All clients read the same entry, which expires every second, so they all
+-- find it expired at once: one refreshes it, the others serve it stale, see
+-- items_short in local.sql.
+SELECT count(*), sum(length(val)) FROM items_short WHERE grp = 1;
@@ -0,0 +1,3 @@
+-- Reads of a few entries that stay fresh, all hits once warmed up.
+\set g random(1, :groups - 1)
+SELECT count(*), sum(length(val)) FROM items_cached WHERE grp = :g;
@@ -0,0 +1,22 @@
+-- Foreign tables of the pgbench suite, see run.sh.  The same remote table
+-- under different cache settings:
+--   items_nocache  cache_timeout 0, plain postgres_fdw behaviour
+--   items_cached   cache_timeout 3600, entries stay fresh for the run
+--   items_short    cache_timeout 1, entries expire every second, and are
+--                  served stale for another second while one client
+--                  refreshes them
+
+CREATE EXTENSION IF NOT EXISTS pgc_fdw;
+
+DROP SERVER IF EXISTS bench_remote CASCADE;
+CREATE SERVER bench_remote FOREIGN DATA WRAPPER pgc_fdw
+	OPTIONS (host :'remote_host', port :'remote_port', dbname :'remote_db');
+CREATE USER MAPPING FOR CURRENT_USER SERVER bench_remote;
+
+CREATE FOREIGN TABLE items_nocache (id int, grp int, val text)
+	SERVER bench_remote OPTIONS (table_name 'bench_items', cache_timeout '0');
+CREATE FOREIGN TABLE items_cached (id int, grp int, val text)
+	SERVER bench_remote OPTIONS (table_name 'bench_items', cache_timeout '3600');
+CREATE FOREIGN TABLE items_short (id int, grp int, val text)
+	SERVER bench_remote OPTIONS (table_name 'bench_items', cache_timeout '1',
+		cache_stale_grace '1');
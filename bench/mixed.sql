@@ -0,0 +1,9 @@
+-- 90% reads of fresh entries, 10% writes through the foreign table.
+\set g random(1, :groups - 1)
+\set id random(1, :rows)
+\set r random(1, 100)
+\if :r <= 10
+UPDATE items_cached SET val = md5(random()::text) || repeat('y', 100) WHERE id = :id;
+\else
+SELECT count(*), sum(length(val)) FROM items_cached WHERE grp = :g;
+\endif
@@ -0,0 +1,14 @@
+-- Schema of the "remote" server of the pgbench suite, see run.sh.
+-- :rows rows in :groups groups.
+
+DROP TABLE IF EXISTS bench_items;
+CREATE TABLE bench_items (
+	id int PRIMARY KEY,
+	grp int NOT NULL,
+	val text NOT NULL
+);
+INSERT INTO bench_items
+	SELECT i, i % :groups, md5(i::text) || repeat('x', 100)
+	FROM generate_series(1, :rows) i;
+CREATE INDEX ON bench_items (grp);
+ANALYZE bench_items;
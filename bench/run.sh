@@ -0,0 +1,138 @@
+#!/bin/sh
+#
+# End-to-end pgbench suite of pgc_fdw.
+#
+# Starts a local fdbserver, a "remote" postgres holding the data and a
+# "local" postgres with pgc_fdw preloaded, creates foreign tables of the
+# same remote table with different cache_timeout (see local.sql), and runs
+# each workload with pgbench:
+#
+#   baseline   reads without the cache
+#   hot_hit    reads of fresh entries
+#   cold_miss  reads that all miss
+#   herd       all clients on one entry that expires every second
+#   mixed      90% hot reads, 10% writes
+#
+#   bench/run.sh [-c clients] [-j threads] [-T seconds] [-r rows] [-g groups]
+#                [-w workdir] [-k] [workload ...]
+#
+# The workdir is removed first, so -w must name a directory that does not
+# exist or that an earlier run created, which is marked with a file
+# .pgc_fdw_bench.  -k keeps the servers running, and the workdir, when
+# done.  Binaries are
+# taken from PATH, or from PGBIN and FDBBIN if set.  Each workload reports
+# the pgbench summary and the cache statistics of the run.
+
+set -e
+
+clients=8
+threads=4
+duration=30
+rows=100000
+groups=100
+work=/tmp/pgc_fdw_bench
+marker=.pgc_fdw_bench
+keep=0
+
+while getopts c:j:T:r:g:w:k opt; do
+	case $opt in
+	c) clients=$OPTARG ;;
+	j) threads=$OPTARG ;;
+	T) duration=$OPTARG ;;
+	r) rows=$OPTARG ;;
+	g) groups=$OPTARG ;;
+	w) work=$OPTARG ;;
+	k) keep=1 ;;
+	*) sed -n '2,/^$/s/^# \{0,1\}//p' "$0" >&2
+	   exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+workloads=${*:-baseline hot_hit cold_miss herd mixed}
+
+here=$(cd "$(dirname "$0")" && pwd)
+pgbin=${PGBIN:+$PGBIN/}
+fdbbin=${FDBBIN:+$FDBBIN/}
+
+fdb_port=4689
+remote_port=5492
+local_port=5491
+
+stop() {
+	if [ $keep -eq 1 ]; then
+		echo "servers left running, workdir $work"
+		return
+	fi
+	"${pgbin}pg_ctl" -D "$work/local" -m immediate stop > /dev/null 2>&1 || true
+	"${pgbin}pg_ctl" -D "$work/remote" -m immediate stop > /dev/null 2>&1 || true
+	if [ -f "$work/fdb.pid" ]; then
+		kill "$(cat "$work/fdb.pid")" 2> /dev/null || true
+	fi
+	if [ -f "$work/$marker" ]; then
+		rm -rf "$work"
+	fi
+}
+
+if [ -e "$work" ] && [ ! -f "$work/$marker" ]; then
+	echo "$work exists and is not a workdir of $0, not removing it" >&2
+	exit 1
+fi
+rm -rf "$work"
+mkdir -p "$work/fdb/data" "$work/fdb/log"
+touch "$work/$marker"
+trap stop EXIT
+
+# fdb, single process, memory storage
+echo "bench:bench@127.0.0.1:$fdb_port" > "$work/fdb.cluster"
+"${fdbbin}fdbserver" -p "127.0.0.1:$fdb_port" -C "$work/fdb.cluster" \
+	-d "$work/fdb/data" -L "$work/fdb/log" > "$work/fdb/out.log" 2>&1 &
+echo $! > "$work/fdb.pid"
+"${fdbbin}fdbcli" -C "$work/fdb.cluster" --timeout 30 --exec "configure new single memory" > /dev/null
+export FDB_CLUSTER_FILE="$work/fdb.cluster"
+
+# remote
+"${pgbin}initdb" -D "$work/remote" -A trust > /dev/null
+"${pgbin}pg_ctl" -D "$work/remote" -l "$work/remote.log" -w \
+	-o "-p $remote_port -k $work -c listen_addresses=''" start > /dev/null
+"${pgbin}psql" -X -q -h "$work" -p $remote_port -d postgres -v ON_ERROR_STOP=1 \
+	-v rows=$rows -v groups=$groups -f "$here/remote.sql"
+
+# local, the cache statistics need pgc_fdw preloaded
+"${pgbin}initdb" -D "$work/local" -A trust > /dev/null
+"${pgbin}pg_ctl" -D "$work/local" -l "$work/local.log" -w \
+	-o "-p $local_port -k $work -c listen_addresses='' -c shared_preload_libraries=pgc_fdw -c max_connections=$((clients + 20))" \
+	start > /dev/null
+"${pgbin}psql" -X -q -h "$work" -p $local_port -d postgres -v ON_ERROR_STOP=1 \
+	-v remote_host="$work" -v remote_port=$remote_port -v remote_db=postgres \
+	-f "$here/local.sql"
+
+psql_local() {
+	"${pgbin}psql" -X -q -h "$work" -p $local_port -d postgres -v ON_ERROR_STOP=1 "$@"
+}
+
+for w in $workloads; do
+	if [ ! -f "$here/$w.sql" ]; then
+		echo "no workload $w" >&2
+		exit 1
+	fi
+
+	# Each run starts from an empty cache.
+	psql_local -c "select count(pgc_fdw_invalidate(sha)) from pgc_fdw_cache_info()" > /dev/null
+	if [ "$w" = hot_hit ] || [ "$w" = mixed ]; then
+		"${pgbin}pgbench" -n -M simple -h "$work" -p $local_port -c "$clients" -j "$threads" \
+			-t $((groups * 2 / clients + 1)) -D rows=$rows -D groups=$groups \
+			-f "$here/hot_hit.sql" postgres > /dev/null
+	fi
+	psql_local -c "select pgc_fdw_cache_stats_reset()" > /dev/null
+
+	echo "=== $w: clients=$clients threads=$threads duration=${duration}s rows=$rows groups=$groups"
+	"${pgbin}pgbench" -n -M simple -h "$work" -p $local_port -c "$clients" -j "$threads" \
+		-T "$duration" -r -D rows=$rows -D groups=$groups \
+		-f "$here/$w.sql" postgres | grep -E '^(number of transactions actually|latency|tps)|^ +[0-9.]+ +'
+	psql_local -c "select hits, misses, stale_hits, waits, bypasses, populates,
+			round(status_time_ms::numeric / greatest(hits + misses + bypasses, 1), 3) as status_ms,
+			round(remote_time_ms::numeric / greatest(misses + bypasses, 1), 3) as remote_ms,
+			round(populate_time_ms::numeric / greatest(populates, 1), 3) as populate_ms
+		from pgc_fdw_cache_stats where scope = 'global'"
+	echo
+done
@@ -5,13 +5,37 @@
  *-------------------------------------------------------------------------
  */
 #include "cache.h"
+#include "common/hashfn.h"
+#include "common/pg_lzcompress.h"
+#include "utils/guc.h"
 #include <pthread.h>
 
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+/* GUCs, in ms */
+static int populate_lease = 30000;
+static int populate_wait = 10000;
+
+#define PGC_WAIT_POLL_US 1000
+
 static bool fdb_inited;
 static FDBDatabase *fdb;
 static pthread_t pth;
 
+/*
+ * Network is started on first use, not in _PG_init, as the postmaster
+ * loads us with shared_preload_libraries and its thread would not survive
+ * the fork.
+ */
 FDBDatabase *get_fdb() {
+	if (!fdb) {
+		pgcache_init();
+	}
 	return fdb;
 }
 
@@ -35,15 +59,193 @@ void pgcache_init()
 
 void pgcache_fini()
 {
+	if (!fdb) {
+		return;
+	}
 	CHECK_ERR(fdb_stop_network(), "Cannot stop fdb network.");
 	CHECK_ERR(pthread_join(pth, NULL), "Cannot join fdb network thread");
 	fdb = 0;
 }
 
-int32_t pgcache_get_status(const qry_key_t *qk, int64_t ts, int64_t *to, const char* qstr) 
+/*
+ * Fingerprint of the row type a query is cached as.  Cached tuples are 
+ * binary images, so an entry is only good for readers that agree on the
+ * row layout, the server major version, the platform and the block layout.
+ */
+uint32_t pgcache_fingerprint(TupleDesc tupdesc, List *retrieved_attrs)
+{
+	uint32_t h;
+	uint32_t v[5];
+	ListCell *lc;
+
+	v[0] = PG_VERSION_NUM / 100;
+	v[1] = MAXIMUM_ALIGNOF;
+#ifdef WORDS_BIGENDIAN
+	v[2] = 1;
+#else
+	v[2] = 0;
+#endif
+	v[3] = tupdesc->natts;
+	v[4] = PGC_BLOCK_FORMAT;
+	h = hash_bytes((const unsigned char *) v, sizeof(v));
+
+	for (int i = 0; i < tupdesc->natts; i++) {
+		Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+		int32_t a[6];
+
+		a[0] = attr->atttypid;
+		a[1] = attr->atttypmod;
+		a[2] = attr->attlen;
+		a[3] = attr->attbyval;
+		a[4] = attr->attalign;
+		a[5] = attr->attisdropped;
+		h = hash_combine(h, hash_bytes((const unsigned char *) a, sizeof(a)));
+	}
+
+	foreach(lc, retrieved_attrs) {
+		h = hash_combine(h, hash_bytes_uint32((uint32) lfirst_int(lc)));
+	}
+	return h;
+}
+
+void pgcache_lease_init(void)
+{
+	DefineCustomIntVariable("pgc_fdw.populate_lease",
+			"How long a populate holds its claim on a cache entry without renewing it.",
+			"Other backends take over a populate whose lease expired.",
+			&populate_lease,
+			30000, 100, INT_MAX / 1000,
+			PGC_SUSET, GUC_UNIT_MS,
+			NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgc_fdw.populate_wait",
+			"How long a scan waits for another backend populating the same cache entry.",
+			"After that, the scan queries the remote server itself.",
+			&populate_wait,
+			10000, 0, INT_MAX / 1000,
+			PGC_USERSET, GUC_UNIT_MS,
+			NULL, NULL, NULL);
+}
+
+/*
+ * Add delta to counter name, under PGCM + name.
+ */
+void pgcache_metric_add(FDBTransaction *tr, const char *name, int64_t delta)
+{
+	char key[4 + NAMEDATALEN];
+	int namesz = Min(strlen(name), NAMEDATALEN);
+	uint64_t v = pgc_le64((uint64_t) delta);
+
+	memcpy(key, "PGCM", 4);
+	memcpy(key + 4, name, namesz);
+	fdb_transaction_atomic_op(tr, (const uint8_t *) key, 4 + namesz,
+			(const uint8_t *) &v, sizeof(v), FDB_MUTATION_TYPE_ADD);
+}
+
+/*
+ * Record a use of qk at ts in tr, and a hit if hit.
+ */
+static void acc_touch(FDBTransaction *tr, const qry_key_t *qk, int64_t ts, bool hit)
+{
+	acc_key_t ak;
+	uint64_t v;
+
+	acc_key_init(&ak, qk->SHA, PGC_ACC_LAST);
+	v = pgc_le64((uint64_t) ts);
+	fdb_transaction_atomic_op(tr, (const uint8_t *) &ak, sizeof(ak), 
+			(const uint8_t *) &v, sizeof(v), FDB_MUTATION_TYPE_MAX);
+	if (hit) {
+		acc_key_init(&ak, qk->SHA, PGC_ACC_HITS);
+		v = pgc_le64(1);
+		fdb_transaction_atomic_op(tr, (const uint8_t *) &ak, sizeof(ak), 
+				(const uint8_t *) &v, sizeof(v), FDB_MUTATION_TYPE_ADD);
+	}
+}
+
+/*
+ * Hits record access stats in a transaction of their own, and we do not
+ * wait for its commit, a hit should not pay a commit for it.  Commits in
+ * flight are reaped by later touches.  Best effort, stats of a hit may be
+ * lost.
+ */
+#define PGC_MAX_TOUCH 16
+static FDBTransaction *touchTr[PGC_MAX_TOUCH];
+static FDBFuture *touchF[PGC_MAX_TOUCH];
+static int ntouch;
+
+static void touch_reap(bool wait)
+{
+	int n = 0;
+
+	for (int i = 0; i < ntouch; i++) {
+		if (wait || fdb_future_is_ready(touchF[i])) {
+			fdb_future_block_until_ready(touchF[i]);
+			fdb_future_destroy(touchF[i]);
+			fdb_transaction_destroy(touchTr[i]);
+		} else {
+			touchTr[n] = touchTr[i];
+			touchF[n] = touchF[i];
+			n++;
+		}
+	}
+	ntouch = n;
+}
+
+void pgcache_touch(const qry_key_t *qk, int64_t ts)
+{
+	FDBTransaction *tr = 0;
+
+	touch_reap(false);
+	if (ntouch == PGC_MAX_TOUCH) {
+		touch_reap(true);
+	}
+
+	if (fdb_database_create_transaction(get_fdb(), &tr)) {
+		return;
+	}
+	acc_touch(tr, qk, ts, true);
+	touchTr[ntouch] = tr;
+	touchF[ntouch] = fdb_transaction_commit(tr);
+	ntouch++;
+}
+
+/*
+ * A new meta of query qstr, to claim its populate.
+ */
+static qry_val_t *qry_val_new(const char *qstr, int64_t timeout, int64_t grace, uint32_t fpr, int *pqvsz)
+{
+	qry_val_t *qv;
+	int qstrsz = strlen(qstr);
+	int qvsz = qry_val_sz(qstrsz);
+
+	qv = (qry_val_t *) palloc0(qvsz);
+	qv->timeout = timeout;
+	qv->grace = grace;
+	qv->status = QRY_FETCH;
+	qv->fingerprint = fpr;
+	qv->ownerpid = MyProcPid;
+	qv->txtsz = qstrsz;
+	memcpy(qv->qrytxt, qstr, qstrsz); 
+	qv->qrytxt[qstrsz] = 0;
+	*pqvsz = qvsz;
+	return qv;
+}
+
+/*
+ * Look up the entry of qk at ts, *to is its timeout.  Return the number of
+ * tuples of a usable entry, and set *to to its generation.  Return 
+ * QRY_FETCH if we claimed the populate of generation *to.  An entry that
+ * expired less than grace ago is still returned, while the first caller 
+ * to see it stale claims its refresh.  Unless claim, return QRY_MISS 
+ * instead of claiming a new entry.  Serving a stale entry, waiting, fdb 
+ * round trips and time taken are counted in st.
+ */
+int32_t pgcache_get_status(const qry_key_t *qk, int64_t ts, int64_t *to, int64_t grace, uint32_t fpr, bool claim, 
+		const char* qstr, pgcache_stats_t *st) 
 {
 	FDBTransaction *tr = 0;
 	FDBFuture *f = 0;
+	FDBFuture *fw = 0;
 	fdb_error_t err;
 	int32_t ret = QRY_FAIL;
 
@@ -51,32 +253,99 @@ int32_t pgcache_get_status(const qry_key_t *qk, int64_t ts, int64_t *to, const c
 	const qry_val_t *qvbuf = 0;
 	qry_val_t *qv = 0;
 	int qvsz;
-	int qstrsz;
+	int nerr = 0;
+	int64_t deadline = ts + (int64_t) populate_wait * 1000;
+	int64_t start = get_ts();
+	bool everwaited = false;
 
-	qstrsz = strlen(qstr); 
-	qvsz = qry_val_sz(qstrsz); 
-	qv = (qry_val_t *) palloc(qvsz);
-	qv->ts = ts;
-	qv->status = QRY_FETCH;
-	qv->txtsz = qstrsz;
-	memcpy(qv->qrytxt, qstr, qstrsz); 
-	qv->qrytxt[qstrsz] = 0;
+	qv = qry_val_new(qstr, *to, grace, fpr, &qvsz);
+
+	while (ret == QRY_FAIL) {
+		bool takeover;
+		bool stale;
+		bool waited = false;
+		int32_t ownerpid;
 
-	/* TODO: Magic 10 */
-	for (int i = 0; i < 10; i++) {
 		ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
 		f = fdb_transaction_get(tr, (const uint8_t *) qk, sizeof(qry_key_t), 0); 
+		pgcache_stats_add(st, PGC_STAT_FDB_ROUND_TRIPS, 1);
 		ERR_DONE( fdb_wait_error(f), "fdb future failed");
 		ERR_DONE( fdb_future_get_value(f, &found, (const uint8_t **) &qvbuf, &qvsz), "fdb get value failed");
 
-		/* If not found, or, qv is very old, we add a new entry to fetch remote ... */
-		if (!found || qvbuf->ts + *to < ts) {
+		/* A populate in flight whose owner stopped renewing its lease. */
+		takeover = found && qvbuf->status == QRY_FETCH && qvbuf->lease < ts;
+		ownerpid = found ? qvbuf->ownerpid : 0;
+
+		/* Expired, but within grace, and good for us otherwise. */
+		stale = found && qvbuf->status >= 0 && qvbuf->fingerprint == fpr &&
+			qvbuf->ts + qv->timeout < ts && qvbuf->ts + qv->timeout + grace >= ts;
+
+		if (stale && (qvbuf->refts == 0 || qvbuf->lease < ts)) {
+			/* 
+			 * Claim the refresh, the published generation stays as is for 
+			 * everyone else until we publish ours.
+			 */
+			qry_val_t *rv = (qry_val_t *) palloc(qvsz);
+			bool reftakeover = qvbuf->refts != 0;
+
+			memcpy(rv, qvbuf, qvsz);
+			rv->timeout = qv->timeout;
+			rv->grace = grace;
+			rv->refts = ts;
+			rv->lease = ts + (int64_t) populate_lease * 1000;
+			rv->ownerpid = MyProcPid;
+			fdb_future_destroy(f);
+			f = 0;
+			fdb_transaction_set(tr, (const uint8_t *) qk, sizeof(qry_key_t), (const uint8_t *) rv, qvsz);
+			pfree(rv);
+			if (reftakeover) {
+				pgcache_metric_add(tr, PGC_METRIC_LEASE_TAKEOVER, 1);
+			}
+			f = fdb_transaction_commit(tr);
+			pgcache_stats_add(st, PGC_STAT_FDB_ROUND_TRIPS, 1);
+			if (!fdb_wait_error(f)) {
+				ret = QRY_FETCH;
+				*to = ts;
+			}
+			goto done;
+		} else if (stale) {
+			/* Someone is refreshing it, serve what we have. */
+			ret = qvbuf->status;
+			*to = qvbuf->ts;
+			pgcache_touch(qk, ts);
+			pgcache_stats_add(st, PGC_STAT_STALE_HITS, 1);
+			goto done;
+		}
+
+		/* 
+		 * If not found, or, qv is very old, or was populated for another
+		 * row type, or abandoned, we add a new entry to fetch remote ... 
+		 * A populate in flight is only ours once its lease ran out, however
+		 * long it has been going.
+		 */
+		if (!found || takeover ||
+			(qvbuf->status != QRY_FETCH && qvbuf->ts + qv->timeout < ts) ||
+			(qvbuf->status >= 0 && qvbuf->fingerprint != fpr)) {
+			if (!claim) {
+				ret = QRY_MISS;
+				goto done;
+			}
 			fdb_future_destroy(f);
 			f = 0;
+			qv->ts = ts;
+			qv->lease = ts + (int64_t) populate_lease * 1000;
 			fdb_transaction_set(tr, (const uint8_t *) qk, sizeof(qry_key_t), (const uint8_t *) qv, qvsz);
+			acc_touch(tr, qk, ts, false);
+			if (takeover) {
+				pgcache_metric_add(tr, PGC_METRIC_LEASE_TAKEOVER, 1);
+			}
 			f = fdb_transaction_commit(tr);
+			pgcache_stats_add(st, PGC_STAT_FDB_ROUND_TRIPS, 1);
 			err = fdb_wait_error(f);
 			if (!err) {
+				if (takeover) {
+					elog(LOG, "pgc_fdw took over populate abandoned by pid %d", ownerpid);
+				}
 				ret = QRY_FETCH;
 				*to = ts;
 				goto done;
@@ -84,17 +353,60 @@ int32_t pgcache_get_status(const qry_key_t *qk, int64_t ts, int64_t *to, const c
 		} else if (qvbuf->status >= 0) {
 			ret = qvbuf->status;
 			*to = qvbuf->ts;
+			pgcache_touch(qk, ts);
 			goto done;
 		} else if (qvbuf->status == QRY_FDB_LIMIT_REACHED) {
 			ret = qvbuf->status;
 			goto done;
+		} else if (ownerpid == MyProcPid) {
+			/* Another scan of ours is populating it as it goes, see pgcache_writer_t. */
+			ret = QRY_FAIL_NO_RETRY;
+			goto done;
+		} else if (ts >= deadline) {
+			/* Waited long enough, go remote without populating. */
+			ret = QRY_FAIL_NO_RETRY;
+			goto done;
 		} else {
+			/* 
+			 * Wait for the populate to finish, or its lease to expire.  The
+			 * watch is only armed once the transaction commits.
+			 */
+			int64_t until = Min(qvbuf->lease, deadline);
+
+			waited = true;
+			everwaited = true;
 			fdb_future_destroy(f);
-			f = fdb_transaction_watch(tr, (const uint8_t *) qk, sizeof(qry_key_t)); 
-			fdb_wait_error(f);
+			fw = fdb_transaction_watch(tr, (const uint8_t *) qk, sizeof(qry_key_t)); 
+			f = fdb_transaction_commit(tr);
+			pgcache_stats_add(st, PGC_STAT_FDB_ROUND_TRIPS, 1);
+			if (!fdb_wait_error(f)) {
+				/* Don't leave the watch armed on the cluster if we are cancelled. */
+				PG_TRY();
+				{
+					while (!fdb_future_is_ready(fw) && get_ts() < until) {
+						CHECK_FOR_INTERRUPTS();
+						pg_usleep(PGC_WAIT_POLL_US);
+					}
+				}
+				PG_CATCH();
+				{
+					fdb_future_cancel(fw);
+					fdb_future_destroy(fw);
+					fdb_future_destroy(f);
+					fdb_transaction_destroy(tr);
+					PG_RE_THROW();
+				}
+				PG_END_TRY();
+			}
 		}
 
 done:
+		if (fw) {
+			fdb_future_cancel(fw);
+			fdb_future_destroy(fw);
+			fw = 0;
+		}
+
 		if (f) {
 			fdb_future_destroy(f);
 			f = 0;
@@ -105,10 +417,17 @@ done:
 			tr = 0;
 		}
 
-		if (ret != QRY_FAIL) {
+		/* fdb errors and lost claim races are retried a few times */
+		if (ret == QRY_FAIL && !waited && nerr++ >= PGC_MAX_RETRY) {
 			break;
 		}
+		ts = get_ts();
+	}
+
+	if (everwaited) {
+		pgcache_stats_add(st, PGC_STAT_WAITS, 1);
 	}
+	pgcache_stats_add(st, PGC_STAT_STATUS_US, get_ts() - start);
 
 	if (qv) {
 		pfree(qv);
@@ -117,58 +436,28 @@ done:
 	return ret;
 }
 
-int32_t pgcache_retrieve(const qry_key_t *qk, int64_t ts, int *ntup, HeapTuple **ptups)
+/*
+ * Number of tuples of the entry of qk if it is fresh for a reader with 
+ * timeout at now, QRY_MISS otherwise.  Claims and touches nothing, for the
+ * planner.
+ */
+int32_t pgcache_peek(const qry_key_t *qk, int64_t now, int64_t timeout)
 {
 	FDBTransaction *tr = 0;
 	FDBFuture *f = 0;
-	int32_t ret = QRY_FAIL;
-
 	fdb_bool_t found;
-	qry_val_t *qv = 0;
+	const qry_val_t *qvbuf;
 	int qvsz;
-
-	tup_key_t ka;
-	tup_key_t kz;
-	const FDBKeyValue *outkv;
-	int kvcnt;
-	HeapTuple *tups = 0;
+	int32_t ret = QRY_MISS;
 
 	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
-	f = fdb_transaction_get(tr, (const uint8_t *) qk, sizeof(qry_key_t), 0); 
+	f = fdb_transaction_get(tr, (const uint8_t *) qk, sizeof(qry_key_t), 1);
 	ERR_DONE( fdb_wait_error(f), "fdb future failed");
-	ERR_DONE( fdb_future_get_value(f, &found, (const uint8_t **) &qv, &qvsz), "fdb get value failed");
-	ERR_DONE( !found || qv->ts != ts, "qry key not found");
-	ERR_DONE( qv->status < 0, "qry race.");
-
-	*ntup = qv->status;
-	tups = (HeapTuple *) palloc0(*ntup * sizeof(HeapTuple));
-	*ptups = tups;
-	
-	tup_key_initsha(&ka, qk->SHA, 0);
-	tup_key_initsha(&kz, qk->SHA, -1); 
+	ERR_DONE( fdb_future_get_value(f, &found, (const uint8_t **) &qvbuf, &qvsz), "fdb get value failed");
 
-	fdb_future_destroy(f);
-	f = fdb_transaction_get_range(tr, 
-			(const uint8_t *)&ka, sizeof(tup_key_t), 0, 1,
-			(const uint8_t *)&kz, sizeof(tup_key_t), 0, 1,
-			0, 0, FDB_STREAMING_MODE_WANT_ALL, 1, 0, 0);
-	ERR_DONE( fdb_wait_error(f), "get range failed");
-	ERR_DONE( fdb_future_get_keyvalue_array(f, &outkv, &kvcnt, &found), "retrieve kv array failed.");
-	ERR_DONE( kvcnt != *ntup, "kvcount mismatch! get %d, expecting %d", kvcnt, *ntup);
-
-	for (int i = 0; i < kvcnt; i++) {
-		char *dst;
-		/* 
-		 * tup_key_t *tk = (tup_key_t *) outkv[i].key;
-		 * elog(LOG, "Reading a key, seq %d, klen %d, vlen %d.", tk->seq, outkv[i].key_length, outkv[i].value_length); 
-		 */
-		dst = (char *) palloc(outkv[i].value_length);
-		memcpy(dst, outkv[i].value, outkv[i].value_length);
-		tups[i] = (HeapTuple) dst;
-		/* FUBAR: unmarshaling */
-		tups[i]->t_data = (HeapTupleHeader) (dst + HEAPTUPLESIZE);
+	if (found && qvbuf->status >= 0 && qvbuf->ts + timeout >= now) {
+		ret = qvbuf->status;
 	}
-	ret = *ntup;
 
 done:
 	if (f) {
@@ -180,27 +469,36 @@ done:
 		fdb_transaction_destroy(tr);
 		tr = 0;
 	}
-
 	return ret;
 }
 
-static int32_t pgcache_set_qry(const qry_key_t *qk, const uint8_t *qv, int qvsz)
+/*
+ * Number of tuples of the entry of qk if it is good for a reader with 
+ * timeout and row type fpr at now, not even stale, and its generation in
+ * *pgen.  QRY_MISS otherwise.  Claims nothing, for a parallel scan that 
+ * reads a fresh entry or leaves the scan to one participant.
+ */
+int32_t pgcache_fresh(const qry_key_t *qk, int64_t now, int64_t timeout, uint32_t fpr, int64_t *pgen,
+		pgcache_stats_t *st)
 {
 	FDBTransaction *tr = 0;
 	FDBFuture *f = 0;
-	int32_t ret = QRY_FAIL;
-	fdb_error_t err;
-
-	ERR_DONE(fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
-	f = fdb_transaction_get(tr, (const uint8_t *)qk, sizeof(qry_key_t), 0);
-	ERR_DONE(fdb_wait_error(f), "fdb future failed");
+	fdb_bool_t found;
+	const qry_val_t *qvbuf;
+	int qvsz;
+	int32_t ret = QRY_MISS;
+	int64_t start = get_ts();
 
-	fdb_transaction_set(tr, (const uint8_t *)qk, sizeof(qry_key_t), qv, qvsz);
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	f = fdb_transaction_get(tr, (const uint8_t *) qk, sizeof(qry_key_t), 1);
+	pgcache_stats_add(st, PGC_STAT_FDB_ROUND_TRIPS, 1);
+	ERR_DONE( fdb_wait_error(f), "fdb future failed");
+	ERR_DONE( fdb_future_get_value(f, &found, (const uint8_t **) &qvbuf, &qvsz), "fdb get value failed");
 
-	f = fdb_transaction_commit(tr);
-	err = fdb_wait_error(f);
-	ERR_DONE(err, "cache populate transaction error.");
-	ret = 0;
+	if (found && qvbuf->status >= 0 && qvbuf->fingerprint == fpr && qvbuf->ts + timeout >= now) {
+		ret = qvbuf->status;
+		*pgen = qvbuf->ts;
+	}
 
 done:
 	if (f) {
@@ -212,113 +510,1887 @@ done:
 		fdb_transaction_destroy(tr);
 		tr = 0;
 	}
+	pgcache_stats_add(st, PGC_STAT_STATUS_US, get_ts() - start);
 	return ret;
 }
 
-int32_t pgcache_populate(const qry_key_t *qk, int64_t ts, int ntup, HeapTuple *tups)
+/*
+ * Claim the populate of generation ts of those of the n entries qks (of 
+ * queries qstrs) that need a new one, all in one transaction, and set 
+ * claimed accordingly.  Unlike pgcache_get_status we never wait: an entry 
+ * that is good, stale within its grace, or populated by somebody else is 
+ * simply not claimed.  Best effort, return the number claimed.
+ */
+int pgcache_claim_many(int n, const qry_key_t *qks, const char **qstrs, int64_t ts, int64_t timeout, 
+		int64_t grace, uint32_t fpr, bool *claimed)
 {
 	FDBTransaction *tr = 0;
 	FDBFuture *f = 0;
-	int32_t ret = QRY_FAIL;
-	fdb_error_t err;
+	FDBFuture **fs = 0;
+	int nclaim = 0;
 
-	fdb_bool_t found;
-	qry_val_t *qv = 0;
-	uint8_t *qvbuf;
-	int qvsz;
+	memset(claimed, 0, n * sizeof(bool));
+	if (n == 0) {
+		return 0;
+	}
 
-	tup_key_t ka;
-	tup_key_t kz;
+	fs = (FDBFuture **) palloc0(n * sizeof(FDBFuture *));
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int i = 0; i < n; i++) {
+		fs[i] = fdb_transaction_get(tr, (const uint8_t *) &qks[i], sizeof(qry_key_t), 0);
+	}
 
-	int wszNb = 0;
-	/* FoundationDB funny transaction limit -- 10MB.  We cap it to 5MB */
-	const int wszLimit = 5000000; 
+	for (int i = 0; i < n; i++) {
+		fdb_bool_t found;
+		const qry_val_t *qvbuf;
+		qry_val_t *qv;
+		int qvsz;
 
-	char qkbuf[QK_DUMP_SZ];
-	qry_key_dump(qk, qkbuf);
-	/* elog(LOG, "Populating %d keys, for qk %s.", ntup, qkbuf); */
+		if (fdb_wait_error(fs[i]) || 
+			fdb_future_get_value(fs[i], &found, (const uint8_t **) &qvbuf, &qvsz)) {
+			continue;
+		}
+		if (found && 
+			!(qvbuf->status == QRY_FETCH && qvbuf->lease < ts) &&
+			!(qvbuf->ts + timeout + grace < ts) &&
+			!(qvbuf->status >= 0 && qvbuf->fingerprint != fpr)) {
+			continue;
+		}
 
-	for (int i = 0; i < 10; i++) {
-		wszNb = 0;
+		qv = qry_val_new(qstrs[i], timeout, grace, fpr, &qvsz);
+		qv->ts = ts;
+		qv->lease = ts + (int64_t) populate_lease * 1000;
+		fdb_transaction_set(tr, (const uint8_t *) &qks[i], sizeof(qry_key_t), (const uint8_t *) qv, qvsz);
+		acc_touch(tr, &qks[i], ts, false);
+		pfree(qv);
+		claimed[i] = true;
+		nclaim++;
+	}
 
-		ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
-		f = fdb_transaction_get(tr, (const uint8_t *) qk, sizeof(qry_key_t), 0);
-		ERR_DONE( fdb_wait_error(f), "fdb future failed");
-		ERR_DONE( fdb_future_get_value(f, &found, (const uint8_t **) &qvbuf, &qvsz), "fdb get value failed");
-		if (!found) {
-			ret = QRY_FAIL_NO_RETRY;
-			goto done;
+	if (nclaim > 0) {
+		f = fdb_transaction_commit(tr);
+		if (fdb_wait_error(f)) {
+			/* lost a race on some of them, leave them all to their readers */
+			memset(claimed, 0, n * sizeof(bool));
+			nclaim = 0;
 		}
+	}
 
-		qv = (qry_val_t *) palloc(qvsz);
-		memcpy(qv, qvbuf, qvsz);
-		if (qv->ts > ts) {
-			ret = QRY_FAIL_NO_RETRY;
-			goto done;
-		}
+done:
+	if (f) {
 		fdb_future_destroy(f);
 		f = 0;
+	}
 
-		tup_key_initsha(&ka, qk->SHA, 0);
-		tup_key_initsha(&kz, qk->SHA, -1); 
-
-		fdb_transaction_clear_range(tr, (const uint8_t *) &ka, sizeof(ka), 
-				(const uint8_t *) &kz, sizeof(kz));
-
-		/* Now put all tuples in */
-		for (int i = 0; i < ntup; i++) {
-			int vlen = HEAPTUPLESIZE + tups[i]->t_len;
-			ka.seq = i + 1;
-			fdb_transaction_set(tr, 
-					(const uint8_t *) &ka, sizeof(ka), 
-					(const uint8_t *) tups[i], vlen); 
-			/* elog(LOG, "Putting in a key, seq %d, vlen %d.", ka.seq, vlen); */
-
-			wszNb += sizeof(ka) + vlen;
-			if (wszNb > wszLimit) {
-				ret = QRY_FDB_LIMIT_REACHED;
-				elog(LOG, "FoundattionDB TX limit reached after %d out of %d tuples.", i, ntup); 
-				goto done;
-			}
+	for (int i = 0; i < n; i++) {
+		if (fs[i]) {
+			fdb_future_destroy(fs[i]);
 		}
+	}
+	pfree(fs);
 
-		/* Finally update meta */
-		qv->status = ntup;
-		fdb_transaction_set(tr, (const uint8_t *) qk, sizeof(qry_key_t),
-				(const uint8_t *) qv, qvsz);
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	return nclaim;
+}
 
-		f = fdb_transaction_commit(tr);
-		err = fdb_wait_error(f);
-		ERR_DONE(err, "cache populate transaction error.");
-		ret = ntup;
+/*
+ * Map cache_compression option value to codec, -1 if unknown or not 
+ * supported by this build.
+ */
+int pgcache_codec_by_name(const char *name)
+{
+	if (strcmp(name, "none") == 0) {
+		return PGC_CODEC_NONE;
+	} else if (strcmp(name, "pglz") == 0) {
+		return PGC_CODEC_PGLZ;
+	}
+#ifdef USE_LZ4
+	else if (strcmp(name, "lz4") == 0) {
+		return PGC_CODEC_LZ4;
+	}
+#endif
+#ifdef USE_ZSTD
+	else if (strcmp(name, "zstd") == 0) {
+		return PGC_CODEC_ZSTD;
+	}
+#endif
+	return -1;
+}
 
-done:
-	
-		if (f) {
-			fdb_future_destroy(f);
-			f = 0;
+/*
+ * Compress src into dst.  Return compressed size, or -1 if codec could 
+ * not make it smaller than srclen.  dst must hold PGLZ_MAX_OUTPUT(srclen).
+ */
+static int blk_compress(int codec, const char *src, int srclen, char *dst)
+{
+	int sz = -1;
+
+	switch (codec) {
+		case PGC_CODEC_PGLZ:
+			sz = pglz_compress(src, srclen, dst, PGLZ_strategy_default);
+			break;
+#ifdef USE_LZ4
+		case PGC_CODEC_LZ4:
+			sz = LZ4_compress_default(src, dst, srclen, srclen - 1);
+			if (sz <= 0) {
+				sz = -1;
+			}
+			break;
+#endif
+#ifdef USE_ZSTD
+		case PGC_CODEC_ZSTD:
+			{
+				size_t zsz = ZSTD_compress(dst, srclen - 1, src, srclen, ZSTD_CLEVEL_DEFAULT);
+				sz = ZSTD_isError(zsz) ? -1 : (int) zsz;
+			}
+			break;
+#endif
+		default:
+			break;
+	}
+
+	if (sz >= srclen) {
+		sz = -1;
+	}
+	return sz;
+}
+
+/*
+ * Decompress src into dst, which must hold rawlen bytes.  Return true if
+ * we got exactly rawlen bytes back.
+ */
+static bool blk_decompress(int codec, const char *src, int srclen, char *dst, int rawlen)
+{
+	int sz = -1;
+
+	switch (codec) {
+		case PGC_CODEC_PGLZ:
+			sz = pglz_decompress(src, srclen, dst, rawlen, true);
+			break;
+#ifdef USE_LZ4
+		case PGC_CODEC_LZ4:
+			sz = LZ4_decompress_safe(src, dst, srclen, rawlen);
+			break;
+#endif
+#ifdef USE_ZSTD
+		case PGC_CODEC_ZSTD:
+			{
+				size_t zsz = ZSTD_decompress(dst, rawlen, src, srclen);
+				sz = ZSTD_isError(zsz) ? -1 : (int) zsz;
+			}
+			break;
+#endif
+		default:
+			break;
+	}
+	return sz == rawlen;
+}
+
+/*
+ * Records hold the body of the tuple as a MinimalTuple would, that is 
+ * t_data minus the transaction fields, and no pointers.  See tuplestore.c
+ * writetup_heap/readtup_heap.  The in-memory format depends on the build,
+ * which is covered by pgcache_fingerprint.
+ */
+#define PGC_TUP_BODY_OFFSET (MINIMAL_TUPLE_OFFSET + MINIMAL_TUPLE_DATA_OFFSET)
+
+/*
+ * Size of the record of a tuple in the block stream.
+ */
+static inline int64_t blk_rec_sz(HeapTuple tup)
+{
+	return sizeof(uint32_t) + tup->t_len - PGC_TUP_BODY_OFFSET;
+}
+
+/*
+ * Fill blk with up to cap bytes of the record stream, starting at record 
+ * *pi, offset *poff.  Advance *pi, *poff, and count records started in 
+ * *pnstart.  Return number of bytes filled.
+ */
+static int blk_fill(char *blk, int cap, HeapTuple *tups, int ntup, 
+		int *pi, int *poff, uint32_t *pnstart)
+{
+	int used = 0;
+
+	while (used < cap && *pi < ntup) {
+		HeapTuple tup = tups[*pi];
+		uint32_t reclen = tup->t_len - PGC_TUP_BODY_OFFSET;
+		int recsz = sizeof(uint32_t) + reclen;
+		int n;
+
+		if (*poff == 0) {
+			(*pnstart)++;
 		}
 
-		if (tr) {
-			fdb_transaction_destroy(tr);
-			tr = 0;
+		/* length first */
+		if (*poff < (int) sizeof(uint32_t)) {
+			n = Min(cap - used, (int) sizeof(uint32_t) - *poff);
+			memcpy(blk + used, ((char *) &reclen) + *poff, n);
+			used += n;
+			*poff += n;
 		}
 
-		if (ret != QRY_FAIL) {
-			break;
-		} 
+		/* then the tuple body */
+		if (*poff >= (int) sizeof(uint32_t)) {
+			n = Min(cap - used, recsz - *poff);
+			memcpy(blk + used, ((char *) tup->t_data) + PGC_TUP_BODY_OFFSET + *poff - sizeof(uint32_t), n);
+			used += n;
+			*poff += n;
+		}
+
+		if (*poff == recsz) {
+			(*pi)++;
+			*poff = 0;
+		}
 	}
+	return used;
+}
 
-	while (ret == QRY_FDB_LIMIT_REACHED) {
-		qv->status = QRY_FDB_LIMIT_REACHED;
-		if (pgcache_set_qry(qk, (const uint8_t *) qv, qvsz) >= 0) {
-			ret = QRY_FAIL_NO_RETRY;
+/*
+ * Streaming reader of a cached result.  Blocks are read with 
+ * FDB_STREAMING_MODE_ITERATOR, and the next get_range is issued before we
+ * decode the current one, so fdb works on the next batch while the executor
+ * consumes this one.  Only the current batch is kept in caller's memory.
+ * A hit in the shared memory tier is decoded from the l1 copy instead, and
+ * an FDB read collects the stream to put it in the tier when done.
+ *
+ * A ranged reader, of a parallel scan, reads whatever ranges of blocks it
+ * is given with pgcache_reader_seek, and returns the records that start in
+ * them.  It skips the head of the first block of a range, and reads on past
+ * the range to finish its last record.  It never uses the shared memory
+ * tier.
+ */
+struct pgcache_reader_t {
+	MemoryContext cxt;
+	qry_key_t qk;
+	int64_t ts;
+	FDBTransaction *tr;
+	FDBFuture *f;			/* get_range in flight, if any */
+
+	tup_key_t ka;			/* range still to read */
+	tup_key_t kz;
+	int orEqual;
+	int iteration;
+	int nretry;
+
+	int ntup;				/* expected from meta */
+	int nblk;
+	int ntupRead;			/* decoded so far */
+	int nblkRead;
+
+	/* output of the current batch */
+	HeapTuple *tups;
+	int maxtup;
+	int cnt;
+
+	/* record being reassembled, rec is the HeapTuple we build */
+	char lenbuf[sizeof(uint32_t)];
+	int lengot;
+	char *rec;
+	bool recSpans;			/* rec lives in cxt, not in the batch */
+	uint32_t reclen;
+	uint32_t recgot;
+
+	/* decompressed payload of current block */
+	char *rawbuf;
+
+	/* stream from the shared memory tier, on a hit */
+	char *l1buf;
+	Size l1sz;
+	Size l1off;
+
+	/* stream collected for the shared memory tier, on a miss */
+	char *l1fill;
+	Size l1fillcap;
+	Size l1fillsz;
+
+	/* range of a ranged reader, blkStop is past blkEnd to finish a record */
+	bool ranged;
+	int32_t blkFirst;
+	int32_t blkEnd;
+	int32_t blkStop;
+
+	pgcache_stats_t *st;	/* of the scan, may be NULL */
+};
+
+static bool rec_decode(pgcache_reader_t *rd, const char *p, const char *end, uint32_t *pnstart);
+static int32_t reader_open(const qry_key_t *qk, int64_t ts, MemoryContext cxt, pgcache_stats_t *st, 
+		bool ranged, pgcache_reader_t **prd);
+
+static bool blk_decode(pgcache_reader_t *rd, int32_t seq, const uint8_t *val, int vlen)
+{
+	const blk_hdr_t *hdr = (const blk_hdr_t *) val;
+	const char *p = (const char *) val + sizeof(blk_hdr_t);
+	const char *end;
+	int datasz = vlen - (int) sizeof(blk_hdr_t);
+	uint32_t expect;
+	uint32_t nstart = 0;
+
+	if (datasz < 0 || hdr->rawsz > PGC_BLOCK_SZ || hdr->head > hdr->rawsz) {
+		return false;
+	}
+	pgcache_stats_add(rd->st, PGC_STAT_BYTES_READ, vlen);
+
+	if (hdr->codec == PGC_CODEC_NONE) {
+		if ((int) hdr->rawsz != datasz) {
+			return false;
+		}
+	} else {
+		if (!rd->rawbuf) {
+			rd->rawbuf = (char *) MemoryContextAlloc(rd->cxt, PGC_BLOCK_SZ);
 		}
+		if (!blk_decompress(hdr->codec, p, datasz, rd->rawbuf, hdr->rawsz)) {
+			return false;
+		}
+		p = rd->rawbuf;
 	}
+	rd->nblkRead++;
 
-	if (qv) {
-		pfree(qv);
-		qv = 0;
+	if (rd->l1fill) {
+		if (rd->l1fillsz + hdr->rawsz <= rd->l1fillcap) {
+			memcpy(rd->l1fill + rd->l1fillsz, p, hdr->rawsz);
+			rd->l1fillsz += hdr->rawsz;
+		} else {
+			pfree(rd->l1fill);
+			rd->l1fill = 0;
+		}
 	}
-	return ret;
+
+	end = p + hdr->rawsz;
+	expect = hdr->ntup;
+	if (rd->ranged && seq >= rd->blkEnd) {
+		/* past the range, only the end of our last record */
+		end = p + hdr->head;
+		expect = 0;
+	} else if (rd->ranged && seq == rd->blkFirst && rd->lengot == 0) {
+		/* the record ending here belongs to the range before ours */
+		p += hdr->head;
+	}
+
+	if (!rec_decode(rd, p, end, &nstart)) {
+		return false;
+	}
+	return nstart == expect;
+}
+
+/*
+ * Decode records of the stream in [p, end) into the batch, carrying a 
+ * record that does not end here over to the next call.  Count records 
+ * started in *pnstart.
+ */
+static bool rec_decode(pgcache_reader_t *rd, const char *p, const char *end, uint32_t *pnstart)
+{
+	while (p < end) {
+		int n;
+
+		if (rd->lengot < (int) sizeof(uint32_t)) {
+			if (rd->lengot == 0) {
+				(*pnstart)++;
+			}
+			n = Min(end - p, (int) sizeof(uint32_t) - rd->lengot);
+			memcpy(rd->lenbuf + rd->lengot, p, n);
+			rd->lengot += n;
+			p += n;
+			if (rd->lengot == sizeof(uint32_t)) {
+				Size tupsz;
+
+				memcpy(&rd->reclen, rd->lenbuf, sizeof(uint32_t));
+				tupsz = HEAPTUPLESIZE + PGC_TUP_BODY_OFFSET + (Size) rd->reclen;
+				if (rd->cnt >= rd->maxtup || !AllocSizeIsValid(tupsz)) {
+					return false;
+				}
+				/* A record spanning blocks may outlive the batch. */
+				rd->recSpans = (end - p) < rd->reclen;
+				if (rd->recSpans) {
+					rd->rec = (char *) MemoryContextAlloc(rd->cxt, tupsz);
+				} else {
+					rd->rec = (char *) palloc(tupsz);
+				}
+				rd->recgot = 0;
+			}
+			continue;
+		}
+
+		n = Min(end - p, rd->reclen - rd->recgot);
+		memcpy(rd->rec + HEAPTUPLESIZE + PGC_TUP_BODY_OFFSET + rd->recgot, p, n);
+		rd->recgot += n;
+		p += n;
+		if (rd->recgot == rd->reclen) {
+			HeapTuple tup;
+			char *dst = rd->rec;
+			Size tupsz = HEAPTUPLESIZE + PGC_TUP_BODY_OFFSET + (Size) rd->reclen;
+
+			if (rd->recSpans) {
+				dst = (char *) palloc(tupsz);
+				memcpy(dst, rd->rec, tupsz);
+				pfree(rd->rec);
+			}
+
+			/* Same as heap_tuple_from_minimal_tuple, with a clean header. */
+			tup = (HeapTuple) dst;
+			tup->t_len = PGC_TUP_BODY_OFFSET + rd->reclen;
+			ItemPointerSetInvalid(&(tup->t_self));
+			tup->t_tableOid = InvalidOid;
+			tup->t_data = (HeapTupleHeader) (dst + HEAPTUPLESIZE);
+			memset(tup->t_data, 0, PGC_TUP_BODY_OFFSET);
+			ItemPointerSetInvalid(&(tup->t_data->t_ctid));
+			rd->tups[rd->cnt++] = tup;
+			rd->ntupRead++;
+			rd->rec = 0;
+			rd->lengot = 0;
+		}
+	}
+
+	return true;
+}
+
+static void pgcache_reader_issue(pgcache_reader_t *rd)
+{
+	rd->f = fdb_transaction_get_range(rd->tr, 
+			(const uint8_t *) &rd->ka, sizeof(tup_key_t), rd->orEqual, 1,
+			(const uint8_t *) &rd->kz, sizeof(tup_key_t), 0, 1,
+			0, 0, FDB_STREAMING_MODE_ITERATOR, rd->iteration++, 0, 0);
+}
+
+/*
+ * Release fdb objects of the reader.  Also called when the memory context
+ * of the reader goes away, so that an error in the middle of a scan does
+ * not leak them.
+ */
+static void pgcache_reader_release(void *arg)
+{
+	pgcache_reader_t *rd = (pgcache_reader_t *) arg;
+
+	if (rd->f) {
+		fdb_future_destroy(rd->f);
+		rd->f = 0;
+	}
+
+	if (rd->tr) {
+		fdb_transaction_destroy(rd->tr);
+		rd->tr = 0;
+	}
+}
+
+/*
+ * Open a reader on generation ts of the entry, in a child context of cxt.
+ * Return number of tuples, or QRY_FAIL if the entry is not (or no longer)
+ * that generation, in which case the reader is already closed.  Bytes read
+ * are counted in st, which must outlive the reader.
+ */
+int32_t pgcache_reader_open(const qry_key_t *qk, int64_t ts, MemoryContext cxt, pgcache_stats_t *st, 
+		pgcache_reader_t **prd)
+{
+	return reader_open(qk, ts, cxt, st, false, prd);
+}
+
+/*
+ * Same for a ranged reader, which reads nothing until pgcache_reader_seek.
+ * Set *pnblk to the number of blocks of the entry.
+ */
+int32_t pgcache_reader_open_ranged(const qry_key_t *qk, int64_t ts, MemoryContext cxt, pgcache_stats_t *st,
+		int32_t *pnblk, pgcache_reader_t **prd)
+{
+	int32_t ret = reader_open(qk, ts, cxt, st, true, prd);
+
+	*pnblk = ret >= 0 ? (*prd)->nblk : 0;
+	return ret;
+}
+
+/*
+ * Have ranged reader rd return the records that start in blocks [first, 
+ * end) of its entry, after those of its previous range.
+ */
+void pgcache_reader_seek(pgcache_reader_t *rd, int32_t first, int32_t end)
+{
+	Assert(rd->ranged && !rd->f && rd->lengot == 0);
+
+	rd->blkFirst = first;
+	rd->blkEnd = end;
+	rd->blkStop = end;
+	rd->nblkRead = 0;
+	rd->orEqual = 0;		/* first_greater_or_equal */
+	rd->iteration = 1;
+	tup_key_initsha(&rd->ka, rd->qk.SHA, rd->ts, first);
+	tup_key_initsha(&rd->kz, rd->qk.SHA, rd->ts, end);
+	if (first < end) {
+		pgcache_reader_issue(rd);
+	}
+}
+
+static int32_t reader_open(const qry_key_t *qk, int64_t ts, MemoryContext cxt, pgcache_stats_t *st, 
+		bool ranged, pgcache_reader_t **prd)
+{
+	FDBFuture *f = 0;
+	int32_t ret = QRY_FAIL;
+
+	fdb_bool_t found;
+	const qry_val_t *qv = 0;
+	int qvsz;
+	pgcache_reader_t *rd;
+	MemoryContextCallback *cb;
+	MemoryContext oldcxt;
+	int64_t start = get_ts();
+
+	cxt = AllocSetContextCreate(cxt, "pgc_fdw cache reader", ALLOCSET_SMALL_SIZES);
+	rd = (pgcache_reader_t *) MemoryContextAllocZero(cxt, sizeof(pgcache_reader_t));
+	rd->cxt = cxt;
+	cb = (MemoryContextCallback *) MemoryContextAllocZero(cxt, sizeof(MemoryContextCallback));
+	cb->func = pgcache_reader_release;
+	cb->arg = rd;
+	MemoryContextRegisterResetCallback(cxt, cb);
+	rd->qk = *qk;
+	rd->ts = ts;
+	rd->st = st;
+	rd->ranged = ranged;
+
+	/* Caller just checked ts is the current generation, try local copy. */
+	if (!ranged) {
+		oldcxt = MemoryContextSwitchTo(cxt);
+		rd->l1buf = pgcache_l1_get(qk, ts, &rd->ntup, &rd->l1sz);
+		MemoryContextSwitchTo(oldcxt);
+	}
+	if (rd->l1buf) {
+		pgcache_stats_add(st, PGC_STAT_L1_HITS, 1);
+		pgcache_stats_add(st, PGC_STAT_BYTES_READ, rd->l1sz);
+		ret = rd->ntup;
+		goto done;
+	}
+
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &rd->tr), "cannot begin fdb transaction");
+	f = fdb_transaction_get(rd->tr, (const uint8_t *) qk, sizeof(qry_key_t), 0); 
+	pgcache_stats_add(st, PGC_STAT_FDB_ROUND_TRIPS, 1);
+	ERR_DONE( fdb_wait_error(f), "fdb future failed");
+	ERR_DONE( fdb_future_get_value(f, &found, (const uint8_t **) &qv, &qvsz), "fdb get value failed");
+	ERR_DONE( !found || qv->ts != ts, "qry key not found");
+	ERR_DONE( qv->status < 0, "qry race.");
+
+	rd->ntup = qv->status;
+	rd->nblk = qv->nblk;
+	if (ranged) {
+		ret = rd->ntup;
+		goto done;
+	}
+	rd->orEqual = 0;		/* first_greater_or_equal */
+	rd->iteration = 1;
+	tup_key_initsha(&rd->ka, qk->SHA, ts, 0);
+	tup_key_initsha(&rd->kz, qk->SHA, ts, PGC_SEQ_MAX); 
+
+	if (pgcache_l1_admit(qv->rawsz)) {
+		rd->l1fillcap = qv->rawsz;
+		rd->l1fill = (char *) MemoryContextAlloc(cxt, Max(rd->l1fillcap, 1));
+	}
+
+	if (rd->nblk > 0) {
+		pgcache_reader_issue(rd);
+	}
+	ret = rd->ntup;
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	pgcache_stats_add(st, PGC_STAT_READ_US, get_ts() - start);
+	if (ret < 0) {
+		pgcache_reader_close(rd);
+		rd = 0;
+	}
+	*prd = rd;
+	return ret;
+}
+
+/*
+ * pgcache_reader_next of a hit in the shared memory tier, the stream is 
+ * decoded PGC_BLOCK_SZ bytes at a time so that batches look the same.
+ */
+static int l1_reader_next(pgcache_reader_t *rd, HeapTuple **ptups)
+{
+	/* records started in a chunk, plus one that started before */
+	rd->maxtup = Min(rd->ntup - rd->ntupRead, PGC_BLOCK_SZ / (int) sizeof(uint32_t)) + 2;
+	rd->tups = (HeapTuple *) palloc(rd->maxtup * sizeof(HeapTuple));
+
+	while (rd->cnt == 0 && rd->l1off < rd->l1sz) {
+		Size n = Min(rd->l1sz - rd->l1off, PGC_BLOCK_SZ);
+		uint32_t nstart = 0;
+
+		if (!rec_decode(rd, rd->l1buf + rd->l1off, rd->l1buf + rd->l1off + n, &nstart)) {
+			elog(ERROR, PGC_FLINE "corrupted l1 cache entry at %zu", rd->l1off);
+		}
+		rd->l1off += n;
+	}
+
+	if (rd->l1off == rd->l1sz) {
+		CHECK_COND(rd->ntupRead == rd->ntup && rd->lengot == 0,
+				"corrupted l1 cache entry, get %d, expecting %d", rd->ntupRead, rd->ntup);
+	}
+
+	*ptups = rd->tups;
+	return rd->cnt;
+}
+
+/*
+ * Return the next batch of tuples, allocated in current memory context, 
+ * 0 at the end of the result.  Errors out if the entry went away under us,
+ * at this point we cannot go back to the remote server.
+ */
+int pgcache_reader_next(pgcache_reader_t *rd, HeapTuple **ptups)
+{
+	const FDBKeyValue *outkv;
+	int kvcnt;
+	fdb_bool_t more;
+	fdb_error_t err;
+	int64_t start = get_ts();
+
+	rd->tups = 0;
+	rd->maxtup = 0;
+	rd->cnt = 0;
+
+	if (rd->l1buf) {
+		l1_reader_next(rd, ptups);
+		pgcache_stats_add(rd->st, PGC_STAT_READ_US, get_ts() - start);
+		return rd->cnt;
+	}
+
+	while (rd->cnt == 0 && rd->f) {
+		FDBFuture *cur = rd->f;
+		int maxtup = 1;
+
+		rd->f = 0;
+		pgcache_stats_add(rd->st, PGC_STAT_FDB_ROUND_TRIPS, 1);
+		err = fdb_wait_error(cur);
+		if (!err) {
+			err = fdb_future_get_keyvalue_array(cur, &outkv, &kvcnt, &more);
+		}
+
+		if (err) {
+			/* 
+			 * Likely the transaction got too old while the executor was busy.
+			 * Blocks of a generation never change, resume where we were.
+			 */
+			fdb_future_destroy(cur);
+			if (rd->nretry++ < PGC_MAX_RETRY) {
+				cur = fdb_transaction_on_error(rd->tr, err);
+				err = fdb_wait_error(cur);
+				fdb_future_destroy(cur);
+			}
+			CHECK_ERR(err, "cache read failed, err %d", err);
+			pgcache_reader_issue(rd);
+			continue;
+		}
+		rd->nretry = 0;
+
+		/* Prefetch next batch, before we decode this one. */
+		if (kvcnt > 0) {
+			memcpy(&rd->ka, outkv[kvcnt - 1].key, sizeof(tup_key_t));
+			rd->orEqual = 1;	/* first_greater_than */
+		}
+		if (more) {
+			pgcache_reader_issue(rd);
+		}
+
+		for (int i = 0; i < kvcnt; i++) {
+			if (outkv[i].value_length >= (int) sizeof(blk_hdr_t)) {
+				maxtup += ((const blk_hdr_t *) outkv[i].value)->ntup;
+			}
+		}
+		rd->tups = (HeapTuple *) palloc(maxtup * sizeof(HeapTuple));
+		rd->maxtup = maxtup;
+
+		for (int i = 0; i < kvcnt; i++) {
+			int32_t seq = tup_key_getseq((const tup_key_t *) outkv[i].key);
+
+			if (!blk_decode(rd, seq, outkv[i].value, outkv[i].value_length)) {
+				fdb_future_destroy(cur);
+				elog(ERROR, PGC_FLINE "corrupted cache block %d", rd->nblkRead);
+			}
+		}
+		fdb_future_destroy(cur);
+
+		/* A ranged reader reads on, a block at a time, to finish a record. */
+		if (!rd->f && rd->ranged && rd->lengot > 0 && rd->blkStop < rd->nblk) {
+			rd->blkStop++;
+			tup_key_setseq(&rd->kz, rd->blkStop);
+			pgcache_reader_issue(rd);
+		}
+	}
+
+	if (!rd->f && rd->ranged) {
+		CHECK_COND(rd->nblkRead == rd->blkStop - rd->blkFirst && rd->lengot == 0,
+				"cache entry changed during scan, get %d blocks, expecting %d",
+				rd->nblkRead, rd->blkStop - rd->blkFirst);
+	} else if (!rd->f) {
+		CHECK_COND(rd->nblkRead == rd->nblk && rd->ntupRead == rd->ntup,
+				"cache entry changed during scan, get %d/%d, expecting %d/%d",
+				rd->ntupRead, rd->nblkRead, rd->ntup, rd->nblk);
+		if (rd->l1fill && rd->l1fillsz == rd->l1fillcap) {
+			pgcache_l1_put(&rd->qk, rd->ts, rd->ntup, rd->l1fill, rd->l1fillsz);
+			pfree(rd->l1fill);
+			rd->l1fill = 0;
+		}
+	}
+
+	pgcache_stats_add(rd->st, PGC_STAT_READ_US, get_ts() - start);
+	*ptups = rd->tups;
+	return rd->cnt;
+}
+
+void pgcache_reader_close(pgcache_reader_t *rd)
+{
+	/* reset callback releases fdb objects */
+	MemoryContextDelete(rd->cxt);
+}
+
+/*
+ * Record the shape of the cached scan qk of relation relsha, see 
+ * shape_key_t.  Best effort.
+ */
+void pgcache_shape_register(const char *relsha, const qry_key_t *qk, List *retrieved_attrs, List *conds)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	shape_key_t sk;
+	StringInfoData val;
+	ListCell *lc;
+	int32_t n;
+
+	initStringInfo(&val);
+	n = list_length(retrieved_attrs);
+	appendBinaryStringInfo(&val, (const char *) &n, sizeof(n));
+	n = list_length(conds);
+	appendBinaryStringInfo(&val, (const char *) &n, sizeof(n));
+	foreach(lc, retrieved_attrs) {
+		n = lfirst_int(lc);
+		appendBinaryStringInfo(&val, (const char *) &n, sizeof(n));
+	}
+	foreach(lc, conds) {
+		const char *cond = strVal(lfirst(lc));
+		appendBinaryStringInfo(&val, cond, strlen(cond) + 1);
+	}
+
+	/* FDB caps a value at 100KB, such a scan is not worth it anyway. */
+	if (val.len > PGC_BLOCK_SZ) {
+		goto done;
+	}
+
+	shape_key_init(&sk, relsha, qk->SHA);
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int i = 0; i < PGC_MAX_RETRY; i++) {
+		fdb_error_t err;
+
+		fdb_transaction_set(tr, (const uint8_t *) &sk, sizeof(sk), (const uint8_t *) val.data, val.len);
+		f = fdb_transaction_commit(tr);
+		err = fdb_wait_error(f);
+		fdb_future_destroy(f);
+		f = 0;
+		if (!err) {
+			break;
+		}
+		f = fdb_transaction_on_error(tr, err);
+		ERR_DONE(fdb_wait_error(f), "cache shape transaction error.");
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	pfree(val.data);
+}
+
+#define PGC_MAX_SHAPE 16
+
+/*
+ * Among entries of relation relsha, find the fresh one with the fewest 
+ * tuples that subsumes a scan with conditions conds (String), whose 
+ * attributes are in condattrs (Bitmapset, offset by 
+ * FirstLowInvalidHeapAttributeNumber), retrieving retattrs.  Its tuples 
+ * must have our row type, tupdesc, and its key text must start with ours,
+ * prefix, that has the epochs.  Return its number of tuples, set *qk
+ * and *ts to the entry, and *residual to the (0 based) indexes of conds 
+ * the entry does not apply.  Return QRY_MISS if there is none.
+ */
+int32_t pgcache_shape_lookup(const char *relsha, List *conds, List *condattrs, Bitmapset *retattrs,
+		TupleDesc tupdesc, const char *prefix, int64_t now, int64_t timeout, qry_key_t *qk, int64_t *ts,
+		List **residual)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	FDBFuture *fm[PGC_MAX_SHAPE];
+	List *cattrs[PGC_MAX_SHAPE];
+	List *cresidual[PGC_MAX_SHAPE];
+	char csha[PGC_MAX_SHAPE][20];
+	int ncand = 0;
+	int32_t ret = QRY_MISS;
+
+	shape_key_t ka;
+	shape_key_t kz;
+	char zsha[20];
+	char fsha[20];
+	const FDBKeyValue *kv;
+	int kvcnt;
+	fdb_bool_t more;
+
+	memset(zsha, 0, 20);
+	memset(fsha, 0xff, 20);
+	shape_key_init(&ka, relsha, zsha);
+	shape_key_init(&kz, relsha, fsha);
+
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	f = fdb_transaction_get_range(tr, 
+			(const uint8_t *) &ka, sizeof(ka), 0, 1,
+			(const uint8_t *) &kz, sizeof(kz), 0, 1,
+			0, 0, FDB_STREAMING_MODE_WANT_ALL, 1, 1, 0);
+	ERR_DONE( fdb_wait_error(f), "fdb get range failed");
+	ERR_DONE( fdb_future_get_keyvalue_array(f, &kv, &kvcnt, &more), "fdb get kv array failed");
+
+	for (int i = 0; i < kvcnt && ncand < PGC_MAX_SHAPE; i++) {
+		const shape_val_t *sv = (const shape_val_t *) kv[i].value;
+		const char *p;
+		const char *end = (const char *) kv[i].value + kv[i].value_length;
+		Bitmapset *need = bms_copy(retattrs);
+		Bitmapset *have = NULL;
+		List *attrs = NIL;
+		List *res = NIL;
+		bool ok = true;
+		int j;
+		ListCell *lc;
+		ListCell *la;
+
+		if (kv[i].key_length != sizeof(shape_key_t) || kv[i].value_length < (int) offsetof(shape_val_t, attrs) ||
+			kv[i].value_length < (int) offsetof(shape_val_t, attrs) + sv->nattr * (int) sizeof(int32_t)) {
+			continue;
+		}
+
+		for (j = 0; j < sv->nattr; j++) {
+			attrs = lappend_int(attrs, sv->attrs[j]);
+			have = bms_add_member(have, sv->attrs[j] - FirstLowInvalidHeapAttributeNumber);
+		}
+
+		/* Every condition of the entry must be one of ours ... */
+		p = (const char *) &sv->attrs[sv->nattr];
+		for (j = 0; j < sv->ncond && ok; j++) {
+			const char *cond = p;
+
+			p += strnlen(p, end - p) + 1;
+			if (p > end) {
+				ok = false;
+				break;
+			}
+			ok = false;
+			foreach(lc, conds) {
+				if (strcmp(strVal(lfirst(lc)), cond) == 0) {
+					ok = true;
+					break;
+				}
+			}
+		}
+
+		/* ... and the ones it does not apply, we do with its columns. */
+		j = 0;
+		forboth(lc, conds, la, condattrs) {
+			bool applied = false;
+			const char *q = (const char *) &sv->attrs[sv->nattr];
+
+			for (int k = 0; k < sv->ncond && ok && q < end; k++) {
+				if (strcmp(strVal(lfirst(lc)), q) == 0) {
+					applied = true;
+					break;
+				}
+				q += strnlen(q, end - q) + 1;
+			}
+			if (!applied) {
+				res = lappend_int(res, j);
+				need = bms_add_members(need, (Bitmapset *) lfirst(la));
+			}
+			j++;
+		}
+
+		if (ok && bms_is_subset(need, have)) {
+			memcpy(csha[ncand], ((const shape_key_t *) kv[i].key)->SHA, 20);
+			cattrs[ncand] = attrs;
+			cresidual[ncand] = res;
+			ncand++;
+		}
+	}
+	fdb_future_destroy(f);
+	f = 0;
+
+	/* Fetch the metas of all candidates at once. */
+	for (int i = 0; i < ncand; i++) {
+		qry_key_t cqk;
+
+		memcpy(cqk.PREFIX, "PGCQ", 4);
+		memcpy(cqk.SHA, csha[i], 20);
+		fm[i] = fdb_transaction_get(tr, (const uint8_t *) &cqk, sizeof(cqk), 1);
+	}
+
+	for (int i = 0; i < ncand; i++) {
+		fdb_bool_t found;
+		const qry_val_t *qv;
+		int qvsz;
+
+		if (!fdb_wait_error(fm[i]) && 
+			!fdb_future_get_value(fm[i], &found, (const uint8_t **) &qv, &qvsz) &&
+			found && qv->status >= 0 && qv->ts + timeout >= now &&
+			(ret == QRY_MISS || qv->status < ret) &&
+			qvsz > (int) offsetof(qry_val_t, qrytxt) + (int) strlen(prefix) &&
+			strncmp(qv->qrytxt, prefix, strlen(prefix)) == 0 &&
+			qv->fingerprint == pgcache_fingerprint(tupdesc, cattrs[i])) {
+			ret = qv->status;
+			memcpy(qk->PREFIX, "PGCQ", 4);
+			memcpy(qk->SHA, csha[i], 20);
+			*ts = qv->ts;
+			*residual = cresidual[i];
+		}
+		fdb_future_destroy(fm[i]);
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	return ret;
+}
+
+/*
+ * Drop entry sha, all its generations, in tr.
+ */
+void pgcache_clear_entry(FDBTransaction *tr, const char *sha)
+{
+	tup_key_t ka;
+	tup_key_t kz;
+	qry_key_t qk;
+	acc_key_t ak;
+
+	tup_key_initsha(&ka, sha, 0, 0);
+	tup_key_initsha(&kz, sha, PGC_GEN_MAX, PGC_SEQ_MAX);
+	fdb_transaction_clear_range(tr, (const uint8_t *) &ka, sizeof(ka),
+			(const uint8_t *) &kz, sizeof(kz));
+	memcpy(qk.PREFIX, "PGCQ", 4);
+	memcpy(qk.SHA, sha, 20);
+	fdb_transaction_clear(tr, (const uint8_t *) &qk, sizeof(qk));
+	acc_key_init(&ak, sha, PGC_ACC_LAST);
+	fdb_transaction_clear(tr, (const uint8_t *) &ak, sizeof(ak));
+	acc_key_init(&ak, sha, PGC_ACC_HITS);
+	fdb_transaction_clear(tr, (const uint8_t *) &ak, sizeof(ak));
+}
+
+/*
+ * Record that entries qks depend on each of the nrel relations of
+ * relshas, 20 bytes each, see dep_key_t.  Best effort.
+ */
+void pgcache_dep_register(const char *relshas, int nrel, const qry_key_t *qks, int nqk)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+
+	if (nrel == 0 || nqk == 0) {
+		return;
+	}
+
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int i = 0; i < PGC_MAX_RETRY; i++) {
+		fdb_error_t err;
+
+		for (int r = 0; r < nrel; r++) {
+			for (int q = 0; q < nqk; q++) {
+				dep_key_t dk;
+
+				dep_key_init(&dk, relshas + r * 20, qks[q].SHA);
+				fdb_transaction_set(tr, (const uint8_t *) &dk, sizeof(dk), (const uint8_t *) "", 0);
+			}
+		}
+		f = fdb_transaction_commit(tr);
+		err = fdb_wait_error(f);
+		fdb_future_destroy(f);
+		f = 0;
+		if (!err) {
+			break;
+		}
+		f = fdb_transaction_on_error(tr, err);
+		ERR_DONE(fdb_wait_error(f), "cache dependency transaction error.");
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+}
+
+/*
+ * Drop all entries that depend on relation relsha, PGC_DEP_CHUNK per
+ * transaction, and the shapes of the relation.  Return the number of
+ * entries dropped.  Best effort, errors are only logged, as we are called
+ * once the modifying transaction has committed.
+ */
+int64_t pgcache_dep_invalidate(const char *relsha)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	dep_key_t ka;
+	dep_key_t kz;
+	shape_key_t sa;
+	shape_key_t sz;
+	char zsha[20];
+	char fsha[20];
+	int64_t n = 0;
+	int retry = 0;
+
+	memset(zsha, 0, 20);
+	memset(fsha, 0xff, 20);
+	dep_key_init(&ka, relsha, zsha);
+	dep_key_init(&kz, relsha, fsha);
+	shape_key_init(&sa, relsha, zsha);
+	shape_key_init(&sz, relsha, fsha);
+
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (;;) {
+		const FDBKeyValue *kv;
+		int kvcnt = 0;
+		fdb_bool_t more = 0;
+		fdb_error_t err;
+
+		f = fdb_transaction_get_range(tr, 
+				(const uint8_t *) &ka, sizeof(ka), 0, 1,
+				(const uint8_t *) &kz, sizeof(kz), 0, 1,
+				PGC_DEP_CHUNK, 0, FDB_STREAMING_MODE_WANT_ALL, 1, 0, 0);
+		err = fdb_wait_error(f);
+		if (!err) {
+			err = fdb_future_get_keyvalue_array(f, &kv, &kvcnt, &more);
+		}
+		if (!err) {
+			for (int i = 0; i < kvcnt; i++) {
+				if (kv[i].key_length == sizeof(dep_key_t)) {
+					pgcache_clear_entry(tr, ((const dep_key_t *) kv[i].key)->SHA);
+				}
+				fdb_transaction_clear(tr, kv[i].key, kv[i].key_length);
+			}
+			if (!more) {
+				/* they only lead to entries we just dropped */
+				fdb_transaction_clear_range(tr, (const uint8_t *) &sa, sizeof(sa),
+						(const uint8_t *) &sz, sizeof(sz));
+			}
+			fdb_future_destroy(f);
+			f = fdb_transaction_commit(tr);
+			err = fdb_wait_error(f);
+		}
+		fdb_future_destroy(f);
+		f = 0;
+
+		if (!err) {
+			n += kvcnt;
+			if (!more) {
+				break;
+			}
+			fdb_transaction_reset(tr);
+			retry = 0;
+			continue;
+		}
+
+		ERR_DONE( retry++ >= PGC_MAX_RETRY ? err : 0, "too many retries dropping dependent entries");
+		f = fdb_transaction_on_error(tr, err);
+		ERR_DONE( fdb_wait_error(f), "cache invalidate transaction error.");
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	return n;
+}
+
+/*
+ * Append the current epochs of the nsha tables and servers of shas, 20 
+ * bytes each, to the cache key text buf, as "Epochs: <sha>:<epoch> ..., ",
+ * see epoch_key_t.  The gc parses them back, see gc_epoch_stale.  Return 
+ * the fdb error, 0 on success, buf is left alone on error.
+ */
+int pgcache_epoch_text(StringInfo buf, const char *shas, int nsha)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture **fs;
+	uint64_t *epochs;
+	fdb_error_t err = 0;
+
+	fs = (FDBFuture **) palloc0(Max(nsha, 1) * sizeof(FDBFuture *));
+	epochs = (uint64_t *) palloc0(Max(nsha, 1) * sizeof(uint64_t));
+	ERR_DONE(err = fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int r = 0; r < PGC_MAX_RETRY; r++) {
+		FDBFuture *f;
+		fdb_error_t oerr;
+
+		err = 0;
+		for (int i = 0; i < nsha; i++) {
+			epoch_key_t ek;
+
+			epoch_key_init(&ek, shas + i * 20);
+			fs[i] = fdb_transaction_get(tr, (const uint8_t *) &ek, sizeof(ek), 1);
+		}
+
+		for (int i = 0; i < nsha; i++) {
+			fdb_bool_t found = 0;
+			const uint8_t *v;
+			int vlen = 0;
+
+			if (!err) {
+				err = fdb_wait_error(fs[i]);
+			}
+			if (!err) {
+				err = fdb_future_get_value(fs[i], &found, &v, &vlen);
+			}
+			if (!err) {
+				epochs[i] = 0;
+				if (found) {
+					memcpy(&epochs[i], v, Min(vlen, (int) sizeof(uint64_t)));
+					epochs[i] = pgc_le64(epochs[i]);
+				}
+			}
+			fdb_future_destroy(fs[i]);
+			fs[i] = 0;
+		}
+
+		if (!err) {
+			break;
+		}
+
+		f = fdb_transaction_on_error(tr, err);
+		oerr = fdb_wait_error(f);
+		fdb_future_destroy(f);
+		ERR_DONE(oerr, "cache epoch transaction error.");
+	}
+
+	if (err) {
+		elog(LOG, PGC_FLINE "err %d, cannot read cache epochs", err);
+	} else {
+		appendStringInfoString(buf, "Epochs:");
+		for (int i = 0; i < nsha; i++) {
+			char hex[41];
+
+			hex_encode(shas + i * 20, 20, hex);
+			hex[40] = 0;
+			appendStringInfo(buf, " %s:" INT64_FORMAT, hex, (int64) epochs[i]);
+		}
+		appendStringInfoString(buf, ", ");
+	}
+
+done:
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	pfree(fs);
+	pfree(epochs);
+	return err;
+}
+
+/*
+ * Bump the epoch of the table or server sha, retiring all its entries.
+ * Return the fdb error, 0 on success.
+ */
+int pgcache_epoch_bump(const char *sha)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	epoch_key_t ek;
+	uint64_t one = pgc_le64(1);
+	fdb_error_t err = 0;
+
+	epoch_key_init(&ek, sha);
+	CHECK_ERR( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int i = 0; i < PGC_MAX_RETRY; i++) {
+		/* a commit retried after an unknown result may bump twice, that is fine */
+		fdb_transaction_atomic_op(tr, (const uint8_t *) &ek, sizeof(ek),
+				(const uint8_t *) &one, sizeof(one), FDB_MUTATION_TYPE_ADD);
+		f = fdb_transaction_commit(tr);
+		err = fdb_wait_error(f);
+		fdb_future_destroy(f);
+		f = 0;
+		if (!err) {
+			break;
+		}
+		f = fdb_transaction_on_error(tr, err);
+		err = fdb_wait_error(f);
+		fdb_future_destroy(f);
+		f = 0;
+		if (err) {
+			break;
+		}
+	}
+
+	fdb_transaction_destroy(tr);
+	return err;
+}
+
+/*
+ * Parameter values remembered for the query of sha, most recent first, as
+ * a List of C strings.  Best effort, NIL if there are none.
+ */
+List *pgcache_params_recall(const char *sha)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	param_key_t pk;
+	fdb_bool_t found;
+	const param_val_t *pv;
+	int pvsz;
+	List *vals = NIL;
+
+	param_key_init(&pk, sha);
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	f = fdb_transaction_get(tr, (const uint8_t *) &pk, sizeof(pk), 1);
+	ERR_DONE( fdb_wait_error(f), "fdb future failed");
+	ERR_DONE( fdb_future_get_value(f, &found, (const uint8_t **) &pv, &pvsz), "fdb get value failed");
+
+	if (found && pvsz >= (int) offsetof(param_val_t, vals)) {
+		const char *p = pv->vals;
+		const char *end = (const char *) pv + pvsz;
+
+		for (int i = 0; i < pv->nval && p < end; i++) {
+			int len = strnlen(p, end - p);
+
+			vals = lappend(vals, pnstrdup(p, len));
+			p += len + 1;
+		}
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	return vals;
+}
+
+/*
+ * Remember value as the most recent parameter value of the query of sha,
+ * whose entries time out after timeout.  Oldest values are forgotten past
+ * PGC_MAX_PARAM_VALS, or what fits in one fdb value.  Best effort.
+ */
+void pgcache_params_remember(const char *sha, const char *value, int64_t ts, int64_t timeout)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	param_key_t pk;
+	StringInfoData buf;
+	int vlen = strlen(value);
+
+	if (vlen > PGC_MAX_PARAM_LEN) {
+		return;
+	}
+
+	param_key_init(&pk, sha);
+	initStringInfo(&buf);
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int i = 0; i < PGC_MAX_RETRY; i++) {
+		fdb_bool_t found;
+		const param_val_t *pv;
+		int pvsz;
+		param_val_t hdr;
+		fdb_error_t err;
+
+		f = fdb_transaction_get(tr, (const uint8_t *) &pk, sizeof(pk), 0);
+		err = fdb_wait_error(f);
+		if (!err) {
+			err = fdb_future_get_value(f, &found, (const uint8_t **) &pv, &pvsz);
+		}
+
+		if (!err) {
+			resetStringInfo(&buf);
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.ts = ts;
+			hdr.timeout = timeout;
+			hdr.nval = 1;
+			appendBinaryStringInfo(&buf, (const char *) &hdr, offsetof(param_val_t, vals));
+			appendBinaryStringInfo(&buf, value, vlen + 1);
+
+			if (found && pvsz >= (int) offsetof(param_val_t, vals)) {
+				const char *p = pv->vals;
+				const char *end = (const char *) pv + pvsz;
+
+				for (int j = 0; j < pv->nval && p < end; j++) {
+					int len = strnlen(p, end - p);
+
+					if (hdr.nval >= PGC_MAX_PARAM_VALS || buf.len + len + 1 > PGC_BLOCK_SZ) {
+						break;
+					}
+					if (len != vlen || memcmp(p, value, vlen) != 0) {
+						appendBinaryStringInfo(&buf, p, len);
+						appendStringInfoChar(&buf, '\0');
+						hdr.nval++;
+					}
+					p += len + 1;
+				}
+			}
+			memcpy(buf.data + offsetof(param_val_t, nval), &hdr.nval, sizeof(hdr.nval));
+
+			fdb_future_destroy(f);
+			fdb_transaction_set(tr, (const uint8_t *) &pk, sizeof(pk), (const uint8_t *) buf.data, buf.len);
+			f = fdb_transaction_commit(tr);
+			err = fdb_wait_error(f);
+		}
+		fdb_future_destroy(f);
+		f = 0;
+
+		if (!err) {
+			break;
+		}
+
+		f = fdb_transaction_on_error(tr, err);
+		ERR_DONE(fdb_wait_error(f), "cache param transaction error.");
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	pfree(buf.data);
+}
+
+/*
+ * Set status of the entry, and its lease unless 0, if it is still the 
+ * generation ts.  Return QRY_FAIL_NO_RETRY if it is not.  If ts is the 
+ * refresh of a stale entry, QRY_FETCH only renews the lease, any other 
+ * status replaces the stale generation.
+ */
+static int32_t pgcache_mark_status(const qry_key_t *qk, int64_t ts, int32_t status, int64_t lease)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	int32_t ret = QRY_FAIL;
+	fdb_error_t err;
+
+	fdb_bool_t found;
+	const qry_val_t *qvbuf;
+	qry_val_t *qv = 0;
+	int qvsz;
+
+	ERR_DONE(fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int i = 0; i < PGC_MAX_RETRY; i++) {
+		f = fdb_transaction_get(tr, (const uint8_t *)qk, sizeof(qry_key_t), 0);
+		err = fdb_wait_error(f);
+		if (!err) {
+			err = fdb_future_get_value(f, &found, (const uint8_t **) &qvbuf, &qvsz);
+		}
+		if (!err) {
+			if (!found || (qvbuf->ts != ts && qvbuf->refts != ts)) {
+				ret = QRY_FAIL_NO_RETRY;
+				goto done;
+			}
+			qv = (qry_val_t *) palloc(qvsz);
+			memcpy(qv, qvbuf, qvsz);
+			if (qvbuf->ts == ts || status != QRY_FETCH) {
+				if (qvbuf->ts != ts) {
+					qv->supts = get_ts();
+				}
+				qv->ts = ts;
+				qv->refts = 0;
+				qv->status = status;
+			}
+			if (lease) {
+				qv->lease = lease;
+			}
+			fdb_transaction_set(tr, (const uint8_t *)qk, sizeof(qry_key_t), (const uint8_t *) qv, qvsz);
+			pfree(qv);
+
+			fdb_future_destroy(f);
+			f = fdb_transaction_commit(tr);
+			err = fdb_wait_error(f);
+		}
+		fdb_future_destroy(f);
+		f = 0;
+
+		if (!err) {
+			ret = 0;
+			break;
+		}
+
+		f = fdb_transaction_on_error(tr, err);
+		ERR_DONE(fdb_wait_error(f), "cache mark status transaction error.");
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	return ret;
+}
+
+/*
+ * Extend the lease of our populate of generation ts, while we are still
+ * fetching from the remote server, if *next, the time it is due, passed.
+ * Return QRY_FAIL_NO_RETRY if someone took the entry over, in which case 
+ * we should not populate.
+ */
+int32_t pgcache_renew_lease(const qry_key_t *qk, int64_t ts, int64_t *next)
+{
+	int64_t now = get_ts();
+
+	if (now < *next) {
+		return 0;
+	}
+	*next = now + (int64_t) populate_lease * 500;
+	return pgcache_mark_status(qk, ts, QRY_FETCH, now + (int64_t) populate_lease * 1000);
+}
+
+/*
+ * Give up our populate of generation ts, which has not published yet: its
+ * lease runs out now, so the next backend that wants the entry takes it 
+ * over instead of waiting for the lease to expire.
+ */
+void pgcache_release_lease(const qry_key_t *qk, int64_t ts)
+{
+	(void) pgcache_mark_status(qk, ts, QRY_FETCH, 1);
+}
+
+/*
+ * Streaming writer of generation ts of an entry we claimed.  Tuples come a
+ * batch at a time, as the remote server returns them, and are packed into
+ * blocks compressed with codec.  The block being filled carries over from
+ * one batch to the next, and encoded blocks are held until they make a 
+ * transaction, capped by PGC_TX_WRITE_LIMIT, so that a retry can set them
+ * again.  That, and the copy for the shared memory tier while the stream
+ * fits there, is all the memory a populate takes, whatever the size of 
+ * the result.
+ */
+struct pgcache_writer_t {
+	MemoryContext cxt;
+	qry_key_t qk;
+	int64_t ts;
+	int codec;
+	int32_t status;			/* QRY_FETCH while writing, then the outcome */
+	int64_t renew;			/* when the lease is due, see pgcache_renew_lease */
+
+	int ntup;				/* added so far */
+	int64_t totalNb;		/* size of their record stream */
+
+	/* block being filled, and its header */
+	char *blk;
+	char *cblk;
+	int used;
+	uint32_t nstart;
+	uint32_t head;
+
+	/* encoded blocks of the next transaction, each an int length and the value */
+	StringInfoData chunk;
+	int chunkblk;
+	int64_t chunkRawNb;
+	int wszNb;
+
+	/* committed so far, blkno is the first block of chunk */
+	int blkno;
+	int nchunk;
+	int64_t rawNb;
+	int64_t storeNb;
+
+	/* stream for the shared memory tier, dropped once it does not fit */
+	char *l1buf;
+	int64_t l1cap;
+	int64_t l1sz;
+
+	int64_t us;				/* time spent populating */
+	pgcache_stats_t *st;	/* of the scan, may be NULL */
+};
+
+/*
+ * Write the blocks of w->chunk in one transaction, which also renews our 
+ * lease, or publishes the entry if last.  The meta is only updated by the
+ * last transaction, so readers either see the complete new result or the 
+ * entry is still QRY_FETCH.  Readers still on the generation we supersede
+ * keep reading it, the gc drops it later, see gc_drop_superseded.  Sets
+ * w->status on failure, and to the number of tuples once published.
+ */
+static void writer_commit(pgcache_writer_t *w, bool last)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	int32_t ret = QRY_FAIL;
+	fdb_error_t err;
+
+	fdb_bool_t found;
+	const qry_val_t *qvbuf;
+	qry_val_t *qv = 0;
+	int qvsz;
+
+	tup_key_t ka;
+	int nretry = 0;
+
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+
+	for (;;) {
+		/* 
+		 * Every chunk reads the meta, so that we stop as soon as someone 
+		 * took over or invalidated the entry, and any change to the meta
+		 * conflicts with our commit.
+		 */
+		f = fdb_transaction_get(tr, (const uint8_t *) &w->qk, sizeof(qry_key_t), 0);
+		pgcache_stats_add(w->st, PGC_STAT_FDB_ROUND_TRIPS, 1);
+		err = fdb_wait_error(f);
+		if (!err) {
+			err = fdb_future_get_value(f, &found, (const uint8_t **) &qvbuf, &qvsz);
+		}
+
+		if (!err) {
+			const char *p = w->chunk.data;
+
+			/* Our claim is either the entry, or the refresh of it. */
+			if (!found || !((qvbuf->ts == w->ts && qvbuf->status == QRY_FETCH) || qvbuf->refts == w->ts)) {
+				ret = QRY_FAIL_NO_RETRY;
+				goto done;
+			}
+
+			if (!qv) {
+				qv = (qry_val_t *) palloc(qvsz);
+			}
+			memcpy(qv, qvbuf, qvsz);
+			fdb_future_destroy(f);
+			f = 0;
+
+			tup_key_initsha(&ka, w->qk.SHA, w->ts, 0);
+			for (int b = 0; b < w->chunkblk; b++) {
+				int vlen;
+
+				memcpy(&vlen, p, sizeof(vlen));
+				tup_key_setseq(&ka, w->blkno + b);
+				fdb_transaction_set(tr, 
+						(const uint8_t *) &ka, sizeof(ka), 
+						(const uint8_t *) p + sizeof(vlen), vlen); 
+				p += sizeof(vlen) + vlen;
+			}
+
+			if (last) {
+				/* Publish.  Other generations are left to the gc. */
+				qv->ts = w->ts;
+				qv->refts = 0;
+				qv->supts = get_ts();
+				qv->status = w->ntup;
+				qv->nblk = w->blkno + w->chunkblk;
+				qv->rawsz = w->rawNb + w->chunkRawNb;
+				qv->storesz = w->storeNb + w->wszNb;
+			} else {
+				/* More chunks to come, keep our lease. */
+				qv->lease = get_ts() + (int64_t) populate_lease * 1000;
+			}
+			fdb_transaction_set(tr, (const uint8_t *) &w->qk, sizeof(qry_key_t),
+					(const uint8_t *) qv, qvsz);
+
+			f = fdb_transaction_commit(tr);
+			pgcache_stats_add(w->st, PGC_STAT_FDB_ROUND_TRIPS, 1);
+			err = fdb_wait_error(f);
+		}
+		fdb_future_destroy(f);
+		f = 0;
+
+		if (!err) {
+			ret = 0;
+			break;
+		}
+
+		if (nretry++ < PGC_MAX_RETRY) {
+			f = fdb_transaction_on_error(tr, err);
+			err = fdb_wait_error(f);
+			fdb_future_destroy(f);
+			f = 0;
+		}
+		ERR_DONE(err, "cache populate transaction error, chunk %d.", w->nchunk);
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+
+	if (qv) {
+		pfree(qv);
+		qv = 0;
+	}
+
+	if (ret < 0) {
+		w->status = ret;
+		return;
+	}
+
+	w->rawNb += w->chunkRawNb;
+	w->storeNb += w->wszNb;
+	w->blkno += w->chunkblk;
+	w->nchunk++;
+	resetStringInfo(&w->chunk);
+	w->chunkblk = 0;
+	w->chunkRawNb = 0;
+	w->wszNb = 0;
+	w->renew = get_ts() + (int64_t) populate_lease * 500;
+	if (last) {
+		w->status = w->ntup;
+	}
+}
+
+/*
+ * Encode the block being filled and add it to the next transaction, after
+ * committing the ones before if it would not fit.
+ */
+static void writer_emit(pgcache_writer_t *w)
+{
+	char *val = w->blk;
+	int csz = -1;
+	int vlen;
+	blk_hdr_t *hdr;
+
+	if (w->wszNb > 0 && w->wszNb + (int) (sizeof(tup_key_t) + sizeof(blk_hdr_t)) + PGC_BLOCK_SZ > PGC_TX_WRITE_LIMIT) {
+		writer_commit(w, false);
+		if (w->status != QRY_FETCH) {
+			return;
+		}
+	}
+
+	if (w->cblk) {
+		csz = blk_compress(w->codec, w->blk + sizeof(blk_hdr_t), w->used, w->cblk + sizeof(blk_hdr_t));
+	}
+
+	if (csz > 0) {
+		val = w->cblk;
+		vlen = sizeof(blk_hdr_t) + csz;
+	} else {
+		vlen = sizeof(blk_hdr_t) + w->used;
+	}
+	hdr = (blk_hdr_t *) val;
+	hdr->ntup = w->nstart;
+	hdr->rawsz = w->used;
+	hdr->codec = csz > 0 ? w->codec : PGC_CODEC_NONE;
+	hdr->head = w->head;
+
+	appendBinaryStringInfo(&w->chunk, (const char *) &vlen, sizeof(vlen));
+	appendBinaryStringInfo(&w->chunk, val, vlen);
+	/* elog(LOG, "Putting in a block, seq %d, ntup %d, vlen %d.", w->blkno + w->chunkblk, w->nstart, vlen); */
+	w->chunkblk++;
+	w->wszNb += sizeof(tup_key_t) + vlen;
+	w->chunkRawNb += w->used;
+
+	w->used = 0;
+	w->nstart = 0;
+	w->head = 0;
+}
+
+/*
+ * Start populating generation ts of qk, which we claimed.  The writer
+ * lives in cxt.  Outcome, bytes stored, fdb round trips and time taken 
+ * are counted in st, see pgcache_writer_close.
+ */
+pgcache_writer_t *pgcache_writer_open(const qry_key_t *qk, int64_t ts, int codec, MemoryContext cxt, 
+		pgcache_stats_t *st)
+{
+	pgcache_writer_t *w;
+	MemoryContext oldcxt = MemoryContextSwitchTo(cxt);
+
+	w = (pgcache_writer_t *) palloc0(sizeof(pgcache_writer_t));
+	w->cxt = cxt;
+	w->qk = *qk;
+	w->ts = ts;
+	w->codec = codec;
+	w->st = st;
+	w->status = QRY_FETCH;
+	/* the claim just set our lease */
+	w->renew = get_ts() + (int64_t) populate_lease * 500;
+
+	w->blk = (char *) palloc0(sizeof(blk_hdr_t) + PGC_BLOCK_SZ);
+	if (codec != PGC_CODEC_NONE) {
+		w->cblk = (char *) palloc0(sizeof(blk_hdr_t) + PGLZ_MAX_OUTPUT(PGC_BLOCK_SZ));
+	}
+	initStringInfo(&w->chunk);
+
+	/* The stream also goes to the shared memory tier, if it fits there. */
+	if (pgcache_l1_admit(0)) {
+		w->l1cap = PGC_BLOCK_SZ;
+		w->l1buf = (char *) palloc(w->l1cap);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+	return w;
+}
+
+/*
+ * Add ntup tuples to the populate, writing out whatever transactions they
+ * fill, and renew our lease if due.  Return 0, or the failure once the
+ * populate failed, in which case the rest of the result need not be added.
+ */
+int32_t pgcache_writer_add(pgcache_writer_t *w, int ntup, HeapTuple *tups)
+{
+	int64_t start = get_ts();
+	int i = 0;
+	int off = 0;
+
+	if (w->status != QRY_FETCH) {
+		return w->status;
+	}
+
+	for (i = 0; i < ntup; i++) {
+		w->totalNb += blk_rec_sz(tups[i]);
+	}
+	if (w->totalNb > PGC_MAX_ENTRY_SZ) {
+		elog(LOG, "Cache entry limit reached, %d tuples, " INT64_FORMAT " bytes.", w->ntup + ntup, w->totalNb); 
+		w->status = QRY_FDB_LIMIT_REACHED;
+		return w->status;
+	}
+
+	if (w->l1buf && !pgcache_l1_admit(w->totalNb)) {
+		pfree(w->l1buf);
+		w->l1buf = 0;
+	} else if (w->l1buf && w->totalNb > w->l1cap) {
+		w->l1cap = Max(w->l1cap * 2, w->totalNb);
+		w->l1buf = (char *) repalloc(w->l1buf, w->l1cap);
+	}
+
+	i = 0;
+	while (i < ntup && w->status == QRY_FETCH) {
+		char *p = w->blk + sizeof(blk_hdr_t) + w->used;
+		int n;
+
+		if (w->used == 0 && off > 0) {
+			w->head = (uint32_t) Min(blk_rec_sz(tups[i]) - off, PGC_BLOCK_SZ);
+		}
+		n = blk_fill(p, PGC_BLOCK_SZ - w->used, tups, ntup, &i, &off, &w->nstart);
+		if (w->l1buf) {
+			memcpy(w->l1buf + w->l1sz, p, n);
+			w->l1sz += n;
+		}
+		w->used += n;
+
+		if (w->used == PGC_BLOCK_SZ) {
+			writer_emit(w);
+		}
+	}
+	w->ntup += ntup;
+
+	if (w->status == QRY_FETCH && pgcache_renew_lease(&w->qk, w->ts, &w->renew) == QRY_FAIL_NO_RETRY) {
+		/* Someone took over, they will populate. */
+		w->status = QRY_FAIL_NO_RETRY;
+	}
+
+	w->us += get_ts() - start;
+	return w->status == QRY_FETCH ? 0 : w->status;
+}
+
+/*
+ * Publish the populate, unless it failed already, and free the writer.  
+ * Return the number of tuples, or QRY_FAIL_NO_RETRY or QRY_FAIL.  A result
+ * over PGC_MAX_ENTRY_SZ is marked QRY_FDB_LIMIT_REACHED, so that it goes 
+ * remote from now on.
+ */
+int32_t pgcache_writer_close(pgcache_writer_t *w)
+{
+	int64_t start = get_ts();
+	int32_t ret;
+
+	if (w->status == QRY_FETCH && w->used > 0) {
+		writer_emit(w);
+	}
+	if (w->status == QRY_FETCH) {
+		writer_commit(w, true);
+	}
+	if (w->status >= 0 && w->l1buf) {
+		pgcache_l1_put(&w->qk, w->ts, w->ntup, w->l1buf, w->l1sz);
+	}
+	ret = w->status;
+
+	if (ret >= 0) {
+		pgcache_stats_add(w->st, PGC_STAT_POPULATES, 1);
+		pgcache_stats_add(w->st, PGC_STAT_BYTES_WRITTEN, w->storeNb);
+	} else if (ret == QRY_FDB_LIMIT_REACHED) {
+		pgcache_stats_add(w->st, PGC_STAT_LIMIT_REACHED, 1);
+	} else {
+		pgcache_stats_add(w->st, PGC_STAT_POPULATE_FAILS, 1);
+	}
+	if (w->st) {
+		int64_t us = w->us + get_ts() - start;
+
+		pgcache_stats_add(w->st, PGC_STAT_POPULATE_US, us);
+		pgcache_stats_latency(w->st->populate_hist, us);
+	}
+
+	if (ret == QRY_FDB_LIMIT_REACHED) {
+		pgcache_mark_status(&w->qk, w->ts, QRY_FDB_LIMIT_REACHED, 0);
+		ret = QRY_FAIL_NO_RETRY;
+	}
+
+	pfree(w->blk);
+	if (w->cblk) {
+		pfree(w->cblk);
+	}
+	if (w->l1buf) {
+		pfree(w->l1buf);
+	}
+	pfree(w->chunk.data);
+	pfree(w);
+	return ret;
+}
+
+/*
+ * Populate the cache with generation ts, all ntup tuples at once, see
+ * pgcache_writer_open.
+ */
+int32_t pgcache_populate(const qry_key_t *qk, int64_t ts, int ntup, HeapTuple *tups, int codec, pgcache_stats_t *st)
+{
+	pgcache_writer_t *w = pgcache_writer_open(qk, ts, codec, CurrentMemoryContext, st);
+
+	(void) pgcache_writer_add(w, ntup, tups);
+	return pgcache_writer_close(w);
 }
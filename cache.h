@@ -14,6 +14,10 @@
 #include "utils/varlena.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "port/pg_bswap.h"
+#include "utils/memutils.h"
+#include "nodes/bitmapset.h"
+#include "nodes/pg_list.h"
 
 #include <stdint.h>
 #include <openssl/sha.h>
@@ -59,6 +63,19 @@ static const int32_t QRY_FETCH = -1;
 static const int32_t QRY_FAIL = -2;
 static const int32_t QRY_FDB_LIMIT_REACHED = -3;
 static const int32_t QRY_FAIL_NO_RETRY = -4;
+static const int32_t QRY_MISS = -5;		/* would fetch, but did not claim */
+
+/* 
+ * FoundationDB funny transaction limit -- 10MB.  We cap each populate 
+ * transaction to 5MB, and spread bigger results over several of them.
+ * PGC_MAX_ENTRY_SZ caps a single cached result, anything bigger is 
+ * marked QRY_FDB_LIMIT_REACHED and always goes remote.
+ */
+#define PGC_TX_WRITE_LIMIT 5000000
+#define PGC_MAX_ENTRY_SZ ((int64_t) 1 << 30)
+
+/* How many times we retry a retryable fdb error in one transaction. */
+#define PGC_MAX_RETRY 10
 
 typedef struct qry_key_t {
 	char PREFIX[4];
@@ -67,7 +84,17 @@ typedef struct qry_key_t {
 
 typedef struct qry_val_t {
 	int64_t ts;
+	int64_t timeout;	/* usec, entry expires at ts + timeout */
+	int64_t grace;		/* usec, and is served stale until ts + timeout + grace */
+	int64_t refts;		/* generation refreshing a stale entry, 0 if none */
+	int64_t rawsz;		/* tuple stream bytes */
+	int64_t storesz;	/* block bytes stored in fdb */
+	int64_t lease;		/* populate in flight (ts or refts) is abandoned after that */
+	int64_t supts;		/* when ts superseded older generations, 0 once they are gone */
 	int32_t status;
+	int32_t nblk;		/* number of tuple blocks */
+	uint32_t fingerprint;	/* row type and build, see pgcache_fingerprint */
+	int32_t ownerpid;	/* backend that claimed the populate */
 	int32_t txtsz;
 	char qrytxt[1];
 } qry_val_t;
@@ -104,28 +131,227 @@ static inline ssize_t qry_val_sz(int32_t txtsz)
 	return offsetof(qry_val_t, qrytxt) + txtsz + 1;
 }
 
+/*
+ * Tuples of a cached query are stored under TUPL + SHA + GEN + SEQ.  GEN is
+ * the ts of the populate that wrote them, so a populate can spread its tuples
+ * over many transactions without touching the generation readers are using.
+ * SEQ is the block number, see blk_hdr_t.  GEN and SEQ are big endian so
+ * that FDB key order is generation/block order.  Both are byte arrays so 
+ * there is no padding in the key.
+ */
 typedef struct tup_key_t {
 	char PREFIX[4]; 
 	char SHA[20];
-	int32_t seq;
+	uint8_t GEN[8];
+	uint8_t SEQ[4];
 } tup_key_t;
 
-static inline void tup_key_init(tup_key_t *k, const char *shastr, int seq) {
+#define PGC_GEN_MAX ((int64_t) -1)
+#define PGC_SEQ_MAX ((int32_t) -1)
+
+static inline void tup_key_setseq(tup_key_t *k, int32_t seq) {
+	uint32_t be = pg_hton32((uint32_t) seq);
+	memcpy(k->SEQ, &be, 4);
+}
+
+static inline int32_t tup_key_getseq(const tup_key_t *k) {
+	uint32_t be;
+	memcpy(&be, k->SEQ, 4);
+	return (int32_t) pg_ntoh32(be);
+}
+
+static inline void tup_key_setgen(tup_key_t *k, int64_t gen) {
+	uint64_t be = pg_hton64((uint64_t) gen);
+	memcpy(k->GEN, &be, 8);
+}
+
+static inline void tup_key_init(tup_key_t *k, const char *shastr, int64_t gen, int32_t seq) {
 	memcpy(k->PREFIX, "TUPL", 4);
 	if (!shastr) {
 		memset(k->SHA, 0, 20);
 	} else {
 		hex_decode(shastr, 40, k->SHA);
 	}
-	k->seq = seq;
+	tup_key_setgen(k, gen);
+	tup_key_setseq(k, seq);
 }
 
-static inline void tup_key_initsha(tup_key_t *k, const char *sha, int seq) { 
+static inline void tup_key_initsha(tup_key_t *k, const char *sha, int64_t gen, int32_t seq) { 
 	memcpy(k->PREFIX, "TUPL", 4);
 	memcpy(k->SHA, sha, 20);
-	k->seq = seq;
+	tup_key_setgen(k, gen);
+	tup_key_setseq(k, seq);
+}
+
+/*
+ * Shape of a cached base relation scan, under PGCR + REL + SHA, REL is the
+ * SHA of the relation.  The value is shape_val_t, followed by the deparsed
+ * conditions, each NUL terminated.  A scan that misses looks for a fresh
+ * entry of the same relation with a subset of its conditions and a 
+ * superset of the columns it needs, and filters it locally.
+ */
+typedef struct shape_key_t {
+	char PREFIX[4];
+	char REL[20];
+	char SHA[20];
+} shape_key_t;
+
+typedef struct shape_val_t {
+	int32_t nattr;
+	int32_t ncond;
+	int32_t attrs[FLEXIBLE_ARRAY_MEMBER];	/* retrieved_attrs */
+} shape_val_t;
+
+static inline void shape_key_init(shape_key_t *k, const char *rel, const char *sha) {
+	memcpy(k->PREFIX, "PGCR", 4);
+	memcpy(k->REL, rel, 20);
+	memcpy(k->SHA, sha, 20);
+}
+
+/*
+ * SHAs of a foreign table and of a foreign server, to find what the cache
+ * keeps about them.
+ */
+static inline void pgcache_rel_sha(Oid relid, char *sha) {
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "Dbid: %u, Relid: %u", MyDatabaseId, relid);
+	SHA1((const unsigned char *) buf, strlen(buf), (unsigned char *) sha);
+}
+
+static inline void pgcache_server_sha(Oid serverid, char *sha) {
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "Dbid: %u, Serverid: %u", MyDatabaseId, serverid);
+	SHA1((const unsigned char *) buf, strlen(buf), (unsigned char *) sha);
+}
+
+/*
+ * Epoch of a foreign table or server, under PGCE + SHA.  The value is a
+ * little endian int64, 0 until first bumped with an fdb atomic add by
+ * pgc_fdw_invalidate_table or pgc_fdw_invalidate_server.  Scans put the
+ * epochs of their tables and server in the text of their cache key, see
+ * pgcache_epoch_text, so one bump retires every entry of the table or
+ * server, and the gc drops them.
+ */
+typedef struct epoch_key_t {
+	char PREFIX[4];
+	char SHA[20];
+} epoch_key_t;
+
+static inline void epoch_key_init(epoch_key_t *k, const char *sha) {
+	memcpy(k->PREFIX, "PGCE", 4);
+	memcpy(k->SHA, sha, 20);
+}
+
+/*
+ * Cache entries that depend on a foreign table, under PGCD + REL + SHA, REL
+ * as for shapes.  Set when a scan claims an entry, before it goes remote,
+ * and dropped with the entries when a transaction that modified the table
+ * commits, see pgcache_dep_invalidate.  The value is empty.
+ */
+typedef struct dep_key_t {
+	char PREFIX[4];
+	char REL[20];
+	char SHA[20];
+} dep_key_t;
+
+/* Entries dropped per transaction by pgcache_dep_invalidate */
+#define PGC_DEP_CHUNK 1000
+
+static inline void dep_key_init(dep_key_t *k, const char *rel, const char *sha) {
+	memcpy(k->PREFIX, "PGCD", 4);
+	memcpy(k->REL, rel, 20);
+	memcpy(k->SHA, sha, 20);
+}
+
+/*
+ * Parameter values a parameterized query was recently run with, under 
+ * PGCP + SHA of the query without its parameters.  The value is 
+ * param_val_t followed by the values, each NUL terminated, most recent 
+ * first.  A miss fetches the remembered values whose entries are missing 
+ * along with its own, see cache_param_batch.
+ */
+typedef struct param_key_t {
+	char PREFIX[4];
+	char SHA[20];
+} param_key_t;
+
+typedef struct param_val_t {
+	int64_t ts;			/* last remembered */
+	int64_t timeout;	/* usec, of the entries, memory is dropped after PGC_PARAM_KEEP of it */
+	int32_t nval;
+	char vals[FLEXIBLE_ARRAY_MEMBER];
+} param_val_t;
+
+#define PGC_MAX_PARAM_VALS 1024
+#define PGC_MAX_PARAM_LEN 1024
+#define PGC_PARAM_KEEP 4
+
+static inline void param_key_init(param_key_t *k, const char *sha) {
+	memcpy(k->PREFIX, "PGCP", 4);
+	memcpy(k->SHA, sha, 20);
+}
+
+/*
+ * Access stats of a query, for eviction, under PGCA + SHA + KIND.  Values 
+ * are little endian int64 updated with fdb atomic ops, so hits never 
+ * conflict with each other or with populate.
+ */
+typedef struct acc_key_t {
+	char PREFIX[4];
+	char SHA[20];
+	char KIND;
+} acc_key_t;
+
+#define PGC_ACC_LAST 'L'	/* last use, max of ts */
+#define PGC_ACC_HITS 'H'	/* number of hits */
+
+static inline void acc_key_init(acc_key_t *k, const char *sha, char kind) {
+	memcpy(k->PREFIX, "PGCA", 4);
+	memcpy(k->SHA, sha, 20);
+	k->KIND = kind;
 }
 
+static inline uint64_t pgc_le64(uint64_t v) {
+#ifdef WORDS_BIGENDIAN
+	return pg_bswap64(v);
+#else
+	return v;
+#endif
+}
+
+/*
+ * Tuples are serialized as a stream of records, uint32 length followed by
+ * the tuple, and the stream is cut into blocks of at most PGC_BLOCK_SZ bytes,
+ * one block per FDB value.  A record may span blocks.  ntup counts records 
+ * that start in the block, head is the number of bytes before the first of
+ * them, the end of a record started in an earlier block, so that a parallel
+ * scan can start reading at any block.  FDB caps a value at 100KB.
+ *
+ * PGC_BLOCK_FORMAT is part of pgcache_fingerprint, bump it when the layout
+ * changes so that entries of the old layout are simply fetched again.
+ */
+#define PGC_BLOCK_SZ 90000
+#define PGC_BLOCK_FORMAT 2
+
+typedef struct blk_hdr_t {
+	uint32_t ntup;
+	uint32_t rawsz;		/* bytes of the stream, before compression */
+	uint16_t codec;		/* how the payload is compressed */
+	uint16_t pad;
+	uint32_t head;		/* bytes ending a record of an earlier block */
+} blk_hdr_t;
+
+/*
+ * Block compression codecs, see cache_compression option.  A block is 
+ * stored with PGC_CODEC_NONE if compression does not make it smaller.
+ */
+#define PGC_CODEC_NONE 0
+#define PGC_CODEC_PGLZ 1
+#define PGC_CODEC_LZ4 2
+#define PGC_CODEC_ZSTD 3
+
 static inline fdb_error_t fdb_wait_error(FDBFuture *f) {
 	fdb_error_t blkErr = fdb_future_block_until_ready(f);
 	if (!blkErr) {
@@ -136,11 +362,139 @@ static inline fdb_error_t fdb_wait_error(FDBFuture *f) {
 }
 
 
+/*
+ * Cache statistics of a scan, see cache_stats.c.  Counters are indexes of
+ * counters, latencies go to histograms of PGC_STAT_NHIST buckets, bucket i
+ * counts those under 2^i ms, and the last one the rest.
+ */
+#define PGC_STAT_HITS 0
+#define PGC_STAT_MISSES 1
+#define PGC_STAT_STALE_HITS 2		/* also counted in hits */
+#define PGC_STAT_L1_HITS 3			/* also counted in hits */
+#define PGC_STAT_BYPASSES 4		/* went remote without populating */
+#define PGC_STAT_POPULATES 5
+#define PGC_STAT_POPULATE_FAILS 6
+#define PGC_STAT_LIMIT_REACHED 7
+#define PGC_STAT_BYTES_READ 8
+#define PGC_STAT_BYTES_WRITTEN 9
+#define PGC_STAT_REMOTE_US 10
+#define PGC_STAT_POPULATE_US 11
+#define PGC_STAT_WAITS 12			/* waited on the populate of another backend */
+#define PGC_STAT_FDB_ROUND_TRIPS 13
+#define PGC_STAT_STATUS_US 14		/* in pgcache_get_status */
+#define PGC_STAT_READ_US 15		/* in pgcache_reader_open and _next */
+#define PGC_STAT_NCOUNTER 16
+#define PGC_STAT_NHIST 16
+
+typedef struct pgcache_stats_t {
+	int64_t counters[PGC_STAT_NCOUNTER];
+	int64_t remote_hist[PGC_STAT_NHIST];
+	int64_t populate_hist[PGC_STAT_NHIST];
+} pgcache_stats_t;
+
+static inline void pgcache_stats_add(pgcache_stats_t *st, int counter, int64_t delta) {
+	if (st) {
+		st->counters[counter] += delta;
+	}
+}
+
+static inline void pgcache_stats_latency(int64_t *hist, int64_t us) {
+	int64_t ms = us / 1000;
+	int b = 0;
+
+	while (ms > 0 && b < PGC_STAT_NHIST - 1) {
+		ms >>= 1;
+		b++;
+	}
+	hist[b]++;
+}
+
 void pgcache_init(void);
 void pgcache_fini(void);
-int32_t pgcache_get_status(const qry_key_t* qk, int64_t ts, int64_t *to, const char *data); 
-int32_t pgcache_populate(const qry_key_t* qk, int64_t ts, int ntup, HeapTuple *tups); 
-int32_t pgcache_retrieve(const qry_key_t* qk, int64_t ts, int *ntup, HeapTuple **tups); 
+int pgcache_codec_by_name(const char *name);
+uint32_t pgcache_fingerprint(TupleDesc tupdesc, List *retrieved_attrs);
+int32_t pgcache_get_status(const qry_key_t* qk, int64_t ts, int64_t *to, int64_t grace, uint32_t fpr, bool claim, 
+		const char *data, pgcache_stats_t *st); 
+int32_t pgcache_peek(const qry_key_t *qk, int64_t now, int64_t timeout);
+int32_t pgcache_fresh(const qry_key_t *qk, int64_t now, int64_t timeout, uint32_t fpr, int64_t *pgen,
+		pgcache_stats_t *st);
+int32_t pgcache_populate(const qry_key_t* qk, int64_t ts, int ntup, HeapTuple *tups, int codec, pgcache_stats_t *st); 
+typedef struct pgcache_writer_t pgcache_writer_t;
+pgcache_writer_t *pgcache_writer_open(const qry_key_t *qk, int64_t ts, int codec, MemoryContext cxt, 
+		pgcache_stats_t *st);
+int32_t pgcache_writer_add(pgcache_writer_t *w, int ntup, HeapTuple *tups);
+int32_t pgcache_writer_close(pgcache_writer_t *w);
+int32_t pgcache_renew_lease(const qry_key_t *qk, int64_t ts, int64_t *next);
+void pgcache_release_lease(const qry_key_t *qk, int64_t ts);
+int pgcache_claim_many(int n, const qry_key_t *qks, const char **qstrs, int64_t ts, int64_t timeout, 
+		int64_t grace, uint32_t fpr, bool *claimed);
+void pgcache_lease_init(void);
+
+/* Counters under PGCM + name, see pgc_fdw_cache_metrics */
+#define PGC_METRIC_LEASE_TAKEOVER "lease_takeovers"
+void pgcache_metric_add(FDBTransaction *tr, const char *name, int64_t delta);
+
+typedef struct pgcache_reader_t pgcache_reader_t;
+int32_t pgcache_reader_open(const qry_key_t *qk, int64_t ts, MemoryContext cxt, pgcache_stats_t *st, 
+		pgcache_reader_t **prd);
+int32_t pgcache_reader_open_ranged(const qry_key_t *qk, int64_t ts, MemoryContext cxt, pgcache_stats_t *st,
+		int32_t *pnblk, pgcache_reader_t **prd);
+void pgcache_reader_seek(pgcache_reader_t *rd, int32_t first, int32_t end);
+int pgcache_reader_next(pgcache_reader_t *rd, HeapTuple **tups);
+void pgcache_reader_close(pgcache_reader_t *rd);
+
+void pgcache_touch(const qry_key_t *qk, int64_t ts);
+
+void pgcache_shape_register(const char *relsha, const qry_key_t *qk, List *retrieved_attrs, List *conds);
+int32_t pgcache_shape_lookup(const char *relsha, List *conds, List *condattrs, Bitmapset *retattrs,
+		TupleDesc tupdesc, const char *prefix, int64_t now, int64_t timeout, qry_key_t *qk, int64_t *ts,
+		List **residual);
+
+void pgcache_clear_entry(FDBTransaction *tr, const char *sha);
+void pgcache_dep_register(const char *relshas, int nrel, const qry_key_t *qks, int nqk);
+int64_t pgcache_dep_invalidate(const char *relsha);
+int pgcache_epoch_text(StringInfo buf, const char *shas, int nsha);
+int pgcache_epoch_bump(const char *sha);
+
+List *pgcache_params_recall(const char *sha);
+void pgcache_params_remember(const char *sha, const char *value, int64_t ts, int64_t timeout);
+
+/* cache_gc.c */
+#define PGC_GC_LRU 0
+#define PGC_GC_LFU 1
+void pgcache_gc_init(void);
+int64_t pgcache_gc(void);
+
+/* cache_l1.c */
+void pgcache_l1_init(void);
+bool pgcache_l1_admit(int64_t sz);
+char *pgcache_l1_get(const qry_key_t *qk, int64_t ts, int32_t *pntup, Size *psz);
+void pgcache_l1_put(const qry_key_t *qk, int64_t ts, int32_t ntup, const char *data, Size sz);
+
+/* cache_stats.c */
+#define PGC_STATS_GLOBAL 'G'
+#define PGC_STATS_TABLE 'T'
+#define PGC_STATS_ENTRY 'E'
+
+typedef struct pgcache_stats_key_t {
+	Oid dbid;
+	Oid relid;			/* of a table, InvalidOid for an entry */
+	char SHA[20];		/* of an entry */
+	char kind;
+	char pad[3];
+} pgcache_stats_key_t;
+
+typedef struct pgcache_stats_row_t {
+	pgcache_stats_key_t key;	/* hash key, must be first */
+	Oid relid;			/* table scanned, InvalidOid for a join */
+	pgcache_stats_t st;
+} pgcache_stats_row_t;
+
+void pgcache_stats_init(void);
+void pgcache_stats_accum(pgcache_stats_t *dst, const pgcache_stats_t *src);
+void pgcache_stats_flush(Oid relid, const qry_key_t *qk, pgcache_stats_t *st);
+pgcache_stats_row_t *pgcache_stats_snapshot(int *pnrow, TimestampTz *preset);
+void pgcache_stats_reset(void);
 
 
 
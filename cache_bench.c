@@ -0,0 +1,219 @@
+/*-------------------------------------------------------------------------
+ *
+ * cache_bench.c
+ *		  Microbenchmark of the cache storage layer.
+ *
+ * pgc_fdw_cache_bench() drives pgcache_get_status, pgcache_populate and the
+ * cache reader directly, against whatever fdb cluster the backend uses, on
+ * synthetic entries of ntuples rows of (int4, text of width bytes).  Every
+ * iteration populates a fresh entry, checks it, reads it back and drops it.
+ * With the shared memory tier on, populate also fills it and the read back
+ * comes from there.  Run it from several sessions at once for concurrency,
+ * see bench/cache_bench.sh.
+ *-------------------------------------------------------------------------
+ */
+#include "cache.h"
+#include "access/tupdesc.h"
+#include "catalog/pg_type.h"
+#include "utils/tuplestore.h"
+
+#define PGC_BENCH_OPS 3
+
+static const char *bench_op_names[PGC_BENCH_OPS] = {"populate", "status", "retrieve"};
+
+static int bench_cmp_us(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * Synthetic rows, the text is random letters, about as compressible as
+ * real text columns.
+ */
+static HeapTuple *bench_tuples(TupleDesc tupdesc, int ntup, int width, int64_t *prawsz)
+{
+	HeapTuple *tups = (HeapTuple *) palloc(Max(ntup, 1) * sizeof(HeapTuple));
+	char *pad = (char *) palloc(width + 1);
+	uint32_t seed = (uint32_t) MyProcPid;
+
+	*prawsz = 0;
+	for (int i = 0; i < ntup; i++) {
+		Datum values[2];
+		bool nulls[2] = {false, false};
+
+		for (int j = 0; j < width; j++) {
+			seed = seed * 1103515245 + 12345;
+			pad[j] = 'a' + (seed >> 16) % 26;
+		}
+		pad[width] = '\0';
+		values[0] = Int32GetDatum(i);
+		values[1] = CStringGetTextDatum(pad);
+		tups[i] = heap_form_tuple(tupdesc, values, nulls);
+		*prawsz += tups[i]->t_len;
+		pfree(DatumGetPointer(values[1]));
+	}
+	pfree(pad);
+	return tups;
+}
+
+/*
+ * Drop all generations of the entry, and its meta.
+ */
+static void bench_drop(const qry_key_t *qk)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	pgcache_clear_entry(tr, qk->SHA);
+	f = fdb_transaction_commit(tr);
+	ERR_DONE( fdb_wait_error(f), "cannot drop bench entry");
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+}
+
+/*
+ * pgc_fdw_cache_bench(ntuples, width, iterations, compression)
+ *
+ * One row per operation: throughput in tuples and raw MB per second, p50
+ * and p99 latency, and bytes per tuple in fdb (written by populate, read
+ * by retrieve).
+ */
+PG_FUNCTION_INFO_V1(pgc_fdw_cache_bench);
+Datum pgc_fdw_cache_bench(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int32 ntup = PG_GETARG_INT32(0);
+	int32 width = PG_GETARG_INT32(1);
+	int32 niter = PG_GETARG_INT32(2);
+	char *codecname = text_to_cstring(PG_GETARG_TEXT_PP(3));
+	int codec = pgcache_codec_by_name(codecname);
+	TupleDesc tupdesc;
+	TupleDesc rowdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldctxt;
+	MemoryContext itercxt;
+	HeapTuple *tups;
+	int64_t rawsz;
+	uint32_t fpr;
+	int64_t *lat[PGC_BENCH_OPS];
+	int64_t total[PGC_BENCH_OPS] = {0, 0, 0};
+	pgcache_stats_t st[PGC_BENCH_OPS];
+
+	CHECK_COND( rsinfo && (rsinfo->allowedModes & SFRM_Materialize),
+			"pgc_fdw_cache_bench called in context that cannot accept a set");
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+		elog(ERROR, "return type must be a row type");
+	}
+	CHECK_COND( ntup >= 0 && width >= 0 && niter > 0, "ntuples and width cannot be negative, iterations must be positive");
+	CHECK_COND( codec >= 0, "unknown or unsupported compression \"%s\"", codecname);
+
+	oldctxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldctxt);
+
+	rowdesc = CreateTemplateTupleDesc(2);
+	TupleDescInitEntry(rowdesc, (AttrNumber) 1, "id", INT4OID, -1, 0);
+	TupleDescInitEntry(rowdesc, (AttrNumber) 2, "pad", TEXTOID, -1, 0);
+	fpr = pgcache_fingerprint(rowdesc, list_make2_int(1, 2));
+	tups = bench_tuples(rowdesc, ntup, width, &rawsz);
+
+	memset(st, 0, sizeof(st));
+	for (int op = 0; op < PGC_BENCH_OPS; op++) {
+		lat[op] = (int64_t *) palloc(niter * sizeof(int64_t));
+	}
+	itercxt = AllocSetContextCreate(CurrentMemoryContext, "pgc_fdw bench", ALLOCSET_DEFAULT_SIZES);
+
+	for (int it = 0; it < niter; it++) {
+		char qstr[128];
+		qry_key_t qk;
+		pgcache_reader_t *rd;
+		HeapTuple *batch;
+		int64_t to = (int64_t) 3600 * 1000000;
+		int64_t start;
+		int32_t status;
+		int nread = 0;
+		int n;
+
+		CHECK_FOR_INTERRUPTS();
+		oldctxt = MemoryContextSwitchTo(itercxt);
+		snprintf(qstr, sizeof(qstr), "pgc_fdw bench, pid %d, iteration %d, ts " INT64_FORMAT,
+				MyProcPid, it, get_ts());
+		qry_key_build(&qk, qstr);
+
+		status = pgcache_get_status(&qk, get_ts(), &to, 0, fpr, true, qstr, NULL);
+		CHECK_COND( status == QRY_FETCH, "cannot claim bench entry, status %d", status);
+
+		start = get_ts();
+		status = pgcache_populate(&qk, to, ntup, tups, codec, &st[0]);
+		lat[0][it] = get_ts() - start;
+		CHECK_COND( status == ntup, "bench populate failed, status %d", status);
+
+		start = get_ts();
+		to = (int64_t) 3600 * 1000000;
+		status = pgcache_get_status(&qk, get_ts(), &to, 0, fpr, true, qstr, &st[1]);
+		lat[1][it] = get_ts() - start;
+		CHECK_COND( status == ntup, "bench entry not found, status %d", status);
+
+		start = get_ts();
+		status = pgcache_reader_open(&qk, to, itercxt, &st[2], &rd);
+		CHECK_COND( status == ntup, "cannot open bench entry, status %d", status);
+		while ((n = pgcache_reader_next(rd, &batch)) > 0) {
+			nread += n;
+		}
+		pgcache_reader_close(rd);
+		lat[2][it] = get_ts() - start;
+		CHECK_COND( nread == ntup, "bench read %d tuples, expecting %d", nread, ntup);
+
+		bench_drop(&qk);
+		MemoryContextSwitchTo(oldctxt);
+		MemoryContextReset(itercxt);
+
+		for (int op = 0; op < PGC_BENCH_OPS; op++) {
+			total[op] += lat[op][it];
+		}
+	}
+
+	for (int op = 0; op < PGC_BENCH_OPS; op++) {
+		Datum values[7];
+		bool nulls[7] = {false, false, false, false, false, false, false};
+		double secs = Max(total[op], 1) / 1000000.0;
+		int64_t bytes;
+
+		qsort(lat[op], niter, sizeof(int64_t), bench_cmp_us);
+		values[0] = CStringGetTextDatum(bench_op_names[op]);
+		values[1] = Int32GetDatum(niter);
+		values[2] = Float8GetDatum((double) ntup * niter / secs);
+		values[3] = Float8GetDatum((double) rawsz * niter / secs / (1024 * 1024));
+		values[4] = Float8GetDatum(lat[op][niter / 2] / 1000.0);
+		values[5] = Float8GetDatum(lat[op][Min((int64_t) niter * 99 / 100, niter - 1)] / 1000.0);
+
+		bytes = op == 0 ? st[op].counters[PGC_STAT_BYTES_WRITTEN] : st[op].counters[PGC_STAT_BYTES_READ];
+		nulls[6] = op == 1 || ntup == 0;
+		values[6] = Float8GetDatum(ntup > 0 ? (double) bytes / ((double) ntup * niter) : 0);
+		if (op == 1) {
+			/* a status check is per entry, not per tuple */
+			values[2] = Float8GetDatum(niter / secs);
+			nulls[3] = true;
+		}
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	MemoryContextDelete(itercxt);
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
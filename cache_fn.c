@@ -1,4 +1,10 @@
 #include "cache.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "foreign/foreign.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+#include "utils/tuplestore.h"
 
 typedef struct cache_info_ctxt_t {
 	TupleDesc tupdesc;
@@ -82,8 +88,8 @@ done:
 	funcctxt = SRF_PERCALL_SETUP();
 	fnctxt = funcctxt->user_fctx;
 	if (funcctxt->call_cntr < funcctxt->max_calls) {
-		Datum values[4];
-		bool nulls[4];
+		Datum values[7];
+		bool nulls[7];
 		HeapTuple htup;
 		Datum result;
 
@@ -100,6 +106,13 @@ done:
 		nulls[2] = false;
 		values[3] = (Datum) cstring_to_text_with_len(qv->qrytxt, qv->txtsz);
 		nulls[3] = false;
+		values[4] = Int64GetDatum(qv->rawsz);
+		nulls[4] = false;
+		values[5] = Int64GetDatum(qv->storesz);
+		nulls[5] = false;
+		/* compression ratio, only meaningful once the entry is populated */
+		values[6] = Float8GetDatum(qv->storesz > 0 ? (double) qv->rawsz / qv->storesz : 0);
+		nulls[6] = qv->storesz <= 0;
 
 		htup = heap_form_tuple(fnctxt->tupdesc, values, nulls);
 		result = HeapTupleGetDatum(htup);
@@ -146,7 +159,7 @@ Datum pgc_fdw_set(PG_FUNCTION_ARGS)
 		}
 
 		qv_sz = qry_val_sz(qrysz);
-		qv = (qry_val_t *) palloc(qv_sz); 
+		qv = (qry_val_t *) palloc0(qv_sz); 
 		qv->ts = ts;
 		qv->status = status;
 		qv->txtsz = qrysz;
@@ -197,9 +210,6 @@ Datum pgc_fdw_invalidate(PG_FUNCTION_ARGS)
 {
 	text *shatext;
 	char *shastr;
-	
-	tup_key_t ka;
-	tup_key_t kz;
 	qry_key_t qk;
 
 	fdb_error_t err = 0;
@@ -211,15 +221,9 @@ Datum pgc_fdw_invalidate(PG_FUNCTION_ARGS)
 	shastr = text_to_cstring(shatext);
 	CHECK_COND( strlen(shastr) == 40, "sha should be hex encoded."); 
 
-	tup_key_init(&ka, shastr, 0);
-	tup_key_init(&kz, shastr, -1);
-	
-	CHECK_ERR( fdb_database_create_transaction(get_fdb(), &tr), "cannot create transaction");
-	fdb_transaction_clear_range(tr, (const uint8_t *) &ka, sizeof(ka), 
-			                        (const uint8_t *) &kz, sizeof(kz));
-
 	qry_key_init(&qk, shastr);
-	fdb_transaction_clear(tr, (const uint8_t *) &qk, sizeof(qk));
+	CHECK_ERR( fdb_database_create_transaction(get_fdb(), &tr), "cannot create transaction");
+	pgcache_clear_entry(tr, qk.SHA);
 
 	f = fdb_transaction_commit(tr);
 	err = fdb_wait_error(f);
@@ -227,3 +231,218 @@ Datum pgc_fdw_invalidate(PG_FUNCTION_ARGS)
 	fdb_transaction_destroy(tr);
 	PG_RETURN_INT32(err);
 }
+
+/*
+ * pgc_fdw_invalidate_table(regclass) and pgc_fdw_invalidate_server(name)
+ *
+ * Retire all entries of a foreign table, or of all tables of a server, by
+ * bumping its epoch, see epoch_key_t.  The gc reclaims them.  Return the
+ * fdb error, 0 on success.
+ */
+PG_FUNCTION_INFO_V1(pgc_fdw_invalidate_table);
+Datum pgc_fdw_invalidate_table(PG_FUNCTION_ARGS)
+{
+	Oid relid;
+	char sha[20];
+
+	CHECK_COND( !PG_ARGISNULL(0), "table cannot be null");
+	relid = PG_GETARG_OID(0);
+	CHECK_COND( get_rel_relkind(relid) == RELKIND_FOREIGN_TABLE, "relation %u is not a foreign table", relid);
+
+	pgcache_rel_sha(relid, sha);
+	PG_RETURN_INT32(pgcache_epoch_bump(sha));
+}
+
+PG_FUNCTION_INFO_V1(pgc_fdw_invalidate_server);
+Datum pgc_fdw_invalidate_server(PG_FUNCTION_ARGS)
+{
+	ForeignServer *server;
+	char sha[20];
+
+	CHECK_COND( !PG_ARGISNULL(0), "server cannot be null");
+	server = GetForeignServerByName(NameStr(*PG_GETARG_NAME(0)), false);
+
+	pgcache_server_sha(server->serverid, sha);
+	PG_RETURN_INT32(pgcache_epoch_bump(sha));
+}
+
+PG_FUNCTION_INFO_V1(pgc_fdw_gc);
+Datum pgc_fdw_gc(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(pgcache_gc());
+}
+
+PG_FUNCTION_INFO_V1(pgc_fdw_cache_metrics);
+Datum pgc_fdw_cache_metrics(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldctxt;
+
+	fdb_error_t err = 0;
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	const FDBKeyValue *kv;
+	int kvCnt = 0;
+	fdb_bool_t hasMore;
+
+	CHECK_COND( rsinfo && (rsinfo->allowedModes & SFRM_Materialize), 
+			"pgc_fdw_cache_metrics called in context that cannot accept a set");
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+		elog(ERROR, "return type must be a row type");
+	}
+
+	oldctxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldctxt);
+
+	ERR_DONE((err = fdb_database_create_transaction(get_fdb(), &tr)), "cannot begin fdb tx"); 
+	f = fdb_transaction_get_range(tr, 
+			(const uint8_t*) "PGCM", 4, 0, 1,
+			(const uint8_t*) "PGCN", 4, 0, 1,
+			0, 0, FDB_STREAMING_MODE_WANT_ALL, 1, 0, 0);
+	ERR_DONE((err = fdb_wait_error(f)), "fdb get range error");
+	ERR_DONE((err = fdb_future_get_keyvalue_array(f, &kv, &kvCnt, &hasMore)), 
+			"get kv array failed");
+
+	for (int i = 0; i < kvCnt; i++) {
+		Datum values[2];
+		bool nulls[2] = {false, false};
+		uint64_t v = 0;
+
+		memcpy(&v, kv[i].value, Min(kv[i].value_length, (int) sizeof(v)));
+		values[0] = (Datum) cstring_to_text_with_len((const char *) kv[i].key + 4, kv[i].key_length - 4);
+		values[1] = Int64GetDatum((int64_t) pgc_le64(v));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	CHECK_ERR(err, "pgc_fdw_cache_metrics failed to read from fdb, err %d", err);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+static Datum stats_hist_datum(const int64_t *hist)
+{
+	Datum elems[PGC_STAT_NHIST];
+
+	for (int i = 0; i < PGC_STAT_NHIST; i++) {
+		elems[i] = Int64GetDatum(hist[i]);
+	}
+	return PointerGetDatum(construct_array(elems, PGC_STAT_NHIST, INT8OID, 8, FLOAT8PASSBYVAL, 'd'));
+}
+
+/*
+ * Cache statistics kept in shared memory, the global row first, then one
+ * per foreign table and per cache entry.  Latency histograms have bucket i
+ * counting latencies below 2^i ms, the last one everything above.
+ */
+PG_FUNCTION_INFO_V1(pgc_fdw_cache_stats);
+Datum pgc_fdw_cache_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldctxt;
+	pgcache_stats_row_t *rows;
+	TimestampTz reset = 0;
+	int nrow;
+
+	CHECK_COND( rsinfo && (rsinfo->allowedModes & SFRM_Materialize), 
+			"pgc_fdw_cache_stats called in context that cannot accept a set");
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+		elog(ERROR, "return type must be a row type");
+	}
+
+	oldctxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldctxt);
+
+	rows = pgcache_stats_snapshot(&nrow, &reset);
+	if (!rows) {
+		ereport(WARNING,
+				(errmsg("pgc_fdw cache statistics are not kept"),
+				 errhint("Add pgc_fdw to shared_preload_libraries.")));
+	}
+
+	for (int i = 0; i < nrow; i++) {
+		const pgcache_stats_row_t *row = &rows[i];
+		const int64_t *c = row->st.counters;
+		Datum values[23];
+		bool nulls[23];
+		int k = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+		switch (row->key.kind) {
+			case PGC_STATS_GLOBAL:
+				values[k++] = CStringGetTextDatum("global");
+				nulls[k] = nulls[k + 1] = nulls[k + 2] = true;
+				k += 3;
+				break;
+			case PGC_STATS_TABLE:
+				values[k++] = CStringGetTextDatum("table");
+				values[k++] = ObjectIdGetDatum(row->key.dbid);
+				values[k++] = ObjectIdGetDatum(row->relid);
+				nulls[k++] = true;
+				break;
+			default: {
+				char shahex[40];
+
+				values[k++] = CStringGetTextDatum("entry");
+				values[k++] = ObjectIdGetDatum(row->key.dbid);
+				nulls[k] = !OidIsValid(row->relid);
+				values[k++] = ObjectIdGetDatum(row->relid);
+				hex_encode(row->key.SHA, 20, shahex);
+				values[k++] = (Datum) cstring_to_text_with_len(shahex, 40);
+				break;
+			}
+		}
+		values[k++] = Int64GetDatum(c[PGC_STAT_HITS]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_MISSES]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_STALE_HITS]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_L1_HITS]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_WAITS]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_BYPASSES]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_POPULATES]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_POPULATE_FAILS]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_LIMIT_REACHED]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_BYTES_READ]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_BYTES_WRITTEN]);
+		values[k++] = Int64GetDatum(c[PGC_STAT_FDB_ROUND_TRIPS]);
+		values[k++] = Float8GetDatum(c[PGC_STAT_STATUS_US] / 1000.0);
+		values[k++] = Float8GetDatum(c[PGC_STAT_READ_US] / 1000.0);
+		values[k++] = Float8GetDatum(c[PGC_STAT_REMOTE_US] / 1000.0);
+		values[k++] = Float8GetDatum(c[PGC_STAT_POPULATE_US] / 1000.0);
+		values[k++] = stats_hist_datum(row->st.remote_hist);
+		values[k++] = stats_hist_datum(row->st.populate_hist);
+		values[k++] = TimestampTzGetDatum(reset);
+		Assert(k == lengthof(values));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pgc_fdw_cache_stats_reset);
+Datum pgc_fdw_cache_stats_reset(PG_FUNCTION_ARGS)
+{
+	pgcache_stats_reset();
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,788 @@
+/*-------------------------------------------------------------------------
+ *
+ * cache_gc.c
+ *		  Garbage collector of the FDB cache.
+ *
+ * Entries are only replaced when their query runs again, so entries of
+ * queries that never come back would stay forever.  A gc pass scans all
+ * query metas, drops the expired ones with their tuple blocks, then evicts
+ * entries by LRU or LFU until the cache fits pgc_fdw.cache_max_size.
+ * Entries keyed with the epoch of a table or server that was bumped since
+ * are dropped as expired, see epoch_key_t.  Generations superseded by a 
+ * refresh are kept pgc_fdw.generation_keep seconds for readers still on
+ * them, then dropped.
+ * Shapes of entries that are gone, and parameter memories not used for a
+ * long time, are dropped last.  Everything runs at fdb
+ * batch priority.
+ *
+ * Passes run in a background worker every pgc_fdw.gc_interval seconds when
+ * pgc_fdw is in shared_preload_libraries, or by pgc_fdw_gc().
+ *-------------------------------------------------------------------------
+ */
+#include "cache.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+
+static int gc_interval = 60;	/* seconds, GUC */
+static int cache_max_size = 0;	/* kB, GUC */
+static int generation_keep = 300;	/* seconds, GUC */
+static int gc_policy = PGC_GC_LRU;
+
+static const struct config_enum_entry gc_policy_options[] = {
+	{"lru", PGC_GC_LRU, false},
+	{"lfu", PGC_GC_LFU, false},
+	{NULL, 0, false}
+};
+
+typedef struct gc_ent_t {
+	char SHA[20];
+	int64_t ts;
+	int64_t timeout;
+	int64_t grace;
+	int64_t storesz;
+	int64_t lease;
+	int64_t supts;
+	int32_t status;
+	int64_t lastuse;
+	int64_t hits;
+	bool stale;			/* of an older epoch */
+	bool gone;
+} gc_ent_t;
+
+typedef struct gc_scan_t {
+	gc_ent_t *ents;
+	int nent;
+	int maxent;
+	char *orphans;			/* SHA of access stats without meta */
+	int norphan;
+	int maxorphan;
+	shape_key_t *shapes;	/* shapes of entries that are gone */
+	int nshape;
+	int maxshape;
+	param_key_t *params;	/* parameter memories to forget */
+	int nparam;
+	int maxparam;
+	char *epoch_shas;		/* of tables and servers with an epoch, sorted */
+	int64_t *epochs;
+	int nepoch;
+	int maxepoch;
+	int64_t now;
+} gc_scan_t;
+
+/* Keys cleared per transaction, well below the fdb transaction size limit. */
+#define PGC_GC_CLEAR_BATCH 1000
+
+PGDLLEXPORT void pgc_fdw_gc_main(Datum arg);
+
+void pgcache_gc_init(void)
+{
+	BackgroundWorker worker;
+
+	DefineCustomIntVariable("pgc_fdw.gc_interval",
+			"Seconds between passes of the cache garbage collector.",
+			"0 disables the background worker.",
+			&gc_interval,
+			60, 0, INT_MAX / 1000,
+			PGC_SIGHUP, GUC_UNIT_S,
+			NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgc_fdw.cache_max_size",
+			"Total size of the FDB cache the garbage collector evicts down to.",
+			"0 means no limit, only expired entries are dropped.",
+			&cache_max_size,
+			0, 0, INT_MAX,
+			PGC_SIGHUP, GUC_UNIT_KB,
+			NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgc_fdw.generation_keep",
+			"Seconds the garbage collector keeps generations of an entry superseded by a refresh.",
+			"Scans that started on the old generation can finish reading it meanwhile.",
+			&generation_keep,
+			300, 0, INT_MAX / 1000,
+			PGC_SIGHUP, GUC_UNIT_S,
+			NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("pgc_fdw.gc_policy",
+			"Which entries the garbage collector evicts first.",
+			NULL,
+			&gc_policy,
+			PGC_GC_LRU, gc_policy_options,
+			PGC_SIGHUP, 0,
+			NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress) {
+		return;
+	}
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 60;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgc_fdw");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgc_fdw_gc_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pgc_fdw cache gc");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pgc_fdw cache gc");
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Call fn on all key values in [ka, kz), with snapshot reads at batch
+ * priority.  A scan of a big cache outlives an fdb transaction, so we
+ * resume after the last key we got when the transaction gets too old.
+ */
+static void gc_scan_range(const uint8_t *ka, int kalen, const uint8_t *kz, int kzlen,
+		void (*fn)(const FDBKeyValue *kv, void *arg), void *arg)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	fdb_error_t err;
+	uint8_t kbuf[64];
+	int klen = kalen;
+	int orEqual = 0;		/* first_greater_or_equal */
+	int iteration = 1;
+	int nretry = 0;
+	fdb_bool_t more = 1;
+
+	Assert(kalen <= (int) sizeof(kbuf));
+	memcpy(kbuf, ka, kalen);
+
+	CHECK_ERR( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	fdb_transaction_set_option(tr, FDB_TR_OPTION_PRIORITY_BATCH, NULL, 0);
+
+	while (more) {
+		const FDBKeyValue *kv;
+		int kvcnt;
+
+		f = fdb_transaction_get_range(tr,
+				kbuf, klen, orEqual, 1,
+				kz, kzlen, 0, 1,
+				0, 0, FDB_STREAMING_MODE_ITERATOR, iteration++, 1, 0);
+		err = fdb_wait_error(f);
+		if (!err) {
+			err = fdb_future_get_keyvalue_array(f, &kv, &kvcnt, &more);
+		}
+
+		if (err) {
+			fdb_future_destroy(f);
+			f = 0;
+			if (nretry++ < PGC_MAX_RETRY) {
+				f = fdb_transaction_on_error(tr, err);
+				err = fdb_wait_error(f);
+				fdb_future_destroy(f);
+				f = 0;
+				fdb_transaction_set_option(tr, FDB_TR_OPTION_PRIORITY_BATCH, NULL, 0);
+			}
+			if (err) {
+				fdb_transaction_destroy(tr);
+				elog(ERROR, PGC_FLINE "cache gc scan failed, err %d", err);
+			}
+			more = 1;
+			continue;
+		}
+		nretry = 0;
+
+		for (int i = 0; i < kvcnt; i++) {
+			fn(&kv[i], arg);
+		}
+		if (kvcnt > 0 && kv[kvcnt - 1].key_length <= (int) sizeof(kbuf)) {
+			klen = kv[kvcnt - 1].key_length;
+			memcpy(kbuf, kv[kvcnt - 1].key, klen);
+			orEqual = 1;	/* first_greater_than */
+		}
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	fdb_transaction_destroy(tr);
+}
+
+static void gc_add_epoch(const FDBKeyValue *kv, void *arg)
+{
+	gc_scan_t *scan = (gc_scan_t *) arg;
+	uint64_t v = 0;
+
+	if (kv->key_length != sizeof(epoch_key_t)) {
+		return;
+	}
+
+	if (scan->nepoch == scan->maxepoch) {
+		scan->maxepoch *= 2;
+		scan->epoch_shas = (char *) repalloc(scan->epoch_shas, scan->maxepoch * 20);
+		scan->epochs = (int64_t *) repalloc(scan->epochs, scan->maxepoch * sizeof(int64_t));
+	}
+	memcpy(&v, kv->value, Min(kv->value_length, (int) sizeof(v)));
+	memcpy(scan->epoch_shas + scan->nepoch * 20, ((const epoch_key_t *) kv->key)->SHA, 20);
+	scan->epochs[scan->nepoch++] = (int64_t) pgc_le64(v);
+}
+
+static int gc_sha_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, 20);
+}
+
+/*
+ * Was the entry of meta qv, of vlen bytes, keyed with an epoch that was
+ * bumped since?  Its text starts "Dbid: <oid>, Epochs: <sha>:<epoch> ...",
+ * see pgcache_epoch_text.
+ */
+static bool gc_epoch_stale(const gc_scan_t *scan, const qry_val_t *qv, int vlen)
+{
+	const char *p = qv->qrytxt;
+
+	/* the text is NUL terminated, unless the meta is damaged */
+	if (scan->nepoch == 0 || vlen < (int) qry_val_sz(0) || ((const char *) qv)[vlen - 1] != '\0') {
+		return false;
+	}
+
+	p = strchr(p, ',');
+	if (!p || strncmp(p, ", Epochs:", 9) != 0) {
+		return false;
+	}
+	p += 9;
+
+	while (*p == ' ') {
+		char sha[20];
+		const char *found;
+		char *end;
+		int64_t epoch;
+
+		p++;
+		if (strspn(p, "0123456789abcdef") != 40 || p[40] != ':') {
+			return false;
+		}
+		hex_decode(p, 40, sha);
+		epoch = strtoll(p + 41, &end, 10);
+		found = (const char *) bsearch(sha, scan->epoch_shas, scan->nepoch, 20, gc_sha_cmp);
+		if (found && scan->epochs[(found - scan->epoch_shas) / 20] > epoch) {
+			return true;
+		}
+		p = end;
+	}
+	return false;
+}
+
+static void gc_add_meta(const FDBKeyValue *kv, void *arg)
+{
+	gc_scan_t *scan = (gc_scan_t *) arg;
+	const qry_val_t *qv = (const qry_val_t *) kv->value;
+	gc_ent_t *ent;
+
+	if (kv->key_length != sizeof(qry_key_t) || kv->value_length < (int) offsetof(qry_val_t, qrytxt)) {
+		return;
+	}
+
+	if (scan->nent == scan->maxent) {
+		scan->maxent *= 2;
+		scan->ents = (gc_ent_t *) repalloc(scan->ents, scan->maxent * sizeof(gc_ent_t));
+	}
+	ent = &scan->ents[scan->nent++];
+	memset(ent, 0, sizeof(gc_ent_t));
+	memcpy(ent->SHA, ((const qry_key_t *) kv->key)->SHA, 20);
+	ent->ts = qv->ts;
+	ent->timeout = qv->timeout;
+	ent->grace = qv->grace;
+	ent->storesz = qv->storesz;
+	ent->lease = qv->lease;
+	ent->supts = qv->supts;
+	ent->status = qv->status;
+	ent->stale = gc_epoch_stale(scan, qv, kv->value_length);
+}
+
+static int gc_ent_sha_cmp(const void *a, const void *b)
+{
+	return memcmp(((const gc_ent_t *) a)->SHA, ((const gc_ent_t *) b)->SHA, 20);
+}
+
+static void gc_add_acc(const FDBKeyValue *kv, void *arg)
+{
+	gc_scan_t *scan = (gc_scan_t *) arg;
+	const acc_key_t *ak = (const acc_key_t *) kv->key;
+	gc_ent_t key;
+	gc_ent_t *ent;
+	uint64_t v = 0;
+
+	if (kv->key_length != sizeof(acc_key_t)) {
+		return;
+	}
+
+	/* metas were scanned in key order, so they are sorted by SHA */
+	memcpy(key.SHA, ak->SHA, 20);
+	ent = (gc_ent_t *) bsearch(&key, scan->ents, scan->nent, sizeof(gc_ent_t), gc_ent_sha_cmp);
+	if (!ent) {
+		if (scan->norphan == 0 || memcmp(scan->orphans + (scan->norphan - 1) * 20, ak->SHA, 20) != 0) {
+			if (scan->norphan == scan->maxorphan) {
+				scan->maxorphan *= 2;
+				scan->orphans = (char *) repalloc(scan->orphans, scan->maxorphan * 20);
+			}
+			memcpy(scan->orphans + scan->norphan * 20, ak->SHA, 20);
+			scan->norphan++;
+		}
+		return;
+	}
+
+	memcpy(&v, kv->value, Min(kv->value_length, (int) sizeof(v)));
+	v = pgc_le64(v);
+	if (ak->KIND == PGC_ACC_LAST) {
+		ent->lastuse = (int64_t) v;
+	} else if (ak->KIND == PGC_ACC_HITS) {
+		ent->hits = (int64_t) v;
+	}
+}
+
+static void gc_add_shape(const FDBKeyValue *kv, void *arg)
+{
+	gc_scan_t *scan = (gc_scan_t *) arg;
+	gc_ent_t key;
+	gc_ent_t *ent;
+
+	if (kv->key_length != sizeof(shape_key_t)) {
+		return;
+	}
+
+	memcpy(key.SHA, ((const shape_key_t *) kv->key)->SHA, 20);
+	ent = (gc_ent_t *) bsearch(&key, scan->ents, scan->nent, sizeof(gc_ent_t), gc_ent_sha_cmp);
+	if (ent && !ent->gone) {
+		return;
+	}
+
+	if (scan->nshape == scan->maxshape) {
+		scan->maxshape *= 2;
+		scan->shapes = (shape_key_t *) repalloc(scan->shapes, scan->maxshape * sizeof(shape_key_t));
+	}
+	memcpy(&scan->shapes[scan->nshape++], kv->key, sizeof(shape_key_t));
+}
+
+static void gc_add_param(const FDBKeyValue *kv, void *arg)
+{
+	gc_scan_t *scan = (gc_scan_t *) arg;
+	const param_val_t *pv = (const param_val_t *) kv->value;
+
+	if (kv->key_length != sizeof(param_key_t) || kv->value_length < (int) offsetof(param_val_t, vals) ||
+		pv->ts + PGC_PARAM_KEEP * pv->timeout >= scan->now) {
+		return;
+	}
+
+	if (scan->nparam == scan->maxparam) {
+		scan->maxparam *= 2;
+		scan->params = (param_key_t *) repalloc(scan->params, scan->maxparam * sizeof(param_key_t));
+	}
+	memcpy(&scan->params[scan->nparam++], kv->key, sizeof(param_key_t));
+}
+
+/*
+ * Clear the nkey keys of keysz bytes collected by a scan.  A key written 
+ * again since we looked is lost, which only costs a shape to subsume, or 
+ * parameters to batch.
+ */
+static void gc_clear_keys(const char *keys, int keysz, int nkey)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	fdb_error_t err;
+
+	for (int from = 0; from < nkey; from += PGC_GC_CLEAR_BATCH) {
+		int to = Min(from + PGC_GC_CLEAR_BATCH, nkey);
+
+		ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+		for (int i = 0; i < PGC_MAX_RETRY; i++) {
+			fdb_transaction_set_option(tr, FDB_TR_OPTION_PRIORITY_BATCH, NULL, 0);
+			for (int j = from; j < to; j++) {
+				fdb_transaction_clear(tr, (const uint8_t *) keys + j * keysz, keysz);
+			}
+			f = fdb_transaction_commit(tr);
+			err = fdb_wait_error(f);
+			fdb_future_destroy(f);
+			f = 0;
+			if (!err) {
+				break;
+			}
+
+			f = fdb_transaction_on_error(tr, err);
+			ERR_DONE(fdb_wait_error(f), "cache gc transaction error.");
+			fdb_future_destroy(f);
+			f = 0;
+		}
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+}
+
+/*
+ * Drop an entry, if it is still generation ts.  A negative ts drops stats
+ * and blocks left without a meta, only if there is still no meta.  Return
+ * true if it is gone.
+ */
+static bool gc_remove(const char *sha, int64_t ts)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	fdb_error_t err;
+	bool ret = false;
+
+	fdb_bool_t found;
+	const qry_val_t *qvbuf;
+	int qvsz;
+	qry_key_t qk;
+	tup_key_t ka;
+	tup_key_t kz;
+	acc_key_t aa;
+	acc_key_t az;
+
+	memcpy(qk.PREFIX, "PGCQ", 4);
+	memcpy(qk.SHA, sha, 20);
+	tup_key_initsha(&ka, sha, 0, 0);
+	tup_key_initsha(&kz, sha, PGC_GEN_MAX, PGC_SEQ_MAX);
+	acc_key_init(&aa, sha, 0);
+	acc_key_init(&az, sha, (char) 0xff);
+
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int i = 0; i < PGC_MAX_RETRY; i++) {
+		fdb_transaction_set_option(tr, FDB_TR_OPTION_PRIORITY_BATCH, NULL, 0);
+		f = fdb_transaction_get(tr, (const uint8_t *) &qk, sizeof(qk), 0);
+		err = fdb_wait_error(f);
+		if (!err) {
+			err = fdb_future_get_value(f, &found, (const uint8_t **) &qvbuf, &qvsz);
+		}
+		if (!err) {
+			if (found && (ts < 0 || qvbuf->ts != ts)) {
+				/* someone refreshed it since we looked */
+				goto done;
+			}
+			fdb_transaction_clear(tr, (const uint8_t *) &qk, sizeof(qk));
+			fdb_transaction_clear_range(tr, (const uint8_t *) &ka, sizeof(ka),
+					(const uint8_t *) &kz, sizeof(kz));
+			fdb_transaction_clear_range(tr, (const uint8_t *) &aa, sizeof(aa),
+					(const uint8_t *) &az, sizeof(az));
+			fdb_future_destroy(f);
+			f = fdb_transaction_commit(tr);
+			err = fdb_wait_error(f);
+		}
+		fdb_future_destroy(f);
+		f = 0;
+
+		if (!err) {
+			ret = true;
+			break;
+		}
+
+		f = fdb_transaction_on_error(tr, err);
+		ERR_DONE(fdb_wait_error(f), "cache gc transaction error.");
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+	return ret;
+}
+
+/*
+ * Drop the blocks of all generations of an entry but its published one ts 
+ * and the refresh in flight, if ts is still published and superseded them
+ * at supts.
+ */
+static void gc_drop_superseded(const char *sha, int64_t ts, int64_t supts)
+{
+	FDBTransaction *tr = 0;
+	FDBFuture *f = 0;
+	fdb_error_t err;
+
+	fdb_bool_t found;
+	const qry_val_t *qvbuf;
+	qry_val_t *qv;
+	int qvsz;
+	qry_key_t qk;
+	tup_key_t ka;
+	tup_key_t kz;
+
+	memcpy(qk.PREFIX, "PGCQ", 4);
+	memcpy(qk.SHA, sha, 20);
+
+	ERR_DONE( fdb_database_create_transaction(get_fdb(), &tr), "cannot begin fdb transaction");
+	for (int i = 0; i < PGC_MAX_RETRY; i++) {
+		fdb_transaction_set_option(tr, FDB_TR_OPTION_PRIORITY_BATCH, NULL, 0);
+		f = fdb_transaction_get(tr, (const uint8_t *) &qk, sizeof(qk), 0);
+		err = fdb_wait_error(f);
+		if (!err) {
+			err = fdb_future_get_value(f, &found, (const uint8_t **) &qvbuf, &qvsz);
+		}
+		if (!err) {
+			int64_t keep;
+
+			if (!found || qvbuf->ts != ts || qvbuf->supts != supts) {
+				/* someone refreshed or dropped it since we looked */
+				goto done;
+			}
+			keep = qvbuf->refts > ts ? qvbuf->refts : ts;
+
+			tup_key_initsha(&ka, sha, 0, 0);
+			tup_key_initsha(&kz, sha, ts, 0);
+			fdb_transaction_clear_range(tr, (const uint8_t *) &ka, sizeof(ka),
+					(const uint8_t *) &kz, sizeof(kz));
+			if (keep != ts) {
+				tup_key_initsha(&ka, sha, ts + 1, 0);
+				tup_key_initsha(&kz, sha, keep, 0);
+				fdb_transaction_clear_range(tr, (const uint8_t *) &ka, sizeof(ka),
+						(const uint8_t *) &kz, sizeof(kz));
+			}
+			tup_key_initsha(&ka, sha, keep + 1, 0);
+			tup_key_initsha(&kz, sha, PGC_GEN_MAX, PGC_SEQ_MAX);
+			fdb_transaction_clear_range(tr, (const uint8_t *) &ka, sizeof(ka),
+					(const uint8_t *) &kz, sizeof(kz));
+
+			qv = (qry_val_t *) palloc(qvsz);
+			memcpy(qv, qvbuf, qvsz);
+			qv->supts = 0;
+			fdb_transaction_set(tr, (const uint8_t *) &qk, sizeof(qk), (const uint8_t *) qv, qvsz);
+			pfree(qv);
+
+			fdb_future_destroy(f);
+			f = fdb_transaction_commit(tr);
+			err = fdb_wait_error(f);
+		}
+		fdb_future_destroy(f);
+		f = 0;
+
+		if (!err) {
+			break;
+		}
+
+		f = fdb_transaction_on_error(tr, err);
+		ERR_DONE(fdb_wait_error(f), "cache gc transaction error.");
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+done:
+	if (f) {
+		fdb_future_destroy(f);
+		f = 0;
+	}
+
+	if (tr) {
+		fdb_transaction_destroy(tr);
+		tr = 0;
+	}
+}
+
+static int gc_lru_cmp(const void *a, const void *b)
+{
+	const gc_ent_t *ea = *(const gc_ent_t * const *) a;
+	const gc_ent_t *eb = *(const gc_ent_t * const *) b;
+	int64_t la = Max(ea->lastuse, ea->ts);
+	int64_t lb = Max(eb->lastuse, eb->ts);
+
+	return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static int gc_lfu_cmp(const void *a, const void *b)
+{
+	const gc_ent_t *ea = *(const gc_ent_t * const *) a;
+	const gc_ent_t *eb = *(const gc_ent_t * const *) b;
+
+	if (ea->hits != eb->hits) {
+		return ea->hits < eb->hits ? -1 : 1;
+	}
+	return gc_lru_cmp(a, b);
+}
+
+/*
+ * One gc pass, return number of entries dropped.
+ */
+int64_t pgcache_gc(void)
+{
+	gc_scan_t scan;
+	qry_key_t qa;
+	qry_key_t qz;
+	epoch_key_t ea;
+	epoch_key_t ez;
+	acc_key_t aa;
+	acc_key_t az;
+	shape_key_t sa;
+	shape_key_t sz;
+	param_key_t pa;
+	param_key_t pz;
+	gc_ent_t **live;
+	int nlive = 0;
+	int64_t total = 0;
+	int64_t budget = (int64_t) cache_max_size * 1024;
+	int64_t now = get_ts();
+	int64_t ndrop = 0;
+	char zsha[20];
+	char fsha[20];
+
+	memset(&scan, 0, sizeof(scan));
+	scan.maxent = 1024;
+	scan.ents = (gc_ent_t *) palloc(scan.maxent * sizeof(gc_ent_t));
+	scan.maxorphan = 64;
+	scan.orphans = (char *) palloc(scan.maxorphan * 20);
+	scan.maxshape = 64;
+	scan.shapes = (shape_key_t *) palloc(scan.maxshape * sizeof(shape_key_t));
+	scan.maxparam = 64;
+	scan.params = (param_key_t *) palloc(scan.maxparam * sizeof(param_key_t));
+	scan.maxepoch = 64;
+	scan.epoch_shas = (char *) palloc(scan.maxepoch * 20);
+	scan.epochs = (int64_t *) palloc(scan.maxepoch * sizeof(int64_t));
+	scan.now = now;
+
+	/* Epochs first, metas are checked against them as they are scanned. */
+	memset(zsha, 0, 20);
+	memset(fsha, 0xff, 20);
+	epoch_key_init(&ea, zsha);
+	epoch_key_init(&ez, fsha);
+	gc_scan_range((const uint8_t *) &ea, sizeof(ea), (const uint8_t *) &ez, sizeof(ez),
+			gc_add_epoch, &scan);
+
+	qry_key_init_az(&qa, 0);
+	qry_key_init_az(&qz, 0xff);
+	gc_scan_range((const uint8_t *) &qa, sizeof(qa), (const uint8_t *) &qz, sizeof(qz),
+			gc_add_meta, &scan);
+
+	memset(zsha, 0, 20);
+	memset(fsha, 0xff, 20);
+	acc_key_init(&aa, zsha, 0);
+	acc_key_init(&az, fsha, (char) 0xff);
+	gc_scan_range((const uint8_t *) &aa, sizeof(aa), (const uint8_t *) &az, sizeof(az),
+			gc_add_acc, &scan);
+
+	/* 
+	 * Expired, including populates that were abandoned long ago, and 
+	 * entries of older epochs, nobody looks them up any more.  A populate
+	 * whose owner still holds the lease is live however old it is.
+	 */
+	live = (gc_ent_t **) palloc(Max(scan.nent, 1) * sizeof(gc_ent_t *));
+	for (int i = 0; i < scan.nent; i++) {
+		gc_ent_t *ent = &scan.ents[i];
+
+		if (ent->status == QRY_FETCH && ent->lease >= now) {
+			live[nlive++] = ent;
+		} else if (ent->stale || (ent->timeout > 0 && ent->ts + ent->timeout + ent->grace < now)) {
+			ent->gone = gc_remove(ent->SHA, ent->ts);
+			ndrop += ent->gone ? 1 : 0;
+		} else {
+			live[nlive++] = ent;
+			total += ent->storesz;
+		}
+	}
+
+	for (int i = 0; i < scan.norphan; i++) {
+		gc_remove(scan.orphans + i * 20, -1);
+	}
+
+	/* Then evict until we fit, in flight populates are left alone. */
+	if (budget > 0 && total > budget) {
+		qsort(live, nlive, sizeof(gc_ent_t *),
+				gc_policy == PGC_GC_LFU ? gc_lfu_cmp : gc_lru_cmp);
+		for (int i = 0; i < nlive && total > budget; i++) {
+			if (live[i]->status < 0) {
+				continue;
+			}
+			if (gc_remove(live[i]->SHA, live[i]->ts)) {
+				live[i]->gone = true;
+				total -= live[i]->storesz;
+				ndrop++;
+			}
+		}
+	}
+
+	/* Generations superseded long enough ago of what is left. */
+	for (int i = 0; i < nlive; i++) {
+		if (!live[i]->gone && live[i]->status >= 0 && live[i]->supts > 0 &&
+			live[i]->supts + (int64_t) generation_keep * 1000000 < now) {
+			gc_drop_superseded(live[i]->SHA, live[i]->ts, live[i]->supts);
+		}
+	}
+
+	memset(zsha, 0, 20);
+	memset(fsha, 0xff, 20);
+	shape_key_init(&sa, zsha, zsha);
+	shape_key_init(&sz, fsha, fsha);
+	gc_scan_range((const uint8_t *) &sa, sizeof(sa), (const uint8_t *) &sz, sizeof(sz),
+			gc_add_shape, &scan);
+	gc_clear_keys((const char *) scan.shapes, sizeof(shape_key_t), scan.nshape);
+
+	param_key_init(&pa, zsha);
+	param_key_init(&pz, fsha);
+	gc_scan_range((const uint8_t *) &pa, sizeof(pa), (const uint8_t *) &pz, sizeof(pz),
+			gc_add_param, &scan);
+	gc_clear_keys((const char *) scan.params, sizeof(param_key_t), scan.nparam);
+
+	elog(DEBUG1, "pgc_fdw cache gc dropped " INT64_FORMAT " of %d entries, " INT64_FORMAT " bytes left",
+			ndrop, scan.nent, total);
+
+	pfree(live);
+	pfree(scan.ents);
+	pfree(scan.orphans);
+	pfree(scan.shapes);
+	pfree(scan.params);
+	pfree(scan.epoch_shas);
+	pfree(scan.epochs);
+	return ndrop;
+}
+
+void pgc_fdw_gc_main(Datum arg)
+{
+	MemoryContext gccxt;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	gccxt = AllocSetContextCreate(TopMemoryContext, "pgc_fdw cache gc", ALLOCSET_DEFAULT_SIZES);
+
+	for (;;) {
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending) {
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (gc_interval > 0) {
+			MemoryContext oldcxt = MemoryContextSwitchTo(gccxt);
+
+			/* A failed pass, fdb unreachable say, is logged and retried next time. */
+			PG_TRY();
+			{
+				pgcache_gc();
+			}
+			PG_CATCH();
+			{
+				MemoryContextSwitchTo(oldcxt);
+				EmitErrorReport();
+				FlushErrorState();
+			}
+			PG_END_TRY();
+			MemoryContextSwitchTo(oldcxt);
+			MemoryContextReset(gccxt);
+		}
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+				(gc_interval > 0 ? gc_interval : 60) * 1000L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+}
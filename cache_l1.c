@@ -0,0 +1,351 @@
+/*-------------------------------------------------------------------------
+ *
+ * cache_l1.c
+ *		  Shared memory tier in front of the FDB cache.
+ *
+ * Hot entries are kept in a DSA area shared by all backends of the node,
+ * keyed by qry_key_t and the generation (ts) of the entry.  Generations
+ * never change once published, so an entry is good as long as the FDB meta
+ * still says that generation, which the caller checks with
+ * pgcache_get_status.  Data is the raw record stream, as in blocks before
+ * compression.  Eviction is approximately LRU, bounded by 
+ * pgc_fdw.l1_cache_size.
+ *
+ * Hits only take the lock shared: they stamp the entry with an atomic
+ * clock instead of moving it in the lru list, and pin its data with a
+ * refcount so the copy happens outside the lock.  Eviction gives entries
+ * stamped since they were last listed a second chance at the head.
+ *
+ * Only available when pgc_fdw is in shared_preload_libraries.
+ *-------------------------------------------------------------------------
+ */
+#include "cache.h"
+#include "lib/ilist.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/dsa.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+
+/* Average entry size we size the hash table for, in kB. */
+#define PGC_L1_ENTRY_KB 16
+#define PGC_L1_MIN_ENTRIES 64
+
+/* An entry larger than 1/PGC_L1_MAX_ENTRY_FRAC of the tier is not kept. */
+#define PGC_L1_MAX_ENTRY_FRAC 4
+
+typedef struct l1_shared_t {
+	LWLock *lock;			/* protects everything below, and the hash */
+	int tranche;			/* of the dsa area */
+	bool dsaInited;
+	int nentry;
+	Size used;				/* bytes of entry data */
+	dlist_head lru;			/* most recently listed first */
+	pg_atomic_uint64 clock;	/* stamps hits, no lock needed */
+	char dsaPlace[FLEXIBLE_ARRAY_MEMBER];
+} l1_shared_t;
+
+typedef struct l1_entry_t {
+	qry_key_t qk;			/* hash key, must be first */
+	int64_t ts;
+	int32_t ntup;
+	Size sz;
+	dsa_pointer data;		/* l1_data_t */
+	dlist_node lru;
+	uint64 listed;			/* lastuse when put at the head of the lru list */
+	pg_atomic_uint64 lastuse;	/* clock of the last hit */
+} l1_entry_t;
+
+/* 
+ * Entry data in the dsa area.  The tier holds one reference until the
+ * entry is evicted, readers copying the data hold one each, the last one
+ * frees it.
+ */
+typedef struct l1_data_t {
+	pg_atomic_uint32 refcnt;
+	char data[FLEXIBLE_ARRAY_MEMBER];
+} l1_data_t;
+
+#define L1_DATA_SZ(sz) (offsetof(l1_data_t, data) + Max((sz), 1))
+
+static int l1_cache_size = 0;	/* kB, GUC */
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static l1_shared_t *l1 = NULL;
+static HTAB *l1_hash = NULL;
+static dsa_area *l1_area = NULL;
+
+static inline Size l1_budget(void)
+{
+	return (Size) l1_cache_size * 1024;
+}
+
+static inline int l1_max_entries(void)
+{
+	return Max(l1_cache_size / PGC_L1_ENTRY_KB, PGC_L1_MIN_ENTRIES);
+}
+
+static Size l1_shared_sz(void)
+{
+	return add_size(MAXALIGN(offsetof(l1_shared_t, dsaPlace)), dsa_minimum_size());
+}
+
+static void l1_shmem_startup(void)
+{
+	bool found;
+	HASHCTL info;
+
+	if (prev_shmem_startup_hook) {
+		prev_shmem_startup_hook();
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	l1 = (l1_shared_t *) ShmemInitStruct("pgc_fdw l1", l1_shared_sz(), &found);
+	if (!found) {
+		l1->lock = &(GetNamedLWLockTranche("pgc_fdw_l1"))->lock;
+		l1->tranche = LWLockNewTrancheId();
+		l1->dsaInited = false;
+		l1->nentry = 0;
+		l1->used = 0;
+		dlist_init(&l1->lru);
+		pg_atomic_init_u64(&l1->clock, 0);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(qry_key_t);
+	info.entrysize = sizeof(l1_entry_t);
+	l1_hash = ShmemInitHash("pgc_fdw l1 hash", l1_max_entries(), l1_max_entries(),
+			&info, HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Called from _PG_init.  Sets up the tier if we are preloaded and it is
+ * configured, otherwise the tier stays disabled.
+ */
+void pgcache_l1_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress) {
+		return;
+	}
+
+	DefineCustomIntVariable("pgc_fdw.l1_cache_size",
+			"Size of the shared memory tier of the query cache.",
+			"0 disables it.",
+			&l1_cache_size,
+			0, 0, MAX_KILOBYTES,
+			PGC_POSTMASTER, GUC_UNIT_KB,
+			NULL, NULL, NULL);
+
+	if (l1_cache_size <= 0) {
+		return;
+	}
+
+	RequestAddinShmemSpace(add_size(l1_shared_sz(),
+				hash_estimate_size(l1_max_entries(), sizeof(l1_entry_t))));
+	RequestNamedLWLockTranche("pgc_fdw_l1", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = l1_shmem_startup;
+}
+
+/*
+ * Attach this backend to the dsa area, creating it if we are the first.
+ * Caller holds l1->lock, exclusively unless the area exists.
+ */
+static void l1_attach(void)
+{
+	MemoryContext oldcxt;
+
+	if (l1_area) {
+		return;
+	}
+
+	LWLockRegisterTranche(l1->tranche, "pgc_fdw_l1_dsa");
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+	if (!l1->dsaInited) {
+		l1_area = dsa_create_in_place(l1->dsaPlace, dsa_minimum_size(), l1->tranche, NULL);
+		/* headroom for fragmentation, l1->used is what we really bound */
+		dsa_set_size_limit(l1_area, dsa_minimum_size() + 2 * l1_budget());
+		l1->dsaInited = true;
+	} else {
+		l1_area = dsa_attach_in_place(l1->dsaPlace, NULL);
+	}
+	dsa_pin_mapping(l1_area);
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Drop a reference to entry data dp, freeing it if it was the last.
+ */
+static void l1_unref(dsa_pointer dp)
+{
+	l1_data_t *d = (l1_data_t *) dsa_get_address(l1_area, dp);
+
+	if (pg_atomic_sub_fetch_u32(&d->refcnt, 1) == 0) {
+		dsa_free(l1_area, dp);
+	}
+}
+
+/*
+ * Drop entry e.  Caller holds l1->lock exclusively.  Readers still copying
+ * its data free it when done.
+ */
+static void l1_evict(l1_entry_t *e)
+{
+	dlist_delete(&e->lru);
+	l1_unref(e->data);
+	l1->used -= e->sz;
+	l1->nentry--;
+	hash_search(l1_hash, &e->qk, HASH_REMOVE, NULL);
+}
+
+/*
+ * Drop the least recently used entry, false if there is none.  Entries hit
+ * since they were listed go back to the head instead, so this takes at most
+ * one round of the list.
+ */
+static bool l1_evict_lru(void)
+{
+	while (!dlist_is_empty(&l1->lru)) {
+		l1_entry_t *e = dlist_tail_element(l1_entry_t, lru, &l1->lru);
+		uint64 lastuse = pg_atomic_read_u64(&e->lastuse);
+
+		if (lastuse == e->listed) {
+			l1_evict(e);
+			return true;
+		}
+		e->listed = lastuse;
+		dlist_move_head(&l1->lru, &e->lru);
+	}
+	return false;
+}
+
+/*
+ * Is a stream of sz bytes worth putting in the tier?
+ */
+bool pgcache_l1_admit(int64_t sz)
+{
+	return l1 && sz <= (int64_t) (l1_budget() / PGC_L1_MAX_ENTRY_FRAC);
+}
+
+/*
+ * Look up generation ts of qk.  On a hit return a copy of the record
+ * stream in current memory context, and set *pntup and *psz.  Return NULL
+ * on a miss.
+ */
+char *pgcache_l1_get(const qry_key_t *qk, int64_t ts, int32_t *pntup, Size *psz)
+{
+	l1_entry_t *e;
+	l1_data_t *d = NULL;
+	dsa_pointer dp = InvalidDsaPointer;
+	char *buf = NULL;
+	Size sz = 0;
+	bool superseded = false;
+
+	if (!l1) {
+		return NULL;
+	}
+
+	LWLockAcquire(l1->lock, LW_SHARED);
+	if (!l1->dsaInited) {
+		LWLockRelease(l1->lock);
+		return NULL;
+	}
+	l1_attach();
+	e = (l1_entry_t *) hash_search(l1_hash, qk, HASH_FIND, NULL);
+	if (e && e->ts == ts) {
+		/* allocate before pinning, so an error cannot leak the pin */
+		buf = (char *) palloc(Max(e->sz, 1));
+		dp = e->data;
+		sz = e->sz;
+		*pntup = e->ntup;
+		*psz = e->sz;
+		d = (l1_data_t *) dsa_get_address(l1_area, dp);
+		pg_atomic_fetch_add_u32(&d->refcnt, 1);
+		pg_atomic_write_u64(&e->lastuse, pg_atomic_add_fetch_u64(&l1->clock, 1));
+	} else if (e && e->ts < ts) {
+		superseded = true;
+	}
+	LWLockRelease(l1->lock);
+
+	if (buf) {
+		memcpy(buf, d->data, sz);
+		l1_unref(dp);
+	} else if (superseded) {
+		/* superseded generation, nobody will ask for it again */
+		LWLockAcquire(l1->lock, LW_EXCLUSIVE);
+		e = (l1_entry_t *) hash_search(l1_hash, qk, HASH_FIND, NULL);
+		if (e && e->ts < ts) {
+			l1_evict(e);
+		}
+		LWLockRelease(l1->lock);
+	}
+	return buf;
+}
+
+/*
+ * Remember the record stream of generation ts of qk, evicting lru entries
+ * to make room.  Best effort, we simply do not keep it if we cannot.
+ */
+void pgcache_l1_put(const qry_key_t *qk, int64_t ts, int32_t ntup, const char *data, Size sz)
+{
+	l1_entry_t *e;
+	l1_data_t *d;
+	dsa_pointer dp;
+	bool found;
+
+	if (!pgcache_l1_admit(sz)) {
+		return;
+	}
+
+	LWLockAcquire(l1->lock, LW_EXCLUSIVE);
+	l1_attach();
+
+	e = (l1_entry_t *) hash_search(l1_hash, qk, HASH_FIND, NULL);
+	if (e) {
+		if (e->ts >= ts) {
+			goto done;
+		}
+		l1_evict(e);
+	}
+
+	while (l1->used + sz > l1_budget() || l1->nentry >= l1_max_entries()) {
+		if (!l1_evict_lru()) {
+			goto done;
+		}
+	}
+
+	for (;;) {
+		dp = dsa_allocate_extended(l1_area, L1_DATA_SZ(sz), DSA_ALLOC_NO_OOM);
+		if (DsaPointerIsValid(dp) || !l1_evict_lru()) {
+			break;
+		}
+	}
+	if (!DsaPointerIsValid(dp)) {
+		goto done;
+	}
+
+	e = (l1_entry_t *) hash_search(l1_hash, qk, HASH_ENTER_NULL, &found);
+	if (!e) {
+		dsa_free(l1_area, dp);
+		goto done;
+	}
+	d = (l1_data_t *) dsa_get_address(l1_area, dp);
+	pg_atomic_init_u32(&d->refcnt, 1);
+	memcpy(d->data, data, sz);
+	e->ts = ts;
+	e->ntup = ntup;
+	e->sz = sz;
+	e->data = dp;
+	pg_atomic_init_u64(&e->lastuse, pg_atomic_read_u64(&l1->clock));
+	e->listed = pg_atomic_read_u64(&e->lastuse);
+	dlist_push_head(&l1->lru, &e->lru);
+	l1->used += sz;
+	l1->nentry++;
+
+done:
+	LWLockRelease(l1->lock);
+}
@@ -0,0 +1,211 @@
+/*-------------------------------------------------------------------------
+ *
+ * cache_stats.c
+ *		  Cache statistics in shared memory.
+ *
+ * Scans collect their statistics in a pgcache_stats_t and flush them here,
+ * once they know whether they hit, and when their cache reader is done.
+ * A flush adds them to the global row, the row of the foreign table and
+ * the row of the cache entry.  Rows of tables and entries are kept up to
+ * pgc_fdw.stats_max_entries, rows that do not fit are not tracked until
+ * pgc_fdw_cache_stats_reset().
+ *
+ * Only available when pgc_fdw is in shared_preload_libraries.
+ *-------------------------------------------------------------------------
+ */
+#include "cache.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+
+typedef struct stats_shared_t {
+	LWLock *lock;			/* protects everything below, and the hash */
+	pgcache_stats_row_t global;
+	int nrow;
+	TimestampTz reset;
+} stats_shared_t;
+
+static int stats_max_entries = 1000;	/* GUC */
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static stats_shared_t *stats = NULL;
+static HTAB *stats_hash = NULL;
+
+static void stats_shmem_startup(void)
+{
+	bool found;
+	HASHCTL info;
+
+	if (prev_shmem_startup_hook) {
+		prev_shmem_startup_hook();
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	stats = (stats_shared_t *) ShmemInitStruct("pgc_fdw stats", sizeof(stats_shared_t), &found);
+	if (!found) {
+		memset(stats, 0, sizeof(stats_shared_t));
+		stats->lock = &(GetNamedLWLockTranche("pgc_fdw_stats"))->lock;
+		stats->global.key.kind = PGC_STATS_GLOBAL;
+		stats->reset = GetCurrentTimestamp();
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgcache_stats_key_t);
+	info.entrysize = sizeof(pgcache_stats_row_t);
+	stats_hash = ShmemInitHash("pgc_fdw stats hash", stats_max_entries, stats_max_entries,
+			&info, HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Called from _PG_init.  Statistics are only kept if we are preloaded.
+ */
+void pgcache_stats_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress) {
+		return;
+	}
+
+	DefineCustomIntVariable("pgc_fdw.stats_max_entries",
+			"Number of foreign tables and cache entries cache statistics are kept for.",
+			NULL,
+			&stats_max_entries,
+			1000, 1, INT_MAX / 2,
+			PGC_POSTMASTER, 0,
+			NULL, NULL, NULL);
+
+	RequestAddinShmemSpace(add_size(sizeof(stats_shared_t),
+				hash_estimate_size(stats_max_entries, sizeof(pgcache_stats_row_t))));
+	RequestNamedLWLockTranche("pgc_fdw_stats", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = stats_shmem_startup;
+}
+
+void pgcache_stats_accum(pgcache_stats_t *dst, const pgcache_stats_t *src)
+{
+	for (int i = 0; i < PGC_STAT_NCOUNTER; i++) {
+		dst->counters[i] += src->counters[i];
+	}
+	for (int i = 0; i < PGC_STAT_NHIST; i++) {
+		dst->remote_hist[i] += src->remote_hist[i];
+		dst->populate_hist[i] += src->populate_hist[i];
+	}
+}
+
+/*
+ * Add a row for key, or find it.  NULL if it is not tracked.  Caller holds
+ * stats->lock exclusively.
+ */
+static pgcache_stats_row_t *stats_row(const pgcache_stats_key_t *key, Oid relid)
+{
+	pgcache_stats_row_t *row;
+	bool found;
+
+	if (stats->nrow >= stats_max_entries) {
+		return (pgcache_stats_row_t *) hash_search(stats_hash, key, HASH_FIND, NULL);
+	}
+
+	row = (pgcache_stats_row_t *) hash_search(stats_hash, key, HASH_ENTER_NULL, &found);
+	if (row && !found) {
+		row->relid = relid;
+		memset(&row->st, 0, sizeof(pgcache_stats_t));
+		stats->nrow++;
+	}
+	return row;
+}
+
+/*
+ * Add st of a scan of relid (InvalidOid for a join) that used entry qk to
+ * the shared statistics, and zero it.
+ */
+void pgcache_stats_flush(Oid relid, const qry_key_t *qk, pgcache_stats_t *st)
+{
+	pgcache_stats_key_t key;
+	pgcache_stats_row_t *row;
+
+	if (!stats) {
+		return;
+	}
+
+	LWLockAcquire(stats->lock, LW_EXCLUSIVE);
+	pgcache_stats_accum(&stats->global.st, st);
+
+	if (OidIsValid(relid)) {
+		memset(&key, 0, sizeof(key));
+		key.kind = PGC_STATS_TABLE;
+		key.dbid = MyDatabaseId;
+		key.relid = relid;
+		if ((row = stats_row(&key, relid)) != NULL) {
+			pgcache_stats_accum(&row->st, st);
+		}
+	}
+
+	if (qk) {
+		memset(&key, 0, sizeof(key));
+		key.kind = PGC_STATS_ENTRY;
+		key.dbid = MyDatabaseId;
+		memcpy(key.SHA, qk->SHA, 20);
+		if ((row = stats_row(&key, relid)) != NULL) {
+			pgcache_stats_accum(&row->st, st);
+		}
+	}
+	LWLockRelease(stats->lock);
+
+	memset(st, 0, sizeof(pgcache_stats_t));
+}
+
+/*
+ * Copy of all rows, the global one first, in current memory context, and
+ * when they were last reset.  NULL and *pnrow 0 if statistics are not kept.
+ */
+pgcache_stats_row_t *pgcache_stats_snapshot(int *pnrow, TimestampTz *preset)
+{
+	pgcache_stats_row_t *rows;
+	pgcache_stats_row_t *row;
+	HASH_SEQ_STATUS hs;
+	int n = 0;
+
+	*pnrow = 0;
+	if (!stats) {
+		return NULL;
+	}
+
+	LWLockAcquire(stats->lock, LW_SHARED);
+	rows = (pgcache_stats_row_t *) palloc((stats->nrow + 1) * sizeof(pgcache_stats_row_t));
+	rows[n++] = stats->global;
+	*preset = stats->reset;
+	hash_seq_init(&hs, stats_hash);
+	while ((row = (pgcache_stats_row_t *) hash_seq_search(&hs)) != NULL) {
+		rows[n++] = *row;
+	}
+	LWLockRelease(stats->lock);
+
+	*pnrow = n;
+	return rows;
+}
+
+/*
+ * Zero all statistics, and stop tracking all tables and entries.
+ */
+void pgcache_stats_reset(void)
+{
+	pgcache_stats_row_t *row;
+	HASH_SEQ_STATUS hs;
+
+	if (!stats) {
+		return;
+	}
+
+	LWLockAcquire(stats->lock, LW_EXCLUSIVE);
+	memset(&stats->global.st, 0, sizeof(pgcache_stats_t));
+	hash_seq_init(&hs, stats_hash);
+	while ((row = (pgcache_stats_row_t *) hash_seq_search(&hs)) != NULL) {
+		hash_search(stats_hash, &row->key, HASH_REMOVE, NULL);
+	}
+	stats->nrow = 0;
+	stats->reset = GetCurrentTimestamp();
+	LWLockRelease(stats->lock);
+}
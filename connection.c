@@ -58,6 +58,7 @@ typedef struct ConnCacheEntry
 	bool		invalidated;	/* true if reconnect is pending */
 	uint32		server_hashvalue;	/* hash value of foreign server OID */
 	uint32		mapping_hashvalue;	/* hash value of user mapping OID */
+	PgFdwConnState state;		/* extra per-connection state */
 } ConnCacheEntry;
 
 /*
@@ -102,9 +103,12 @@ static bool UserMappingPasswordRequired(UserMapping *user);
  * will_prep_stmt must be true if caller intends to create any prepared
  * statements.  Since those don't go away automatically at transaction end
  * (not even on error), we need this flag to cue manual cleanup.
+ *
+ * If state is not NULL, *state receives the per-connection state associated
+ * with the PGconn.
  */
 PGconn *
-GetConnection(UserMapping *user, bool will_prep_stmt)
+GetConnection(UserMapping *user, bool will_prep_stmt, PgFdwConnState **state)
 {
 	bool		found;
 	ConnCacheEntry *entry;
@@ -190,6 +194,7 @@ GetConnection(UserMapping *user, bool will_prep_stmt)
 		entry->have_error = false;
 		entry->changing_xact_state = false;
 		entry->invalidated = false;
+		memset(&entry->state, 0, sizeof(entry->state));
 		entry->server_hashvalue =
 			GetSysCacheHashValue1(FOREIGNSERVEROID,
 								  ObjectIdGetDatum(server->serverid));
@@ -212,6 +217,10 @@ GetConnection(UserMapping *user, bool will_prep_stmt)
 	/* Remember if caller will prepare statements */
 	entry->have_prep_stmt |= will_prep_stmt;
 
+	/* If caller needs access to the per-connection state, return it. */
+	if (state)
+		*state = &entry->state;
+
 	return entry->conn;
 }
 
@@ -505,8 +514,11 @@ begin_remote_xact(ConnCacheEntry *entry)
 	/*
 	 * If we're in a subtransaction, stack up savepoints to match our level.
 	 * This ensures we can rollback just the desired effects when a
-	 * subtransaction aborts.
+	 * subtransaction aborts.  A FETCH some scan sent ahead must be collected
+	 * first, see process_pending_request.
 	 */
+	if (entry->xact_depth < curlevel && entry->state.pendingScan)
+		process_pending_request(entry->state.pendingScan);
 	while (entry->xact_depth < curlevel)
 	{
 		char		sql[64];
@@ -568,11 +580,18 @@ GetPrepStmtNumber(PGconn *conn)
  *
  * This function is interruptible by signals.
  *
+ * If state is not NULL and a scan has a FETCH in flight on the connection,
+ * that is collected first.
+ *
  * Caller is responsible for the error handling on the result.
  */
 PGresult *
-pgfdw_exec_query(PGconn *conn, const char *query)
+pgfdw_exec_query(PGconn *conn, const char *query, PgFdwConnState *state)
 {
+	/* First, process a pending asynchronous request, if any. */
+	if (state && state->pendingScan)
+		process_pending_request(state->pendingScan);
+
 	/*
 	 * Submit a query.  Since we don't use non-blocking mode, this also can
 	 * block.  But its risk is relatively small, so we ignore that for now.
@@ -584,6 +603,41 @@ pgfdw_exec_query(PGconn *conn, const char *query)
 	return pgfdw_get_result(conn, query);
 }
 
+/*
+ * Wait for the next result from a prior asynchronous execution function
+ * call, NULL if there are no more.  Like pgfdw_get_result, this checks for
+ * interruptions while waiting.
+ *
+ * Caller is responsible for the error handling on the result.
+ */
+PGresult *
+pgfdw_get_next_result(PGconn *conn, const char *query)
+{
+	while (PQisBusy(conn))
+	{
+		int			wc;
+
+		/* Sleep until there's something to do */
+		wc = WaitLatchOrSocket(MyLatch,
+							   WL_LATCH_SET | WL_SOCKET_READABLE |
+							   WL_EXIT_ON_PM_DEATH,
+							   PQsocket(conn),
+							   -1L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Data available in socket? */
+		if (wc & WL_SOCKET_READABLE)
+		{
+			if (!PQconsumeInput(conn))
+				pgfdw_report_error(ERROR, NULL, conn, false, query);
+		}
+	}
+
+	return PQgetResult(conn);
+}
+
 /*
  * Wait for the result from a prior asynchronous execution function call.
  *
@@ -606,29 +660,7 @@ pgfdw_get_result(PGconn *conn, const char *query)
 		{
 			PGresult   *res;
 
-			while (PQisBusy(conn))
-			{
-				int			wc;
-
-				/* Sleep until there's something to do */
-				wc = WaitLatchOrSocket(MyLatch,
-									   WL_LATCH_SET | WL_SOCKET_READABLE |
-									   WL_EXIT_ON_PM_DEATH,
-									   PQsocket(conn),
-									   -1L, PG_WAIT_EXTENSION);
-				ResetLatch(MyLatch);
-
-				CHECK_FOR_INTERRUPTS();
-
-				/* Data available in socket? */
-				if (wc & WL_SOCKET_READABLE)
-				{
-					if (!PQconsumeInput(conn))
-						pgfdw_report_error(ERROR, NULL, conn, false, query);
-				}
-			}
-
-			res = PQgetResult(conn);
+			res = pgfdw_get_next_result(conn, query);
 			if (res == NULL)
 				break;			/* query is complete */
 
@@ -752,6 +784,10 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 					 */
 					pgfdw_reject_incomplete_xact_state_change(entry);
 
+					/* A FETCH sent ahead must not be in the way */
+					if (entry->state.pendingScan)
+						process_pending_request(entry->state.pendingScan);
+
 					/* Commit all remote transactions during pre-commit */
 					entry->changing_xact_state = true;
 					do_sql_command(entry->conn, "COMMIT TRANSACTION");
@@ -869,6 +905,7 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 
 		/* Reset state to show we're out of a transaction */
 		entry->xact_depth = 0;
+		entry->state.pendingScan = NULL;
 
 		/*
 		 * If the connection isn't in a good idle state, discard it to
@@ -943,6 +980,10 @@ pgfdw_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 			 */
 			pgfdw_reject_incomplete_xact_state_change(entry);
 
+			/* A FETCH sent ahead must not be in the way */
+			if (entry->state.pendingScan)
+				process_pending_request(entry->state.pendingScan);
+
 			/* Commit all remote subtransactions during pre-commit */
 			snprintf(sql, sizeof(sql), "RELEASE SAVEPOINT s%d", curlevel);
 			entry->changing_xact_state = true;
@@ -991,6 +1032,13 @@ pgfdw_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 			entry->changing_xact_state = abort_cleanup_failure;
 		}
 
+		/*
+		 * A FETCH sent ahead was cancelled by the abort cleanup, its scan
+		 * finds out when it looks for the result.
+		 */
+		if (event == SUBXACT_EVENT_ABORT_SUB)
+			entry->state.pendingScan = NULL;
+
 		/* OK, we're outta that level of subtransaction */
 		entry->xact_depth--;
 	}
@@ -1415,6 +1415,35 @@ appendConditions(List *exprs, deparse_expr_cxt *context)
 	reset_transmission_modes(nestlevel);
 }
 
+/*
+ * Deparse a single remote condition of a base relation scan, as it would
+ * appear in the WHERE clause.  The cache compares conditions of queries by
+ * this text, see cache_open_subsuming().  Column references are not
+ * qualified for a base relation, so the text does not depend on the range
+ * table.
+ */
+void
+deparseRemoteCondition(StringInfo buf, PlannerInfo *root,
+					   RelOptInfo *baserel, Expr *expr)
+{
+	deparse_expr_cxt context;
+	List	   *params_list = NIL;
+	int			nestlevel;
+
+	Assert(IS_SIMPLE_REL(baserel));
+
+	context.root = root;
+	context.foreignrel = baserel;
+	context.scanrel = baserel;
+	context.buf = buf;
+	context.params_list = &params_list;
+
+	/* Make sure any constants in the exprs are printed portably */
+	nestlevel = set_transmission_modes();
+	deparseExpr(expr, &context);
+	reset_transmission_modes(nestlevel);
+}
+
 /* Output join name for given join type */
 const char *
 get_jointype_name(JoinType jointype)
@@ -1750,14 +1779,16 @@ deparseRangeTblRef(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
  *
  * The statement text is appended to buf, and we also create an integer List
  * of the columns being retrieved by WITH CHECK OPTION or RETURNING (if any),
- * which is returned to *retrieved_attrs.
+ * which is returned to *retrieved_attrs.  The length of the statement up to
+ * the end of its VALUES clause is returned to *values_end_len, for
+ * rebuildInsertSql.
  */
 void
 deparseInsertSql(StringInfo buf, RangeTblEntry *rte,
 				 Index rtindex, Relation rel,
 				 List *targetAttrs, bool doNothing,
 				 List *withCheckOptionList, List *returningList,
-				 List **retrieved_attrs)
+				 List **retrieved_attrs, int *values_end_len)
 {
 	AttrNumber	pindex;
 	bool		first;
@@ -1800,6 +1831,7 @@ deparseInsertSql(StringInfo buf, RangeTblEntry *rte,
 	}
 	else
 		appendStringInfoString(buf, " DEFAULT VALUES");
+	*values_end_len = buf->len;
 
 	if (doNothing)
 		appendStringInfoString(buf, " ON CONFLICT DO NOTHING");
@@ -1809,6 +1841,77 @@ deparseInsertSql(StringInfo buf, RangeTblEntry *rte,
 						 withCheckOptionList, returningList, retrieved_attrs);
 }
 
+/*
+ * deparse remote COPY ... FROM STDIN statement
+ *
+ * For inserting the columns targetAttrs of rows streamed in COPY format,
+ * binary or text.
+ */
+void
+deparseCopyFromSql(StringInfo buf, RangeTblEntry *rte,
+				   Index rtindex, Relation rel,
+				   List *targetAttrs, bool binary)
+{
+	bool		first;
+	ListCell   *lc;
+
+	appendStringInfoString(buf, "COPY ");
+	deparseRelation(buf, rel);
+	appendStringInfoString(buf, " (");
+
+	first = true;
+	foreach(lc, targetAttrs)
+	{
+		int			attnum = lfirst_int(lc);
+
+		if (!first)
+			appendStringInfoString(buf, ", ");
+		first = false;
+
+		deparseColumnRef(buf, rtindex, attnum, rte, false);
+	}
+
+	appendStringInfoString(buf, ") FROM STDIN");
+	if (binary)
+		appendStringInfoString(buf, " (FORMAT binary)");
+}
+
+/*
+ * rebuild remote INSERT statement for num_rows rows
+ *
+ * orig_query is a statement built by deparseInsertSql, for one row of
+ * num_params parameters; the VALUES clause is given one more row of
+ * parameters per extra row, numbered on from those of the first.
+ */
+void
+rebuildInsertSql(StringInfo buf, const char *orig_query,
+				 int values_end_len, int num_params, int num_rows)
+{
+	int			pindex = num_params + 1;
+
+	Assert(values_end_len > 0 && values_end_len <= strlen(orig_query));
+	Assert(num_params > 0);
+
+	/* Copy up to the end of the first row */
+	appendBinaryStringInfo(buf, orig_query, values_end_len);
+
+	for (int i = 1; i < num_rows; i++)
+	{
+		appendStringInfoString(buf, ", (");
+		for (int j = 0; j < num_params; j++)
+		{
+			if (j > 0)
+				appendStringInfoString(buf, ", ");
+			appendStringInfo(buf, "$%d", pindex);
+			pindex++;
+		}
+		appendStringInfoChar(buf, ')');
+	}
+
+	/* Copy what follows the VALUES clause */
+	appendStringInfoString(buf, orig_query + values_end_len);
+}
+
 /*
  * deparse remote UPDATE statement
  *
@@ -1968,6 +2071,67 @@ deparseDeleteSql(StringInfo buf, RangeTblEntry *rte,
 						 NIL, returningList, retrieved_attrs);
 }
 
+/*
+ * deparse remote UPDATE statement of many rows
+ *
+ * The ctids of the rows are the tid[] parameter $1, and the new values of
+ * each of targetAttrs the text[] parameters that follow, element i of each
+ * array for row i.  The values are cast to the column types without typmod,
+ * which the assignment applies, as it does for deparseUpdateSql's.
+ */
+void
+deparseBatchUpdateSql(StringInfo buf, RangeTblEntry *rte,
+					  Index rtindex, Relation rel,
+					  List *targetAttrs)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	AttrNumber	pindex;
+	bool		first;
+	ListCell   *lc;
+
+	appendStringInfoString(buf, "UPDATE ");
+	deparseRelation(buf, rel);
+	appendStringInfo(buf, " %s%d SET ", REL_ALIAS_PREFIX, rtindex);
+
+	pindex = 2;
+	first = true;
+	foreach(lc, targetAttrs)
+	{
+		int			attnum = lfirst_int(lc);
+		Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
+
+		if (!first)
+			appendStringInfoString(buf, ", ");
+		first = false;
+
+		deparseColumnRef(buf, rtindex, attnum, rte, false);
+		appendStringInfo(buf, " = v.p%d::%s", pindex,
+						 deparse_type_name(attr->atttypid, -1));
+		pindex++;
+	}
+
+	appendStringInfoString(buf, " FROM unnest($1::tid[]");
+	for (pindex = 2; pindex <= list_length(targetAttrs) + 1; pindex++)
+		appendStringInfo(buf, ", $%d::text[]", pindex);
+	appendStringInfoString(buf, ") v(ctid");
+	for (pindex = 2; pindex <= list_length(targetAttrs) + 1; pindex++)
+		appendStringInfo(buf, ", p%d", pindex);
+	appendStringInfo(buf, ") WHERE %s%d.ctid = v.ctid", REL_ALIAS_PREFIX, rtindex);
+}
+
+/*
+ * deparse remote DELETE statement of many rows
+ *
+ * The ctids of the rows are the tid[] parameter $1.
+ */
+void
+deparseBatchDeleteSql(StringInfo buf, Relation rel)
+{
+	appendStringInfoString(buf, "DELETE FROM ");
+	deparseRelation(buf, rel);
+	appendStringInfoString(buf, " WHERE ctid = ANY ($1::tid[])");
+}
+
 /*
  * deparse remote DELETE statement
  *
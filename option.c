@@ -107,13 +107,18 @@ pgc_fdw_validator(PG_FUNCTION_ARGS)
 		 * Validate option value, when we can do so without any context.
 		 */
 		if (strcmp(def->defname, "use_remote_estimate") == 0 ||
+			strcmp(def->defname, "use_binary_format") == 0 ||
+			strcmp(def->defname, "async_capable") == 0 ||
+			strcmp(def->defname, "use_remote_copy") == 0 ||
 			strcmp(def->defname, "updatable") == 0)
 		{
 			/* these accept only boolean values */
 			(void) defGetBoolean(def);
 		}
 		else if (strcmp(def->defname, "fdw_startup_cost") == 0 ||
-				 strcmp(def->defname, "fdw_tuple_cost") == 0)
+				 strcmp(def->defname, "fdw_tuple_cost") == 0 ||
+				 strcmp(def->defname, "cache_startup_cost") == 0 ||
+				 strcmp(def->defname, "cache_tuple_cost") == 0)
 		{
 			/* these must have a non-negative numeric value */
 			double		val;
@@ -131,7 +136,8 @@ pgc_fdw_validator(PG_FUNCTION_ARGS)
 			/* check list syntax, warn about uninstalled extensions */
 			(void) ExtractExtensionList(defGetString(def), true);
 		}
-		else if (strcmp(def->defname, "fetch_size") == 0)
+		else if (strcmp(def->defname, "fetch_size") == 0 ||
+				 strcmp(def->defname, "batch_size") == 0)
 		{
 			int			fetch_size;
 
@@ -143,7 +149,9 @@ pgc_fdw_validator(PG_FUNCTION_ARGS)
 								def->defname)));
 		}
 
-		else if (strcmp(def->defname, "cache_timeout") == 0) 
+		else if (strcmp(def->defname, "cache_timeout") == 0 ||
+				 strcmp(def->defname, "cache_stale_grace") == 0 ||
+				 strcmp(def->defname, "cache_param_batch") == 0) 
 		{
 			int cache_timeout;
 			cache_timeout = strtol(defGetString(def), NULL, 10);
@@ -155,6 +163,16 @@ pgc_fdw_validator(PG_FUNCTION_ARGS)
 			}
 		}
 
+		else if (strcmp(def->defname, "cache_compression") == 0)
+		{
+			if (pgcache_codec_by_name(defGetString(def)) < 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid value for %s: \"%s\"",
+								def->defname, defGetString(def)),
+						 errhint("Valid values are none, pglz, lz4 and zstd, if this build supports them.")));
+		}
+
 		else if (strcmp(def->defname, "password_required") == 0)
 		{
 			bool		pw_required = defGetBoolean(def);
@@ -205,9 +223,17 @@ InitPgFdwOptions(void)
 		/* use_remote_estimate is available on both server and table */
 		{"use_remote_estimate", ForeignServerRelationId, false},
 		{"use_remote_estimate", ForeignTableRelationId, false},
+		/* use_binary_format is available on both server and table */
+		{"use_binary_format", ForeignServerRelationId, false},
+		{"use_binary_format", ForeignTableRelationId, false},
+		/* async_capable is available on both server and table */
+		{"async_capable", ForeignServerRelationId, false},
+		{"async_capable", ForeignTableRelationId, false},
 		/* cost factors */
 		{"fdw_startup_cost", ForeignServerRelationId, false},
 		{"fdw_tuple_cost", ForeignServerRelationId, false},
+		{"cache_startup_cost", ForeignServerRelationId, false},
+		{"cache_tuple_cost", ForeignServerRelationId, false},
 		/* shippable extensions */
 		{"extensions", ForeignServerRelationId, false},
 		/* updatable is available on both server and table */
@@ -216,10 +242,25 @@ InitPgFdwOptions(void)
 		/* fetch_size is available on both server and table */
 		{"fetch_size", ForeignServerRelationId, false},
 		{"fetch_size", ForeignTableRelationId, false},
+		/* batch_size is available on both server and table */
+		{"batch_size", ForeignServerRelationId, false},
+		{"batch_size", ForeignTableRelationId, false},
+		/* use_remote_copy is available on both server and table */
+		{"use_remote_copy", ForeignServerRelationId, false},
+		{"use_remote_copy", ForeignTableRelationId, false},
 
 		/* cache_timeout is available on both server tand table */
 		{"cache_timeout", ForeignServerRelationId, false},
 		{"cache_timeout", ForeignTableRelationId, false}, 
+		/* cache_stale_grace is available on both server and table */
+		{"cache_stale_grace", ForeignServerRelationId, false},
+		{"cache_stale_grace", ForeignTableRelationId, false},
+		/* cache_param_batch is available on both server and table */
+		{"cache_param_batch", ForeignServerRelationId, false},
+		{"cache_param_batch", ForeignTableRelationId, false},
+		/* cache_compression is available on both server and table */
+		{"cache_compression", ForeignServerRelationId, false},
+		{"cache_compression", ForeignTableRelationId, false},
 
 		{"password_required", UserMappingRelationId, false},
 
@@ -21,7 +21,10 @@ CREATE FUNCTION pgc_fdw_cache_info(
     OUT sha text,
     OUT ts timestamp with time zone,
     OUT tupcnt int,
-    OUT qry text
+    OUT qry text,
+    OUT raw_bytes bigint,
+    OUT stored_bytes bigint,
+    OUT compression_ratio float8
 ) RETURNS SETOF record
 AS 'MODULE_PATHNAME', 'pgc_fdw_cache_info'
 LANGUAGE C;
@@ -42,3 +45,87 @@ CREATE FUNCTION pgc_fdw_invalidate(sha text)
 RETURNS int
 AS 'MODULE_PATHNAME', 'pgc_fdw_invalidate'
 LANGUAGE C;
+
+CREATE FUNCTION pgc_fdw_invalidate_table(tbl regclass)
+RETURNS int
+AS 'MODULE_PATHNAME', 'pgc_fdw_invalidate_table'
+LANGUAGE C;
+
+CREATE FUNCTION pgc_fdw_invalidate_server(server name)
+RETURNS int
+AS 'MODULE_PATHNAME', 'pgc_fdw_invalidate_server'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pgc_fdw_invalidate_table(regclass) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pgc_fdw_invalidate_server(name) FROM PUBLIC;
+
+CREATE FUNCTION pgc_fdw_gc()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pgc_fdw_gc'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pgc_fdw_gc() FROM PUBLIC;
+
+CREATE FUNCTION pgc_fdw_cache_metrics(
+    OUT name text,
+    OUT value bigint
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgc_fdw_cache_metrics'
+LANGUAGE C;
+
+CREATE FUNCTION pgc_fdw_cache_stats(
+    OUT scope text,
+    OUT dbid oid,
+    OUT relid oid,
+    OUT sha text,
+    OUT hits bigint,
+    OUT misses bigint,
+    OUT stale_hits bigint,
+    OUT l1_hits bigint,
+    OUT waits bigint,
+    OUT bypasses bigint,
+    OUT populates bigint,
+    OUT populate_failures bigint,
+    OUT limit_reached bigint,
+    OUT bytes_read bigint,
+    OUT bytes_written bigint,
+    OUT fdb_round_trips bigint,
+    OUT status_time_ms float8,
+    OUT read_time_ms float8,
+    OUT remote_time_ms float8,
+    OUT populate_time_ms float8,
+    OUT remote_latency bigint[],
+    OUT populate_latency bigint[],
+    OUT stats_reset timestamp with time zone
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgc_fdw_cache_stats'
+LANGUAGE C;
+
+CREATE VIEW pgc_fdw_cache_stats AS
+    SELECT * FROM pgc_fdw_cache_stats();
+
+CREATE FUNCTION pgc_fdw_cache_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pgc_fdw_cache_stats_reset'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pgc_fdw_cache_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION pgc_fdw_cache_bench(
+    ntuples int DEFAULT 10000,
+    width int DEFAULT 100,
+    iterations int DEFAULT 20,
+    compression text DEFAULT 'none',
+    OUT op text,
+    OUT runs int,
+    OUT tuples_per_sec float8,
+    OUT mb_per_sec float8,
+    OUT p50_ms float8,
+    OUT p99_ms float8,
+    OUT bytes_per_tuple float8
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgc_fdw_cache_bench'
+LANGUAGE C STRICT;
+
+-- writes to the shared cache, superuser only unless granted
+REVOKE ALL ON FUNCTION pgc_fdw_cache_bench(int, int, int, text) FROM PUBLIC;
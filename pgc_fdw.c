@@ -15,9 +15,12 @@
 #include <limits.h>
 
 #include "access/htup_details.h"
+#include "access/parallel.h"
 #include "access/sysattr.h"
 #include "access/table.h"
+#include "access/xact.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
@@ -32,10 +35,14 @@
 #include "optimizer/pathnode.h"
 #include "optimizer/paths.h"
 #include "optimizer/planmain.h"
+#include "optimizer/prep.h"
 #include "optimizer/restrictinfo.h"
 #include "optimizer/tlist.h"
 #include "parser/parsetree.h"
 #include "pgc_fdw.h"
+#include "port/atomics.h"
+#include "port/pg_bswap.h"
+#include "storage/spin.h"
 #include "utils/builtins.h"
 #include "utils/float.h"
 #include "utils/guc.h"
@@ -44,6 +51,7 @@
 #include "utils/rel.h"
 #include "utils/sampling.h"
 #include "utils/selfuncs.h"
+#include "utils/syscache.h"
 
 #include "cache.h"
 
@@ -51,7 +59,14 @@ PG_MODULE_MAGIC;
 
 void _PG_init(void)
 {
-	pgcache_init();
+	/* fdb itself is started on first use, see get_fdb */
+	pgcache_lease_init();
+	pgcache_l1_init();
+	pgcache_stats_init();
+	pgcache_gc_init();
+
+	/* after every pgc_fdw.* variable above is defined */
+	EmitWarningsOnPlaceholders("pgc_fdw");
 }
 
 void _PG_fini(void)
@@ -65,9 +80,21 @@ void _PG_fini(void)
 /* Default CPU cost to process 1 row (above and beyond cpu_tuple_cost). */
 #define DEFAULT_FDW_TUPLE_COST		0.01
 
+/* Default cost to look up and start reading a cached result in FDB. */
+#define DEFAULT_CACHE_STARTUP_COST	5.0
+
+/* Default cost to read and decode 1 cached row (above cpu_tuple_cost). */
+#define DEFAULT_CACHE_TUPLE_COST	0.002
+
 /* If no remote estimates, assume a sort costs 20% extra */
 #define DEFAULT_FDW_SORT_MULTIPLIER 1.2
 
+/* Most parameters the protocol allows a statement to have. */
+#define PGC_QUERY_PARAM_MAX 65535
+
+/* Bytes of rows an insert through a remote COPY collects before sending. */
+#define PGC_COPY_BUF_SIZE	(1024 * 1024)
+
 /*
  * Indexes of FDW-private information stored in fdw_private lists.
  *
@@ -86,6 +113,20 @@ enum FdwScanPrivateIndex
 	
 	/* Cache timeout: */
 	FdwScanPrivateCacheTimeout,
+	/* Codec of cached blocks */
+	FdwScanPrivateCacheCompression,
+	/* Seconds a stale cache entry is served while it is refreshed */
+	FdwScanPrivateCacheStaleGrace,
+	/* Integer: may the scan be answered by a broader cached scan */
+	FdwScanPrivateCacheSubsume,
+	/* List of deparsed remote conditions, as String, see deparseRemoteCondition */
+	FdwScanPrivateCacheConds,
+	/* Parameter values fetched together on a miss, 0 if not batched */
+	FdwScanPrivateCacheParamBatch,
+	/* Integer: fetch results in binary, if every column allows it */
+	FdwScanPrivateUseBinaryFormat,
+	/* Integer: start the remote query when the scan begins */
+	FdwScanPrivateAsyncCapable,
 
 	/*
 	 * String describing join i.e. names of relations being joined and types
@@ -103,6 +144,7 @@ enum FdwScanPrivateIndex
  *	  (NIL for a DELETE)
  * 3) Boolean flag showing if the remote query has a RETURNING clause
  * 4) Integer list of attribute numbers retrieved by RETURNING, if any
+ * 5) Length of an INSERT up to the end of its VALUES clause, -1 otherwise
  */
 enum FdwModifyPrivateIndex
 {
@@ -113,7 +155,9 @@ enum FdwModifyPrivateIndex
 	/* has-returning flag (as an integer Value node) */
 	FdwModifyPrivateHasReturning,
 	/* Integer list of attribute numbers retrieved by RETURNING */
-	FdwModifyPrivateRetrievedAttrs
+	FdwModifyPrivateRetrievedAttrs,
+	/* Integer: length of the INSERT up to the end of its VALUES clause */
+	FdwModifyPrivateLen
 };
 
 /*
@@ -137,6 +181,16 @@ enum FdwDirectModifyPrivateIndex
 	FdwDirectModifyPrivateSetProcessed
 };
 
+/*
+ * Receive functions of the columns of a scan fetched in binary, indexed
+ * by attribute number - 1 like AttInMetadata.
+ */
+typedef struct AttRecvMetadata
+{
+	FmgrInfo   *attrecvfuncs;
+	Oid		   *attioparams;
+} AttRecvMetadata;
+
 /*
  * Execution state of a foreign scan using pgc_fdw.
  */
@@ -146,6 +200,7 @@ typedef struct PgFdwScanState
 								 * for a foreign join scan. */
 	TupleDesc	tupdesc;		/* tuple descriptor of scan */
 	AttInMetadata *attinmeta;	/* attribute datatype conversion metadata */
+	AttRecvMetadata *attrecvmeta;	/* NULL unless fetched in binary */
 
 	/* extracted fdw_private data */
 	char	   *query;			/* text of SELECT command */
@@ -153,6 +208,7 @@ typedef struct PgFdwScanState
 
 	/* for remote query execution */
 	PGconn	   *conn;			/* connection for the scan */
+	PgFdwConnState *conn_state; /* extra per-connection state */
 	unsigned int cursor_number; /* quasi-unique ID for my cursor */
 	bool		cursor_exists;	/* have we created the cursor? */
 	int			numParams;		/* number of parameters passed to query */
@@ -175,14 +231,67 @@ typedef struct PgFdwScanState
 
 	int			fetch_size;		/* number of tuples per fetch */
 
+	/* next batch, fetched while the current one is consumed */
+	MemoryContext prefetch_cxt; /* context holding the next batch */
+	HeapTuple  *prefetch_tuples;	/* array of tuples of the next batch */
+	int			prefetch_num;	/* # of tuples in it */
+	bool		prefetch_sent;	/* FETCH of it sent, result not collected */
+	bool		prefetch_ready; /* collected, waiting to become current */
+
 	/* pgc cache info */
 	int cache_timeout;
+	int cache_stale_grace;
+	int cache_compression;
+	uint32_t cache_fpr;		/* row type fingerprint, see pgcache_fingerprint */
+	bool cache_subsume;		/* may be answered by a broader cached scan */
+	List *cache_conds;		/* deparsed remote conditions */
+	int cache_param_batch;	/* parameter values fetched together on a miss */
 	qry_key_t cache_qk;
+	pgcache_reader_t *cache_rd;	/* streaming reader of a cache hit */
+	bool cache_remote;		/* gone remote, cursor_number is open */
+	pgcache_writer_t *cache_wr;	/* populate of a miss, fed a batch at a time */
+	int64_t cache_remote_us;	/* waiting for the remote server */
+	ExprState *cache_filter;	/* conditions a broader cached scan lacks */
+	char *cache_key_prefix;	/* of cache_key_text, has the epochs, NULL if 
+							 * they could not be read and we bypass the cache */
+	char *cache_deps;		/* SHAs of the tables scanned, see pgcache_rel_sha */
+	List *cache_relids;		/* their Oids */
+	int cache_ndep;
+	pgcache_stats_t cache_stats;	/* not yet flushed to shared memory */
+	pgcache_stats_t cache_totals;	/* of all rescans, for EXPLAIN ANALYZE */
 	/* reuse num_tuple and next_tuple */
 
+	/* for parallel scans */
+	PgFdwParallelScan *pscan;	/* shared state, NULL unless parallel aware */
+	int32		cache_nblk;		/* blocks of the entry read in chunks */
+	UserMapping *user;			/* to connect on demand, in a worker */
+
 } PgFdwScanState;
 
 
+/*
+ * Blocks of a cached result a parallel scan participant reads at a time.
+ */
+#define PGC_PARALLEL_CHUNK	8
+
+/*
+ * Shared state of a parallel scan, in the DSM of the Gather.  The leader
+ * decides, before the workers start, whether the cached result is fresh.
+ * If it is, participants read it a chunk of blocks at a time; otherwise the
+ * first participant to start does the whole scan as a serial scan would,
+ * and the others return nothing.
+ */
+typedef struct PgFdwParallelScan
+{
+	slock_t		mutex;			/* protects taken */
+	bool		split;			/* fresh entry, blocks are split */
+	bool		taken;			/* otherwise, has a participant started? */
+	bool		bypass;			/* and it does without the cache */
+	int64		gen;			/* generation of the entry, if split */
+	qry_key_t	qk;				/* cache key, if split */
+	pg_atomic_uint32 next_chunk;	/* next chunk to read, if split */
+} PgFdwParallelScan;
+
 /*
  * Execution state of a foreign insert/update/delete operation.
  */
@@ -193,6 +302,7 @@ typedef struct PgFdwModifyState
 
 	/* for remote query execution */
 	PGconn	   *conn;			/* connection for the scan */
+	PgFdwConnState *conn_state; /* extra per-connection state */
 	char	   *p_name;			/* name of prepared statement, if created */
 
 	/* extracted fdw_private data */
@@ -209,6 +319,21 @@ typedef struct PgFdwModifyState
 	/* working memory context */
 	MemoryContext temp_cxt;		/* context for per-tuple temporary data */
 
+	/* for batched modifies, see batch_foreign_insert and batch_by_ctid */
+	char	   *orig_query;		/* INSERT of one row */
+	int			values_end_len; /* its length up to the end of VALUES */
+	bool		batch_by_ctid;	/* UPDATE/DELETE of arrays of rows? */
+	int			batch_size;		/* rows per statement, 1 if not batched */
+	int			num_batched;	/* rows waiting in batch_values */
+	const char **batch_values;	/* their parameters, p_nums per row */
+	ItemPointerData *batch_ctids;	/* their ctids, if batch_by_ctid */
+	MemoryContext batch_cxt;	/* context holding them */
+
+	/* for inserts through a remote COPY, see copy_foreign_insert */
+	char	   *copy_query;		/* COPY ... FROM STDIN, NULL if not used */
+	FmgrInfo   *copy_sendfuncs; /* binary send functions, NULL for text */
+	StringInfoData copy_buf;	/* rows not sent yet, in COPY format */
+
 	/* for update row movement if subplan result rel */
 	struct PgFdwModifyState *aux_fmstate;	/* foreign-insert state, if
 											 * created */
@@ -230,6 +355,7 @@ typedef struct PgFdwDirectModifyState
 
 	/* for remote query execution */
 	PGconn	   *conn;			/* connection for the update */
+	PgFdwConnState *conn_state; /* extra per-connection state */
 	int			numParams;		/* number of parameters passed to query */
 	FmgrInfo   *param_flinfo;	/* output conversion functions for them */
 	List	   *param_exprs;	/* executable expressions for param values */
@@ -323,6 +449,14 @@ typedef struct
 	List	   *already_used;	/* expressions already dealt with */
 } ec_member_foreign_arg;
 
+/*
+ * Foreign tables modified by the current transaction, whose dependent cache
+ * entries are dropped when it commits, see cache_xact_callback.  Scans of
+ * them do without the cache until then, see cache_rels_modified.
+ */
+static List *cache_modified_rels = NIL;
+static bool cache_xact_callback_registered = false;
+
 /*
  * SQL functions
  */
@@ -413,6 +547,20 @@ static void postgresGetForeignUpperPaths(PlannerInfo *root,
 										 RelOptInfo *input_rel,
 										 RelOptInfo *output_rel,
 										 void *extra);
+static bool postgresIsForeignScanParallelSafe(PlannerInfo *root,
+											  RelOptInfo *rel,
+											  RangeTblEntry *rte);
+static Size postgresEstimateDSMForeignScan(ForeignScanState *node,
+										   ParallelContext *pcxt);
+static void postgresInitializeDSMForeignScan(ForeignScanState *node,
+											 ParallelContext *pcxt,
+											 void *coordinate);
+static void postgresReInitializeDSMForeignScan(ForeignScanState *node,
+											   ParallelContext *pcxt,
+											   void *coordinate);
+static void postgresInitializeWorkerForeignScan(ForeignScanState *node,
+												shm_toc *toc,
+												void *coordinate);
 
 /*
  * Helper functions
@@ -426,6 +574,7 @@ static void estimate_path_cost_size(PlannerInfo *root,
 									Cost *p_startup_cost, Cost *p_total_cost);
 static void get_remote_estimate(const char *sql,
 								PGconn *conn,
+								PgFdwConnState *conn_state,
 								double *rows,
 								int *width,
 								Cost *startup_cost,
@@ -440,11 +589,38 @@ static void adjust_foreign_grouping_path_cost(PlannerInfo *root,
 static bool ec_member_matches_foreign(PlannerInfo *root, RelOptInfo *rel,
 									  EquivalenceClass *ec, EquivalenceMember *em,
 									  void *arg);
+static bool scan_locks_rows(PlannerInfo *root, RelOptInfo *foreignrel);
+static double cache_plan_rows(PlannerInfo *root, RelOptInfo *foreignrel,
+							  PgFdwPathExtraData *fpextra);
 static void create_cursor(ForeignScanState *node);
 static void cache_create_cursor(ForeignScanState *node);
+static void cache_key_text(StringInfo buf, PgFdwScanState *fsstate, const char **values);
+static bool cache_fetch_param_batch(ForeignScanState *node, int64_t gen, int64_t grace);
+static int32_t cache_open_subsuming(ForeignScanState *node, int64_t now, int64_t timeout);
+static bool cache_key_prefix(StringInfo buf, List *relids, Oid serverid);
+static void cache_note_modified(Oid relid);
+static bool cache_rels_modified(List *relids);
+static void cache_xact_callback(XactEvent event, void *arg);
+static void cache_parallel_decide(ForeignScanState *node,
+								  PgFdwParallelScan *pscan);
+static bool cache_parallel_begin(ForeignScanState *node);
+static bool cache_parallel_seek(PgFdwScanState *fsstate);
 
 static void fetch_more_data(ForeignScanState *node);
-static void close_cursor(PGconn *conn, unsigned int cursor_number);
+static int	fetch_result_tuples(ForeignScanState *node, PGresult *res,
+								HeapTuple **tuples);
+static void fetch_more_data_begin(ForeignScanState *node);
+static void create_cursor_begin(ForeignScanState *node);
+static void discard_prefetch(ForeignScanState *node);
+static void cache_fetch_more_data(ForeignScanState *node);
+static void cache_remote_batch(ForeignScanState *node, int64_t us);
+static void cache_finish_remote(ForeignScanState *node);
+static void cache_end_remote(ForeignScanState *node);
+static void cache_close_reader(PgFdwScanState *fsstate);
+static void cache_flush_stats(PgFdwScanState *fsstate);
+static void cache_explain(PgFdwScanState *fsstate, ExplainState *es);
+static void close_cursor(PGconn *conn, unsigned int cursor_number,
+						 PgFdwConnState *conn_state);
 static PgFdwModifyState *create_foreign_modify(EState *estate,
 											   RangeTblEntry *rte,
 											   ResultRelInfo *resultRelInfo,
@@ -452,8 +628,24 @@ static PgFdwModifyState *create_foreign_modify(EState *estate,
 											   Plan *subplan,
 											   char *query,
 											   List *target_attrs,
+											   int values_end_len,
 											   bool has_returning,
-											   List *retrieved_attrs);
+											   List *retrieved_attrs,
+											   bool doNothing);
+static void get_modify_options(Relation rel, int *batch_size,
+							   bool *use_remote_copy, bool *use_binary_format);
+static TupleTableSlot *batch_foreign_insert(PgFdwModifyState *fmstate,
+											TupleTableSlot *slot);
+static void flush_foreign_insert(PgFdwModifyState *fmstate);
+static TupleTableSlot *batch_foreign_modify(PgFdwModifyState *fmstate,
+											ItemPointer ctid,
+											TupleTableSlot *slot);
+static void flush_foreign_modify(PgFdwModifyState *fmstate);
+static char *batch_param_array(PgFdwModifyState *fmstate, int nrows, int i);
+static TupleTableSlot *copy_foreign_insert(PgFdwModifyState *fmstate,
+										   TupleTableSlot *slot);
+static void copy_append_text(StringInfo buf, const char *s);
+static void flush_foreign_copy(PgFdwModifyState *fmstate);
 static TupleTableSlot *execute_foreign_modify(EState *estate,
 											  ResultRelInfo *resultRelInfo,
 											  CmdType operation,
@@ -493,10 +685,14 @@ static int	postgresAcquireSampleRowsFunc(Relation relation, int elevel,
 										  double *totaldeadrows);
 static void analyze_row_processor(PGresult *res, int row,
 								  PgFdwAnalyzeState *astate);
+static bool binary_safe_type(Oid typid);
+static AttRecvMetadata *binary_recv_metadata(TupleDesc tupdesc,
+											  List *retrieved_attrs);
 static HeapTuple make_tuple_from_result_row(PGresult *res,
 											int row,
 											Relation rel,
 											AttInMetadata *attinmeta,
+											AttRecvMetadata *attrecvmeta,
 											List *retrieved_attrs,
 											ForeignScanState *fsstate,
 											MemoryContext temp_context);
@@ -582,6 +778,13 @@ pgc_fdw_handler(PG_FUNCTION_ARGS)
 	/* Support functions for upper relation push-down */
 	routine->GetForeignUpperPaths = postgresGetForeignUpperPaths;
 
+	/* Support functions for parallel scans of cached results */
+	routine->IsForeignScanParallelSafe = postgresIsForeignScanParallelSafe;
+	routine->EstimateDSMForeignScan = postgresEstimateDSMForeignScan;
+	routine->InitializeDSMForeignScan = postgresInitializeDSMForeignScan;
+	routine->ReInitializeDSMForeignScan = postgresReInitializeDSMForeignScan;
+	routine->InitializeWorkerForeignScan = postgresInitializeWorkerForeignScan;
+
 	PG_RETURN_POINTER(routine);
 }
 
@@ -620,11 +823,18 @@ postgresGetForeignRelSize(PlannerInfo *root,
 	 * use_remote_estimate overrides per-server setting.
 	 */
 	fpinfo->use_remote_estimate = false;
+	fpinfo->use_binary_format = false;
+	fpinfo->async_capable = false;
 	fpinfo->fdw_startup_cost = DEFAULT_FDW_STARTUP_COST;
 	fpinfo->fdw_tuple_cost = DEFAULT_FDW_TUPLE_COST;
+	fpinfo->cache_startup_cost = DEFAULT_CACHE_STARTUP_COST;
+	fpinfo->cache_tuple_cost = DEFAULT_CACHE_TUPLE_COST;
 	fpinfo->shippable_extensions = NIL;
 	fpinfo->fetch_size = 100;
 	fpinfo->cache_timeout = 3600;
+	fpinfo->cache_stale_grace = 0;
+	fpinfo->cache_compression = PGC_CODEC_NONE;
+	fpinfo->cache_param_batch = 0;
 
 	apply_server_options(fpinfo);
 	apply_table_options(fpinfo);
@@ -740,6 +950,9 @@ postgresGetForeignRelSize(PlannerInfo *root,
 		estimate_path_cost_size(root, baserel, NIL, NIL, NULL,
 								&fpinfo->rows, &fpinfo->width,
 								&fpinfo->startup_cost, &fpinfo->total_cost);
+
+		/* Unchanged, unless a cached result told us the exact count. */
+		baserel->rows = fpinfo->rows;
 	}
 
 	/*
@@ -1018,6 +1231,44 @@ postgresGetForeignPaths(PlannerInfo *root,
 	/* Add paths with pathkeys */
 	add_paths_with_pathkeys_for_rel(root, baserel, NULL);
 
+	/*
+	 * A cached result can be read by parallel workers, each taking a share
+	 * of its blocks (see cache_parallel_begin), so add a partial path too.
+	 * Size the number of workers as for a heap of the same size.
+	 */
+	if (baserel->consider_parallel && baserel->lateral_relids == NULL &&
+		fpinfo->cache_timeout > 0)
+	{
+		double		pages = ceil(fpinfo->rows * fpinfo->width / BLCKSZ);
+		int			parallel_workers;
+
+		parallel_workers = compute_parallel_worker(baserel, pages, -1,
+												   max_parallel_workers_per_gather);
+		if (parallel_workers > 0)
+		{
+			double		divisor = parallel_workers;
+
+			/* Same leader contribution as get_parallel_divisor() assumes */
+			if (parallel_leader_participation &&
+				1.0 - 0.3 * parallel_workers > 0)
+				divisor += 1.0 - 0.3 * parallel_workers;
+
+			path = create_foreignscan_path(root, baserel,
+										   NULL,	/* default pathtarget */
+										   fpinfo->rows / divisor,
+										   fpinfo->startup_cost,
+										   fpinfo->startup_cost +
+										   (fpinfo->total_cost - fpinfo->startup_cost) / divisor,
+										   NIL, /* no pathkeys */
+										   NULL,	/* no outer rel either */
+										   NULL,	/* no extra plan */
+										   NIL);	/* no fdw_private list */
+			path->path.parallel_aware = true;
+			path->path.parallel_workers = parallel_workers;
+			add_partial_path(baserel, (Path *) path);
+		}
+	}
+
 	/*
 	 * If we're not using remote estimates, stop here.  We have no way to
 	 * estimate whether any join clauses would be worth sending across, so
@@ -1214,6 +1465,10 @@ postgresGetForeignPlan(PlannerInfo *root,
 	StringInfoData sql;
 	bool		has_final_sort = false;
 	bool		has_limit = false;
+	int			cache_timeout = fpinfo->cache_timeout;
+	bool		cache_subsume;
+	List	   *cache_conds = NIL;
+	int			cache_param_batch;
 	ListCell   *lc;
 
 	/*
@@ -1381,6 +1636,41 @@ postgresGetForeignPlan(PlannerInfo *root,
 	/* Remember remote_exprs for possible use by postgresPlanDirectModify */
 	fpinfo->final_remote_exprs = remote_exprs;
 
+	/*
+	 * Rows locked or fetched for UPDATE/DELETE must come from the remote
+	 * server; the cache neither takes the locks nor keeps the ctid.
+	 */
+	if (scan_locks_rows(root, foreignrel))
+		cache_timeout = 0;
+
+	/*
+	 * A plain scan of a base relation can be answered from a cached scan of
+	 * the same relation with fewer conditions.  Keep each remote condition
+	 * as text to compare them, in the order of fdw_recheck_quals, which we
+	 * will evaluate locally for the ones the cached scan does not have.
+	 */
+	cache_subsume = cache_timeout > 0 && IS_SIMPLE_REL(foreignrel) &&
+		params_list == NIL && best_path->path.pathkeys == NIL &&
+		!has_final_sort && !has_limit;
+	if (cache_subsume)
+	{
+		foreach(lc, remote_exprs)
+		{
+			StringInfoData cond;
+
+			initStringInfo(&cond);
+			deparseRemoteCondition(&cond, root, foreignrel, (Expr *) lfirst(lc));
+			cache_conds = lappend(cache_conds, makeString(cond.data));
+		}
+	}
+
+	/*
+	 * A scan with a single parameter, typically the inner side of a nested
+	 * loop, can fetch the entries of several parameter values at once.
+	 */
+	cache_param_batch = (cache_timeout > 0 && list_length(params_list) == 1) ?
+		fpinfo->cache_param_batch : 0;
+
 	/*
 	 * Build the fdw_private list that will be available to the executor.
 	 * Items in the list must match order in enum FdwScanPrivateIndex.
@@ -1388,7 +1678,16 @@ postgresGetForeignPlan(PlannerInfo *root,
 	fdw_private = list_make4(makeString(sql.data),
 							 retrieved_attrs,
 							 makeInteger(fpinfo->fetch_size),
-							 makeInteger(fpinfo->cache_timeout));
+							 makeInteger(cache_timeout));
+	fdw_private = lappend(fdw_private,
+						  makeInteger(fpinfo->cache_compression));
+	fdw_private = lappend(fdw_private,
+						  makeInteger(fpinfo->cache_stale_grace));
+	fdw_private = lappend(fdw_private, makeInteger(cache_subsume));
+	fdw_private = lappend(fdw_private, cache_conds);
+	fdw_private = lappend(fdw_private, makeInteger(cache_param_batch));
+	fdw_private = lappend(fdw_private, makeInteger(fpinfo->use_binary_format));
+	fdw_private = lappend(fdw_private, makeInteger(fpinfo->async_capable));
 	if (IS_JOIN_REL(foreignrel) || IS_UPPER_REL(foreignrel))
 		fdw_private = lappend(fdw_private,
 							  makeString(fpinfo->relation_name));
@@ -1410,6 +1709,119 @@ postgresGetForeignPlan(PlannerInfo *root,
 							outer_plan);
 }
 
+/*
+ * Does the scan of foreignrel lock rows, or fetch them for UPDATE/DELETE?
+ * This must match what deparseLockingClause() does.
+ */
+static bool
+scan_locks_rows(PlannerInfo *root, RelOptInfo *foreignrel)
+{
+	int			relid = -1;
+
+	while ((relid = bms_next_member(foreignrel->relids, relid)) >= 0)
+	{
+		PlanRowMark *rc;
+
+		if (relid == root->parse->resultRelation &&
+			(root->parse->commandType == CMD_UPDATE ||
+			 root->parse->commandType == CMD_DELETE))
+			return true;
+
+		rc = get_plan_rowmark(root->rowMarks, relid);
+		if (rc && rc->strength != LCS_NONE)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Number of rows of a fresh cached result of the unparameterized scan of
+ * foreignrel, deparsed as GetForeignPlan will, or -1 if there is none.
+ * Costs two FDB reads, the epochs and the entry, the first time for each of
+ * foreignrel's scans with and without LIMIT; the answer is kept in fpinfo
+ * for the other paths costed.  A stale entry counts as none, the planner
+ * does not know whether it would still be served when the plan runs.
+ */
+static double
+cache_plan_rows(PlannerInfo *root, RelOptInfo *foreignrel,
+				PgFdwPathExtraData *fpextra)
+{
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) foreignrel->fdw_private;
+	int			slot = (fpextra && fpextra->has_limit) ? 1 : 0;
+	List	   *fdw_scan_tlist = NIL;
+	List	   *remote_conds = NIL;
+	List	   *retrieved_attrs;
+	List	   *params_list = NIL;
+	List	   *relids = NIL;
+	Relids		scanrelids;
+	StringInfoData sql;
+	StringInfoData key;
+	qry_key_t	qk;
+	int32_t		ntup = QRY_MISS;
+	int			rti = -1;
+	ListCell   *lc;
+
+	if (fpinfo->cache_timeout <= 0 || scan_locks_rows(root, foreignrel) ||
+		(fpextra && fpextra->has_final_sort))
+		return -1;
+
+	if (fpinfo->cache_rows_done & (1 << slot))
+		return fpinfo->cache_rows[slot];
+
+	if (IS_SIMPLE_REL(foreignrel))
+	{
+		/* GetForeignPlan leaves pseudoconstants to the core code */
+		foreach(lc, fpinfo->remote_conds)
+		{
+			RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+
+			if (!rinfo->pseudoconstant)
+				remote_conds = lappend(remote_conds, rinfo);
+		}
+	}
+	else
+	{
+		remote_conds = fpinfo->remote_conds;
+		fdw_scan_tlist = build_tlist_to_deparse(foreignrel);
+	}
+
+	initStringInfo(&sql);
+	deparseSelectStmtForRel(&sql, root, foreignrel, fdw_scan_tlist,
+							remote_conds, NIL, false,
+							fpextra ? fpextra->has_limit : false,
+							false, &retrieved_attrs, &params_list);
+
+	/* Same text as cache_key_text, the tables are those of fs_relids */
+	scanrelids = IS_UPPER_REL(foreignrel) ? root->all_baserels : foreignrel->relids;
+	while ((rti = bms_next_member(scanrelids, rti)) >= 0)
+	{
+		RangeTblEntry *rte = planner_rt_fetch(rti, root);
+
+		if (rte->rtekind == RTE_RELATION)
+			relids = lappend_oid(relids, rte->relid);
+	}
+
+	/*
+	 * The key of a query with parameters depends on their values, and a
+	 * table we modified is scanned without the cache, see cache_create_cursor.
+	 */
+	initStringInfo(&key);
+	if (params_list == NIL && !cache_rels_modified(relids) &&
+		cache_key_prefix(&key, relids, fpinfo->server->serverid))
+	{
+		appendStringInfoString(&key, sql.data);
+		qry_key_build(&qk, key.data);
+		ntup = pgcache_peek(&qk, get_ts(),
+							(int64_t) fpinfo->cache_timeout * 1000000);
+	}
+	pfree(sql.data);
+	pfree(key.data);
+
+	fpinfo->cache_rows[slot] = ntup >= 0 ? (double) ntup : -1;
+	fpinfo->cache_rows_done |= 1 << slot;
+	return fpinfo->cache_rows[slot];
+}
+
 /*
  * postgresBeginForeignScan
  *		Initiate an executor scan of a foreign PostgreSQL table.
@@ -1458,12 +1870,19 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 
 	/*
 	 * Get connection to the foreign server.  Connection manager will
-	 * establish new connection if necessary.
+	 * establish new connection if necessary.  A parallel worker reading a
+	 * cached result may never need one, it connects on a miss, see
+	 * cache_create_cursor.
 	 */
-	fsstate->conn = GetConnection(user, false);
+	fsstate->user = user;
+	if (!IsParallelWorker() ||
+		intVal(list_nth(fsplan->fdw_private, FdwScanPrivateCacheTimeout)) == 0)
+	{
+		fsstate->conn = GetConnection(user, false, &fsstate->conn_state);
 
-	/* Assign a unique ID for my cursor */
-	fsstate->cursor_number = GetCursorNumber(fsstate->conn);
+		/* Assign a unique ID for my cursor */
+		fsstate->cursor_number = GetCursorNumber(fsstate->conn);
+	}
 	fsstate->cursor_exists = false;
 
 	/* Get private info created by planner functions. */
@@ -1474,6 +1893,16 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 	fsstate->fetch_size = intVal(list_nth(fsplan->fdw_private,
 										  FdwScanPrivateFetchSize));
 	fsstate->cache_timeout = intVal(list_nth(fsplan->fdw_private, FdwScanPrivateCacheTimeout));
+	fsstate->cache_compression = intVal(list_nth(fsplan->fdw_private,
+												 FdwScanPrivateCacheCompression));
+	fsstate->cache_stale_grace = intVal(list_nth(fsplan->fdw_private,
+												 FdwScanPrivateCacheStaleGrace));
+	fsstate->cache_subsume = intVal(list_nth(fsplan->fdw_private,
+											 FdwScanPrivateCacheSubsume));
+	fsstate->cache_conds = (List *) list_nth(fsplan->fdw_private,
+											 FdwScanPrivateCacheConds);
+	fsstate->cache_param_batch = intVal(list_nth(fsplan->fdw_private,
+												 FdwScanPrivateCacheParamBatch));
 
 
 	/* Create contexts for batches of tuples and per-tuple temp workspace. */
@@ -1483,6 +1912,9 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 	fsstate->temp_cxt = AllocSetContextCreate(estate->es_query_cxt,
 											  "pgc_fdw temporary data",
 											  ALLOCSET_SMALL_SIZES);
+	fsstate->prefetch_cxt = AllocSetContextCreate(estate->es_query_cxt,
+												  "pgc_fdw tuple data",
+												  ALLOCSET_DEFAULT_SIZES);
 
 	/*
 	 * Get info we'll need for converting data fetched from the foreign server
@@ -1500,6 +1932,42 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 	}
 
 	fsstate->attinmeta = TupleDescGetAttInMetadata(fsstate->tupdesc);
+	if (intVal(list_nth(fsplan->fdw_private, FdwScanPrivateUseBinaryFormat)))
+		fsstate->attrecvmeta = binary_recv_metadata(fsstate->tupdesc,
+													fsstate->retrieved_attrs);
+	fsstate->cache_fpr = pgcache_fingerprint(fsstate->tupdesc,
+											 fsstate->retrieved_attrs);
+
+	/*
+	 * Tables whose modification drops the entries of the scan, and whose
+	 * epochs, with the server's, are part of their keys.
+	 */
+	if (fsstate->cache_timeout > 0)
+	{
+		StringInfoData prefix;
+		List	   *relids = NIL;
+		int			rti = -1;
+
+		fsstate->cache_deps = palloc(20 * bms_num_members(fsplan->fs_relids));
+		fsstate->cache_ndep = 0;
+		while ((rti = bms_next_member(fsplan->fs_relids, rti)) >= 0)
+		{
+			RangeTblEntry *deprte = exec_rt_fetch(rti, estate);
+
+			if (deprte->rtekind != RTE_RELATION)
+				continue;
+			relids = lappend_oid(relids, deprte->relid);
+			pgcache_rel_sha(deprte->relid,
+							fsstate->cache_deps + 20 * fsstate->cache_ndep++);
+		}
+
+		fsstate->cache_relids = relids;
+
+		/* Without the epochs, fdb is in trouble, just go remote. */
+		initStringInfo(&prefix);
+		if (cache_key_prefix(&prefix, relids, fsstate->user->serverid))
+			fsstate->cache_key_prefix = prefix.data;
+	}
 
 	/*
 	 * Prepare for processing of parameters used in remote query, if any.
@@ -1513,6 +1981,18 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 							 &fsstate->param_flinfo,
 							 &fsstate->param_exprs,
 							 &fsstate->param_values);
+
+	/*
+	 * If allowed, send the query now rather than on the first fetch, so
+	 * that the scans of an Append over several servers all have their
+	 * remote queries running by the time the first one is read.  Not for
+	 * cached scans, nor for parameterized ones whose values we don't know
+	 * yet, nor if the connection is busy with another scan already.
+	 */
+	if (intVal(list_nth(fsplan->fdw_private, FdwScanPrivateAsyncCapable)) &&
+		fsstate->cache_timeout == 0 && numParams == 0 &&
+		fsstate->conn_state->pendingScan == NULL)
+		create_cursor_begin(node);
 }
 
 /*
@@ -1566,6 +2046,7 @@ postgresReScanForeignScan(ForeignScanState *node)
 	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
 	char		sql[64];
 	PGresult   *res;
+	bool		moved;
 
 	/* If we haven't created the cursor yet, nothing to do. */
 	if (!fsstate->cursor_exists)
@@ -1573,6 +2054,8 @@ postgresReScanForeignScan(ForeignScanState *node)
 
 	if (fsstate->cache_timeout > 0) {
 		/* force reopen a cursor. */
+		cache_close_reader(fsstate);
+		cache_end_remote(node);
 		fsstate->num_tuples = 0;
 		fsstate->next_tuple = 0;
 		fsstate->eof_reached = false;
@@ -1580,6 +2063,12 @@ postgresReScanForeignScan(ForeignScanState *node)
 		return;
 	}
 
+	/*
+	 * The batch fetched ahead is of no use any more.  If the cursor was
+	 * moved for it, rewinding is the only way back to the start.
+	 */
+	moved = fsstate->prefetch_sent || fsstate->prefetch_ready;
+	discard_prefetch(node);
 
 	/*
 	 * If any internal parameters affecting this node have changed, we'd
@@ -1593,7 +2082,7 @@ postgresReScanForeignScan(ForeignScanState *node)
 		snprintf(sql, sizeof(sql), "CLOSE c%u",
 				 fsstate->cursor_number);
 	}
-	else if (fsstate->fetch_ct_2 > 1)
+	else if (fsstate->fetch_ct_2 > 1 || moved)
 	{
 		snprintf(sql, sizeof(sql), "MOVE BACKWARD ALL IN c%u",
 				 fsstate->cursor_number);
@@ -1609,7 +2098,7 @@ postgresReScanForeignScan(ForeignScanState *node)
 	 * We don't use a PG_TRY block here, so be careful not to throw error
 	 * without releasing the PGresult.
 	 */
-	res = pgfdw_exec_query(fsstate->conn, sql);
+	res = pgfdw_exec_query(fsstate->conn, sql, fsstate->conn_state);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK)
 		pgfdw_report_error(ERROR, res, fsstate->conn, true, sql);
 	PQclear(res);
@@ -1637,8 +2126,12 @@ postgresEndForeignScan(ForeignScanState *node)
 
 	/* Close the cursor if open, to prevent accumulation of cursors */
 	if (fsstate->cursor_exists && fsstate->cache_timeout == 0) {
-		close_cursor(fsstate->conn, fsstate->cursor_number);
+		discard_prefetch(node);
+		close_cursor(fsstate->conn, fsstate->cursor_number,
+					 fsstate->conn_state);
 	}
+	cache_close_reader(fsstate);
+	cache_end_remote(node);
 
 	/* Release remote connection */
 	ReleaseConnection(fsstate->conn);
@@ -1647,6 +2140,85 @@ postgresEndForeignScan(ForeignScanState *node)
 	/* MemoryContexts will be deleted automatically. */
 }
 
+/*
+ * postgresIsForeignScanParallelSafe
+ *		Can the foreign table be scanned in a parallel worker?
+ *
+ * Only if it is cached: a worker has a remote transaction, and so a remote
+ * snapshot, of its own, which is no worse than a cached result can be.  We
+ * are called before postgresGetForeignRelSize, so look the options up.
+ */
+static bool
+postgresIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel,
+								  RangeTblEntry *rte)
+{
+	PgFdwRelationInfo fpinfo;
+
+	memset(&fpinfo, 0, sizeof(fpinfo));
+	fpinfo.table = GetForeignTable(rte->relid);
+	fpinfo.server = GetForeignServer(fpinfo.table->serverid);
+	fpinfo.cache_timeout = 3600;
+
+	apply_server_options(&fpinfo);
+	apply_table_options(&fpinfo);
+
+	return fpinfo.cache_timeout > 0;
+}
+
+/*
+ * postgresEstimateDSMForeignScan
+ *		Size of the shared state of a parallel scan
+ */
+static Size
+postgresEstimateDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt)
+{
+	return sizeof(PgFdwParallelScan);
+}
+
+/*
+ * postgresInitializeDSMForeignScan
+ *		Set up the shared state of a parallel scan, in the leader
+ */
+static void
+postgresInitializeDSMForeignScan(ForeignScanState *node,
+								 ParallelContext *pcxt,
+								 void *coordinate)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	PgFdwParallelScan *pscan = (PgFdwParallelScan *) coordinate;
+
+	SpinLockInit(&pscan->mutex);
+	pg_atomic_init_u32(&pscan->next_chunk, 0);
+	cache_parallel_decide(node, pscan);
+	fsstate->pscan = pscan;
+}
+
+/*
+ * postgresReInitializeDSMForeignScan
+ *		Reset the shared state of a parallel scan for a rescan
+ */
+static void
+postgresReInitializeDSMForeignScan(ForeignScanState *node,
+								   ParallelContext *pcxt,
+								   void *coordinate)
+{
+	cache_parallel_decide(node, (PgFdwParallelScan *) coordinate);
+}
+
+/*
+ * postgresInitializeWorkerForeignScan
+ *		Attach a worker to the shared state of a parallel scan
+ */
+static void
+postgresInitializeWorkerForeignScan(ForeignScanState *node,
+									shm_toc *toc,
+									void *coordinate)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+
+	fsstate->pscan = (PgFdwParallelScan *) coordinate;
+}
+
 /*
  * postgresAddForeignUpdateTargets
  *		Add resjunk column(s) needed for update/delete on a foreign table
@@ -1703,6 +2275,7 @@ postgresPlanForeignModify(PlannerInfo *root,
 	List	   *returningList = NIL;
 	List	   *retrieved_attrs = NIL;
 	bool		doNothing = false;
+	int			values_end_len = -1;
 
 	initStringInfo(&sql);
 
@@ -1790,7 +2363,7 @@ postgresPlanForeignModify(PlannerInfo *root,
 			deparseInsertSql(&sql, rte, resultRelation, rel,
 							 targetAttrs, doNothing,
 							 withCheckOptionList, returningList,
-							 &retrieved_attrs);
+							 &retrieved_attrs, &values_end_len);
 			break;
 		case CMD_UPDATE:
 			deparseUpdateSql(&sql, rte, resultRelation, rel,
@@ -1814,10 +2387,11 @@ postgresPlanForeignModify(PlannerInfo *root,
 	 * Build the fdw_private list that will be available to the executor.
 	 * Items in the list must match enum FdwModifyPrivateIndex, above.
 	 */
-	return list_make4(makeString(sql.data),
+	return list_make5(makeString(sql.data),
 					  targetAttrs,
 					  makeInteger((retrieved_attrs != NIL)),
-					  retrieved_attrs);
+					  retrieved_attrs,
+					  makeInteger(values_end_len));
 }
 
 /*
@@ -1834,9 +2408,11 @@ postgresBeginForeignModify(ModifyTableState *mtstate,
 	PgFdwModifyState *fmstate;
 	char	   *query;
 	List	   *target_attrs;
+	int			values_end_len;
 	bool		has_returning;
 	List	   *retrieved_attrs;
 	RangeTblEntry *rte;
+	ModifyTable *plan = castNode(ModifyTable, mtstate->ps.plan);
 
 	/*
 	 * Do nothing in EXPLAIN (no ANALYZE) case.  resultRelInfo->ri_FdwState
@@ -1854,6 +2430,8 @@ postgresBeginForeignModify(ModifyTableState *mtstate,
 									FdwModifyPrivateHasReturning));
 	retrieved_attrs = (List *) list_nth(fdw_private,
 										FdwModifyPrivateRetrievedAttrs);
+	values_end_len = intVal(list_nth(fdw_private,
+									 FdwModifyPrivateLen));
 
 	/* Find RTE. */
 	rte = exec_rt_fetch(resultRelInfo->ri_RangeTableIndex,
@@ -1867,8 +2445,10 @@ postgresBeginForeignModify(ModifyTableState *mtstate,
 									mtstate->mt_plans[subplan_index]->plan,
 									query,
 									target_attrs,
+									values_end_len,
 									has_returning,
-									retrieved_attrs);
+									retrieved_attrs,
+									plan->onConflictAction == ONCONFLICT_NOTHING);
 
 	resultRelInfo->ri_FdwState = fmstate;
 }
@@ -1967,6 +2547,7 @@ postgresBeginForeignInsert(ModifyTableState *mtstate,
 	List	   *targetAttrs = NIL;
 	List	   *retrieved_attrs = NIL;
 	bool		doNothing = false;
+	int			values_end_len;
 
 	/*
 	 * If the foreign table we are about to insert routed rows into is also an
@@ -2039,7 +2620,7 @@ postgresBeginForeignInsert(ModifyTableState *mtstate,
 	deparseInsertSql(&sql, rte, resultRelation, rel, targetAttrs, doNothing,
 					 resultRelInfo->ri_WithCheckOptions,
 					 resultRelInfo->ri_returningList,
-					 &retrieved_attrs);
+					 &retrieved_attrs, &values_end_len);
 
 	/* Construct an execution state. */
 	fmstate = create_foreign_modify(mtstate->ps.state,
@@ -2049,8 +2630,10 @@ postgresBeginForeignInsert(ModifyTableState *mtstate,
 									NULL,
 									sql.data,
 									targetAttrs,
+									values_end_len,
 									retrieved_attrs != NIL,
-									retrieved_attrs);
+									retrieved_attrs,
+									doNothing);
 
 	/*
 	 * If the given resultRelInfo already has PgFdwModifyState set, it means
@@ -2411,7 +2994,7 @@ postgresBeginDirectModify(ForeignScanState *node, int eflags)
 	 * Get connection to the foreign server.  Connection manager will
 	 * establish new connection if necessary.
 	 */
-	dmstate->conn = GetConnection(user, false);
+	dmstate->conn = GetConnection(user, false, &dmstate->conn_state);
 
 	/* Update the foreign-join-related fields. */
 	if (fsplan->scan.scanrelid == 0)
@@ -2654,6 +3237,14 @@ postgresExplainForeignScan(ForeignScanState *node, ExplainState *es)
 		sql = strVal(list_nth(fdw_private, FdwScanPrivateSelectSql));
 		ExplainPropertyText("Remote SQL", sql, es);
 	}
+
+	/*
+	 * Add what the cache did, when ANALYZE option is specified.  fdw_state
+	 * is NULL if the scan did not run.
+	 */
+	if (es->analyze && node->fdw_state &&
+		((PgFdwScanState *) node->fdw_state)->cache_timeout > 0)
+		cache_explain((PgFdwScanState *) node->fdw_state, es);
 }
 
 /*
@@ -2673,6 +3264,18 @@ postgresExplainForeignModify(ModifyTableState *mtstate,
 										  FdwModifyPrivateUpdateSql));
 
 		ExplainPropertyText("Remote SQL", sql, es);
+
+		/* Only known once the modify has begun, with ANALYZE */
+		if (rinfo->ri_FdwState &&
+			((PgFdwModifyState *) rinfo->ri_FdwState)->batch_size > 1)
+			ExplainPropertyInteger("Batch Size", NULL,
+								   ((PgFdwModifyState *) rinfo->ri_FdwState)->batch_size,
+								   es);
+		if (rinfo->ri_FdwState &&
+			((PgFdwModifyState *) rinfo->ri_FdwState)->copy_query)
+			ExplainPropertyText("Remote COPY",
+								((PgFdwModifyState *) rinfo->ri_FdwState)->copy_query,
+								es);
 	}
 }
 
@@ -2722,6 +3325,7 @@ estimate_path_cost_size(PlannerInfo *root,
 	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) foreignrel->fdw_private;
 	double		rows;
 	double		retrieved_rows;
+	double		cached_rows;
 	int			width;
 	Cost		startup_cost;
 	Cost		total_cost;
@@ -2742,6 +3346,7 @@ estimate_path_cost_size(PlannerInfo *root,
 		List	   *local_param_join_conds;
 		StringInfoData sql;
 		PGconn	   *conn;
+		PgFdwConnState *conn_state;
 		Selectivity local_sel;
 		QualCost	local_cost;
 		List	   *fdw_scan_tlist = NIL;
@@ -2785,8 +3390,8 @@ estimate_path_cost_size(PlannerInfo *root,
 								false, &retrieved_attrs, NULL);
 
 		/* Get the remote estimate */
-		conn = GetConnection(fpinfo->user, false);
-		get_remote_estimate(sql.data, conn, &rows, &width,
+		conn = GetConnection(fpinfo->user, false, &conn_state);
+		get_remote_estimate(sql.data, conn, conn_state, &rows, &width,
 							&startup_cost, &total_cost);
 		ReleaseConnection(conn);
 
@@ -3178,15 +3783,40 @@ estimate_path_cost_size(PlannerInfo *root,
 	}
 
 	/*
-	 * Add some additional cost factors to account for connection overhead
-	 * (fdw_startup_cost), transferring data across the network
-	 * (fdw_tuple_cost per retrieved row), and local manipulation of the data
-	 * (cpu_tuple_cost per retrieved row).
+	 * If a fresh cached result of this very query is in FDB, the scan reads
+	 * it instead of querying the foreign server: its row count is exact, and
+	 * it costs an FDB lookup (cache_startup_cost), reading and decoding each
+	 * row (cache_tuple_cost), and the local work on the rows.  The estimates
+	 * cached above stay those of the remote query, which is what a remote
+	 * join or sort involving this relation would run.
 	 */
-	startup_cost += fpinfo->fdw_startup_cost;
-	total_cost += fpinfo->fdw_startup_cost;
-	total_cost += fpinfo->fdw_tuple_cost * retrieved_rows;
-	total_cost += cpu_tuple_cost * retrieved_rows;
+	if (pathkeys == NIL && param_join_conds == NIL &&
+		(cached_rows = cache_plan_rows(root, foreignrel, fpextra)) >= 0)
+	{
+		retrieved_rows = clamp_row_est(cached_rows);
+		rows = clamp_row_est(retrieved_rows * fpinfo->local_conds_sel);
+
+		startup_cost = fpinfo->cache_startup_cost;
+		startup_cost += fpinfo->local_conds_cost.startup;
+		startup_cost += foreignrel->reltarget->cost.startup;
+		total_cost = startup_cost;
+		total_cost += (fpinfo->cache_tuple_cost + cpu_tuple_cost +
+					   fpinfo->local_conds_cost.per_tuple) * retrieved_rows;
+		total_cost += foreignrel->reltarget->cost.per_tuple * rows;
+	}
+	else
+	{
+		/*
+		 * Add some additional cost factors to account for connection
+		 * overhead (fdw_startup_cost), transferring data across the network
+		 * (fdw_tuple_cost per retrieved row), and local manipulation of the
+		 * data (cpu_tuple_cost per retrieved row).
+		 */
+		startup_cost += fpinfo->fdw_startup_cost;
+		total_cost += fpinfo->fdw_startup_cost;
+		total_cost += fpinfo->fdw_tuple_cost * retrieved_rows;
+		total_cost += cpu_tuple_cost * retrieved_rows;
+	}
 
 	/*
 	 * If we have LIMIT, we should prefer performing the restriction remotely
@@ -3225,7 +3855,7 @@ estimate_path_cost_size(PlannerInfo *root,
  */
 static void
 get_remote_estimate(const char *sql, PGconn *conn,
-					double *rows, int *width,
+					PgFdwConnState *conn_state, double *rows, int *width,
 					Cost *startup_cost, Cost *total_cost)
 {
 	PGresult   *volatile res = NULL;
@@ -3240,7 +3870,7 @@ get_remote_estimate(const char *sql, PGconn *conn,
 		/*
 		 * Execute EXPLAIN remotely.
 		 */
-		res = pgfdw_exec_query(conn, sql);
+		res = pgfdw_exec_query(conn, sql, conn_state);
 		if (PQresultStatus(res) != PGRES_TUPLES_OK)
 			pgfdw_report_error(ERROR, res, conn, false, sql);
 
@@ -3389,8 +4019,14 @@ create_cursor(ForeignScanState *node)
 
 	/* Construct the DECLARE CURSOR command */
 	initStringInfo(&buf);
-	appendStringInfo(&buf, "DECLARE c%u CURSOR FOR\n%s",
-					 fsstate->cursor_number, fsstate->query);
+	appendStringInfo(&buf, "DECLARE c%u%s CURSOR FOR\n%s",
+					 fsstate->cursor_number,
+					 fsstate->attrecvmeta ? " BINARY" : "",
+					 fsstate->query);
+
+	/* First, process a pending asynchronous request, if any. */
+	if (fsstate->conn_state->pendingScan)
+		process_pending_request(fsstate->conn_state->pendingScan);
 
 	/*
 	 * Notice that we pass NULL for paramTypes, thus forcing the remote server
@@ -3428,6 +4064,13 @@ create_cursor(ForeignScanState *node)
 
 /*
  * Fetch some more rows from the node's cursor.
+ *
+ * Once a scan asks for its second batch it is likely to want them all, so
+ * from then on the FETCH of the next batch is sent as soon as a batch is
+ * handed over, and its result collected when that batch is done with (or
+ * when something else needs the connection, see process_pending_request).
+ * The remote server works on the next batch, and the network carries it,
+ * while we process the current one.
  */
 static void
 fetch_more_data(ForeignScanState *node)
@@ -3435,92 +4078,278 @@ fetch_more_data(ForeignScanState *node)
 	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
 	PGresult   *volatile res = NULL;
 	MemoryContext oldcontext;
+	int64_t		start;
 
-	/*
-	 * We'll store the tuples in the batch_cxt.  First, flush the previous
-	 * batch.
-	 */
-	fsstate->tuples = NULL;
-	MemoryContextReset(fsstate->batch_cxt);
-	oldcontext = MemoryContextSwitchTo(fsstate->batch_cxt);
+	/* Cache hits are streamed from the cache reader instead. */
+	if (fsstate->cache_rd)
+		return cache_fetch_more_data(node);
 
-	/* PGresult must be released before leaving this function. */
-	PG_TRY();
+	start = get_ts();
+
+	/* Collect the batch sent for ahead, if it is still on its way. */
+	if (fsstate->prefetch_sent)
 	{
-		PGconn	   *conn = fsstate->conn;
-		char		sql[64];
-		int			numrows;
-		int			i;
+		/* Abort cleanup of a subtransaction cancels it, see connection.c */
+		if (fsstate->conn_state->pendingScan != node)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_ERROR),
+					 errmsg("fetch from foreign scan was cancelled by a subtransaction abort")));
+		process_pending_request(node);
+	}
 
-		snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
-				 fsstate->fetch_size, fsstate->cursor_number);
+	if (fsstate->prefetch_ready)
+	{
+		MemoryContext cxt = fsstate->batch_cxt;
 
-		res = pgfdw_exec_query(conn, sql);
-		/* On error, report the original query, not the FETCH. */
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			pgfdw_report_error(ERROR, res, conn, false, fsstate->query);
+		/* The next batch becomes current, and the current one is flushed. */
+		fsstate->batch_cxt = fsstate->prefetch_cxt;
+		fsstate->prefetch_cxt = cxt;
+		MemoryContextReset(fsstate->prefetch_cxt);
 
-		/* Convert the data into HeapTuples */
-		numrows = PQntuples(res);
-		fsstate->tuples = (HeapTuple *) palloc0(numrows * sizeof(HeapTuple));
-		fsstate->num_tuples = numrows;
+		fsstate->tuples = fsstate->prefetch_tuples;
+		fsstate->num_tuples = fsstate->prefetch_num;
 		fsstate->next_tuple = 0;
+		fsstate->prefetch_tuples = NULL;
+		fsstate->prefetch_num = 0;
+		fsstate->prefetch_ready = false;
+
+		/* Must be EOF if we didn't get as many tuples as we asked for. */
+		fsstate->eof_reached = (fsstate->num_tuples < fsstate->fetch_size);
+	}
+	else
+	{
+		/*
+		 * We'll store the tuples in the batch_cxt.  First, flush the previous
+		 * batch.
+		 */
+		fsstate->tuples = NULL;
+		MemoryContextReset(fsstate->batch_cxt);
+		oldcontext = MemoryContextSwitchTo(fsstate->batch_cxt);
 
-		for (i = 0; i < numrows; i++)
+		/* PGresult must be released before leaving this function. */
+		PG_TRY();
 		{
-			Assert(IsA(node->ss.ps.plan, ForeignScan));
-
-			fsstate->tuples[i] =
-				make_tuple_from_result_row(res, i,
-										   fsstate->rel,
-										   fsstate->attinmeta,
-										   fsstate->retrieved_attrs,
-										   node,
-										   fsstate->temp_cxt);
-		}
+			PGconn	   *conn = fsstate->conn;
+			char		sql[64];
 
-		/* Update fetch_ct_2 */
-		if (fsstate->fetch_ct_2 < 2)
-			fsstate->fetch_ct_2++;
+			snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
+					 fsstate->fetch_size, fsstate->cursor_number);
 
-		/* Must be EOF if we didn't get as many tuples as we asked for. */
-		fsstate->eof_reached = (numrows < fsstate->fetch_size);
+			res = pgfdw_exec_query(conn, sql, fsstate->conn_state);
+			/* On error, report the original query, not the FETCH. */
+			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+				pgfdw_report_error(ERROR, res, conn, false, fsstate->query);
+
+			fsstate->num_tuples = fetch_result_tuples(node, res,
+													  &fsstate->tuples);
+			fsstate->next_tuple = 0;
+
+			/* Update fetch_ct_2 */
+			if (fsstate->fetch_ct_2 < 2)
+				fsstate->fetch_ct_2++;
+
+			/* Must be EOF if we didn't get as many tuples as we asked for. */
+			fsstate->eof_reached = (fsstate->num_tuples < fsstate->fetch_size);
+		}
+		PG_FINALLY();
+		{
+			if (res)
+				PQclear(res);
+		}
+		PG_END_TRY();
+
+		MemoryContextSwitchTo(oldcontext);
 	}
-	PG_FINALLY();
+
+	/* A cached scan gone remote, see cache_create_cursor. */
+	if (fsstate->cache_remote)
+		cache_remote_batch(node, get_ts() - start);
+
+	/* Send for the next batch. */
+	if (!fsstate->eof_reached && fsstate->fetch_ct_2 > 1 &&
+		fsstate->cache_timeout == 0)
+		fetch_more_data_begin(node);
+}
+
+/*
+ * Convert the rows of FETCH result res into HeapTuples, allocated in the
+ * current memory context, and return how many there are.
+ */
+static int
+fetch_result_tuples(ForeignScanState *node, PGresult *res,
+					HeapTuple **tuples)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	int			numrows = PQntuples(res);
+	int			i;
+
+	*tuples = (HeapTuple *) palloc0(numrows * sizeof(HeapTuple));
+	for (i = 0; i < numrows; i++)
 	{
-		if (res)
-			PQclear(res);
+		Assert(IsA(node->ss.ps.plan, ForeignScan));
+
+		(*tuples)[i] =
+			make_tuple_from_result_row(res, i,
+									   fsstate->rel,
+									   fsstate->attinmeta,
+									   fsstate->attrecvmeta,
+									   fsstate->retrieved_attrs,
+									   node,
+									   fsstate->temp_cxt);
 	}
-	PG_END_TRY();
-
-	MemoryContextSwitchTo(oldcontext);
+	return numrows;
 }
 
 /*
- * Force assorted GUC parameters to settings that ensure that we'll output
- * data values in a form that is unambiguous to the remote server.
- *
- * This is rather expensive and annoying to do once per row, but there's
- * little choice if we want to be sure values are transmitted accurately;
- * we can't leave the settings in place between rows for fear of affecting
- * user-visible computations.
- *
- * We use the equivalent of a function SET option to allow the settings to
- * persist only until the caller calls reset_transmission_modes().  If an
- * error is thrown in between, guc.c will take care of undoing the settings.
- *
- * The return value is the nestlevel that must be passed to
- * reset_transmission_modes() to undo things.
+ * Send the FETCH of the next batch of node's cursor, without waiting for the
+ * result.  Until that is collected, nothing else can be sent on the
+ * connection, so we register as its pending scan.
  */
-int
-set_transmission_modes(void)
+static void
+fetch_more_data_begin(ForeignScanState *node)
 {
-	int			nestlevel = NewGUCNestLevel();
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	char		sql[64];
 
-	/*
-	 * The values set here should match what pg_dump does.  See also
-	 * configure_remote_session in connection.c.
-	 */
+	Assert(!fsstate->prefetch_sent && !fsstate->prefetch_ready);
+	Assert(fsstate->conn_state->pendingScan == NULL);
+
+	snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
+			 fsstate->fetch_size, fsstate->cursor_number);
+
+	if (!PQsendQuery(fsstate->conn, sql))
+		pgfdw_report_error(ERROR, NULL, fsstate->conn, false, fsstate->query);
+
+	fsstate->prefetch_sent = true;
+	fsstate->conn_state->pendingScan = node;
+}
+
+/*
+ * Declare node's cursor and send the FETCH of its first batch, without
+ * waiting for either, at executor startup.  The result is collected as a
+ * batch fetched ahead, see process_pending_request.  Only for scans without
+ * parameters, whose query is known before they are run.
+ */
+static void
+create_cursor_begin(ForeignScanState *node)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	StringInfoData buf;
+
+	Assert(fsstate->numParams == 0 && !fsstate->cursor_exists);
+	Assert(fsstate->conn_state->pendingScan == NULL);
+
+	/* One round trip for both, the FETCH is skipped if DECLARE fails */
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "DECLARE c%u%s CURSOR FOR\n%s;\nFETCH %d FROM c%u",
+					 fsstate->cursor_number,
+					 fsstate->attrecvmeta ? " BINARY" : "",
+					 fsstate->query,
+					 fsstate->fetch_size, fsstate->cursor_number);
+
+	if (!PQsendQuery(fsstate->conn, buf.data))
+		pgfdw_report_error(ERROR, NULL, fsstate->conn, false, fsstate->query);
+	pfree(buf.data);
+
+	fsstate->cursor_exists = true;
+	fsstate->prefetch_sent = true;
+	fsstate->conn_state->pendingScan = node;
+}
+
+/*
+ * Collect the result of the FETCH sent by fetch_more_data_begin into the
+ * next batch of node, which frees the connection for other commands.
+ * Whoever sends anything on a connection calls this first if the
+ * connection has a pending scan.
+ */
+void
+process_pending_request(ForeignScanState *node)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	PGresult   *volatile res = NULL;
+	MemoryContext oldcontext;
+
+	Assert(fsstate->prefetch_sent);
+	Assert(fsstate->conn_state->pendingScan == node);
+
+	/* Whatever happens below, the FETCH is no longer pending. */
+	fsstate->conn_state->pendingScan = NULL;
+	fsstate->prefetch_sent = false;
+
+	oldcontext = MemoryContextSwitchTo(fsstate->prefetch_cxt);
+
+	/* PGresult must be released before leaving this function. */
+	PG_TRY();
+	{
+		/* Also the last result of create_cursor_begin, that of the FETCH */
+		res = pgfdw_get_result(fsstate->conn, fsstate->query);
+		/* On error, report the original query, not the FETCH. */
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			pgfdw_report_error(ERROR, res, fsstate->conn, false,
+							   fsstate->query);
+
+		fsstate->prefetch_num = fetch_result_tuples(node, res,
+													&fsstate->prefetch_tuples);
+		fsstate->prefetch_ready = true;
+
+		/* Update fetch_ct_2, the cursor has moved */
+		if (fsstate->fetch_ct_2 < 2)
+			fsstate->fetch_ct_2++;
+	}
+	PG_FINALLY();
+	{
+		if (res)
+			PQclear(res);
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Drop the next batch of node, collecting it first if it is on its way,
+ * before the cursor is moved or closed.
+ */
+static void
+discard_prefetch(ForeignScanState *node)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+
+	if (fsstate->prefetch_sent && fsstate->conn_state->pendingScan == node)
+		process_pending_request(node);
+
+	fsstate->prefetch_sent = false;
+	fsstate->prefetch_ready = false;
+	fsstate->prefetch_tuples = NULL;
+	fsstate->prefetch_num = 0;
+	MemoryContextReset(fsstate->prefetch_cxt);
+}
+
+/*
+ * Force assorted GUC parameters to settings that ensure that we'll output
+ * data values in a form that is unambiguous to the remote server.
+ *
+ * This is rather expensive and annoying to do once per row, but there's
+ * little choice if we want to be sure values are transmitted accurately;
+ * we can't leave the settings in place between rows for fear of affecting
+ * user-visible computations.
+ *
+ * We use the equivalent of a function SET option to allow the settings to
+ * persist only until the caller calls reset_transmission_modes().  If an
+ * error is thrown in between, guc.c will take care of undoing the settings.
+ *
+ * The return value is the nestlevel that must be passed to
+ * reset_transmission_modes() to undo things.
+ */
+int
+set_transmission_modes(void)
+{
+	int			nestlevel = NewGUCNestLevel();
+
+	/*
+	 * The values set here should match what pg_dump does.  See also
+	 * configure_remote_session in connection.c.
+	 */
 	if (DateStyle != USE_ISO_DATES)
 		(void) set_config_option("datestyle", "ISO",
 								 PGC_USERSET, PGC_S_SESSION,
@@ -3550,7 +4379,8 @@ reset_transmission_modes(int nestlevel)
  * Utility routine to close a cursor.
  */
 static void
-close_cursor(PGconn *conn, unsigned int cursor_number)
+close_cursor(PGconn *conn, unsigned int cursor_number,
+			 PgFdwConnState *conn_state)
 {
 	char		sql[64];
 	PGresult   *res;
@@ -3561,7 +4391,7 @@ close_cursor(PGconn *conn, unsigned int cursor_number)
 	 * We don't use a PG_TRY block here, so be careful not to throw error
 	 * without releasing the PGresult.
 	 */
-	res = pgfdw_exec_query(conn, sql);
+	res = pgfdw_exec_query(conn, sql, conn_state);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK)
 		pgfdw_report_error(ERROR, res, conn, true, sql);
 	PQclear(res);
@@ -3580,8 +4410,10 @@ create_foreign_modify(EState *estate,
 					  Plan *subplan,
 					  char *query,
 					  List *target_attrs,
+					  int values_end_len,
 					  bool has_returning,
-					  List *retrieved_attrs)
+					  List *retrieved_attrs,
+					  bool doNothing)
 {
 	PgFdwModifyState *fmstate;
 	Relation	rel = resultRelInfo->ri_RelationDesc;
@@ -3609,7 +4441,7 @@ create_foreign_modify(EState *estate,
 	user = GetUserMapping(userid, table->serverid);
 
 	/* Open connection; report that we'll create a prepared statement. */
-	fmstate->conn = GetConnection(user, true);
+	fmstate->conn = GetConnection(user, true, &fmstate->conn_state);
 	fmstate->p_name = NULL;		/* prepared statement not made yet */
 
 	/* Set up remote query information. */
@@ -3666,6 +4498,131 @@ create_foreign_modify(EState *estate,
 
 	Assert(fmstate->p_nums <= n_params);
 
+	/*
+	 * Inserts can be sent batch_size rows at a time, in one multi-row INSERT,
+	 * or streamed through a remote COPY, if nothing needs to know about a row
+	 * before it is sent: no RETURNING (which AFTER ROW triggers and WITH
+	 * CHECK OPTIONs also need), no AFTER STATEMENT triggers, that fire before
+	 * we send the last rows, and no ON CONFLICT DO NOTHING, for the count of
+	 * rows inserted.  A batch must also fit in the protocol's limit on
+	 * parameters.
+	 */
+	fmstate->batch_size = 1;
+	if (operation == CMD_INSERT && !has_returning && !doNothing &&
+		fmstate->p_nums > 0 &&
+		!(rel->trigdesc && rel->trigdesc->trig_insert_after_statement))
+	{
+		int			batch_size;
+		bool		use_remote_copy;
+		bool		use_binary_format;
+
+		get_modify_options(rel, &batch_size, &use_remote_copy,
+						   &use_binary_format);
+		if (use_remote_copy)
+		{
+			StringInfoData sql;
+			bool		binary = use_binary_format;
+
+			foreach(lc, fmstate->target_attrs)
+			{
+				int			attnum = lfirst_int(lc);
+
+				binary = binary &&
+					binary_safe_type(TupleDescAttr(tupdesc, attnum - 1)->atttypid);
+			}
+
+			initStringInfo(&sql);
+			deparseCopyFromSql(&sql, rte, resultRelInfo->ri_RangeTableIndex,
+							   rel, fmstate->target_attrs, binary);
+			fmstate->copy_query = sql.data;
+			initStringInfo(&fmstate->copy_buf);
+
+			if (binary)
+			{
+				int			i = 0;
+
+				fmstate->copy_sendfuncs = (FmgrInfo *)
+					palloc0(sizeof(FmgrInfo) * fmstate->p_nums);
+				foreach(lc, fmstate->target_attrs)
+				{
+					int			attnum = lfirst_int(lc);
+
+					getTypeBinaryOutputInfo(TupleDescAttr(tupdesc, attnum - 1)->atttypid,
+											&typefnoid, &isvarlena);
+					fmgr_info(typefnoid, &fmstate->copy_sendfuncs[i++]);
+				}
+			}
+		}
+		else
+			fmstate->batch_size = Min(batch_size,
+									  PGC_QUERY_PARAM_MAX / fmstate->p_nums);
+	}
+
+	/*
+	 * Updates and deletes can likewise be sent batch_size rows at a time, as
+	 * one statement over arrays of ctids and new values, if there is no
+	 * RETURNING and no AFTER STATEMENT trigger.  The parameters are one array
+	 * per column whatever the number of rows.
+	 */
+	if ((operation == CMD_UPDATE || operation == CMD_DELETE) &&
+		!has_returning &&
+		(operation == CMD_DELETE || fmstate->p_nums > 1) &&
+		!(rel->trigdesc &&
+		  (operation == CMD_UPDATE ?
+		   rel->trigdesc->trig_update_after_statement :
+		   rel->trigdesc->trig_delete_after_statement)))
+	{
+		int			batch_size;
+		bool		use_remote_copy;
+		bool		use_binary_format;
+
+		get_modify_options(rel, &batch_size, &use_remote_copy,
+						   &use_binary_format);
+		if (batch_size > 1)
+		{
+			StringInfoData sql;
+
+			initStringInfo(&sql);
+			if (operation == CMD_UPDATE)
+				deparseBatchUpdateSql(&sql, rte,
+									  resultRelInfo->ri_RangeTableIndex,
+									  rel, fmstate->target_attrs);
+			else
+				deparseBatchDeleteSql(&sql, rel);
+			fmstate->orig_query = query;
+			fmstate->query = sql.data;
+			fmstate->batch_by_ctid = true;
+			fmstate->batch_size = batch_size;
+		}
+	}
+
+	if (fmstate->batch_size > 1 && fmstate->batch_by_ctid)
+	{
+		fmstate->batch_values = (const char **)
+			palloc(sizeof(char *) * fmstate->p_nums * fmstate->batch_size);
+		fmstate->batch_ctids = (ItemPointerData *)
+			palloc(sizeof(ItemPointerData) * fmstate->batch_size);
+		fmstate->batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
+												   "pgc_fdw modify batch",
+												   ALLOCSET_DEFAULT_SIZES);
+	}
+	else if (fmstate->batch_size > 1)
+	{
+		StringInfoData sql;
+
+		fmstate->orig_query = query;
+		fmstate->values_end_len = values_end_len;
+		initStringInfo(&sql);
+		rebuildInsertSql(&sql, query, values_end_len, fmstate->p_nums,
+						 fmstate->batch_size);
+		fmstate->query = sql.data;
+		fmstate->batch_values = (const char **)
+			palloc(sizeof(char *) * fmstate->p_nums * fmstate->batch_size);
+		fmstate->batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
+												   "pgc_fdw insert batch",
+												   ALLOCSET_DEFAULT_SIZES);
+	}
+
 	/* Initialize auxiliary state */
 	fmstate->aux_fmstate = NULL;
 
@@ -3696,9 +4653,12 @@ execute_foreign_modify(EState *estate,
 		   operation == CMD_UPDATE ||
 		   operation == CMD_DELETE);
 
-	/* Set up the prepared statement on the remote server, if we didn't yet */
-	if (!fmstate->p_name)
-		prepare_foreign_modify(fmstate);
+	cache_note_modified(RelationGetRelid(fmstate->rel));
+
+	if (fmstate->copy_query)
+		return copy_foreign_insert(fmstate, slot);
+	if (fmstate->batch_size > 1 && operation == CMD_INSERT)
+		return batch_foreign_insert(fmstate, slot);
 
 	/*
 	 * For UPDATE/DELETE, get the ctid that was passed up as a resjunk column
@@ -3715,11 +4675,22 @@ execute_foreign_modify(EState *estate,
 		if (isNull)
 			elog(ERROR, "ctid is NULL");
 		ctid = (ItemPointer) DatumGetPointer(datum);
+
+		if (fmstate->batch_by_ctid)
+			return batch_foreign_modify(fmstate, ctid, slot);
 	}
 
+	/* Set up the prepared statement on the remote server, if we didn't yet */
+	if (!fmstate->p_name)
+		prepare_foreign_modify(fmstate);
+
 	/* Convert parameters needed by prepared statement to text form */
 	p_values = convert_prep_stmt_params(fmstate, ctid, slot);
 
+	/* First, process a pending asynchronous request, if any. */
+	if (fmstate->conn_state->pendingScan)
+		process_pending_request(fmstate->conn_state->pendingScan);
+
 	/*
 	 * Execute the prepared statement.
 	 */
@@ -3765,34 +4736,93 @@ execute_foreign_modify(EState *estate,
 }
 
 /*
- * prepare_foreign_modify
- *		Establish a prepared statement for execution of INSERT/UPDATE/DELETE
+ * batch_foreign_insert
+ *		Add a row to the batch of a batched insert, sending the batch when it
+ *		is full
+ *
+ * The row is reported inserted right away; an error inserting it is only
+ * raised when its batch is sent.
+ */
+static TupleTableSlot *
+batch_foreign_insert(PgFdwModifyState *fmstate, TupleTableSlot *slot)
+{
+	const char **p_values;
+	const char **dst;
+	MemoryContext oldcontext;
+	int			i;
+
+	p_values = convert_prep_stmt_params(fmstate, NULL, slot);
+
+	oldcontext = MemoryContextSwitchTo(fmstate->batch_cxt);
+	dst = fmstate->batch_values + fmstate->num_batched * fmstate->p_nums;
+	for (i = 0; i < fmstate->p_nums; i++)
+		dst[i] = p_values[i] ? pstrdup(p_values[i]) : NULL;
+	MemoryContextSwitchTo(oldcontext);
+
+	MemoryContextReset(fmstate->temp_cxt);
+
+	if (++fmstate->num_batched == fmstate->batch_size)
+		flush_foreign_insert(fmstate);
+
+	return slot;
+}
+
+/*
+ * flush_foreign_insert
+ *		Send the rows of a batched insert not sent yet, if any
+ *
+ * A full batch goes through the prepared multi-row statement, the last
+ * partial one through an unnamed statement of its own size.
  */
 static void
-prepare_foreign_modify(PgFdwModifyState *fmstate)
+flush_foreign_insert(PgFdwModifyState *fmstate)
 {
-	char		prep_name[NAMEDATALEN];
-	char	   *p_name;
+	int			nrows = fmstate->num_batched;
+	StringInfoData sql;
 	PGresult   *res;
 
-	/* Construct name we'll use for the prepared statement. */
-	snprintf(prep_name, sizeof(prep_name), "pgsql_fdw_prep_%u",
-			 GetPrepStmtNumber(fmstate->conn));
-	p_name = pstrdup(prep_name);
+	if (nrows == 0)
+		return;
 
-	/*
-	 * We intentionally do not specify parameter types here, but leave the
-	 * remote server to derive them by default.  This avoids possible problems
-	 * with the remote server using different type OIDs than we do.  All of
-	 * the prepared statements we use in this module are simple enough that
-	 * the remote server will make the right choices.
-	 */
-	if (!PQsendPrepare(fmstate->conn,
-					   p_name,
-					   fmstate->query,
-					   0,
-					   NULL))
-		pgfdw_report_error(ERROR, NULL, fmstate->conn, false, fmstate->query);
+	/* Whatever happens below, these rows are done with. */
+	fmstate->num_batched = 0;
+
+	if (nrows == fmstate->batch_size && !fmstate->p_name)
+		prepare_foreign_modify(fmstate);
+
+	/* First, process a pending asynchronous request, if any. */
+	if (fmstate->conn_state->pendingScan)
+		process_pending_request(fmstate->conn_state->pendingScan);
+
+	if (nrows == fmstate->batch_size)
+	{
+		if (!PQsendQueryPrepared(fmstate->conn,
+								 fmstate->p_name,
+								 fmstate->p_nums * nrows,
+								 fmstate->batch_values,
+								 NULL,
+								 NULL,
+								 0))
+			pgfdw_report_error(ERROR, NULL, fmstate->conn, false,
+							   fmstate->query);
+	}
+	else
+	{
+		initStringInfo(&sql);
+		rebuildInsertSql(&sql, fmstate->orig_query, fmstate->values_end_len,
+						 fmstate->p_nums, nrows);
+		if (!PQsendQueryParams(fmstate->conn,
+							   sql.data,
+							   fmstate->p_nums * nrows,
+							   NULL,
+							   fmstate->batch_values,
+							   NULL,
+							   NULL,
+							   0))
+			pgfdw_report_error(ERROR, NULL, fmstate->conn, false,
+							   fmstate->orig_query);
+		pfree(sql.data);
+	}
 
 	/*
 	 * Get the result, and check for success.
@@ -3800,1323 +4830,2461 @@ prepare_foreign_modify(PgFdwModifyState *fmstate)
 	 * We don't use a PG_TRY block here, so be careful not to throw error
 	 * without releasing the PGresult.
 	 */
-	res = pgfdw_get_result(fmstate->conn, fmstate->query);
+	res = pgfdw_get_result(fmstate->conn, fmstate->orig_query);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK)
-		pgfdw_report_error(ERROR, res, fmstate->conn, true, fmstate->query);
+		pgfdw_report_error(ERROR, res, fmstate->conn, true,
+						   fmstate->orig_query);
 	PQclear(res);
 
-	/* This action shows that the prepare has been done. */
-	fmstate->p_name = p_name;
+	MemoryContextReset(fmstate->batch_cxt);
 }
 
 /*
- * convert_prep_stmt_params
- *		Create array of text strings representing parameter values
+ * batch_foreign_modify
+ *		Add a row to the batch of a batched update or delete, sending the
+ *		batch when it is full
  *
- * tupleid is ctid to send, or NULL if none
- * slot is slot to get remaining parameters from, or NULL if none
+ * As with inserts, the row is reported modified right away, even if it
+ * turns out to be gone on the remote end when its batch is sent.
  *
- * Data is constructed in temp_cxt; caller should reset that after use.
+ * A join can hand us the same row more than once.  Row by row, the first
+ * UPDATE or DELETE wins and the later ones find its ctid gone; in one
+ * statement over arrays, which of an UPDATE's values wins is undefined.
+ * So a ctid already in the batch is skipped, as the remote end would skip
+ * it once the batch is sent.
  */
-static const char **
-convert_prep_stmt_params(PgFdwModifyState *fmstate,
-						 ItemPointer tupleid,
-						 TupleTableSlot *slot)
+static TupleTableSlot *
+batch_foreign_modify(PgFdwModifyState *fmstate, ItemPointer ctid,
+					 TupleTableSlot *slot)
 {
 	const char **p_values;
-	int			pindex = 0;
+	const char **dst;
 	MemoryContext oldcontext;
+	int			i;
 
-	oldcontext = MemoryContextSwitchTo(fmstate->temp_cxt);
-
-	p_values = (const char **) palloc(sizeof(char *) * fmstate->p_nums);
-
-	/* 1st parameter should be ctid, if it's in use */
-	if (tupleid != NULL)
+	for (i = 0; i < fmstate->num_batched; i++)
 	{
-		/* don't need set_transmission_modes for TID output */
-		p_values[pindex] = OutputFunctionCall(&fmstate->p_flinfo[pindex],
-											  PointerGetDatum(tupleid));
-		pindex++;
+		if (ItemPointerEquals(&fmstate->batch_ctids[i], ctid))
+			return slot;
 	}
 
-	/* get following parameters from slot */
-	if (slot != NULL && fmstate->target_attrs != NIL)
-	{
-		int			nestlevel;
-		ListCell   *lc;
-
-		nestlevel = set_transmission_modes();
-
-		foreach(lc, fmstate->target_attrs)
-		{
-			int			attnum = lfirst_int(lc);
-			Datum		value;
-			bool		isnull;
-
-			value = slot_getattr(slot, attnum, &isnull);
-			if (isnull)
-				p_values[pindex] = NULL;
-			else
-				p_values[pindex] = OutputFunctionCall(&fmstate->p_flinfo[pindex],
-													  value);
-			pindex++;
-		}
+	p_values = convert_prep_stmt_params(fmstate, ctid, slot);
 
-		reset_transmission_modes(nestlevel);
-	}
+	oldcontext = MemoryContextSwitchTo(fmstate->batch_cxt);
+	dst = fmstate->batch_values + fmstate->num_batched * fmstate->p_nums;
+	for (i = 0; i < fmstate->p_nums; i++)
+		dst[i] = p_values[i] ? pstrdup(p_values[i]) : NULL;
+	MemoryContextSwitchTo(oldcontext);
+	fmstate->batch_ctids[fmstate->num_batched] = *ctid;
 
-	Assert(pindex == fmstate->p_nums);
+	MemoryContextReset(fmstate->temp_cxt);
 
-	MemoryContextSwitchTo(oldcontext);
+	if (++fmstate->num_batched == fmstate->batch_size)
+		flush_foreign_modify(fmstate);
 
-	return p_values;
+	return slot;
 }
 
 /*
- * store_returning_result
- *		Store the result of a RETURNING clause
+ * flush_foreign_modify
+ *		Send the rows of a batched update or delete not sent yet, if any
  *
- * On error, be sure to release the PGresult on the way out.  Callers do not
- * have PG_TRY blocks to ensure this happens.
+ * Whatever the number of rows, the statement has one array parameter per
+ * column, so the prepared statement serves the last, partial batch too.
  */
 static void
-store_returning_result(PgFdwModifyState *fmstate,
-					   TupleTableSlot *slot, PGresult *res)
+flush_foreign_modify(PgFdwModifyState *fmstate)
 {
-	PG_TRY();
-	{
-		HeapTuple	newtup;
+	int			nrows = fmstate->num_batched;
+	const char **p_values;
+	PGresult   *res;
+	int			i;
 
-		newtup = make_tuple_from_result_row(res, 0,
-											fmstate->rel,
-											fmstate->attinmeta,
-											fmstate->retrieved_attrs,
-											NULL,
-											fmstate->temp_cxt);
+	if (nrows == 0)
+		return;
 
-		/*
-		 * The returning slot will not necessarily be suitable to store
-		 * heaptuples directly, so allow for conversion.
-		 */
-		ExecForceStoreHeapTuple(newtup, slot, true);
-	}
-	PG_CATCH();
-	{
-		if (res)
-			PQclear(res);
-		PG_RE_THROW();
-	}
-	PG_END_TRY();
+	/* Whatever happens below, these rows are done with. */
+	fmstate->num_batched = 0;
+
+	if (!fmstate->p_name)
+		prepare_foreign_modify(fmstate);
+
+	p_values = (const char **) MemoryContextAlloc(fmstate->batch_cxt,
+												  sizeof(char *) * fmstate->p_nums);
+	for (i = 0; i < fmstate->p_nums; i++)
+		p_values[i] = batch_param_array(fmstate, nrows, i);
+
+	/* First, process a pending asynchronous request, if any. */
+	if (fmstate->conn_state->pendingScan)
+		process_pending_request(fmstate->conn_state->pendingScan);
+
+	if (!PQsendQueryPrepared(fmstate->conn,
+							 fmstate->p_name,
+							 fmstate->p_nums,
+							 p_values,
+							 NULL,
+							 NULL,
+							 0))
+		pgfdw_report_error(ERROR, NULL, fmstate->conn, false, fmstate->query);
+
+	/*
+	 * Get the result, and check for success.
+	 *
+	 * We don't use a PG_TRY block here, so be careful not to throw error
+	 * without releasing the PGresult.
+	 */
+	res = pgfdw_get_result(fmstate->conn, fmstate->query);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res, fmstate->conn, true, fmstate->query);
+	PQclear(res);
+
+	MemoryContextReset(fmstate->batch_cxt);
 }
 
 /*
- * finish_foreign_modify
- *		Release resources for a foreign insert/update/delete operation
+ * batch_param_array
+ *		Array literal of parameter i of the first nrows batched rows, in
+ *		batch_cxt
  */
-static void
-finish_foreign_modify(PgFdwModifyState *fmstate)
+static char *
+batch_param_array(PgFdwModifyState *fmstate, int nrows, int i)
 {
-	Assert(fmstate != NULL);
+	StringInfoData buf;
+	MemoryContext oldcontext;
+	int			row;
 
-	/* If we created a prepared statement, destroy it */
-	if (fmstate->p_name)
+	oldcontext = MemoryContextSwitchTo(fmstate->batch_cxt);
+	initStringInfo(&buf);
+	appendStringInfoChar(&buf, '{');
+	for (row = 0; row < nrows; row++)
 	{
-		char		sql[64];
-		PGresult   *res;
-
-		snprintf(sql, sizeof(sql), "DEALLOCATE %s", fmstate->p_name);
+		const char *val = fmstate->batch_values[row * fmstate->p_nums + i];
 
-		/*
-		 * We don't use a PG_TRY block here, so be careful not to throw error
-		 * without releasing the PGresult.
-		 */
-		res = pgfdw_exec_query(fmstate->conn, sql);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-			pgfdw_report_error(ERROR, res, fmstate->conn, true, sql);
-		PQclear(res);
-		fmstate->p_name = NULL;
+		if (row > 0)
+			appendStringInfoChar(&buf, ',');
+		if (val == NULL)
+		{
+			appendStringInfoString(&buf, "NULL");
+			continue;
+		}
+		appendStringInfoChar(&buf, '"');
+		for (; *val; val++)
+		{
+			if (*val == '"' || *val == '\\')
+				appendStringInfoChar(&buf, '\\');
+			appendStringInfoChar(&buf, *val);
+		}
+		appendStringInfoChar(&buf, '"');
 	}
+	appendStringInfoChar(&buf, '}');
+	MemoryContextSwitchTo(oldcontext);
 
-	/* Release remote connection */
-	ReleaseConnection(fmstate->conn);
-	fmstate->conn = NULL;
+	return buf.data;
 }
 
 /*
- * build_remote_returning
- *		Build a RETURNING targetlist of a remote query for performing an
- *		UPDATE/DELETE .. RETURNING on a join directly
+ * copy_foreign_insert
+ *		Add a row to the rows of an insert through a remote COPY, sending them
+ *		when there are enough
+ *
+ * Each send is a COPY of its own, so that the connection is free for other
+ * scans and modifications between rows.  As with batches, the row is
+ * reported inserted right away.
  */
-static List *
-build_remote_returning(Index rtindex, Relation rel, List *returningList)
+static TupleTableSlot *
+copy_foreign_insert(PgFdwModifyState *fmstate, TupleTableSlot *slot)
 {
-	bool		have_wholerow = false;
-	List	   *tlist = NIL;
-	List	   *vars;
-	ListCell   *lc;
-
-	Assert(returningList);
-
-	vars = pull_var_clause((Node *) returningList, PVC_INCLUDE_PLACEHOLDERS);
+	StringInfo	buf = &fmstate->copy_buf;
 
-	/*
-	 * If there's a whole-row reference to the target relation, then we'll
-	 * need all the columns of the relation.
-	 */
-	foreach(lc, vars)
+	if (fmstate->copy_sendfuncs)
 	{
-		Var		   *var = (Var *) lfirst(lc);
+		/* signature, flags and header extension length */
+		static const char header[19] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
+		uint16		nfields = pg_hton16((uint16) fmstate->p_nums);
+		MemoryContext oldcontext;
+		ListCell   *lc;
+		int			i = 0;
 
-		if (IsA(var, Var) &&
-			var->varno == rtindex &&
-			var->varattno == InvalidAttrNumber)
+		if (buf->len == 0)
+			appendBinaryStringInfo(buf, header, sizeof(header));
+		appendBinaryStringInfo(buf, (char *) &nfields, sizeof(nfields));
+
+		oldcontext = MemoryContextSwitchTo(fmstate->temp_cxt);
+		foreach(lc, fmstate->target_attrs)
 		{
-			have_wholerow = true;
-			break;
+			int			attnum = lfirst_int(lc);
+			Datum		value;
+			bool		isnull;
+			uint32		len;
+
+			value = slot_getattr(slot, attnum, &isnull);
+			if (isnull)
+			{
+				len = pg_hton32((uint32) -1);
+				appendBinaryStringInfo(buf, (char *) &len, sizeof(len));
+			}
+			else
+			{
+				bytea	   *outputbytes;
+
+				outputbytes = SendFunctionCall(&fmstate->copy_sendfuncs[i],
+											   value);
+				len = pg_hton32(VARSIZE(outputbytes) - VARHDRSZ);
+				appendBinaryStringInfo(buf, (char *) &len, sizeof(len));
+				appendBinaryStringInfo(buf, VARDATA(outputbytes),
+									   VARSIZE(outputbytes) - VARHDRSZ);
+			}
+			i++;
 		}
+		MemoryContextSwitchTo(oldcontext);
 	}
-
-	if (have_wholerow)
+	else
 	{
-		TupleDesc	tupdesc = RelationGetDescr(rel);
+		const char **p_values;
 		int			i;
 
-		for (i = 1; i <= tupdesc->natts; i++)
+		p_values = convert_prep_stmt_params(fmstate, NULL, slot);
+		for (i = 0; i < fmstate->p_nums; i++)
 		{
-			Form_pg_attribute attr = TupleDescAttr(tupdesc, i - 1);
-			Var		   *var;
-
-			/* Ignore dropped attributes. */
-			if (attr->attisdropped)
-				continue;
-
-			var = makeVar(rtindex,
-						  i,
-						  attr->atttypid,
-						  attr->atttypmod,
-						  attr->attcollation,
-						  0);
-
-			tlist = lappend(tlist,
-							makeTargetEntry((Expr *) var,
-											list_length(tlist) + 1,
-											NULL,
-											false));
+			if (i > 0)
+				appendStringInfoChar(buf, '\t');
+			if (p_values[i] == NULL)
+				appendStringInfoString(buf, "\\N");
+			else
+				copy_append_text(buf, p_values[i]);
 		}
+		appendStringInfoChar(buf, '\n');
 	}
 
-	/* Now add any remaining columns to tlist. */
-	foreach(lc, vars)
-	{
-		Var		   *var = (Var *) lfirst(lc);
-
-		/*
-		 * No need for whole-row references to the target relation.  We don't
-		 * need system columns other than ctid and oid either, since those are
-		 * set locally.
-		 */
-		if (IsA(var, Var) &&
-			var->varno == rtindex &&
-			var->varattno <= InvalidAttrNumber &&
-			var->varattno != SelfItemPointerAttributeNumber)
-			continue;			/* don't need it */
-
-		if (tlist_member((Expr *) var, tlist))
-			continue;			/* already got it */
-
-		tlist = lappend(tlist,
-						makeTargetEntry((Expr *) var,
-										list_length(tlist) + 1,
-										NULL,
-										false));
-	}
+	MemoryContextReset(fmstate->temp_cxt);
 
-	list_free(vars);
+	if (buf->len >= PGC_COPY_BUF_SIZE)
+		flush_foreign_copy(fmstate);
 
-	return tlist;
+	return slot;
 }
 
 /*
- * rebuild_fdw_scan_tlist
- *		Build new fdw_scan_tlist of given foreign-scan plan node from given
- *		tlist
- *
- * There might be columns that the fdw_scan_tlist of the given foreign-scan
- * plan node contains that the given tlist doesn't.  The fdw_scan_tlist would
- * have contained resjunk columns such as 'ctid' of the target relation and
- * 'wholerow' of non-target relations, but the tlist might not contain them,
- * for example.  So, adjust the tlist so it contains all the columns specified
- * in the fdw_scan_tlist; else setrefs.c will get confused.
+ * copy_append_text
+ *		Append a value to a row in COPY text format, escaped
  */
 static void
-rebuild_fdw_scan_tlist(ForeignScan *fscan, List *tlist)
+copy_append_text(StringInfo buf, const char *s)
 {
-	List	   *new_tlist = tlist;
-	List	   *old_tlist = fscan->fdw_scan_tlist;
-	ListCell   *lc;
-
-	foreach(lc, old_tlist)
+	for (; *s; s++)
 	{
-		TargetEntry *tle = (TargetEntry *) lfirst(lc);
-
-		if (tlist_member(tle->expr, new_tlist))
-			continue;			/* already got it */
-
-		new_tlist = lappend(new_tlist,
-							makeTargetEntry(tle->expr,
-											list_length(new_tlist) + 1,
-											NULL,
-											false));
+		switch (*s)
+		{
+			case '\\':
+				appendStringInfoString(buf, "\\\\");
+				break;
+			case '\n':
+				appendStringInfoString(buf, "\\n");
+				break;
+			case '\r':
+				appendStringInfoString(buf, "\\r");
+				break;
+			case '\t':
+				appendStringInfoString(buf, "\\t");
+				break;
+			default:
+				appendStringInfoChar(buf, *s);
+				break;
+		}
 	}
-	fscan->fdw_scan_tlist = new_tlist;
 }
 
 /*
- * Execute a direct UPDATE/DELETE statement.
+ * flush_foreign_copy
+ *		Send the rows of an insert through a remote COPY not sent yet, if any
  */
 static void
-execute_dml_stmt(ForeignScanState *node)
+flush_foreign_copy(PgFdwModifyState *fmstate)
 {
-	PgFdwDirectModifyState *dmstate = (PgFdwDirectModifyState *) node->fdw_state;
-	ExprContext *econtext = node->ss.ps.ps_ExprContext;
-	int			numParams = dmstate->numParams;
-	const char **values = dmstate->param_values;
+	StringInfo	buf = &fmstate->copy_buf;
+	PGconn	   *conn = fmstate->conn;
+	PGresult   *res;
 
-	/*
-	 * Construct array of query parameter values in text format.
-	 */
-	if (numParams > 0)
-		process_query_params(econtext,
-							 dmstate->param_flinfo,
-							 dmstate->param_exprs,
-							 values);
+	if (buf->len == 0)
+		return;
 
-	/*
-	 * Notice that we pass NULL for paramTypes, thus forcing the remote server
-	 * to infer types for all parameters.  Since we explicitly cast every
-	 * parameter (see deparse.c), the "inference" is trivial and will produce
-	 * the desired result.  This allows us to avoid assuming that the remote
-	 * server has the same OIDs we do for the parameters' types.
-	 */
-	if (!PQsendQueryParams(dmstate->conn, dmstate->query, numParams,
-						   NULL, values, NULL, NULL, 0))
-		pgfdw_report_error(ERROR, NULL, dmstate->conn, false, dmstate->query);
+	if (fmstate->copy_sendfuncs)
+	{
+		uint16		trailer = pg_hton16((uint16) -1);
+
+		appendBinaryStringInfo(buf, (char *) &trailer, sizeof(trailer));
+	}
+
+	/* First, process a pending asynchronous request, if any. */
+	if (fmstate->conn_state->pendingScan)
+		process_pending_request(fmstate->conn_state->pendingScan);
+
+	if (!PQsendQuery(conn, fmstate->copy_query))
+		pgfdw_report_error(ERROR, NULL, conn, false, fmstate->copy_query);
 
 	/*
-	 * Get the result, and check for success.
+	 * Only one result until the data is sent, pgfdw_get_result would wait
+	 * for more.
 	 *
 	 * We don't use a PG_TRY block here, so be careful not to throw error
 	 * without releasing the PGresult.
 	 */
-	dmstate->result = pgfdw_get_result(dmstate->conn, dmstate->query);
-	if (PQresultStatus(dmstate->result) !=
-		(dmstate->has_returning ? PGRES_TUPLES_OK : PGRES_COMMAND_OK))
-		pgfdw_report_error(ERROR, dmstate->result, dmstate->conn, true,
-						   dmstate->query);
+	res = pgfdw_get_next_result(conn, fmstate->copy_query);
+	if (PQresultStatus(res) != PGRES_COPY_IN)
+		pgfdw_report_error(ERROR, res, conn, true, fmstate->copy_query);
+	PQclear(res);
 
-	/* Get the number of rows affected. */
-	if (dmstate->has_returning)
-		dmstate->num_tuples = PQntuples(dmstate->result);
-	else
-		dmstate->num_tuples = atoi(PQcmdTuples(dmstate->result));
+	if (PQputCopyData(conn, buf->data, buf->len) != 1 ||
+		PQputCopyEnd(conn, NULL) != 1)
+		pgfdw_report_error(ERROR, NULL, conn, false, fmstate->copy_query);
+	resetStringInfo(buf);
+
+	res = pgfdw_get_result(conn, fmstate->copy_query);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res, conn, true, fmstate->copy_query);
+	PQclear(res);
 }
 
 /*
- * Get the result of a RETURNING clause.
+ * prepare_foreign_modify
+ *		Establish a prepared statement for execution of INSERT/UPDATE/DELETE
  */
-static TupleTableSlot *
-get_returning_data(ForeignScanState *node)
+static void
+prepare_foreign_modify(PgFdwModifyState *fmstate)
 {
-	PgFdwDirectModifyState *dmstate = (PgFdwDirectModifyState *) node->fdw_state;
-	EState	   *estate = node->ss.ps.state;
-	ResultRelInfo *resultRelInfo = estate->es_result_relation_info;
-	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
-	TupleTableSlot *resultSlot;
-
-	Assert(resultRelInfo->ri_projectReturning);
+	char		prep_name[NAMEDATALEN];
+	char	   *p_name;
+	PGresult   *res;
 
-	/* If we didn't get any tuples, must be end of data. */
-	if (dmstate->next_tuple >= dmstate->num_tuples)
-		return ExecClearTuple(slot);
+	/* Construct name we'll use for the prepared statement. */
+	snprintf(prep_name, sizeof(prep_name), "pgsql_fdw_prep_%u",
+			 GetPrepStmtNumber(fmstate->conn));
+	p_name = pstrdup(prep_name);
 
-	/* Increment the command es_processed count if necessary. */
-	if (dmstate->set_processed)
-		estate->es_processed += 1;
+	/*
+	 * We intentionally do not specify parameter types here, but leave the
+	 * remote server to derive them by default.  This avoids possible problems
+	 * with the remote server using different type OIDs than we do.  All of
+	 * the prepared statements we use in this module are simple enough that
+	 * the remote server will make the right choices.
+	 */
+	if (fmstate->conn_state->pendingScan)
+		process_pending_request(fmstate->conn_state->pendingScan);
+	if (!PQsendPrepare(fmstate->conn,
+					   p_name,
+					   fmstate->query,
+					   0,
+					   NULL))
+		pgfdw_report_error(ERROR, NULL, fmstate->conn, false, fmstate->query);
 
 	/*
-	 * Store a RETURNING tuple.  If has_returning is false, just emit a dummy
-	 * tuple.  (has_returning is false when the local query is of the form
-	 * "UPDATE/DELETE .. RETURNING 1" for example.)
+	 * Get the result, and check for success.
+	 *
+	 * We don't use a PG_TRY block here, so be careful not to throw error
+	 * without releasing the PGresult.
 	 */
-	if (!dmstate->has_returning)
+	res = pgfdw_get_result(fmstate->conn, fmstate->query);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res, fmstate->conn, true, fmstate->query);
+	PQclear(res);
+
+	/* This action shows that the prepare has been done. */
+	fmstate->p_name = p_name;
+}
+
+/*
+ * convert_prep_stmt_params
+ *		Create array of text strings representing parameter values
+ *
+ * tupleid is ctid to send, or NULL if none
+ * slot is slot to get remaining parameters from, or NULL if none
+ *
+ * Data is constructed in temp_cxt; caller should reset that after use.
+ */
+static const char **
+convert_prep_stmt_params(PgFdwModifyState *fmstate,
+						 ItemPointer tupleid,
+						 TupleTableSlot *slot)
+{
+	const char **p_values;
+	int			pindex = 0;
+	MemoryContext oldcontext;
+
+	oldcontext = MemoryContextSwitchTo(fmstate->temp_cxt);
+
+	p_values = (const char **) palloc(sizeof(char *) * fmstate->p_nums);
+
+	/* 1st parameter should be ctid, if it's in use */
+	if (tupleid != NULL)
 	{
-		ExecStoreAllNullTuple(slot);
-		resultSlot = slot;
+		/* don't need set_transmission_modes for TID output */
+		p_values[pindex] = OutputFunctionCall(&fmstate->p_flinfo[pindex],
+											  PointerGetDatum(tupleid));
+		pindex++;
 	}
-	else
+
+	/* get following parameters from slot */
+	if (slot != NULL && fmstate->target_attrs != NIL)
 	{
-		/*
-		 * On error, be sure to release the PGresult on the way out.  Callers
-		 * do not have PG_TRY blocks to ensure this happens.
-		 */
-		PG_TRY();
-		{
-			HeapTuple	newtup;
+		int			nestlevel;
+		ListCell   *lc;
 
-			newtup = make_tuple_from_result_row(dmstate->result,
-												dmstate->next_tuple,
-												dmstate->rel,
-												dmstate->attinmeta,
-												dmstate->retrieved_attrs,
-												node,
-												dmstate->temp_cxt);
-			ExecStoreHeapTuple(newtup, slot, false);
-		}
-		PG_CATCH();
+		nestlevel = set_transmission_modes();
+
+		foreach(lc, fmstate->target_attrs)
 		{
-			if (dmstate->result)
-				PQclear(dmstate->result);
-			PG_RE_THROW();
+			int			attnum = lfirst_int(lc);
+			Datum		value;
+			bool		isnull;
+
+			value = slot_getattr(slot, attnum, &isnull);
+			if (isnull)
+				p_values[pindex] = NULL;
+			else
+				p_values[pindex] = OutputFunctionCall(&fmstate->p_flinfo[pindex],
+													  value);
+			pindex++;
 		}
-		PG_END_TRY();
 
-		/* Get the updated/deleted tuple. */
-		if (dmstate->rel)
-			resultSlot = slot;
-		else
-			resultSlot = apply_returning_filter(dmstate, slot, estate);
+		reset_transmission_modes(nestlevel);
 	}
-	dmstate->next_tuple++;
 
-	/* Make slot available for evaluation of the local query RETURNING list. */
-	resultRelInfo->ri_projectReturning->pi_exprContext->ecxt_scantuple =
-		resultSlot;
+	Assert(pindex == fmstate->p_nums);
 
-	return slot;
+	MemoryContextSwitchTo(oldcontext);
+
+	return p_values;
 }
 
 /*
- * Initialize a filter to extract an updated/deleted tuple from a scan tuple.
+ * store_returning_result
+ *		Store the result of a RETURNING clause
+ *
+ * On error, be sure to release the PGresult on the way out.  Callers do not
+ * have PG_TRY blocks to ensure this happens.
  */
 static void
-init_returning_filter(PgFdwDirectModifyState *dmstate,
-					  List *fdw_scan_tlist,
-					  Index rtindex)
+store_returning_result(PgFdwModifyState *fmstate,
+					   TupleTableSlot *slot, PGresult *res)
 {
-	TupleDesc	resultTupType = RelationGetDescr(dmstate->resultRel);
-	ListCell   *lc;
-	int			i;
-
-	/*
-	 * Calculate the mapping between the fdw_scan_tlist's entries and the
-	 * result tuple's attributes.
-	 *
-	 * The "map" is an array of indexes of the result tuple's attributes in
-	 * fdw_scan_tlist, i.e., one entry for every attribute of the result
-	 * tuple.  We store zero for any attributes that don't have the
-	 * corresponding entries in that list, marking that a NULL is needed in
-	 * the result tuple.
-	 *
-	 * Also get the indexes of the entries for ctid and oid if any.
-	 */
-	dmstate->attnoMap = (AttrNumber *)
-		palloc0(resultTupType->natts * sizeof(AttrNumber));
-
-	dmstate->ctidAttno = dmstate->oidAttno = 0;
-
-	i = 1;
-	dmstate->hasSystemCols = false;
-	foreach(lc, fdw_scan_tlist)
+	PG_TRY();
 	{
-		TargetEntry *tle = (TargetEntry *) lfirst(lc);
-		Var		   *var = (Var *) tle->expr;
+		HeapTuple	newtup;
 
-		Assert(IsA(var, Var));
+		newtup = make_tuple_from_result_row(res, 0,
+											fmstate->rel,
+											fmstate->attinmeta,
+											NULL,
+											fmstate->retrieved_attrs,
+											NULL,
+											fmstate->temp_cxt);
 
 		/*
-		 * If the Var is a column of the target relation to be retrieved from
-		 * the foreign server, get the index of the entry.
+		 * The returning slot will not necessarily be suitable to store
+		 * heaptuples directly, so allow for conversion.
 		 */
-		if (var->varno == rtindex &&
-			list_member_int(dmstate->retrieved_attrs, i))
-		{
-			int			attrno = var->varattno;
-
-			if (attrno < 0)
-			{
-				/*
-				 * We don't retrieve system columns other than ctid and oid.
-				 */
-				if (attrno == SelfItemPointerAttributeNumber)
-					dmstate->ctidAttno = i;
-				else
-					Assert(false);
-				dmstate->hasSystemCols = true;
-			}
-			else
-			{
-				/*
-				 * We don't retrieve whole-row references to the target
-				 * relation either.
-				 */
-				Assert(attrno > 0);
-
-				dmstate->attnoMap[attrno - 1] = i;
-			}
-		}
-		i++;
+		ExecForceStoreHeapTuple(newtup, slot, true);
+	}
+	PG_CATCH();
+	{
+		if (res)
+			PQclear(res);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 }
 
 /*
- * Extract and return an updated/deleted tuple from a scan tuple.
+ * finish_foreign_modify
+ *		Release resources for a foreign insert/update/delete operation
  */
-static TupleTableSlot *
-apply_returning_filter(PgFdwDirectModifyState *dmstate,
-					   TupleTableSlot *slot,
-					   EState *estate)
+static void
+finish_foreign_modify(PgFdwModifyState *fmstate)
 {
-	ResultRelInfo *relInfo = estate->es_result_relation_info;
-	TupleDesc	resultTupType = RelationGetDescr(dmstate->resultRel);
-	TupleTableSlot *resultSlot;
-	Datum	   *values;
-	bool	   *isnull;
-	Datum	   *old_values;
-	bool	   *old_isnull;
-	int			i;
+	Assert(fmstate != NULL);
 
-	/*
-	 * Use the return tuple slot as a place to store the result tuple.
-	 */
-	resultSlot = ExecGetReturningSlot(estate, relInfo);
+	/* Send the rows of the last, partial batch */
+	if (fmstate->batch_by_ctid)
+		flush_foreign_modify(fmstate);
+	else
+		flush_foreign_insert(fmstate);
+	if (fmstate->copy_query)
+		flush_foreign_copy(fmstate);
 
-	/*
-	 * Extract all the values of the scan tuple.
-	 */
-	slot_getallattrs(slot);
-	old_values = slot->tts_values;
-	old_isnull = slot->tts_isnull;
+	/* If we created a prepared statement, destroy it */
+	if (fmstate->p_name)
+	{
+		char		sql[64];
+		PGresult   *res;
 
-	/*
-	 * Prepare to build the result tuple.
-	 */
-	ExecClearTuple(resultSlot);
-	values = resultSlot->tts_values;
-	isnull = resultSlot->tts_isnull;
+		snprintf(sql, sizeof(sql), "DEALLOCATE %s", fmstate->p_name);
 
-	/*
-	 * Transpose data into proper fields of the result tuple.
-	 */
-	for (i = 0; i < resultTupType->natts; i++)
+		/*
+		 * We don't use a PG_TRY block here, so be careful not to throw error
+		 * without releasing the PGresult.
+		 */
+		res = pgfdw_exec_query(fmstate->conn, sql, fmstate->conn_state);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			pgfdw_report_error(ERROR, res, fmstate->conn, true, sql);
+		PQclear(res);
+		fmstate->p_name = NULL;
+	}
+
+	/* Release remote connection */
+	ReleaseConnection(fmstate->conn);
+	fmstate->conn = NULL;
+}
+
+/*
+ * get_modify_options
+ *		Options of the foreign table, or else of its server, that decide
+ *		how rows are modified: batch_size (default 1), use_remote_copy and
+ *		use_binary_format (default false)
+ */
+static void
+get_modify_options(Relation rel, int *batch_size, bool *use_remote_copy,
+				   bool *use_binary_format)
+{
+	ForeignTable *table = GetForeignTable(RelationGetRelid(rel));
+	ForeignServer *server = GetForeignServer(table->serverid);
+	bool		batch_size_set = false;
+	bool		use_remote_copy_set = false;
+	bool		use_binary_format_set = false;
+	List	   *options = list_concat(list_copy(table->options),
+									  server->options);
+	ListCell   *lc;
+
+	*batch_size = 1;
+	*use_remote_copy = false;
+	*use_binary_format = false;
+
+	/* the table's options come first, and override the server's */
+	foreach(lc, options)
 	{
-		int			j = dmstate->attnoMap[i];
+		DefElem    *def = (DefElem *) lfirst(lc);
 
-		if (j == 0)
+		if (strcmp(def->defname, "batch_size") == 0 && !batch_size_set)
 		{
-			values[i] = (Datum) 0;
-			isnull[i] = true;
+			*batch_size = strtol(defGetString(def), NULL, 10);
+			batch_size_set = true;
 		}
-		else
+		else if (strcmp(def->defname, "use_remote_copy") == 0 &&
+				 !use_remote_copy_set)
 		{
-			values[i] = old_values[j - 1];
-			isnull[i] = old_isnull[j - 1];
+			*use_remote_copy = defGetBoolean(def);
+			use_remote_copy_set = true;
+		}
+		else if (strcmp(def->defname, "use_binary_format") == 0 &&
+				 !use_binary_format_set)
+		{
+			*use_binary_format = defGetBoolean(def);
+			use_binary_format_set = true;
 		}
 	}
+}
 
-	/*
-	 * Build the virtual tuple.
-	 */
-	ExecStoreVirtualTuple(resultSlot);
+/*
+ * build_remote_returning
+ *		Build a RETURNING targetlist of a remote query for performing an
+ *		UPDATE/DELETE .. RETURNING on a join directly
+ */
+static List *
+build_remote_returning(Index rtindex, Relation rel, List *returningList)
+{
+	bool		have_wholerow = false;
+	List	   *tlist = NIL;
+	List	   *vars;
+	ListCell   *lc;
+
+	Assert(returningList);
+
+	vars = pull_var_clause((Node *) returningList, PVC_INCLUDE_PLACEHOLDERS);
 
 	/*
-	 * If we have any system columns to return, materialize a heap tuple in
-	 * the slot from column values set above and install system columns in
-	 * that tuple.
+	 * If there's a whole-row reference to the target relation, then we'll
+	 * need all the columns of the relation.
 	 */
-	if (dmstate->hasSystemCols)
+	foreach(lc, vars)
 	{
-		HeapTuple	resultTup = ExecFetchSlotHeapTuple(resultSlot, true, NULL);
+		Var		   *var = (Var *) lfirst(lc);
 
-		/* ctid */
-		if (dmstate->ctidAttno)
+		if (IsA(var, Var) &&
+			var->varno == rtindex &&
+			var->varattno == InvalidAttrNumber)
 		{
-			ItemPointer ctid = NULL;
-
-			ctid = (ItemPointer) DatumGetPointer(old_values[dmstate->ctidAttno - 1]);
-			resultTup->t_self = *ctid;
+			have_wholerow = true;
+			break;
 		}
-
-		/*
-		 * And remaining columns
-		 *
-		 * Note: since we currently don't allow the target relation to appear
-		 * on the nullable side of an outer join, any system columns wouldn't
-		 * go to NULL.
-		 *
-		 * Note: no need to care about tableoid here because it will be
-		 * initialized in ExecProcessReturning().
-		 */
-		HeapTupleHeaderSetXmin(resultTup->t_data, InvalidTransactionId);
-		HeapTupleHeaderSetXmax(resultTup->t_data, InvalidTransactionId);
-		HeapTupleHeaderSetCmin(resultTup->t_data, InvalidTransactionId);
 	}
 
-	/*
-	 * And return the result tuple.
-	 */
-	return resultSlot;
-}
+	if (have_wholerow)
+	{
+		TupleDesc	tupdesc = RelationGetDescr(rel);
+		int			i;
 
-/*
- * Prepare for processing of parameters used in remote query.
- */
-static void
-prepare_query_params(PlanState *node,
-					 List *fdw_exprs,
-					 int numParams,
-					 FmgrInfo **param_flinfo,
-					 List **param_exprs,
-					 const char ***param_values)
-{
-	int			i;
-	ListCell   *lc;
+		for (i = 1; i <= tupdesc->natts; i++)
+		{
+			Form_pg_attribute attr = TupleDescAttr(tupdesc, i - 1);
+			Var		   *var;
 
-	Assert(numParams > 0);
+			/* Ignore dropped attributes. */
+			if (attr->attisdropped)
+				continue;
 
-	/* Prepare for output conversion of parameters used in remote query. */
-	*param_flinfo = (FmgrInfo *) palloc0(sizeof(FmgrInfo) * numParams);
+			var = makeVar(rtindex,
+						  i,
+						  attr->atttypid,
+						  attr->atttypmod,
+						  attr->attcollation,
+						  0);
 
-	i = 0;
-	foreach(lc, fdw_exprs)
+			tlist = lappend(tlist,
+							makeTargetEntry((Expr *) var,
+											list_length(tlist) + 1,
+											NULL,
+											false));
+		}
+	}
+
+	/* Now add any remaining columns to tlist. */
+	foreach(lc, vars)
 	{
-		Node	   *param_expr = (Node *) lfirst(lc);
-		Oid			typefnoid;
-		bool		isvarlena;
+		Var		   *var = (Var *) lfirst(lc);
 
-		getTypeOutputInfo(exprType(param_expr), &typefnoid, &isvarlena);
-		fmgr_info(typefnoid, &(*param_flinfo)[i]);
-		i++;
+		/*
+		 * No need for whole-row references to the target relation.  We don't
+		 * need system columns other than ctid and oid either, since those are
+		 * set locally.
+		 */
+		if (IsA(var, Var) &&
+			var->varno == rtindex &&
+			var->varattno <= InvalidAttrNumber &&
+			var->varattno != SelfItemPointerAttributeNumber)
+			continue;			/* don't need it */
+
+		if (tlist_member((Expr *) var, tlist))
+			continue;			/* already got it */
+
+		tlist = lappend(tlist,
+						makeTargetEntry((Expr *) var,
+										list_length(tlist) + 1,
+										NULL,
+										false));
 	}
 
-	/*
-	 * Prepare remote-parameter expressions for evaluation.  (Note: in
-	 * practice, we expect that all these expressions will be just Params, so
-	 * we could possibly do something more efficient than using the full
-	 * expression-eval machinery for this.  But probably there would be little
-	 * benefit, and it'd require pgc_fdw to know more than is desirable
-	 * about Param evaluation.)
-	 */
-	*param_exprs = ExecInitExprList(fdw_exprs, node);
+	list_free(vars);
 
-	/* Allocate buffer for text form of query parameters. */
-	*param_values = (const char **) palloc0(numParams * sizeof(char *));
+	return tlist;
 }
 
 /*
- * Construct array of query parameter values in text format.
+ * rebuild_fdw_scan_tlist
+ *		Build new fdw_scan_tlist of given foreign-scan plan node from given
+ *		tlist
+ *
+ * There might be columns that the fdw_scan_tlist of the given foreign-scan
+ * plan node contains that the given tlist doesn't.  The fdw_scan_tlist would
+ * have contained resjunk columns such as 'ctid' of the target relation and
+ * 'wholerow' of non-target relations, but the tlist might not contain them,
+ * for example.  So, adjust the tlist so it contains all the columns specified
+ * in the fdw_scan_tlist; else setrefs.c will get confused.
  */
 static void
-process_query_params(ExprContext *econtext,
-					 FmgrInfo *param_flinfo,
-					 List *param_exprs,
-					 const char **param_values)
+rebuild_fdw_scan_tlist(ForeignScan *fscan, List *tlist)
 {
-	int			nestlevel;
-	int			i;
+	List	   *new_tlist = tlist;
+	List	   *old_tlist = fscan->fdw_scan_tlist;
 	ListCell   *lc;
 
-	nestlevel = set_transmission_modes();
-
-	i = 0;
-	foreach(lc, param_exprs)
+	foreach(lc, old_tlist)
 	{
-		ExprState  *expr_state = (ExprState *) lfirst(lc);
-		Datum		expr_value;
-		bool		isNull;
-
-		/* Evaluate the parameter expression */
-		expr_value = ExecEvalExpr(expr_state, econtext, &isNull);
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
 
-		/*
-		 * Get string representation of each parameter value by invoking
-		 * type-specific output function, unless the value is null.
-		 */
-		if (isNull)
-			param_values[i] = NULL;
-		else
-			param_values[i] = OutputFunctionCall(&param_flinfo[i], expr_value);
+		if (tlist_member(tle->expr, new_tlist))
+			continue;			/* already got it */
 
-		i++;
+		new_tlist = lappend(new_tlist,
+							makeTargetEntry(tle->expr,
+											list_length(new_tlist) + 1,
+											NULL,
+											false));
 	}
-
-	reset_transmission_modes(nestlevel);
+	fscan->fdw_scan_tlist = new_tlist;
 }
 
 /*
- * postgresAnalyzeForeignTable
- *		Test whether analyzing this foreign table is supported
+ * Execute a direct UPDATE/DELETE statement.
  */
-static bool
-postgresAnalyzeForeignTable(Relation relation,
-							AcquireSampleRowsFunc *func,
-							BlockNumber *totalpages)
+static void
+execute_dml_stmt(ForeignScanState *node)
 {
-	ForeignTable *table;
-	UserMapping *user;
-	PGconn	   *conn;
-	StringInfoData sql;
-	PGresult   *volatile res = NULL;
+	PgFdwDirectModifyState *dmstate = (PgFdwDirectModifyState *) node->fdw_state;
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	int			numParams = dmstate->numParams;
+	const char **values = dmstate->param_values;
 
-	/* Return the row-analysis function pointer */
-	*func = postgresAcquireSampleRowsFunc;
+	/* rel is only the target if it is not a join */
+	cache_note_modified(RelationGetRelid(dmstate->rel ? dmstate->rel :
+										 dmstate->resultRel));
 
 	/*
-	 * Now we have to get the number of pages.  It's annoying that the ANALYZE
-	 * API requires us to return that now, because it forces some duplication
-	 * of effort between this routine and postgresAcquireSampleRowsFunc.  But
-	 * it's probably not worth redefining that API at this point.
+	 * Construct array of query parameter values in text format.
 	 */
+	if (numParams > 0)
+		process_query_params(econtext,
+							 dmstate->param_flinfo,
+							 dmstate->param_exprs,
+							 values);
+
+	/* First, process a pending asynchronous request, if any. */
+	if (dmstate->conn_state->pendingScan)
+		process_pending_request(dmstate->conn_state->pendingScan);
 
 	/*
-	 * Get the connection to use.  We do the remote access as the table's
-	 * owner, even if the ANALYZE was started by some other user.
+	 * Notice that we pass NULL for paramTypes, thus forcing the remote server
+	 * to infer types for all parameters.  Since we explicitly cast every
+	 * parameter (see deparse.c), the "inference" is trivial and will produce
+	 * the desired result.  This allows us to avoid assuming that the remote
+	 * server has the same OIDs we do for the parameters' types.
 	 */
-	table = GetForeignTable(RelationGetRelid(relation));
-	user = GetUserMapping(relation->rd_rel->relowner, table->serverid);
-	conn = GetConnection(user, false);
+	if (!PQsendQueryParams(dmstate->conn, dmstate->query, numParams,
+						   NULL, values, NULL, NULL, 0))
+		pgfdw_report_error(ERROR, NULL, dmstate->conn, false, dmstate->query);
 
 	/*
-	 * Construct command to get page count for relation.
+	 * Get the result, and check for success.
+	 *
+	 * We don't use a PG_TRY block here, so be careful not to throw error
+	 * without releasing the PGresult.
 	 */
-	initStringInfo(&sql);
-	deparseAnalyzeSizeSql(&sql, relation);
-
-	/* In what follows, do not risk leaking any PGresults. */
-	PG_TRY();
-	{
-		res = pgfdw_exec_query(conn, sql.data);
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			pgfdw_report_error(ERROR, res, conn, false, sql.data);
-
-		if (PQntuples(res) != 1 || PQnfields(res) != 1)
-			elog(ERROR, "unexpected result from deparseAnalyzeSizeSql query");
-		*totalpages = strtoul(PQgetvalue(res, 0, 0), NULL, 10);
-	}
-	PG_FINALLY();
-	{
-		if (res)
-			PQclear(res);
-	}
-	PG_END_TRY();
-
-	ReleaseConnection(conn);
+	dmstate->result = pgfdw_get_result(dmstate->conn, dmstate->query);
+	if (PQresultStatus(dmstate->result) !=
+		(dmstate->has_returning ? PGRES_TUPLES_OK : PGRES_COMMAND_OK))
+		pgfdw_report_error(ERROR, dmstate->result, dmstate->conn, true,
+						   dmstate->query);
 
-	return true;
+	/* Get the number of rows affected. */
+	if (dmstate->has_returning)
+		dmstate->num_tuples = PQntuples(dmstate->result);
+	else
+		dmstate->num_tuples = atoi(PQcmdTuples(dmstate->result));
 }
 
 /*
- * Acquire a random sample of rows from foreign table managed by pgc_fdw.
- *
- * We fetch the whole table from the remote side and pick out some sample rows.
- *
- * Selected rows are returned in the caller-allocated array rows[],
- * which must have at least targrows entries.
- * The actual number of rows selected is returned as the function result.
- * We also count the total number of rows in the table and return it into
- * *totalrows.  Note that *totaldeadrows is always set to 0.
- *
- * Note that the returned list of rows is not always in order by physical
- * position in the table.  Therefore, correlation estimates derived later
- * may be meaningless, but it's OK because we don't use the estimates
- * currently (the planner only pays attention to correlation for indexscans).
+ * Get the result of a RETURNING clause.
  */
-static int
-postgresAcquireSampleRowsFunc(Relation relation, int elevel,
-							  HeapTuple *rows, int targrows,
-							  double *totalrows,
-							  double *totaldeadrows)
+static TupleTableSlot *
+get_returning_data(ForeignScanState *node)
 {
-	PgFdwAnalyzeState astate;
-	ForeignTable *table;
-	ForeignServer *server;
-	UserMapping *user;
-	PGconn	   *conn;
-	unsigned int cursor_number;
-	StringInfoData sql;
-	PGresult   *volatile res = NULL;
-
-	/* Initialize workspace state */
-	astate.rel = relation;
-	astate.attinmeta = TupleDescGetAttInMetadata(RelationGetDescr(relation));
+	PgFdwDirectModifyState *dmstate = (PgFdwDirectModifyState *) node->fdw_state;
+	EState	   *estate = node->ss.ps.state;
+	ResultRelInfo *resultRelInfo = estate->es_result_relation_info;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	TupleTableSlot *resultSlot;
 
-	astate.rows = rows;
-	astate.targrows = targrows;
-	astate.numrows = 0;
-	astate.samplerows = 0;
-	astate.rowstoskip = -1;		/* -1 means not set yet */
-	reservoir_init_selection_state(&astate.rstate, targrows);
+	Assert(resultRelInfo->ri_projectReturning);
 
-	/* Remember ANALYZE context, and create a per-tuple temp context */
-	astate.anl_cxt = CurrentMemoryContext;
-	astate.temp_cxt = AllocSetContextCreate(CurrentMemoryContext,
-											"pgc_fdw temporary data",
-											ALLOCSET_SMALL_SIZES);
+	/* If we didn't get any tuples, must be end of data. */
+	if (dmstate->next_tuple >= dmstate->num_tuples)
+		return ExecClearTuple(slot);
 
-	/*
-	 * Get the connection to use.  We do the remote access as the table's
-	 * owner, even if the ANALYZE was started by some other user.
-	 */
-	table = GetForeignTable(RelationGetRelid(relation));
-	server = GetForeignServer(table->serverid);
-	user = GetUserMapping(relation->rd_rel->relowner, table->serverid);
-	conn = GetConnection(user, false);
+	/* Increment the command es_processed count if necessary. */
+	if (dmstate->set_processed)
+		estate->es_processed += 1;
 
 	/*
-	 * Construct cursor that retrieves whole rows from remote.
+	 * Store a RETURNING tuple.  If has_returning is false, just emit a dummy
+	 * tuple.  (has_returning is false when the local query is of the form
+	 * "UPDATE/DELETE .. RETURNING 1" for example.)
 	 */
-	cursor_number = GetCursorNumber(conn);
-	initStringInfo(&sql);
-	appendStringInfo(&sql, "DECLARE c%u CURSOR FOR ", cursor_number);
-	deparseAnalyzeSql(&sql, relation, &astate.retrieved_attrs);
-
-	/* In what follows, do not risk leaking any PGresults. */
-	PG_TRY();
+	if (!dmstate->has_returning)
+	{
+		ExecStoreAllNullTuple(slot);
+		resultSlot = slot;
+	}
+	else
 	{
-		char		fetch_sql[64];
-		int			fetch_size;
-		ListCell   *lc;
-
-		res = pgfdw_exec_query(conn, sql.data);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-			pgfdw_report_error(ERROR, res, conn, false, sql.data);
-		PQclear(res);
-		res = NULL;
-
 		/*
-		 * Determine the fetch size.  The default is arbitrary, but shouldn't
-		 * be enormous.
+		 * On error, be sure to release the PGresult on the way out.  Callers
+		 * do not have PG_TRY blocks to ensure this happens.
 		 */
-		fetch_size = 100;
-		foreach(lc, server->options)
+		PG_TRY();
 		{
-			DefElem    *def = (DefElem *) lfirst(lc);
+			HeapTuple	newtup;
 
-			if (strcmp(def->defname, "fetch_size") == 0)
-			{
-				fetch_size = strtol(defGetString(def), NULL, 10);
-				break;
-			}
+			newtup = make_tuple_from_result_row(dmstate->result,
+												dmstate->next_tuple,
+												dmstate->rel,
+												dmstate->attinmeta,
+												NULL,
+												dmstate->retrieved_attrs,
+												node,
+												dmstate->temp_cxt);
+			ExecStoreHeapTuple(newtup, slot, false);
 		}
-		foreach(lc, table->options)
+		PG_CATCH();
 		{
-			DefElem    *def = (DefElem *) lfirst(lc);
-
-			if (strcmp(def->defname, "fetch_size") == 0)
-			{
-				fetch_size = strtol(defGetString(def), NULL, 10);
-				break;
-			}
+			if (dmstate->result)
+				PQclear(dmstate->result);
+			PG_RE_THROW();
 		}
+		PG_END_TRY();
 
-		/* Construct command to fetch rows from remote. */
-		snprintf(fetch_sql, sizeof(fetch_sql), "FETCH %d FROM c%u",
-				 fetch_size, cursor_number);
-
-		/* Retrieve and process rows a batch at a time. */
-		for (;;)
-		{
-			int			numrows;
-			int			i;
+		/* Get the updated/deleted tuple. */
+		if (dmstate->rel)
+			resultSlot = slot;
+		else
+			resultSlot = apply_returning_filter(dmstate, slot, estate);
+	}
+	dmstate->next_tuple++;
 
-			/* Allow users to cancel long query */
-			CHECK_FOR_INTERRUPTS();
+	/* Make slot available for evaluation of the local query RETURNING list. */
+	resultRelInfo->ri_projectReturning->pi_exprContext->ecxt_scantuple =
+		resultSlot;
 
-			/*
-			 * XXX possible future improvement: if rowstoskip is large, we
-			 * could issue a MOVE rather than physically fetching the rows,
-			 * then just adjust rowstoskip and samplerows appropriately.
-			 */
+	return slot;
+}
 
-			/* Fetch some rows */
-			res = pgfdw_exec_query(conn, fetch_sql);
-			/* On error, report the original query, not the FETCH. */
-			if (PQresultStatus(res) != PGRES_TUPLES_OK)
-				pgfdw_report_error(ERROR, res, conn, false, sql.data);
+/*
+ * Initialize a filter to extract an updated/deleted tuple from a scan tuple.
+ */
+static void
+init_returning_filter(PgFdwDirectModifyState *dmstate,
+					  List *fdw_scan_tlist,
+					  Index rtindex)
+{
+	TupleDesc	resultTupType = RelationGetDescr(dmstate->resultRel);
+	ListCell   *lc;
+	int			i;
 
-			/* Process whatever we got. */
-			numrows = PQntuples(res);
-			for (i = 0; i < numrows; i++)
-				analyze_row_processor(res, i, &astate);
+	/*
+	 * Calculate the mapping between the fdw_scan_tlist's entries and the
+	 * result tuple's attributes.
+	 *
+	 * The "map" is an array of indexes of the result tuple's attributes in
+	 * fdw_scan_tlist, i.e., one entry for every attribute of the result
+	 * tuple.  We store zero for any attributes that don't have the
+	 * corresponding entries in that list, marking that a NULL is needed in
+	 * the result tuple.
+	 *
+	 * Also get the indexes of the entries for ctid and oid if any.
+	 */
+	dmstate->attnoMap = (AttrNumber *)
+		palloc0(resultTupType->natts * sizeof(AttrNumber));
 
-			PQclear(res);
-			res = NULL;
+	dmstate->ctidAttno = dmstate->oidAttno = 0;
 
-			/* Must be EOF if we didn't get all the rows requested. */
-			if (numrows < fetch_size)
-				break;
-		}
-
-		/* Close the cursor, just to be tidy. */
-		close_cursor(conn, cursor_number);
-	}
-	PG_CATCH();
+	i = 1;
+	dmstate->hasSystemCols = false;
+	foreach(lc, fdw_scan_tlist)
 	{
-		if (res)
-			PQclear(res);
-		PG_RE_THROW();
-	}
-	PG_END_TRY();
-
-	ReleaseConnection(conn);
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+		Var		   *var = (Var *) tle->expr;
 
-	/* We assume that we have no dead tuple. */
-	*totaldeadrows = 0.0;
+		Assert(IsA(var, Var));
 
-	/* We've retrieved all living tuples from foreign server. */
-	*totalrows = astate.samplerows;
+		/*
+		 * If the Var is a column of the target relation to be retrieved from
+		 * the foreign server, get the index of the entry.
+		 */
+		if (var->varno == rtindex &&
+			list_member_int(dmstate->retrieved_attrs, i))
+		{
+			int			attrno = var->varattno;
 
-	/*
-	 * Emit some interesting relation info
-	 */
-	ereport(elevel,
-			(errmsg("\"%s\": table contains %.0f rows, %d rows in sample",
-					RelationGetRelationName(relation),
-					astate.samplerows, astate.numrows)));
+			if (attrno < 0)
+			{
+				/*
+				 * We don't retrieve system columns other than ctid and oid.
+				 */
+				if (attrno == SelfItemPointerAttributeNumber)
+					dmstate->ctidAttno = i;
+				else
+					Assert(false);
+				dmstate->hasSystemCols = true;
+			}
+			else
+			{
+				/*
+				 * We don't retrieve whole-row references to the target
+				 * relation either.
+				 */
+				Assert(attrno > 0);
 
-	return astate.numrows;
+				dmstate->attnoMap[attrno - 1] = i;
+			}
+		}
+		i++;
+	}
 }
 
 /*
- * Collect sample rows from the result of query.
- *	 - Use all tuples in sample until target # of samples are collected.
- *	 - Subsequently, replace already-sampled tuples randomly.
+ * Extract and return an updated/deleted tuple from a scan tuple.
  */
-static void
-analyze_row_processor(PGresult *res, int row, PgFdwAnalyzeState *astate)
+static TupleTableSlot *
+apply_returning_filter(PgFdwDirectModifyState *dmstate,
+					   TupleTableSlot *slot,
+					   EState *estate)
 {
-	int			targrows = astate->targrows;
-	int			pos;			/* array index to store tuple in */
-	MemoryContext oldcontext;
+	ResultRelInfo *relInfo = estate->es_result_relation_info;
+	TupleDesc	resultTupType = RelationGetDescr(dmstate->resultRel);
+	TupleTableSlot *resultSlot;
+	Datum	   *values;
+	bool	   *isnull;
+	Datum	   *old_values;
+	bool	   *old_isnull;
+	int			i;
 
-	/* Always increment sample row counter. */
-	astate->samplerows += 1;
+	/*
+	 * Use the return tuple slot as a place to store the result tuple.
+	 */
+	resultSlot = ExecGetReturningSlot(estate, relInfo);
 
 	/*
-	 * Determine the slot where this sample row should be stored.  Set pos to
-	 * negative value to indicate the row should be skipped.
+	 * Extract all the values of the scan tuple.
 	 */
-	if (astate->numrows < targrows)
-	{
-		/* First targrows rows are always included into the sample */
-		pos = astate->numrows++;
-	}
-	else
+	slot_getallattrs(slot);
+	old_values = slot->tts_values;
+	old_isnull = slot->tts_isnull;
+
+	/*
+	 * Prepare to build the result tuple.
+	 */
+	ExecClearTuple(resultSlot);
+	values = resultSlot->tts_values;
+	isnull = resultSlot->tts_isnull;
+
+	/*
+	 * Transpose data into proper fields of the result tuple.
+	 */
+	for (i = 0; i < resultTupType->natts; i++)
 	{
-		/*
-		 * Now we start replacing tuples in the sample until we reach the end
-		 * of the relation.  Same algorithm as in acquire_sample_rows in
-		 * analyze.c; see Jeff Vitter's paper.
-		 */
-		if (astate->rowstoskip < 0)
-			astate->rowstoskip = reservoir_get_next_S(&astate->rstate, astate->samplerows, targrows);
+		int			j = dmstate->attnoMap[i];
 
-		if (astate->rowstoskip <= 0)
+		if (j == 0)
 		{
-			/* Choose a random reservoir element to replace. */
-			pos = (int) (targrows * sampler_random_fract(astate->rstate.randstate));
-			Assert(pos >= 0 && pos < targrows);
-			heap_freetuple(astate->rows[pos]);
+			values[i] = (Datum) 0;
+			isnull[i] = true;
 		}
 		else
 		{
-			/* Skip this tuple. */
-			pos = -1;
+			values[i] = old_values[j - 1];
+			isnull[i] = old_isnull[j - 1];
 		}
-
-		astate->rowstoskip -= 1;
 	}
 
-	if (pos >= 0)
+	/*
+	 * Build the virtual tuple.
+	 */
+	ExecStoreVirtualTuple(resultSlot);
+
+	/*
+	 * If we have any system columns to return, materialize a heap tuple in
+	 * the slot from column values set above and install system columns in
+	 * that tuple.
+	 */
+	if (dmstate->hasSystemCols)
 	{
-		/*
-		 * Create sample tuple from current result row, and store it in the
-		 * position determined above.  The tuple has to be created in anl_cxt.
-		 */
-		oldcontext = MemoryContextSwitchTo(astate->anl_cxt);
+		HeapTuple	resultTup = ExecFetchSlotHeapTuple(resultSlot, true, NULL);
 
-		astate->rows[pos] = make_tuple_from_result_row(res, row,
-													   astate->rel,
-													   astate->attinmeta,
-													   astate->retrieved_attrs,
-													   NULL,
-													   astate->temp_cxt);
+		/* ctid */
+		if (dmstate->ctidAttno)
+		{
+			ItemPointer ctid = NULL;
 
-		MemoryContextSwitchTo(oldcontext);
+			ctid = (ItemPointer) DatumGetPointer(old_values[dmstate->ctidAttno - 1]);
+			resultTup->t_self = *ctid;
+		}
+
+		/*
+		 * And remaining columns
+		 *
+		 * Note: since we currently don't allow the target relation to appear
+		 * on the nullable side of an outer join, any system columns wouldn't
+		 * go to NULL.
+		 *
+		 * Note: no need to care about tableoid here because it will be
+		 * initialized in ExecProcessReturning().
+		 */
+		HeapTupleHeaderSetXmin(resultTup->t_data, InvalidTransactionId);
+		HeapTupleHeaderSetXmax(resultTup->t_data, InvalidTransactionId);
+		HeapTupleHeaderSetCmin(resultTup->t_data, InvalidTransactionId);
 	}
+
+	/*
+	 * And return the result tuple.
+	 */
+	return resultSlot;
 }
 
 /*
- * Import a foreign schema
+ * Prepare for processing of parameters used in remote query.
  */
-static List *
-postgresImportForeignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid)
+static void
+prepare_query_params(PlanState *node,
+					 List *fdw_exprs,
+					 int numParams,
+					 FmgrInfo **param_flinfo,
+					 List **param_exprs,
+					 const char ***param_values)
 {
-	List	   *commands = NIL;
-	bool		import_collate = true;
-	bool		import_default = false;
-	bool		import_not_null = true;
-	ForeignServer *server;
-	UserMapping *mapping;
-	PGconn	   *conn;
-	StringInfoData buf;
-	PGresult   *volatile res = NULL;
-	int			numrows,
-				i;
+	int			i;
 	ListCell   *lc;
 
-	/* Parse statement options */
-	foreach(lc, stmt->options)
+	Assert(numParams > 0);
+
+	/* Prepare for output conversion of parameters used in remote query. */
+	*param_flinfo = (FmgrInfo *) palloc0(sizeof(FmgrInfo) * numParams);
+
+	i = 0;
+	foreach(lc, fdw_exprs)
 	{
-		DefElem    *def = (DefElem *) lfirst(lc);
+		Node	   *param_expr = (Node *) lfirst(lc);
+		Oid			typefnoid;
+		bool		isvarlena;
 
-		if (strcmp(def->defname, "import_collate") == 0)
-			import_collate = defGetBoolean(def);
-		else if (strcmp(def->defname, "import_default") == 0)
-			import_default = defGetBoolean(def);
-		else if (strcmp(def->defname, "import_not_null") == 0)
-			import_not_null = defGetBoolean(def);
-		else
-			ereport(ERROR,
-					(errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
-					 errmsg("invalid option \"%s\"", def->defname)));
+		getTypeOutputInfo(exprType(param_expr), &typefnoid, &isvarlena);
+		fmgr_info(typefnoid, &(*param_flinfo)[i]);
+		i++;
 	}
 
 	/*
-	 * Get connection to the foreign server.  Connection manager will
-	 * establish new connection if necessary.
+	 * Prepare remote-parameter expressions for evaluation.  (Note: in
+	 * practice, we expect that all these expressions will be just Params, so
+	 * we could possibly do something more efficient than using the full
+	 * expression-eval machinery for this.  But probably there would be little
+	 * benefit, and it'd require pgc_fdw to know more than is desirable
+	 * about Param evaluation.)
 	 */
-	server = GetForeignServer(serverOid);
-	mapping = GetUserMapping(GetUserId(), server->serverid);
-	conn = GetConnection(mapping, false);
+	*param_exprs = ExecInitExprList(fdw_exprs, node);
 
-	/* Don't attempt to import collation if remote server hasn't got it */
-	if (PQserverVersion(conn) < 90100)
-		import_collate = false;
+	/* Allocate buffer for text form of query parameters. */
+	*param_values = (const char **) palloc0(numParams * sizeof(char *));
+}
 
-	/* Create workspace for strings */
-	initStringInfo(&buf);
-
-	/* In what follows, do not risk leaking any PGresults. */
-	PG_TRY();
-	{
-		/* Check that the schema really exists */
-		appendStringInfoString(&buf, "SELECT 1 FROM pg_catalog.pg_namespace WHERE nspname = ");
-		deparseStringLiteral(&buf, stmt->remote_schema);
+/*
+ * Construct array of query parameter values in text format.
+ */
+static void
+process_query_params(ExprContext *econtext,
+					 FmgrInfo *param_flinfo,
+					 List *param_exprs,
+					 const char **param_values)
+{
+	int			nestlevel;
+	int			i;
+	ListCell   *lc;
 
-		res = pgfdw_exec_query(conn, buf.data);
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			pgfdw_report_error(ERROR, res, conn, false, buf.data);
+	nestlevel = set_transmission_modes();
 
-		if (PQntuples(res) != 1)
-			ereport(ERROR,
-					(errcode(ERRCODE_FDW_SCHEMA_NOT_FOUND),
-					 errmsg("schema \"%s\" is not present on foreign server \"%s\"",
-							stmt->remote_schema, server->servername)));
+	i = 0;
+	foreach(lc, param_exprs)
+	{
+		ExprState  *expr_state = (ExprState *) lfirst(lc);
+		Datum		expr_value;
+		bool		isNull;
 
-		PQclear(res);
-		res = NULL;
-		resetStringInfo(&buf);
+		/* Evaluate the parameter expression */
+		expr_value = ExecEvalExpr(expr_state, econtext, &isNull);
 
 		/*
-		 * Fetch all table data from this schema, possibly restricted by
-		 * EXCEPT or LIMIT TO.  (We don't actually need to pay any attention
-		 * to EXCEPT/LIMIT TO here, because the core code will filter the
-		 * statements we return according to those lists anyway.  But it
-		 * should save a few cycles to not process excluded tables in the
-		 * first place.)
-		 *
-		 * Ignore table data for partitions and only include the definitions
-		 * of the root partitioned tables to allow access to the complete
-		 * remote data set locally in the schema imported.
-		 *
-		 * Note: because we run the connection with search_path restricted to
-		 * pg_catalog, the format_type() and pg_get_expr() outputs will always
-		 * include a schema name for types/functions in other schemas, which
-		 * is what we want.
+		 * Get string representation of each parameter value by invoking
+		 * type-specific output function, unless the value is null.
 		 */
-		if (import_collate)
-			appendStringInfoString(&buf,
-								   "SELECT relname, "
-								   "  attname, "
-								   "  format_type(atttypid, atttypmod), "
-								   "  attnotnull, "
-								   "  pg_get_expr(adbin, adrelid), "
-								   "  collname, "
-								   "  collnsp.nspname "
-								   "FROM pg_class c "
-								   "  JOIN pg_namespace n ON "
-								   "    relnamespace = n.oid "
-								   "  LEFT JOIN pg_attribute a ON "
-								   "    attrelid = c.oid AND attnum > 0 "
-								   "      AND NOT attisdropped "
-								   "  LEFT JOIN pg_attrdef ad ON "
-								   "    adrelid = c.oid AND adnum = attnum "
-								   "  LEFT JOIN pg_collation coll ON "
-								   "    coll.oid = attcollation "
-								   "  LEFT JOIN pg_namespace collnsp ON "
-								   "    collnsp.oid = collnamespace ");
+		if (isNull)
+			param_values[i] = NULL;
 		else
-			appendStringInfoString(&buf,
-								   "SELECT relname, "
-								   "  attname, "
-								   "  format_type(atttypid, atttypmod), "
-								   "  attnotnull, "
-								   "  pg_get_expr(adbin, adrelid), "
-								   "  NULL, NULL "
-								   "FROM pg_class c "
-								   "  JOIN pg_namespace n ON "
-								   "    relnamespace = n.oid "
-								   "  LEFT JOIN pg_attribute a ON "
-								   "    attrelid = c.oid AND attnum > 0 "
-								   "      AND NOT attisdropped "
-								   "  LEFT JOIN pg_attrdef ad ON "
-								   "    adrelid = c.oid AND adnum = attnum ");
+			param_values[i] = OutputFunctionCall(&param_flinfo[i], expr_value);
 
-		appendStringInfoString(&buf,
-							   "WHERE c.relkind IN ("
-							   CppAsString2(RELKIND_RELATION) ","
-							   CppAsString2(RELKIND_VIEW) ","
-							   CppAsString2(RELKIND_FOREIGN_TABLE) ","
-							   CppAsString2(RELKIND_MATVIEW) ","
-							   CppAsString2(RELKIND_PARTITIONED_TABLE) ") "
-							   "  AND n.nspname = ");
-		deparseStringLiteral(&buf, stmt->remote_schema);
+		i++;
+	}
 
-		/* Partitions are supported since Postgres 10 */
-		if (PQserverVersion(conn) >= 100000)
-			appendStringInfoString(&buf, " AND NOT c.relispartition ");
+	reset_transmission_modes(nestlevel);
+}
 
-		/* Apply restrictions for LIMIT TO and EXCEPT */
-		if (stmt->list_type == FDW_IMPORT_SCHEMA_LIMIT_TO ||
-			stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT)
-		{
-			bool		first_item = true;
+/*
+ * postgresAnalyzeForeignTable
+ *		Test whether analyzing this foreign table is supported
+ */
+static bool
+postgresAnalyzeForeignTable(Relation relation,
+							AcquireSampleRowsFunc *func,
+							BlockNumber *totalpages)
+{
+	ForeignTable *table;
+	UserMapping *user;
+	PGconn	   *conn;
+	PgFdwConnState *conn_state;
+	StringInfoData sql;
+	PGresult   *volatile res = NULL;
 
-			appendStringInfoString(&buf, " AND c.relname ");
-			if (stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT)
-				appendStringInfoString(&buf, "NOT ");
-			appendStringInfoString(&buf, "IN (");
+	/* Return the row-analysis function pointer */
+	*func = postgresAcquireSampleRowsFunc;
 
-			/* Append list of table names within IN clause */
-			foreach(lc, stmt->table_list)
-			{
-				RangeVar   *rv = (RangeVar *) lfirst(lc);
+	/*
+	 * Now we have to get the number of pages.  It's annoying that the ANALYZE
+	 * API requires us to return that now, because it forces some duplication
+	 * of effort between this routine and postgresAcquireSampleRowsFunc.  But
+	 * it's probably not worth redefining that API at this point.
+	 */
 
-				if (first_item)
-					first_item = false;
-				else
-					appendStringInfoString(&buf, ", ");
-				deparseStringLiteral(&buf, rv->relname);
-			}
-			appendStringInfoChar(&buf, ')');
-		}
+	/*
+	 * Get the connection to use.  We do the remote access as the table's
+	 * owner, even if the ANALYZE was started by some other user.
+	 */
+	table = GetForeignTable(RelationGetRelid(relation));
+	user = GetUserMapping(relation->rd_rel->relowner, table->serverid);
+	conn = GetConnection(user, false, &conn_state);
 
-		/* Append ORDER BY at the end of query to ensure output ordering */
-		appendStringInfoString(&buf, " ORDER BY c.relname, a.attnum");
+	/*
+	 * Construct command to get page count for relation.
+	 */
+	initStringInfo(&sql);
+	deparseAnalyzeSizeSql(&sql, relation);
 
-		/* Fetch the data */
-		res = pgfdw_exec_query(conn, buf.data);
+	/* In what follows, do not risk leaking any PGresults. */
+	PG_TRY();
+	{
+		res = pgfdw_exec_query(conn, sql.data, conn_state);
 		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			pgfdw_report_error(ERROR, res, conn, false, buf.data);
-
-		/* Process results */
-		numrows = PQntuples(res);
-		/* note: incrementation of i happens in inner loop's while() test */
-		for (i = 0; i < numrows;)
-		{
-			char	   *tablename = PQgetvalue(res, i, 0);
-			bool		first_item = true;
+			pgfdw_report_error(ERROR, res, conn, false, sql.data);
 
-			resetStringInfo(&buf);
-			appendStringInfo(&buf, "CREATE FOREIGN TABLE %s (\n",
-							 quote_identifier(tablename));
+		if (PQntuples(res) != 1 || PQnfields(res) != 1)
+			elog(ERROR, "unexpected result from deparseAnalyzeSizeSql query");
+		*totalpages = strtoul(PQgetvalue(res, 0, 0), NULL, 10);
+	}
+	PG_FINALLY();
+	{
+		if (res)
+			PQclear(res);
+	}
+	PG_END_TRY();
 
-			/* Scan all rows for this table */
-			do
-			{
-				char	   *attname;
-				char	   *typename;
-				char	   *attnotnull;
-				char	   *attdefault;
-				char	   *collname;
-				char	   *collnamespace;
+	ReleaseConnection(conn);
 
-				/* If table has no columns, we'll see nulls here */
-				if (PQgetisnull(res, i, 1))
-					continue;
+	return true;
+}
 
-				attname = PQgetvalue(res, i, 1);
-				typename = PQgetvalue(res, i, 2);
-				attnotnull = PQgetvalue(res, i, 3);
-				attdefault = PQgetisnull(res, i, 4) ? (char *) NULL :
-					PQgetvalue(res, i, 4);
-				collname = PQgetisnull(res, i, 5) ? (char *) NULL :
-					PQgetvalue(res, i, 5);
-				collnamespace = PQgetisnull(res, i, 6) ? (char *) NULL :
-					PQgetvalue(res, i, 6);
+/*
+ * Acquire a random sample of rows from foreign table managed by pgc_fdw.
+ *
+ * We fetch the whole table from the remote side and pick out some sample rows.
+ *
+ * Selected rows are returned in the caller-allocated array rows[],
+ * which must have at least targrows entries.
+ * The actual number of rows selected is returned as the function result.
+ * We also count the total number of rows in the table and return it into
+ * *totalrows.  Note that *totaldeadrows is always set to 0.
+ *
+ * Note that the returned list of rows is not always in order by physical
+ * position in the table.  Therefore, correlation estimates derived later
+ * may be meaningless, but it's OK because we don't use the estimates
+ * currently (the planner only pays attention to correlation for indexscans).
+ */
+static int
+postgresAcquireSampleRowsFunc(Relation relation, int elevel,
+							  HeapTuple *rows, int targrows,
+							  double *totalrows,
+							  double *totaldeadrows)
+{
+	PgFdwAnalyzeState astate;
+	ForeignTable *table;
+	ForeignServer *server;
+	UserMapping *user;
+	PGconn	   *conn;
+	PgFdwConnState *conn_state;
+	unsigned int cursor_number;
+	StringInfoData sql;
+	PGresult   *volatile res = NULL;
 
-				if (first_item)
-					first_item = false;
-				else
-					appendStringInfoString(&buf, ",\n");
+	/* Initialize workspace state */
+	astate.rel = relation;
+	astate.attinmeta = TupleDescGetAttInMetadata(RelationGetDescr(relation));
 
-				/* Print column name and type */
-				appendStringInfo(&buf, "  %s %s",
+	astate.rows = rows;
+	astate.targrows = targrows;
+	astate.numrows = 0;
+	astate.samplerows = 0;
+	astate.rowstoskip = -1;		/* -1 means not set yet */
+	reservoir_init_selection_state(&astate.rstate, targrows);
+
+	/* Remember ANALYZE context, and create a per-tuple temp context */
+	astate.anl_cxt = CurrentMemoryContext;
+	astate.temp_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											"pgc_fdw temporary data",
+											ALLOCSET_SMALL_SIZES);
+
+	/*
+	 * Get the connection to use.  We do the remote access as the table's
+	 * owner, even if the ANALYZE was started by some other user.
+	 */
+	table = GetForeignTable(RelationGetRelid(relation));
+	server = GetForeignServer(table->serverid);
+	user = GetUserMapping(relation->rd_rel->relowner, table->serverid);
+	conn = GetConnection(user, false, &conn_state);
+
+	/*
+	 * Construct cursor that retrieves whole rows from remote.
+	 */
+	cursor_number = GetCursorNumber(conn);
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "DECLARE c%u CURSOR FOR ", cursor_number);
+	deparseAnalyzeSql(&sql, relation, &astate.retrieved_attrs);
+
+	/* In what follows, do not risk leaking any PGresults. */
+	PG_TRY();
+	{
+		char		fetch_sql[64];
+		int			fetch_size;
+		ListCell   *lc;
+
+		res = pgfdw_exec_query(conn, sql.data, conn_state);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			pgfdw_report_error(ERROR, res, conn, false, sql.data);
+		PQclear(res);
+		res = NULL;
+
+		/*
+		 * Determine the fetch size.  The default is arbitrary, but shouldn't
+		 * be enormous.
+		 */
+		fetch_size = 100;
+		foreach(lc, server->options)
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, "fetch_size") == 0)
+			{
+				fetch_size = strtol(defGetString(def), NULL, 10);
+				break;
+			}
+		}
+		foreach(lc, table->options)
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, "fetch_size") == 0)
+			{
+				fetch_size = strtol(defGetString(def), NULL, 10);
+				break;
+			}
+		}
+
+		/* Construct command to fetch rows from remote. */
+		snprintf(fetch_sql, sizeof(fetch_sql), "FETCH %d FROM c%u",
+				 fetch_size, cursor_number);
+
+		/* Retrieve and process rows a batch at a time. */
+		for (;;)
+		{
+			int			numrows;
+			int			i;
+
+			/* Allow users to cancel long query */
+			CHECK_FOR_INTERRUPTS();
+
+			/*
+			 * XXX possible future improvement: if rowstoskip is large, we
+			 * could issue a MOVE rather than physically fetching the rows,
+			 * then just adjust rowstoskip and samplerows appropriately.
+			 */
+
+			/* Fetch some rows */
+			res = pgfdw_exec_query(conn, fetch_sql, conn_state);
+			/* On error, report the original query, not the FETCH. */
+			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+				pgfdw_report_error(ERROR, res, conn, false, sql.data);
+
+			/* Process whatever we got. */
+			numrows = PQntuples(res);
+			for (i = 0; i < numrows; i++)
+				analyze_row_processor(res, i, &astate);
+
+			PQclear(res);
+			res = NULL;
+
+			/* Must be EOF if we didn't get all the rows requested. */
+			if (numrows < fetch_size)
+				break;
+		}
+
+		/* Close the cursor, just to be tidy. */
+		close_cursor(conn, cursor_number, conn_state);
+	}
+	PG_CATCH();
+	{
+		if (res)
+			PQclear(res);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	ReleaseConnection(conn);
+
+	/* We assume that we have no dead tuple. */
+	*totaldeadrows = 0.0;
+
+	/* We've retrieved all living tuples from foreign server. */
+	*totalrows = astate.samplerows;
+
+	/*
+	 * Emit some interesting relation info
+	 */
+	ereport(elevel,
+			(errmsg("\"%s\": table contains %.0f rows, %d rows in sample",
+					RelationGetRelationName(relation),
+					astate.samplerows, astate.numrows)));
+
+	return astate.numrows;
+}
+
+/*
+ * Collect sample rows from the result of query.
+ *	 - Use all tuples in sample until target # of samples are collected.
+ *	 - Subsequently, replace already-sampled tuples randomly.
+ */
+static void
+analyze_row_processor(PGresult *res, int row, PgFdwAnalyzeState *astate)
+{
+	int			targrows = astate->targrows;
+	int			pos;			/* array index to store tuple in */
+	MemoryContext oldcontext;
+
+	/* Always increment sample row counter. */
+	astate->samplerows += 1;
+
+	/*
+	 * Determine the slot where this sample row should be stored.  Set pos to
+	 * negative value to indicate the row should be skipped.
+	 */
+	if (astate->numrows < targrows)
+	{
+		/* First targrows rows are always included into the sample */
+		pos = astate->numrows++;
+	}
+	else
+	{
+		/*
+		 * Now we start replacing tuples in the sample until we reach the end
+		 * of the relation.  Same algorithm as in acquire_sample_rows in
+		 * analyze.c; see Jeff Vitter's paper.
+		 */
+		if (astate->rowstoskip < 0)
+			astate->rowstoskip = reservoir_get_next_S(&astate->rstate, astate->samplerows, targrows);
+
+		if (astate->rowstoskip <= 0)
+		{
+			/* Choose a random reservoir element to replace. */
+			pos = (int) (targrows * sampler_random_fract(astate->rstate.randstate));
+			Assert(pos >= 0 && pos < targrows);
+			heap_freetuple(astate->rows[pos]);
+		}
+		else
+		{
+			/* Skip this tuple. */
+			pos = -1;
+		}
+
+		astate->rowstoskip -= 1;
+	}
+
+	if (pos >= 0)
+	{
+		/*
+		 * Create sample tuple from current result row, and store it in the
+		 * position determined above.  The tuple has to be created in anl_cxt.
+		 */
+		oldcontext = MemoryContextSwitchTo(astate->anl_cxt);
+
+		astate->rows[pos] = make_tuple_from_result_row(res, row,
+													   astate->rel,
+													   astate->attinmeta,
+													   NULL,
+													   astate->retrieved_attrs,
+													   NULL,
+													   astate->temp_cxt);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+}
+
+/*
+ * Import a foreign schema
+ */
+static List *
+postgresImportForeignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid)
+{
+	List	   *commands = NIL;
+	bool		import_collate = true;
+	bool		import_default = false;
+	bool		import_not_null = true;
+	ForeignServer *server;
+	UserMapping *mapping;
+	PGconn	   *conn;
+	PgFdwConnState *conn_state;
+	StringInfoData buf;
+	PGresult   *volatile res = NULL;
+	int			numrows,
+				i;
+	ListCell   *lc;
+
+	/* Parse statement options */
+	foreach(lc, stmt->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "import_collate") == 0)
+			import_collate = defGetBoolean(def);
+		else if (strcmp(def->defname, "import_default") == 0)
+			import_default = defGetBoolean(def);
+		else if (strcmp(def->defname, "import_not_null") == 0)
+			import_not_null = defGetBoolean(def);
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+					 errmsg("invalid option \"%s\"", def->defname)));
+	}
+
+	/*
+	 * Get connection to the foreign server.  Connection manager will
+	 * establish new connection if necessary.
+	 */
+	server = GetForeignServer(serverOid);
+	mapping = GetUserMapping(GetUserId(), server->serverid);
+	conn = GetConnection(mapping, false, &conn_state);
+
+	/* Don't attempt to import collation if remote server hasn't got it */
+	if (PQserverVersion(conn) < 90100)
+		import_collate = false;
+
+	/* Create workspace for strings */
+	initStringInfo(&buf);
+
+	/* In what follows, do not risk leaking any PGresults. */
+	PG_TRY();
+	{
+		/* Check that the schema really exists */
+		appendStringInfoString(&buf, "SELECT 1 FROM pg_catalog.pg_namespace WHERE nspname = ");
+		deparseStringLiteral(&buf, stmt->remote_schema);
+
+		res = pgfdw_exec_query(conn, buf.data, conn_state);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			pgfdw_report_error(ERROR, res, conn, false, buf.data);
+
+		if (PQntuples(res) != 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_SCHEMA_NOT_FOUND),
+					 errmsg("schema \"%s\" is not present on foreign server \"%s\"",
+							stmt->remote_schema, server->servername)));
+
+		PQclear(res);
+		res = NULL;
+		resetStringInfo(&buf);
+
+		/*
+		 * Fetch all table data from this schema, possibly restricted by
+		 * EXCEPT or LIMIT TO.  (We don't actually need to pay any attention
+		 * to EXCEPT/LIMIT TO here, because the core code will filter the
+		 * statements we return according to those lists anyway.  But it
+		 * should save a few cycles to not process excluded tables in the
+		 * first place.)
+		 *
+		 * Ignore table data for partitions and only include the definitions
+		 * of the root partitioned tables to allow access to the complete
+		 * remote data set locally in the schema imported.
+		 *
+		 * Note: because we run the connection with search_path restricted to
+		 * pg_catalog, the format_type() and pg_get_expr() outputs will always
+		 * include a schema name for types/functions in other schemas, which
+		 * is what we want.
+		 */
+		if (import_collate)
+			appendStringInfoString(&buf,
+								   "SELECT relname, "
+								   "  attname, "
+								   "  format_type(atttypid, atttypmod), "
+								   "  attnotnull, "
+								   "  pg_get_expr(adbin, adrelid), "
+								   "  collname, "
+								   "  collnsp.nspname "
+								   "FROM pg_class c "
+								   "  JOIN pg_namespace n ON "
+								   "    relnamespace = n.oid "
+								   "  LEFT JOIN pg_attribute a ON "
+								   "    attrelid = c.oid AND attnum > 0 "
+								   "      AND NOT attisdropped "
+								   "  LEFT JOIN pg_attrdef ad ON "
+								   "    adrelid = c.oid AND adnum = attnum "
+								   "  LEFT JOIN pg_collation coll ON "
+								   "    coll.oid = attcollation "
+								   "  LEFT JOIN pg_namespace collnsp ON "
+								   "    collnsp.oid = collnamespace ");
+		else
+			appendStringInfoString(&buf,
+								   "SELECT relname, "
+								   "  attname, "
+								   "  format_type(atttypid, atttypmod), "
+								   "  attnotnull, "
+								   "  pg_get_expr(adbin, adrelid), "
+								   "  NULL, NULL "
+								   "FROM pg_class c "
+								   "  JOIN pg_namespace n ON "
+								   "    relnamespace = n.oid "
+								   "  LEFT JOIN pg_attribute a ON "
+								   "    attrelid = c.oid AND attnum > 0 "
+								   "      AND NOT attisdropped "
+								   "  LEFT JOIN pg_attrdef ad ON "
+								   "    adrelid = c.oid AND adnum = attnum ");
+
+		appendStringInfoString(&buf,
+							   "WHERE c.relkind IN ("
+							   CppAsString2(RELKIND_RELATION) ","
+							   CppAsString2(RELKIND_VIEW) ","
+							   CppAsString2(RELKIND_FOREIGN_TABLE) ","
+							   CppAsString2(RELKIND_MATVIEW) ","
+							   CppAsString2(RELKIND_PARTITIONED_TABLE) ") "
+							   "  AND n.nspname = ");
+		deparseStringLiteral(&buf, stmt->remote_schema);
+
+		/* Partitions are supported since Postgres 10 */
+		if (PQserverVersion(conn) >= 100000)
+			appendStringInfoString(&buf, " AND NOT c.relispartition ");
+
+		/* Apply restrictions for LIMIT TO and EXCEPT */
+		if (stmt->list_type == FDW_IMPORT_SCHEMA_LIMIT_TO ||
+			stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT)
+		{
+			bool		first_item = true;
+
+			appendStringInfoString(&buf, " AND c.relname ");
+			if (stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT)
+				appendStringInfoString(&buf, "NOT ");
+			appendStringInfoString(&buf, "IN (");
+
+			/* Append list of table names within IN clause */
+			foreach(lc, stmt->table_list)
+			{
+				RangeVar   *rv = (RangeVar *) lfirst(lc);
+
+				if (first_item)
+					first_item = false;
+				else
+					appendStringInfoString(&buf, ", ");
+				deparseStringLiteral(&buf, rv->relname);
+			}
+			appendStringInfoChar(&buf, ')');
+		}
+
+		/* Append ORDER BY at the end of query to ensure output ordering */
+		appendStringInfoString(&buf, " ORDER BY c.relname, a.attnum");
+
+		/* Fetch the data */
+		res = pgfdw_exec_query(conn, buf.data, conn_state);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			pgfdw_report_error(ERROR, res, conn, false, buf.data);
+
+		/* Process results */
+		numrows = PQntuples(res);
+		/* note: incrementation of i happens in inner loop's while() test */
+		for (i = 0; i < numrows;)
+		{
+			char	   *tablename = PQgetvalue(res, i, 0);
+			bool		first_item = true;
+
+			resetStringInfo(&buf);
+			appendStringInfo(&buf, "CREATE FOREIGN TABLE %s (\n",
+							 quote_identifier(tablename));
+
+			/* Scan all rows for this table */
+			do
+			{
+				char	   *attname;
+				char	   *typename;
+				char	   *attnotnull;
+				char	   *attdefault;
+				char	   *collname;
+				char	   *collnamespace;
+
+				/* If table has no columns, we'll see nulls here */
+				if (PQgetisnull(res, i, 1))
+					continue;
+
+				attname = PQgetvalue(res, i, 1);
+				typename = PQgetvalue(res, i, 2);
+				attnotnull = PQgetvalue(res, i, 3);
+				attdefault = PQgetisnull(res, i, 4) ? (char *) NULL :
+					PQgetvalue(res, i, 4);
+				collname = PQgetisnull(res, i, 5) ? (char *) NULL :
+					PQgetvalue(res, i, 5);
+				collnamespace = PQgetisnull(res, i, 6) ? (char *) NULL :
+					PQgetvalue(res, i, 6);
+
+				if (first_item)
+					first_item = false;
+				else
+					appendStringInfoString(&buf, ",\n");
+
+				/* Print column name and type */
+				appendStringInfo(&buf, "  %s %s",
 								 quote_identifier(attname),
 								 typename);
 
-				/*
-				 * Add column_name option so that renaming the foreign table's
-				 * column doesn't break the association to the underlying
-				 * column.
-				 */
-				appendStringInfoString(&buf, " OPTIONS (column_name ");
-				deparseStringLiteral(&buf, attname);
-				appendStringInfoChar(&buf, ')');
+				/*
+				 * Add column_name option so that renaming the foreign table's
+				 * column doesn't break the association to the underlying
+				 * column.
+				 */
+				appendStringInfoString(&buf, " OPTIONS (column_name ");
+				deparseStringLiteral(&buf, attname);
+				appendStringInfoChar(&buf, ')');
+
+				/* Add COLLATE if needed */
+				if (import_collate && collname != NULL && collnamespace != NULL)
+					appendStringInfo(&buf, " COLLATE %s.%s",
+									 quote_identifier(collnamespace),
+									 quote_identifier(collname));
+
+				/* Add DEFAULT if needed */
+				if (import_default && attdefault != NULL)
+					appendStringInfo(&buf, " DEFAULT %s", attdefault);
+
+				/* Add NOT NULL if needed */
+				if (import_not_null && attnotnull[0] == 't')
+					appendStringInfoString(&buf, " NOT NULL");
+			}
+			while (++i < numrows &&
+				   strcmp(PQgetvalue(res, i, 0), tablename) == 0);
+
+			/*
+			 * Add server name and table-level options.  We specify remote
+			 * schema and table name as options (the latter to ensure that
+			 * renaming the foreign table doesn't break the association).
+			 */
+			appendStringInfo(&buf, "\n) SERVER %s\nOPTIONS (",
+							 quote_identifier(server->servername));
+
+			appendStringInfoString(&buf, "schema_name ");
+			deparseStringLiteral(&buf, stmt->remote_schema);
+			appendStringInfoString(&buf, ", table_name ");
+			deparseStringLiteral(&buf, tablename);
+
+			appendStringInfoString(&buf, ");");
+
+			commands = lappend(commands, pstrdup(buf.data));
+		}
+	}
+	PG_FINALLY();
+	{
+		if (res)
+			PQclear(res);
+	}
+	PG_END_TRY();
+
+	ReleaseConnection(conn);
+
+	return commands;
+}
+
+/*
+ * Assess whether the join between inner and outer relations can be pushed down
+ * to the foreign server. As a side effect, save information we obtain in this
+ * function to PgFdwRelationInfo passed in.
+ */
+static bool
+foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
+				RelOptInfo *outerrel, RelOptInfo *innerrel,
+				JoinPathExtraData *extra)
+{
+	PgFdwRelationInfo *fpinfo;
+	PgFdwRelationInfo *fpinfo_o;
+	PgFdwRelationInfo *fpinfo_i;
+	ListCell   *lc;
+	List	   *joinclauses;
+
+	/*
+	 * We support pushing down INNER, LEFT, RIGHT and FULL OUTER joins.
+	 * Constructing queries representing SEMI and ANTI joins is hard, hence
+	 * not considered right now.
+	 */
+	if (jointype != JOIN_INNER && jointype != JOIN_LEFT &&
+		jointype != JOIN_RIGHT && jointype != JOIN_FULL)
+		return false;
+
+	/*
+	 * If either of the joining relations is marked as unsafe to pushdown, the
+	 * join can not be pushed down.
+	 */
+	fpinfo = (PgFdwRelationInfo *) joinrel->fdw_private;
+	fpinfo_o = (PgFdwRelationInfo *) outerrel->fdw_private;
+	fpinfo_i = (PgFdwRelationInfo *) innerrel->fdw_private;
+	if (!fpinfo_o || !fpinfo_o->pushdown_safe ||
+		!fpinfo_i || !fpinfo_i->pushdown_safe)
+		return false;
+
+	/*
+	 * If joining relations have local conditions, those conditions are
+	 * required to be applied before joining the relations. Hence the join can
+	 * not be pushed down.
+	 */
+	if (fpinfo_o->local_conds || fpinfo_i->local_conds)
+		return false;
+
+	/*
+	 * Merge FDW options.  We might be tempted to do this after we have deemed
+	 * the foreign join to be OK.  But we must do this beforehand so that we
+	 * know which quals can be evaluated on the foreign server, which might
+	 * depend on shippable_extensions.
+	 */
+	fpinfo->server = fpinfo_o->server;
+	merge_fdw_options(fpinfo, fpinfo_o, fpinfo_i);
+
+	/*
+	 * Separate restrict list into join quals and pushed-down (other) quals.
+	 *
+	 * Join quals belonging to an outer join must all be shippable, else we
+	 * cannot execute the join remotely.  Add such quals to 'joinclauses'.
+	 *
+	 * Add other quals to fpinfo->remote_conds if they are shippable, else to
+	 * fpinfo->local_conds.  In an inner join it's okay to execute conditions
+	 * either locally or remotely; the same is true for pushed-down conditions
+	 * at an outer join.
+	 *
+	 * Note we might return failure after having already scribbled on
+	 * fpinfo->remote_conds and fpinfo->local_conds.  That's okay because we
+	 * won't consult those lists again if we deem the join unshippable.
+	 */
+	joinclauses = NIL;
+	foreach(lc, extra->restrictlist)
+	{
+		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+		bool		is_remote_clause = is_foreign_expr(root, joinrel,
+													   rinfo->clause);
+
+		if (IS_OUTER_JOIN(jointype) &&
+			!RINFO_IS_PUSHED_DOWN(rinfo, joinrel->relids))
+		{
+			if (!is_remote_clause)
+				return false;
+			joinclauses = lappend(joinclauses, rinfo);
+		}
+		else
+		{
+			if (is_remote_clause)
+				fpinfo->remote_conds = lappend(fpinfo->remote_conds, rinfo);
+			else
+				fpinfo->local_conds = lappend(fpinfo->local_conds, rinfo);
+		}
+	}
+
+	/*
+	 * deparseExplicitTargetList() isn't smart enough to handle anything other
+	 * than a Var.  In particular, if there's some PlaceHolderVar that would
+	 * need to be evaluated within this join tree (because there's an upper
+	 * reference to a quantity that may go to NULL as a result of an outer
+	 * join), then we can't try to push the join down because we'll fail when
+	 * we get to deparseExplicitTargetList().  However, a PlaceHolderVar that
+	 * needs to be evaluated *at the top* of this join tree is OK, because we
+	 * can do that locally after fetching the results from the remote side.
+	 */
+	foreach(lc, root->placeholder_list)
+	{
+		PlaceHolderInfo *phinfo = lfirst(lc);
+		Relids		relids;
+
+		/* PlaceHolderInfo refers to parent relids, not child relids. */
+		relids = IS_OTHER_REL(joinrel) ?
+			joinrel->top_parent_relids : joinrel->relids;
+
+		if (bms_is_subset(phinfo->ph_eval_at, relids) &&
+			bms_nonempty_difference(relids, phinfo->ph_eval_at))
+			return false;
+	}
+
+	/* Save the join clauses, for later use. */
+	fpinfo->joinclauses = joinclauses;
+
+	fpinfo->outerrel = outerrel;
+	fpinfo->innerrel = innerrel;
+	fpinfo->jointype = jointype;
+
+	/*
+	 * By default, both the input relations are not required to be deparsed as
+	 * subqueries, but there might be some relations covered by the input
+	 * relations that are required to be deparsed as subqueries, so save the
+	 * relids of those relations for later use by the deparser.
+	 */
+	fpinfo->make_outerrel_subquery = false;
+	fpinfo->make_innerrel_subquery = false;
+	Assert(bms_is_subset(fpinfo_o->lower_subquery_rels, outerrel->relids));
+	Assert(bms_is_subset(fpinfo_i->lower_subquery_rels, innerrel->relids));
+	fpinfo->lower_subquery_rels = bms_union(fpinfo_o->lower_subquery_rels,
+											fpinfo_i->lower_subquery_rels);
+
+	/*
+	 * Pull the other remote conditions from the joining relations into join
+	 * clauses or other remote clauses (remote_conds) of this relation
+	 * wherever possible. This avoids building subqueries at every join step.
+	 *
+	 * For an inner join, clauses from both the relations are added to the
+	 * other remote clauses. For LEFT and RIGHT OUTER join, the clauses from
+	 * the outer side are added to remote_conds since those can be evaluated
+	 * after the join is evaluated. The clauses from inner side are added to
+	 * the joinclauses, since they need to be evaluated while constructing the
+	 * join.
+	 *
+	 * For a FULL OUTER JOIN, the other clauses from either relation can not
+	 * be added to the joinclauses or remote_conds, since each relation acts
+	 * as an outer relation for the other.
+	 *
+	 * The joining sides can not have local conditions, thus no need to test
+	 * shippability of the clauses being pulled up.
+	 */
+	switch (jointype)
+	{
+		case JOIN_INNER:
+			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
+											   fpinfo_i->remote_conds);
+			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
+											   fpinfo_o->remote_conds);
+			break;
+
+		case JOIN_LEFT:
+			fpinfo->joinclauses = list_concat(fpinfo->joinclauses,
+											  fpinfo_i->remote_conds);
+			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
+											   fpinfo_o->remote_conds);
+			break;
+
+		case JOIN_RIGHT:
+			fpinfo->joinclauses = list_concat(fpinfo->joinclauses,
+											  fpinfo_o->remote_conds);
+			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
+											   fpinfo_i->remote_conds);
+			break;
+
+		case JOIN_FULL:
+
+			/*
+			 * In this case, if any of the input relations has conditions, we
+			 * need to deparse that relation as a subquery so that the
+			 * conditions can be evaluated before the join.  Remember it in
+			 * the fpinfo of this relation so that the deparser can take
+			 * appropriate action.  Also, save the relids of base relations
+			 * covered by that relation for later use by the deparser.
+			 */
+			if (fpinfo_o->remote_conds)
+			{
+				fpinfo->make_outerrel_subquery = true;
+				fpinfo->lower_subquery_rels =
+					bms_add_members(fpinfo->lower_subquery_rels,
+									outerrel->relids);
+			}
+			if (fpinfo_i->remote_conds)
+			{
+				fpinfo->make_innerrel_subquery = true;
+				fpinfo->lower_subquery_rels =
+					bms_add_members(fpinfo->lower_subquery_rels,
+									innerrel->relids);
+			}
+			break;
+
+		default:
+			/* Should not happen, we have just checked this above */
+			elog(ERROR, "unsupported join type %d", jointype);
+	}
+
+	/*
+	 * For an inner join, all restrictions can be treated alike. Treating the
+	 * pushed down conditions as join conditions allows a top level full outer
+	 * join to be deparsed without requiring subqueries.
+	 */
+	if (jointype == JOIN_INNER)
+	{
+		Assert(!fpinfo->joinclauses);
+		fpinfo->joinclauses = fpinfo->remote_conds;
+		fpinfo->remote_conds = NIL;
+	}
+
+	/* Mark that this join can be pushed down safely */
+	fpinfo->pushdown_safe = true;
+
+	/* Get user mapping */
+	if (fpinfo->use_remote_estimate)
+	{
+		if (fpinfo_o->use_remote_estimate)
+			fpinfo->user = fpinfo_o->user;
+		else
+			fpinfo->user = fpinfo_i->user;
+	}
+	else
+		fpinfo->user = NULL;
+
+	/*
+	 * Set # of retrieved rows and cached relation costs to some negative
+	 * value, so that we can detect when they are set to some sensible values,
+	 * during one (usually the first) of the calls to estimate_path_cost_size.
+	 */
+	fpinfo->retrieved_rows = -1;
+	fpinfo->rel_startup_cost = -1;
+	fpinfo->rel_total_cost = -1;
+
+	/*
+	 * Set the string describing this join relation to be used in EXPLAIN
+	 * output of corresponding ForeignScan.  Note that the decoration we add
+	 * to the base relation names mustn't include any digits, or it'll confuse
+	 * postgresExplainForeignScan.
+	 */
+	fpinfo->relation_name = psprintf("(%s) %s JOIN (%s)",
+									 fpinfo_o->relation_name,
+									 get_jointype_name(fpinfo->jointype),
+									 fpinfo_i->relation_name);
+
+	/*
+	 * Set the relation index.  This is defined as the position of this
+	 * joinrel in the join_rel_list list plus the length of the rtable list.
+	 * Note that since this joinrel is at the end of the join_rel_list list
+	 * when we are called, we can get the position by list_length.
+	 */
+	Assert(fpinfo->relation_index == 0);	/* shouldn't be set yet */
+	fpinfo->relation_index =
+		list_length(root->parse->rtable) + list_length(root->join_rel_list);
+
+	return true;
+}
+
+static void
+add_paths_with_pathkeys_for_rel(PlannerInfo *root, RelOptInfo *rel,
+								Path *epq_path)
+{
+	List	   *useful_pathkeys_list = NIL; /* List of all pathkeys */
+	ListCell   *lc;
 
-				/* Add COLLATE if needed */
-				if (import_collate && collname != NULL && collnamespace != NULL)
-					appendStringInfo(&buf, " COLLATE %s.%s",
-									 quote_identifier(collnamespace),
-									 quote_identifier(collname));
+	useful_pathkeys_list = get_useful_pathkeys_for_relation(root, rel);
+
+	/* Create one path for each set of pathkeys we found above. */
+	foreach(lc, useful_pathkeys_list)
+	{
+		double		rows;
+		int			width;
+		Cost		startup_cost;
+		Cost		total_cost;
+		List	   *useful_pathkeys = lfirst(lc);
+		Path	   *sorted_epq_path;
+
+		estimate_path_cost_size(root, rel, NIL, useful_pathkeys, NULL,
+								&rows, &width, &startup_cost, &total_cost);
+
+		/*
+		 * The EPQ path must be at least as well sorted as the path itself, in
+		 * case it gets used as input to a mergejoin.
+		 */
+		sorted_epq_path = epq_path;
+		if (sorted_epq_path != NULL &&
+			!pathkeys_contained_in(useful_pathkeys,
+								   sorted_epq_path->pathkeys))
+			sorted_epq_path = (Path *)
+				create_sort_path(root,
+								 rel,
+								 sorted_epq_path,
+								 useful_pathkeys,
+								 -1.0);
+
+		if (IS_SIMPLE_REL(rel))
+			add_path(rel, (Path *)
+					 create_foreignscan_path(root, rel,
+											 NULL,
+											 rows,
+											 startup_cost,
+											 total_cost,
+											 useful_pathkeys,
+											 rel->lateral_relids,
+											 sorted_epq_path,
+											 NIL));
+		else
+			add_path(rel, (Path *)
+					 create_foreign_join_path(root, rel,
+											  NULL,
+											  rows,
+											  startup_cost,
+											  total_cost,
+											  useful_pathkeys,
+											  rel->lateral_relids,
+											  sorted_epq_path,
+											  NIL));
+	}
+}
+
+/*
+ * Parse options from foreign server and apply them to fpinfo.
+ *
+ * New options might also require tweaking merge_fdw_options().
+ */
+static void
+apply_server_options(PgFdwRelationInfo *fpinfo)
+{
+	ListCell   *lc;
+
+	foreach(lc, fpinfo->server->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "use_remote_estimate") == 0)
+			fpinfo->use_remote_estimate = defGetBoolean(def);
+		else if (strcmp(def->defname, "use_binary_format") == 0)
+			fpinfo->use_binary_format = defGetBoolean(def);
+		else if (strcmp(def->defname, "async_capable") == 0)
+			fpinfo->async_capable = defGetBoolean(def);
+		else if (strcmp(def->defname, "fdw_startup_cost") == 0)
+			fpinfo->fdw_startup_cost = strtod(defGetString(def), NULL);
+		else if (strcmp(def->defname, "fdw_tuple_cost") == 0)
+			fpinfo->fdw_tuple_cost = strtod(defGetString(def), NULL);
+		else if (strcmp(def->defname, "cache_startup_cost") == 0)
+			fpinfo->cache_startup_cost = strtod(defGetString(def), NULL);
+		else if (strcmp(def->defname, "cache_tuple_cost") == 0)
+			fpinfo->cache_tuple_cost = strtod(defGetString(def), NULL);
+		else if (strcmp(def->defname, "extensions") == 0)
+			fpinfo->shippable_extensions =
+				ExtractExtensionList(defGetString(def), false);
+		else if (strcmp(def->defname, "fetch_size") == 0)
+			fpinfo->fetch_size = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_timeout") == 0)
+			fpinfo->cache_timeout = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_stale_grace") == 0)
+			fpinfo->cache_stale_grace = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_param_batch") == 0)
+			fpinfo->cache_param_batch = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_compression") == 0)
+			fpinfo->cache_compression =
+				Max(pgcache_codec_by_name(defGetString(def)), PGC_CODEC_NONE);
+	}
+}
+
+/*
+ * Parse options from foreign table and apply them to fpinfo.
+ *
+ * New options might also require tweaking merge_fdw_options().
+ */
+static void
+apply_table_options(PgFdwRelationInfo *fpinfo)
+{
+	ListCell   *lc;
+
+	foreach(lc, fpinfo->table->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "use_remote_estimate") == 0)
+			fpinfo->use_remote_estimate = defGetBoolean(def);
+		else if (strcmp(def->defname, "use_binary_format") == 0)
+			fpinfo->use_binary_format = defGetBoolean(def);
+		else if (strcmp(def->defname, "async_capable") == 0)
+			fpinfo->async_capable = defGetBoolean(def);
+		else if (strcmp(def->defname, "fetch_size") == 0)
+			fpinfo->fetch_size = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_timeout") == 0) 
+			fpinfo->cache_timeout = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_stale_grace") == 0)
+			fpinfo->cache_stale_grace = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_param_batch") == 0)
+			fpinfo->cache_param_batch = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_compression") == 0)
+			fpinfo->cache_compression =
+				Max(pgcache_codec_by_name(defGetString(def)), PGC_CODEC_NONE);
+	}
+}
+
+/*
+ * Merge FDW options from input relations into a new set of options for a join
+ * or an upper rel.
+ *
+ * For a join relation, FDW-specific information about the inner and outer
+ * relations is provided using fpinfo_i and fpinfo_o.  For an upper relation,
+ * fpinfo_o provides the information for the input relation; fpinfo_i is
+ * expected to NULL.
+ */
+static void
+merge_fdw_options(PgFdwRelationInfo *fpinfo,
+				  const PgFdwRelationInfo *fpinfo_o,
+				  const PgFdwRelationInfo *fpinfo_i)
+{
+	/* We must always have fpinfo_o. */
+	Assert(fpinfo_o);
+
+	/* fpinfo_i may be NULL, but if present the servers must both match. */
+	Assert(!fpinfo_i ||
+		   fpinfo_i->server->serverid == fpinfo_o->server->serverid);
+
+	/*
+	 * Copy the server specific FDW options.  (For a join, both relations come
+	 * from the same server, so the server options should have the same value
+	 * for both relations.)
+	 */
+	fpinfo->fdw_startup_cost = fpinfo_o->fdw_startup_cost;
+	fpinfo->fdw_tuple_cost = fpinfo_o->fdw_tuple_cost;
+	fpinfo->cache_startup_cost = fpinfo_o->cache_startup_cost;
+	fpinfo->cache_tuple_cost = fpinfo_o->cache_tuple_cost;
+	fpinfo->shippable_extensions = fpinfo_o->shippable_extensions;
+	fpinfo->use_remote_estimate = fpinfo_o->use_remote_estimate;
+	fpinfo->use_binary_format = fpinfo_o->use_binary_format;
+	fpinfo->async_capable = fpinfo_o->async_capable;
+	fpinfo->fetch_size = fpinfo_o->fetch_size;
+	fpinfo->cache_timeout = fpinfo_o->cache_timeout;
+	fpinfo->cache_stale_grace = fpinfo_o->cache_stale_grace;
+	fpinfo->cache_compression = fpinfo_o->cache_compression;
+	fpinfo->cache_param_batch = fpinfo_o->cache_param_batch;
+
+	/* Merge the table level options from either side of the join. */
+	if (fpinfo_i)
+	{
+		/*
+		 * We'll prefer to use remote estimates for this join if any table
+		 * from either side of the join is using remote estimates.  This is
+		 * most likely going to be preferred since they're already willing to
+		 * pay the price of a round trip to get the remote EXPLAIN.  In any
+		 * case it's not entirely clear how we might otherwise handle this
+		 * best.
+		 */
+		fpinfo->use_remote_estimate = fpinfo_o->use_remote_estimate ||
+			fpinfo_i->use_remote_estimate;
+
+		/*
+		 * Set fetch size to maximum of the joining sides, since we are
+		 * expecting the rows returned by the join to be proportional to the
+		 * relation sizes.
+		 */
+		fpinfo->fetch_size = Max(fpinfo_o->fetch_size, fpinfo_i->fetch_size);
+
+		/* Binary results only if both sides opted in. */
+		fpinfo->use_binary_format = fpinfo_o->use_binary_format &&
+			fpinfo_i->use_binary_format;
+
+		/*
+		 * The join is run by the one remote server either way, start it
+		 * early if either side is willing to.
+		 */
+		fpinfo->async_capable = fpinfo_o->async_capable ||
+			fpinfo_i->async_capable;
+
+		/* How to merge cache_out?  */
+		fpinfo->cache_timeout = Max(fpinfo_o->cache_timeout, fpinfo_i->cache_timeout); 
+
+		/* Serve a stale join result only as long as both sides allow. */
+		fpinfo->cache_stale_grace = Min(fpinfo_o->cache_stale_grace,
+										fpinfo_i->cache_stale_grace);
+
+		/* Batch parameters of a join only as far as both sides allow. */
+		fpinfo->cache_param_batch = Min(fpinfo_o->cache_param_batch,
+										fpinfo_i->cache_param_batch);
+
+		/* Compress the join result if either side wants it. */
+		if (fpinfo->cache_compression == PGC_CODEC_NONE)
+			fpinfo->cache_compression = fpinfo_i->cache_compression;
+	}
+}
+
+/*
+ * postgresGetForeignJoinPaths
+ *		Add possible ForeignPath to joinrel, if join is safe to push down.
+ */
+static void
+postgresGetForeignJoinPaths(PlannerInfo *root,
+							RelOptInfo *joinrel,
+							RelOptInfo *outerrel,
+							RelOptInfo *innerrel,
+							JoinType jointype,
+							JoinPathExtraData *extra)
+{
+	PgFdwRelationInfo *fpinfo;
+	ForeignPath *joinpath;
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+	Path	   *epq_path;		/* Path to create plan to be executed when
+								 * EvalPlanQual gets triggered. */
+
+	/*
+	 * Skip if this join combination has been considered already.
+	 */
+	if (joinrel->fdw_private)
+		return;
+
+	/*
+	 * This code does not work for joins with lateral references, since those
+	 * must have parameterized paths, which we don't generate yet.
+	 */
+	if (!bms_is_empty(joinrel->lateral_relids))
+		return;
+
+	/*
+	 * Create unfinished PgFdwRelationInfo entry which is used to indicate
+	 * that the join relation is already considered, so that we won't waste
+	 * time in judging safety of join pushdown and adding the same paths again
+	 * if found safe. Once we know that this join can be pushed down, we fill
+	 * the entry.
+	 */
+	fpinfo = (PgFdwRelationInfo *) palloc0(sizeof(PgFdwRelationInfo));
+	fpinfo->pushdown_safe = false;
+	joinrel->fdw_private = fpinfo;
+	/* attrs_used is only for base relations. */
+	fpinfo->attrs_used = NULL;
+
+	/*
+	 * If there is a possibility that EvalPlanQual will be executed, we need
+	 * to be able to reconstruct the row using scans of the base relations.
+	 * GetExistingLocalJoinPath will find a suitable path for this purpose in
+	 * the path list of the joinrel, if one exists.  We must be careful to
+	 * call it before adding any ForeignPath, since the ForeignPath might
+	 * dominate the only suitable local path available.  We also do it before
+	 * calling foreign_join_ok(), since that function updates fpinfo and marks
+	 * it as pushable if the join is found to be pushable.
+	 */
+	if (root->parse->commandType == CMD_DELETE ||
+		root->parse->commandType == CMD_UPDATE ||
+		root->rowMarks)
+	{
+		epq_path = GetExistingLocalJoinPath(joinrel);
+		if (!epq_path)
+		{
+			elog(DEBUG3, "could not push down foreign join because a local path suitable for EPQ checks was not found");
+			return;
+		}
+	}
+	else
+		epq_path = NULL;
 
-				/* Add DEFAULT if needed */
-				if (import_default && attdefault != NULL)
-					appendStringInfo(&buf, " DEFAULT %s", attdefault);
+	if (!foreign_join_ok(root, joinrel, jointype, outerrel, innerrel, extra))
+	{
+		/* Free path required for EPQ if we copied one; we don't need it now */
+		if (epq_path)
+			pfree(epq_path);
+		return;
+	}
 
-				/* Add NOT NULL if needed */
-				if (import_not_null && attnotnull[0] == 't')
-					appendStringInfoString(&buf, " NOT NULL");
-			}
-			while (++i < numrows &&
-				   strcmp(PQgetvalue(res, i, 0), tablename) == 0);
+	/*
+	 * Compute the selectivity and cost of the local_conds, so we don't have
+	 * to do it over again for each path. The best we can do for these
+	 * conditions is to estimate selectivity on the basis of local statistics.
+	 * The local conditions are applied after the join has been computed on
+	 * the remote side like quals in WHERE clause, so pass jointype as
+	 * JOIN_INNER.
+	 */
+	fpinfo->local_conds_sel = clauselist_selectivity(root,
+													 fpinfo->local_conds,
+													 0,
+													 JOIN_INNER,
+													 NULL);
+	cost_qual_eval(&fpinfo->local_conds_cost, fpinfo->local_conds, root);
 
-			/*
-			 * Add server name and table-level options.  We specify remote
-			 * schema and table name as options (the latter to ensure that
-			 * renaming the foreign table doesn't break the association).
-			 */
-			appendStringInfo(&buf, "\n) SERVER %s\nOPTIONS (",
-							 quote_identifier(server->servername));
+	/*
+	 * If we are going to estimate costs locally, estimate the join clause
+	 * selectivity here while we have special join info.
+	 */
+	if (!fpinfo->use_remote_estimate)
+		fpinfo->joinclause_sel = clauselist_selectivity(root, fpinfo->joinclauses,
+														0, fpinfo->jointype,
+														extra->sjinfo);
 
-			appendStringInfoString(&buf, "schema_name ");
-			deparseStringLiteral(&buf, stmt->remote_schema);
-			appendStringInfoString(&buf, ", table_name ");
-			deparseStringLiteral(&buf, tablename);
+	/* Estimate costs for bare join relation */
+	estimate_path_cost_size(root, joinrel, NIL, NIL, NULL,
+							&rows, &width, &startup_cost, &total_cost);
+	/* Now update this information in the joinrel */
+	joinrel->rows = rows;
+	joinrel->reltarget->width = width;
+	fpinfo->rows = rows;
+	fpinfo->width = width;
+	fpinfo->startup_cost = startup_cost;
+	fpinfo->total_cost = total_cost;
 
-			appendStringInfoString(&buf, ");");
+	/*
+	 * Create a new join path and add it to the joinrel which represents a
+	 * join between foreign tables.
+	 */
+	joinpath = create_foreign_join_path(root,
+										joinrel,
+										NULL,	/* default pathtarget */
+										rows,
+										startup_cost,
+										total_cost,
+										NIL,	/* no pathkeys */
+										joinrel->lateral_relids,
+										epq_path,
+										NIL);	/* no fdw_private */
 
-			commands = lappend(commands, pstrdup(buf.data));
-		}
-	}
-	PG_FINALLY();
-	{
-		if (res)
-			PQclear(res);
-	}
-	PG_END_TRY();
+	/* Add generated path into joinrel by add_path(). */
+	add_path(joinrel, (Path *) joinpath);
 
-	ReleaseConnection(conn);
+	/* Consider pathkeys for the join relation */
+	add_paths_with_pathkeys_for_rel(root, joinrel, epq_path);
 
-	return commands;
+	/* XXX Consider parameterized paths for the join relation */
 }
 
 /*
- * Assess whether the join between inner and outer relations can be pushed down
- * to the foreign server. As a side effect, save information we obtain in this
- * function to PgFdwRelationInfo passed in.
+ * Assess whether the aggregation, grouping and having operations can be pushed
+ * down to the foreign server.  As a side effect, save information we obtain in
+ * this function to PgFdwRelationInfo of the input relation.
  */
 static bool
-foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
-				RelOptInfo *outerrel, RelOptInfo *innerrel,
-				JoinPathExtraData *extra)
+foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
+					Node *havingQual)
 {
-	PgFdwRelationInfo *fpinfo;
-	PgFdwRelationInfo *fpinfo_o;
-	PgFdwRelationInfo *fpinfo_i;
+	Query	   *query = root->parse;
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) grouped_rel->fdw_private;
+	PathTarget *grouping_target = grouped_rel->reltarget;
+	PgFdwRelationInfo *ofpinfo;
 	ListCell   *lc;
-	List	   *joinclauses;
+	int			i;
+	List	   *tlist = NIL;
 
-	/*
-	 * We support pushing down INNER, LEFT, RIGHT and FULL OUTER joins.
-	 * Constructing queries representing SEMI and ANTI joins is hard, hence
-	 * not considered right now.
-	 */
-	if (jointype != JOIN_INNER && jointype != JOIN_LEFT &&
-		jointype != JOIN_RIGHT && jointype != JOIN_FULL)
+	/* We currently don't support pushing Grouping Sets. */
+	if (query->groupingSets)
 		return false;
 
-	/*
-	 * If either of the joining relations is marked as unsafe to pushdown, the
-	 * join can not be pushed down.
-	 */
-	fpinfo = (PgFdwRelationInfo *) joinrel->fdw_private;
-	fpinfo_o = (PgFdwRelationInfo *) outerrel->fdw_private;
-	fpinfo_i = (PgFdwRelationInfo *) innerrel->fdw_private;
-	if (!fpinfo_o || !fpinfo_o->pushdown_safe ||
-		!fpinfo_i || !fpinfo_i->pushdown_safe)
-		return false;
+	/* Get the fpinfo of the underlying scan relation. */
+	ofpinfo = (PgFdwRelationInfo *) fpinfo->outerrel->fdw_private;
 
 	/*
-	 * If joining relations have local conditions, those conditions are
-	 * required to be applied before joining the relations. Hence the join can
-	 * not be pushed down.
+	 * If underlying scan relation has any local conditions, those conditions
+	 * are required to be applied before performing aggregation.  Hence the
+	 * aggregate cannot be pushed down.
 	 */
-	if (fpinfo_o->local_conds || fpinfo_i->local_conds)
+	if (ofpinfo->local_conds)
 		return false;
 
 	/*
-	 * Merge FDW options.  We might be tempted to do this after we have deemed
-	 * the foreign join to be OK.  But we must do this beforehand so that we
-	 * know which quals can be evaluated on the foreign server, which might
-	 * depend on shippable_extensions.
+	 * Examine grouping expressions, as well as other expressions we'd need to
+	 * compute, and check whether they are safe to push down to the foreign
+	 * server.  All GROUP BY expressions will be part of the grouping target
+	 * and thus there is no need to search for them separately.  Add grouping
+	 * expressions into target list which will be passed to foreign server.
+	 *
+	 * A tricky fine point is that we must not put any expression into the
+	 * target list that is just a foreign param (that is, something that
+	 * deparse.c would conclude has to be sent to the foreign server).  If we
+	 * do, the expression will also appear in the fdw_exprs list of the plan
+	 * node, and setrefs.c will get confused and decide that the fdw_exprs
+	 * entry is actually a reference to the fdw_scan_tlist entry, resulting in
+	 * a broken plan.  Somewhat oddly, it's OK if the expression contains such
+	 * a node, as long as it's not at top level; then no match is possible.
 	 */
-	fpinfo->server = fpinfo_o->server;
-	merge_fdw_options(fpinfo, fpinfo_o, fpinfo_i);
+	i = 0;
+	foreach(lc, grouping_target->exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc);
+		Index		sgref = get_pathtarget_sortgroupref(grouping_target, i);
+		ListCell   *l;
+
+		/* Check whether this expression is part of GROUP BY clause */
+		if (sgref && get_sortgroupref_clause_noerr(sgref, query->groupClause))
+		{
+			TargetEntry *tle;
+
+			/*
+			 * If any GROUP BY expression is not shippable, then we cannot
+			 * push down aggregation to the foreign server.
+			 */
+			if (!is_foreign_expr(root, grouped_rel, expr))
+				return false;
+
+			/*
+			 * If it would be a foreign param, we can't put it into the tlist,
+			 * so we have to fail.
+			 */
+			if (is_foreign_param(root, grouped_rel, expr))
+				return false;
+
+			/*
+			 * Pushable, so add to tlist.  We need to create a TLE for this
+			 * expression and apply the sortgroupref to it.  We cannot use
+			 * add_to_flat_tlist() here because that avoids making duplicate
+			 * entries in the tlist.  If there are duplicate entries with
+			 * distinct sortgrouprefs, we have to duplicate that situation in
+			 * the output tlist.
+			 */
+			tle = makeTargetEntry(expr, list_length(tlist) + 1, NULL, false);
+			tle->ressortgroupref = sgref;
+			tlist = lappend(tlist, tle);
+		}
+		else
+		{
+			/*
+			 * Non-grouping expression we need to compute.  Can we ship it
+			 * as-is to the foreign server?
+			 */
+			if (is_foreign_expr(root, grouped_rel, expr) &&
+				!is_foreign_param(root, grouped_rel, expr))
+			{
+				/* Yes, so add to tlist as-is; OK to suppress duplicates */
+				tlist = add_to_flat_tlist(tlist, list_make1(expr));
+			}
+			else
+			{
+				/* Not pushable as a whole; extract its Vars and aggregates */
+				List	   *aggvars;
+
+				aggvars = pull_var_clause((Node *) expr,
+										  PVC_INCLUDE_AGGREGATES);
+
+				/*
+				 * If any aggregate expression is not shippable, then we
+				 * cannot push down aggregation to the foreign server.  (We
+				 * don't have to check is_foreign_param, since that certainly
+				 * won't return true for any such expression.)
+				 */
+				if (!is_foreign_expr(root, grouped_rel, (Expr *) aggvars))
+					return false;
+
+				/*
+				 * Add aggregates, if any, into the targetlist.  Plain Vars
+				 * outside an aggregate can be ignored, because they should be
+				 * either same as some GROUP BY column or part of some GROUP
+				 * BY expression.  In either case, they are already part of
+				 * the targetlist and thus no need to add them again.  In fact
+				 * including plain Vars in the tlist when they do not match a
+				 * GROUP BY column would cause the foreign server to complain
+				 * that the shipped query is invalid.
+				 */
+				foreach(l, aggvars)
+				{
+					Expr	   *expr = (Expr *) lfirst(l);
+
+					if (IsA(expr, Aggref))
+						tlist = add_to_flat_tlist(tlist, list_make1(expr));
+				}
+			}
+		}
+
+		i++;
+	}
 
 	/*
-	 * Separate restrict list into join quals and pushed-down (other) quals.
-	 *
-	 * Join quals belonging to an outer join must all be shippable, else we
-	 * cannot execute the join remotely.  Add such quals to 'joinclauses'.
-	 *
-	 * Add other quals to fpinfo->remote_conds if they are shippable, else to
-	 * fpinfo->local_conds.  In an inner join it's okay to execute conditions
-	 * either locally or remotely; the same is true for pushed-down conditions
-	 * at an outer join.
-	 *
-	 * Note we might return failure after having already scribbled on
-	 * fpinfo->remote_conds and fpinfo->local_conds.  That's okay because we
-	 * won't consult those lists again if we deem the join unshippable.
+	 * Classify the pushable and non-pushable HAVING clauses and save them in
+	 * remote_conds and local_conds of the grouped rel's fpinfo.
 	 */
-	joinclauses = NIL;
-	foreach(lc, extra->restrictlist)
+	if (havingQual)
 	{
-		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
-		bool		is_remote_clause = is_foreign_expr(root, joinrel,
-													   rinfo->clause);
+		ListCell   *lc;
 
-		if (IS_OUTER_JOIN(jointype) &&
-			!RINFO_IS_PUSHED_DOWN(rinfo, joinrel->relids))
-		{
-			if (!is_remote_clause)
-				return false;
-			joinclauses = lappend(joinclauses, rinfo);
-		}
-		else
+		foreach(lc, (List *) havingQual)
 		{
-			if (is_remote_clause)
+			Expr	   *expr = (Expr *) lfirst(lc);
+			RestrictInfo *rinfo;
+
+			/*
+			 * Currently, the core code doesn't wrap havingQuals in
+			 * RestrictInfos, so we must make our own.
+			 */
+			Assert(!IsA(expr, RestrictInfo));
+			rinfo = make_restrictinfo(expr,
+									  true,
+									  false,
+									  false,
+									  root->qual_security_level,
+									  grouped_rel->relids,
+									  NULL,
+									  NULL);
+			if (is_foreign_expr(root, grouped_rel, expr))
 				fpinfo->remote_conds = lappend(fpinfo->remote_conds, rinfo);
 			else
 				fpinfo->local_conds = lappend(fpinfo->local_conds, rinfo);
@@ -5124,1644 +7292,1870 @@ foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 	}
 
 	/*
-	 * deparseExplicitTargetList() isn't smart enough to handle anything other
-	 * than a Var.  In particular, if there's some PlaceHolderVar that would
-	 * need to be evaluated within this join tree (because there's an upper
-	 * reference to a quantity that may go to NULL as a result of an outer
-	 * join), then we can't try to push the join down because we'll fail when
-	 * we get to deparseExplicitTargetList().  However, a PlaceHolderVar that
-	 * needs to be evaluated *at the top* of this join tree is OK, because we
-	 * can do that locally after fetching the results from the remote side.
+	 * If there are any local conditions, pull Vars and aggregates from it and
+	 * check whether they are safe to pushdown or not.
 	 */
-	foreach(lc, root->placeholder_list)
+	if (fpinfo->local_conds)
 	{
-		PlaceHolderInfo *phinfo = lfirst(lc);
-		Relids		relids;
+		List	   *aggvars = NIL;
+		ListCell   *lc;
 
-		/* PlaceHolderInfo refers to parent relids, not child relids. */
-		relids = IS_OTHER_REL(joinrel) ?
-			joinrel->top_parent_relids : joinrel->relids;
+		foreach(lc, fpinfo->local_conds)
+		{
+			RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
 
-		if (bms_is_subset(phinfo->ph_eval_at, relids) &&
-			bms_nonempty_difference(relids, phinfo->ph_eval_at))
-			return false;
+			aggvars = list_concat(aggvars,
+								  pull_var_clause((Node *) rinfo->clause,
+												  PVC_INCLUDE_AGGREGATES));
+		}
+
+		foreach(lc, aggvars)
+		{
+			Expr	   *expr = (Expr *) lfirst(lc);
+
+			/*
+			 * If aggregates within local conditions are not safe to push
+			 * down, then we cannot push down the query.  Vars are already
+			 * part of GROUP BY clause which are checked above, so no need to
+			 * access them again here.  Again, we need not check
+			 * is_foreign_param for a foreign aggregate.
+			 */
+			if (IsA(expr, Aggref))
+			{
+				if (!is_foreign_expr(root, grouped_rel, expr))
+					return false;
+
+				tlist = add_to_flat_tlist(tlist, list_make1(expr));
+			}
+		}
 	}
 
-	/* Save the join clauses, for later use. */
-	fpinfo->joinclauses = joinclauses;
+	/* Store generated targetlist */
+	fpinfo->grouped_tlist = tlist;
 
-	fpinfo->outerrel = outerrel;
-	fpinfo->innerrel = innerrel;
-	fpinfo->jointype = jointype;
+	/* Safe to pushdown */
+	fpinfo->pushdown_safe = true;
 
 	/*
-	 * By default, both the input relations are not required to be deparsed as
-	 * subqueries, but there might be some relations covered by the input
-	 * relations that are required to be deparsed as subqueries, so save the
-	 * relids of those relations for later use by the deparser.
+	 * Set # of retrieved rows and cached relation costs to some negative
+	 * value, so that we can detect when they are set to some sensible values,
+	 * during one (usually the first) of the calls to estimate_path_cost_size.
 	 */
-	fpinfo->make_outerrel_subquery = false;
-	fpinfo->make_innerrel_subquery = false;
-	Assert(bms_is_subset(fpinfo_o->lower_subquery_rels, outerrel->relids));
-	Assert(bms_is_subset(fpinfo_i->lower_subquery_rels, innerrel->relids));
-	fpinfo->lower_subquery_rels = bms_union(fpinfo_o->lower_subquery_rels,
-											fpinfo_i->lower_subquery_rels);
+	fpinfo->retrieved_rows = -1;
+	fpinfo->rel_startup_cost = -1;
+	fpinfo->rel_total_cost = -1;
 
 	/*
-	 * Pull the other remote conditions from the joining relations into join
-	 * clauses or other remote clauses (remote_conds) of this relation
-	 * wherever possible. This avoids building subqueries at every join step.
-	 *
-	 * For an inner join, clauses from both the relations are added to the
-	 * other remote clauses. For LEFT and RIGHT OUTER join, the clauses from
-	 * the outer side are added to remote_conds since those can be evaluated
-	 * after the join is evaluated. The clauses from inner side are added to
-	 * the joinclauses, since they need to be evaluated while constructing the
-	 * join.
-	 *
-	 * For a FULL OUTER JOIN, the other clauses from either relation can not
-	 * be added to the joinclauses or remote_conds, since each relation acts
-	 * as an outer relation for the other.
-	 *
-	 * The joining sides can not have local conditions, thus no need to test
-	 * shippability of the clauses being pulled up.
+	 * Set the string describing this grouped relation to be used in EXPLAIN
+	 * output of corresponding ForeignScan.  Note that the decoration we add
+	 * to the base relation name mustn't include any digits, or it'll confuse
+	 * postgresExplainForeignScan.
 	 */
-	switch (jointype)
-	{
-		case JOIN_INNER:
-			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
-											   fpinfo_i->remote_conds);
-			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
-											   fpinfo_o->remote_conds);
-			break;
+	fpinfo->relation_name = psprintf("Aggregate on (%s)",
+									 ofpinfo->relation_name);
 
-		case JOIN_LEFT:
-			fpinfo->joinclauses = list_concat(fpinfo->joinclauses,
-											  fpinfo_i->remote_conds);
-			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
-											   fpinfo_o->remote_conds);
-			break;
+	return true;
+}
 
-		case JOIN_RIGHT:
-			fpinfo->joinclauses = list_concat(fpinfo->joinclauses,
-											  fpinfo_o->remote_conds);
-			fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
-											   fpinfo_i->remote_conds);
-			break;
+/*
+ * postgresGetForeignUpperPaths
+ *		Add paths for post-join operations like aggregation, grouping etc. if
+ *		corresponding operations are safe to push down.
+ */
+static void
+postgresGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
+							 RelOptInfo *input_rel, RelOptInfo *output_rel,
+							 void *extra)
+{
+	PgFdwRelationInfo *fpinfo;
 
-		case JOIN_FULL:
+	/*
+	 * If input rel is not safe to pushdown, then simply return as we cannot
+	 * perform any post-join operations on the foreign server.
+	 */
+	if (!input_rel->fdw_private ||
+		!((PgFdwRelationInfo *) input_rel->fdw_private)->pushdown_safe)
+		return;
 
-			/*
-			 * In this case, if any of the input relations has conditions, we
-			 * need to deparse that relation as a subquery so that the
-			 * conditions can be evaluated before the join.  Remember it in
-			 * the fpinfo of this relation so that the deparser can take
-			 * appropriate action.  Also, save the relids of base relations
-			 * covered by that relation for later use by the deparser.
-			 */
-			if (fpinfo_o->remote_conds)
-			{
-				fpinfo->make_outerrel_subquery = true;
-				fpinfo->lower_subquery_rels =
-					bms_add_members(fpinfo->lower_subquery_rels,
-									outerrel->relids);
-			}
-			if (fpinfo_i->remote_conds)
-			{
-				fpinfo->make_innerrel_subquery = true;
-				fpinfo->lower_subquery_rels =
-					bms_add_members(fpinfo->lower_subquery_rels,
-									innerrel->relids);
-			}
-			break;
+	/* Ignore stages we don't support; and skip any duplicate calls. */
+	if ((stage != UPPERREL_GROUP_AGG &&
+		 stage != UPPERREL_ORDERED &&
+		 stage != UPPERREL_FINAL) ||
+		output_rel->fdw_private)
+		return;
+
+	fpinfo = (PgFdwRelationInfo *) palloc0(sizeof(PgFdwRelationInfo));
+	fpinfo->pushdown_safe = false;
+	fpinfo->stage = stage;
+	output_rel->fdw_private = fpinfo;
 
+	switch (stage)
+	{
+		case UPPERREL_GROUP_AGG:
+			add_foreign_grouping_paths(root, input_rel, output_rel,
+									   (GroupPathExtraData *) extra);
+			break;
+		case UPPERREL_ORDERED:
+			add_foreign_ordered_paths(root, input_rel, output_rel);
+			break;
+		case UPPERREL_FINAL:
+			add_foreign_final_paths(root, input_rel, output_rel,
+									(FinalPathExtraData *) extra);
+			break;
 		default:
-			/* Should not happen, we have just checked this above */
-			elog(ERROR, "unsupported join type %d", jointype);
+			elog(ERROR, "unexpected upper relation: %d", (int) stage);
+			break;
 	}
+}
+
+/*
+ * add_foreign_grouping_paths
+ *		Add foreign path for grouping and/or aggregation.
+ *
+ * Given input_rel represents the underlying scan.  The paths are added to the
+ * given grouped_rel.
+ */
+static void
+add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
+						   RelOptInfo *grouped_rel,
+						   GroupPathExtraData *extra)
+{
+	Query	   *parse = root->parse;
+	PgFdwRelationInfo *ifpinfo = input_rel->fdw_private;
+	PgFdwRelationInfo *fpinfo = grouped_rel->fdw_private;
+	ForeignPath *grouppath;
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
 
-	/*
-	 * For an inner join, all restrictions can be treated alike. Treating the
-	 * pushed down conditions as join conditions allows a top level full outer
-	 * join to be deparsed without requiring subqueries.
-	 */
-	if (jointype == JOIN_INNER)
-	{
-		Assert(!fpinfo->joinclauses);
-		fpinfo->joinclauses = fpinfo->remote_conds;
-		fpinfo->remote_conds = NIL;
-	}
+	/* Nothing to be done, if there is no grouping or aggregation required. */
+	if (!parse->groupClause && !parse->groupingSets && !parse->hasAggs &&
+		!root->hasHavingQual)
+		return;
 
-	/* Mark that this join can be pushed down safely */
-	fpinfo->pushdown_safe = true;
+	Assert(extra->patype == PARTITIONWISE_AGGREGATE_NONE ||
+		   extra->patype == PARTITIONWISE_AGGREGATE_FULL);
 
-	/* Get user mapping */
-	if (fpinfo->use_remote_estimate)
-	{
-		if (fpinfo_o->use_remote_estimate)
-			fpinfo->user = fpinfo_o->user;
-		else
-			fpinfo->user = fpinfo_i->user;
-	}
-	else
-		fpinfo->user = NULL;
+	/* save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
 
 	/*
-	 * Set # of retrieved rows and cached relation costs to some negative
-	 * value, so that we can detect when they are set to some sensible values,
-	 * during one (usually the first) of the calls to estimate_path_cost_size.
+	 * Copy foreign table, foreign server, user mapping, FDW options etc.
+	 * details from the input relation's fpinfo.
 	 */
-	fpinfo->retrieved_rows = -1;
-	fpinfo->rel_startup_cost = -1;
-	fpinfo->rel_total_cost = -1;
+	fpinfo->table = ifpinfo->table;
+	fpinfo->server = ifpinfo->server;
+	fpinfo->user = ifpinfo->user;
+	merge_fdw_options(fpinfo, ifpinfo, NULL);
 
 	/*
-	 * Set the string describing this join relation to be used in EXPLAIN
-	 * output of corresponding ForeignScan.  Note that the decoration we add
-	 * to the base relation names mustn't include any digits, or it'll confuse
-	 * postgresExplainForeignScan.
+	 * Assess if it is safe to push down aggregation and grouping.
+	 *
+	 * Use HAVING qual from extra. In case of child partition, it will have
+	 * translated Vars.
 	 */
-	fpinfo->relation_name = psprintf("(%s) %s JOIN (%s)",
-									 fpinfo_o->relation_name,
-									 get_jointype_name(fpinfo->jointype),
-									 fpinfo_i->relation_name);
+	if (!foreign_grouping_ok(root, grouped_rel, extra->havingQual))
+		return;
 
 	/*
-	 * Set the relation index.  This is defined as the position of this
-	 * joinrel in the join_rel_list list plus the length of the rtable list.
-	 * Note that since this joinrel is at the end of the join_rel_list list
-	 * when we are called, we can get the position by list_length.
+	 * Compute the selectivity and cost of the local_conds, so we don't have
+	 * to do it over again for each path.  (Currently we create just a single
+	 * path here, but in future it would be possible that we build more paths
+	 * such as pre-sorted paths as in postgresGetForeignPaths and
+	 * postgresGetForeignJoinPaths.)  The best we can do for these conditions
+	 * is to estimate selectivity on the basis of local statistics.
 	 */
-	Assert(fpinfo->relation_index == 0);	/* shouldn't be set yet */
-	fpinfo->relation_index =
-		list_length(root->parse->rtable) + list_length(root->join_rel_list);
-
-	return true;
-}
-
-static void
-add_paths_with_pathkeys_for_rel(PlannerInfo *root, RelOptInfo *rel,
-								Path *epq_path)
-{
-	List	   *useful_pathkeys_list = NIL; /* List of all pathkeys */
-	ListCell   *lc;
+	fpinfo->local_conds_sel = clauselist_selectivity(root,
+													 fpinfo->local_conds,
+													 0,
+													 JOIN_INNER,
+													 NULL);
 
-	useful_pathkeys_list = get_useful_pathkeys_for_relation(root, rel);
+	cost_qual_eval(&fpinfo->local_conds_cost, fpinfo->local_conds, root);
 
-	/* Create one path for each set of pathkeys we found above. */
-	foreach(lc, useful_pathkeys_list)
-	{
-		double		rows;
-		int			width;
-		Cost		startup_cost;
-		Cost		total_cost;
-		List	   *useful_pathkeys = lfirst(lc);
-		Path	   *sorted_epq_path;
+	/* Estimate the cost of push down */
+	estimate_path_cost_size(root, grouped_rel, NIL, NIL, NULL,
+							&rows, &width, &startup_cost, &total_cost);
 
-		estimate_path_cost_size(root, rel, NIL, useful_pathkeys, NULL,
-								&rows, &width, &startup_cost, &total_cost);
+	/* Now update this information in the fpinfo */
+	fpinfo->rows = rows;
+	fpinfo->width = width;
+	fpinfo->startup_cost = startup_cost;
+	fpinfo->total_cost = total_cost;
 
-		/*
-		 * The EPQ path must be at least as well sorted as the path itself, in
-		 * case it gets used as input to a mergejoin.
-		 */
-		sorted_epq_path = epq_path;
-		if (sorted_epq_path != NULL &&
-			!pathkeys_contained_in(useful_pathkeys,
-								   sorted_epq_path->pathkeys))
-			sorted_epq_path = (Path *)
-				create_sort_path(root,
-								 rel,
-								 sorted_epq_path,
-								 useful_pathkeys,
-								 -1.0);
+	/* Create and add foreign path to the grouping relation. */
+	grouppath = create_foreign_upper_path(root,
+										  grouped_rel,
+										  grouped_rel->reltarget,
+										  rows,
+										  startup_cost,
+										  total_cost,
+										  NIL,	/* no pathkeys */
+										  NULL,
+										  NIL); /* no fdw_private */
 
-		if (IS_SIMPLE_REL(rel))
-			add_path(rel, (Path *)
-					 create_foreignscan_path(root, rel,
-											 NULL,
-											 rows,
-											 startup_cost,
-											 total_cost,
-											 useful_pathkeys,
-											 rel->lateral_relids,
-											 sorted_epq_path,
-											 NIL));
-		else
-			add_path(rel, (Path *)
-					 create_foreign_join_path(root, rel,
-											  NULL,
-											  rows,
-											  startup_cost,
-											  total_cost,
-											  useful_pathkeys,
-											  rel->lateral_relids,
-											  sorted_epq_path,
-											  NIL));
-	}
+	/* Add generated path into grouped_rel by add_path(). */
+	add_path(grouped_rel, (Path *) grouppath);
 }
 
 /*
- * Parse options from foreign server and apply them to fpinfo.
+ * add_foreign_ordered_paths
+ *		Add foreign paths for performing the final sort remotely.
  *
- * New options might also require tweaking merge_fdw_options().
+ * Given input_rel contains the source-data Paths.  The paths are added to the
+ * given ordered_rel.
  */
 static void
-apply_server_options(PgFdwRelationInfo *fpinfo)
+add_foreign_ordered_paths(PlannerInfo *root, RelOptInfo *input_rel,
+						  RelOptInfo *ordered_rel)
 {
+	Query	   *parse = root->parse;
+	PgFdwRelationInfo *ifpinfo = input_rel->fdw_private;
+	PgFdwRelationInfo *fpinfo = ordered_rel->fdw_private;
+	PgFdwPathExtraData *fpextra;
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+	List	   *fdw_private;
+	ForeignPath *ordered_path;
 	ListCell   *lc;
 
-	foreach(lc, fpinfo->server->options)
-	{
-		DefElem    *def = (DefElem *) lfirst(lc);
-
-		if (strcmp(def->defname, "use_remote_estimate") == 0)
-			fpinfo->use_remote_estimate = defGetBoolean(def);
-		else if (strcmp(def->defname, "fdw_startup_cost") == 0)
-			fpinfo->fdw_startup_cost = strtod(defGetString(def), NULL);
-		else if (strcmp(def->defname, "fdw_tuple_cost") == 0)
-			fpinfo->fdw_tuple_cost = strtod(defGetString(def), NULL);
-		else if (strcmp(def->defname, "extensions") == 0)
-			fpinfo->shippable_extensions =
-				ExtractExtensionList(defGetString(def), false);
-		else if (strcmp(def->defname, "fetch_size") == 0)
-			fpinfo->fetch_size = strtol(defGetString(def), NULL, 10);
-		else if (strcmp(def->defname, "cache_timeout") == 0)
-			fpinfo->cache_timeout = strtol(defGetString(def), NULL, 10);
-	}
-}
+	/* Shouldn't get here unless the query has ORDER BY */
+	Assert(parse->sortClause);
 
-/*
- * Parse options from foreign table and apply them to fpinfo.
- *
- * New options might also require tweaking merge_fdw_options().
- */
-static void
-apply_table_options(PgFdwRelationInfo *fpinfo)
-{
-	ListCell   *lc;
+	/* We don't support cases where there are any SRFs in the targetlist */
+	if (parse->hasTargetSRFs)
+		return;
 
-	foreach(lc, fpinfo->table->options)
-	{
-		DefElem    *def = (DefElem *) lfirst(lc);
+	/* Save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
 
-		if (strcmp(def->defname, "use_remote_estimate") == 0)
-			fpinfo->use_remote_estimate = defGetBoolean(def);
-		else if (strcmp(def->defname, "fetch_size") == 0)
-			fpinfo->fetch_size = strtol(defGetString(def), NULL, 10);
-		else if (strcmp(def->defname, "cache_timeout") == 0) 
-			fpinfo->cache_timeout = strtol(defGetString(def), NULL, 10);
-	}
-}
+	/*
+	 * Copy foreign table, foreign server, user mapping, FDW options etc.
+	 * details from the input relation's fpinfo.
+	 */
+	fpinfo->table = ifpinfo->table;
+	fpinfo->server = ifpinfo->server;
+	fpinfo->user = ifpinfo->user;
+	merge_fdw_options(fpinfo, ifpinfo, NULL);
 
-/*
- * Merge FDW options from input relations into a new set of options for a join
- * or an upper rel.
- *
- * For a join relation, FDW-specific information about the inner and outer
- * relations is provided using fpinfo_i and fpinfo_o.  For an upper relation,
- * fpinfo_o provides the information for the input relation; fpinfo_i is
- * expected to NULL.
- */
-static void
-merge_fdw_options(PgFdwRelationInfo *fpinfo,
-				  const PgFdwRelationInfo *fpinfo_o,
-				  const PgFdwRelationInfo *fpinfo_i)
-{
-	/* We must always have fpinfo_o. */
-	Assert(fpinfo_o);
+	/*
+	 * If the input_rel is a base or join relation, we would already have
+	 * considered pushing down the final sort to the remote server when
+	 * creating pre-sorted foreign paths for that relation, because the
+	 * query_pathkeys is set to the root->sort_pathkeys in that case (see
+	 * standard_qp_callback()).
+	 */
+	if (input_rel->reloptkind == RELOPT_BASEREL ||
+		input_rel->reloptkind == RELOPT_JOINREL)
+	{
+		Assert(root->query_pathkeys == root->sort_pathkeys);
 
-	/* fpinfo_i may be NULL, but if present the servers must both match. */
-	Assert(!fpinfo_i ||
-		   fpinfo_i->server->serverid == fpinfo_o->server->serverid);
+		/* Safe to push down if the query_pathkeys is safe to push down */
+		fpinfo->pushdown_safe = ifpinfo->qp_is_pushdown_safe;
+
+		return;
+	}
+
+	/* The input_rel should be a grouping relation */
+	Assert(input_rel->reloptkind == RELOPT_UPPER_REL &&
+		   ifpinfo->stage == UPPERREL_GROUP_AGG);
 
 	/*
-	 * Copy the server specific FDW options.  (For a join, both relations come
-	 * from the same server, so the server options should have the same value
-	 * for both relations.)
+	 * We try to create a path below by extending a simple foreign path for
+	 * the underlying grouping relation to perform the final sort remotely,
+	 * which is stored into the fdw_private list of the resulting path.
 	 */
-	fpinfo->fdw_startup_cost = fpinfo_o->fdw_startup_cost;
-	fpinfo->fdw_tuple_cost = fpinfo_o->fdw_tuple_cost;
-	fpinfo->shippable_extensions = fpinfo_o->shippable_extensions;
-	fpinfo->use_remote_estimate = fpinfo_o->use_remote_estimate;
-	fpinfo->fetch_size = fpinfo_o->fetch_size;
-	fpinfo->cache_timeout = fpinfo_o->cache_timeout;
 
-	/* Merge the table level options from either side of the join. */
-	if (fpinfo_i)
+	/* Assess if it is safe to push down the final sort */
+	foreach(lc, root->sort_pathkeys)
 	{
-		/*
-		 * We'll prefer to use remote estimates for this join if any table
-		 * from either side of the join is using remote estimates.  This is
-		 * most likely going to be preferred since they're already willing to
-		 * pay the price of a round trip to get the remote EXPLAIN.  In any
-		 * case it's not entirely clear how we might otherwise handle this
-		 * best.
-		 */
-		fpinfo->use_remote_estimate = fpinfo_o->use_remote_estimate ||
-			fpinfo_i->use_remote_estimate;
+		PathKey    *pathkey = (PathKey *) lfirst(lc);
+		EquivalenceClass *pathkey_ec = pathkey->pk_eclass;
+		Expr	   *sort_expr;
 
 		/*
-		 * Set fetch size to maximum of the joining sides, since we are
-		 * expecting the rows returned by the join to be proportional to the
-		 * relation sizes.
+		 * is_foreign_expr would detect volatile expressions as well, but
+		 * checking ec_has_volatile here saves some cycles.
 		 */
-		fpinfo->fetch_size = Max(fpinfo_o->fetch_size, fpinfo_i->fetch_size);
+		if (pathkey_ec->ec_has_volatile)
+			return;
 
-		/* How to merge cache_out?  */
-		fpinfo->cache_timeout = Max(fpinfo_o->cache_timeout, fpinfo_i->cache_timeout); 
+		/* Get the sort expression for the pathkey_ec */
+		sort_expr = find_em_expr_for_input_target(root,
+												  pathkey_ec,
+												  input_rel->reltarget);
+
+		/* If it's unsafe to remote, we cannot push down the final sort */
+		if (!is_foreign_expr(root, input_rel, sort_expr))
+			return;
 	}
+
+	/* Safe to push down */
+	fpinfo->pushdown_safe = true;
+
+	/* Construct PgFdwPathExtraData */
+	fpextra = (PgFdwPathExtraData *) palloc0(sizeof(PgFdwPathExtraData));
+	fpextra->target = root->upper_targets[UPPERREL_ORDERED];
+	fpextra->has_final_sort = true;
+
+	/* Estimate the costs of performing the final sort remotely */
+	estimate_path_cost_size(root, input_rel, NIL, root->sort_pathkeys, fpextra,
+							&rows, &width, &startup_cost, &total_cost);
+
+	/*
+	 * Build the fdw_private list that will be used by postgresGetForeignPlan.
+	 * Items in the list must match order in enum FdwPathPrivateIndex.
+	 */
+	fdw_private = list_make2(makeInteger(true), makeInteger(false));
+
+	/* Create foreign ordering path */
+	ordered_path = create_foreign_upper_path(root,
+											 input_rel,
+											 root->upper_targets[UPPERREL_ORDERED],
+											 rows,
+											 startup_cost,
+											 total_cost,
+											 root->sort_pathkeys,
+											 NULL,	/* no extra plan */
+											 fdw_private);
+
+	/* and add it to the ordered_rel */
+	add_path(ordered_rel, (Path *) ordered_path);
 }
 
 /*
- * postgresGetForeignJoinPaths
- *		Add possible ForeignPath to joinrel, if join is safe to push down.
+ * add_foreign_final_paths
+ *		Add foreign paths for performing the final processing remotely.
+ *
+ * Given input_rel contains the source-data Paths.  The paths are added to the
+ * given final_rel.
  */
 static void
-postgresGetForeignJoinPaths(PlannerInfo *root,
-							RelOptInfo *joinrel,
-							RelOptInfo *outerrel,
-							RelOptInfo *innerrel,
-							JoinType jointype,
-							JoinPathExtraData *extra)
+add_foreign_final_paths(PlannerInfo *root, RelOptInfo *input_rel,
+						RelOptInfo *final_rel,
+						FinalPathExtraData *extra)
 {
-	PgFdwRelationInfo *fpinfo;
-	ForeignPath *joinpath;
+	Query	   *parse = root->parse;
+	PgFdwRelationInfo *ifpinfo = (PgFdwRelationInfo *) input_rel->fdw_private;
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) final_rel->fdw_private;
+	bool		has_final_sort = false;
+	List	   *pathkeys = NIL;
+	PgFdwPathExtraData *fpextra;
+	bool		save_use_remote_estimate = false;
 	double		rows;
 	int			width;
 	Cost		startup_cost;
 	Cost		total_cost;
-	Path	   *epq_path;		/* Path to create plan to be executed when
-								 * EvalPlanQual gets triggered. */
+	List	   *fdw_private;
+	ForeignPath *final_path;
 
 	/*
-	 * Skip if this join combination has been considered already.
+	 * Currently, we only support this for SELECT commands
 	 */
-	if (joinrel->fdw_private)
+	if (parse->commandType != CMD_SELECT)
 		return;
 
 	/*
-	 * This code does not work for joins with lateral references, since those
-	 * must have parameterized paths, which we don't generate yet.
+	 * No work if there is no FOR UPDATE/SHARE clause and if there is no need
+	 * to add a LIMIT node
 	 */
-	if (!bms_is_empty(joinrel->lateral_relids))
+	if (!parse->rowMarks && !extra->limit_needed)
+		return;
+
+	/* We don't support cases where there are any SRFs in the targetlist */
+	if (parse->hasTargetSRFs)
 		return;
 
+	/* Save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
+
 	/*
-	 * Create unfinished PgFdwRelationInfo entry which is used to indicate
-	 * that the join relation is already considered, so that we won't waste
-	 * time in judging safety of join pushdown and adding the same paths again
-	 * if found safe. Once we know that this join can be pushed down, we fill
-	 * the entry.
+	 * Copy foreign table, foreign server, user mapping, FDW options etc.
+	 * details from the input relation's fpinfo.
 	 */
-	fpinfo = (PgFdwRelationInfo *) palloc0(sizeof(PgFdwRelationInfo));
-	fpinfo->pushdown_safe = false;
-	joinrel->fdw_private = fpinfo;
-	/* attrs_used is only for base relations. */
-	fpinfo->attrs_used = NULL;
+	fpinfo->table = ifpinfo->table;
+	fpinfo->server = ifpinfo->server;
+	fpinfo->user = ifpinfo->user;
+	merge_fdw_options(fpinfo, ifpinfo, NULL);
 
 	/*
-	 * If there is a possibility that EvalPlanQual will be executed, we need
-	 * to be able to reconstruct the row using scans of the base relations.
-	 * GetExistingLocalJoinPath will find a suitable path for this purpose in
-	 * the path list of the joinrel, if one exists.  We must be careful to
-	 * call it before adding any ForeignPath, since the ForeignPath might
-	 * dominate the only suitable local path available.  We also do it before
-	 * calling foreign_join_ok(), since that function updates fpinfo and marks
-	 * it as pushable if the join is found to be pushable.
+	 * If there is no need to add a LIMIT node, there might be a ForeignPath
+	 * in the input_rel's pathlist that implements all behavior of the query.
+	 * Note: we would already have accounted for the query's FOR UPDATE/SHARE
+	 * (if any) before we get here.
 	 */
-	if (root->parse->commandType == CMD_DELETE ||
-		root->parse->commandType == CMD_UPDATE ||
-		root->rowMarks)
+	if (!extra->limit_needed)
 	{
-		epq_path = GetExistingLocalJoinPath(joinrel);
-		if (!epq_path)
+		ListCell   *lc;
+
+		Assert(parse->rowMarks);
+
+		/*
+		 * Grouping and aggregation are not supported with FOR UPDATE/SHARE,
+		 * so the input_rel should be a base, join, or ordered relation; and
+		 * if it's an ordered relation, its input relation should be a base or
+		 * join relation.
+		 */
+		Assert(input_rel->reloptkind == RELOPT_BASEREL ||
+			   input_rel->reloptkind == RELOPT_JOINREL ||
+			   (input_rel->reloptkind == RELOPT_UPPER_REL &&
+				ifpinfo->stage == UPPERREL_ORDERED &&
+				(ifpinfo->outerrel->reloptkind == RELOPT_BASEREL ||
+				 ifpinfo->outerrel->reloptkind == RELOPT_JOINREL)));
+
+		foreach(lc, input_rel->pathlist)
 		{
-			elog(DEBUG3, "could not push down foreign join because a local path suitable for EPQ checks was not found");
-			return;
+			Path	   *path = (Path *) lfirst(lc);
+
+			/*
+			 * apply_scanjoin_target_to_paths() uses create_projection_path()
+			 * to adjust each of its input paths if needed, whereas
+			 * create_ordered_paths() uses apply_projection_to_path() to do
+			 * that.  So the former might have put a ProjectionPath on top of
+			 * the ForeignPath; look through ProjectionPath and see if the
+			 * path underneath it is ForeignPath.
+			 */
+			if (IsA(path, ForeignPath) ||
+				(IsA(path, ProjectionPath) &&
+				 IsA(((ProjectionPath *) path)->subpath, ForeignPath)))
+			{
+				/*
+				 * Create foreign final path; this gets rid of a
+				 * no-longer-needed outer plan (if any), which makes the
+				 * EXPLAIN output look cleaner
+				 */
+				final_path = create_foreign_upper_path(root,
+													   path->parent,
+													   path->pathtarget,
+													   path->rows,
+													   path->startup_cost,
+													   path->total_cost,
+													   path->pathkeys,
+													   NULL,	/* no extra plan */
+													   NULL);	/* no fdw_private */
+
+				/* and add it to the final_rel */
+				add_path(final_rel, (Path *) final_path);
+
+				/* Safe to push down */
+				fpinfo->pushdown_safe = true;
+
+				return;
+			}
 		}
+
+		/*
+		 * If we get here it means no ForeignPaths; since we would already
+		 * have considered pushing down all operations for the query to the
+		 * remote server, give up on it.
+		 */
+		return;
 	}
-	else
-		epq_path = NULL;
 
-	if (!foreign_join_ok(root, joinrel, jointype, outerrel, innerrel, extra))
+	Assert(extra->limit_needed);
+
+	/*
+	 * If the input_rel is an ordered relation, replace the input_rel with its
+	 * input relation
+	 */
+	if (input_rel->reloptkind == RELOPT_UPPER_REL &&
+		ifpinfo->stage == UPPERREL_ORDERED)
 	{
-		/* Free path required for EPQ if we copied one; we don't need it now */
-		if (epq_path)
-			pfree(epq_path);
-		return;
+		input_rel = ifpinfo->outerrel;
+		ifpinfo = (PgFdwRelationInfo *) input_rel->fdw_private;
+		has_final_sort = true;
+		pathkeys = root->sort_pathkeys;
 	}
 
+	/* The input_rel should be a base, join, or grouping relation */
+	Assert(input_rel->reloptkind == RELOPT_BASEREL ||
+		   input_rel->reloptkind == RELOPT_JOINREL ||
+		   (input_rel->reloptkind == RELOPT_UPPER_REL &&
+			ifpinfo->stage == UPPERREL_GROUP_AGG));
+
 	/*
-	 * Compute the selectivity and cost of the local_conds, so we don't have
-	 * to do it over again for each path. The best we can do for these
-	 * conditions is to estimate selectivity on the basis of local statistics.
-	 * The local conditions are applied after the join has been computed on
-	 * the remote side like quals in WHERE clause, so pass jointype as
-	 * JOIN_INNER.
+	 * We try to create a path below by extending a simple foreign path for
+	 * the underlying base, join, or grouping relation to perform the final
+	 * sort (if has_final_sort) and the LIMIT restriction remotely, which is
+	 * stored into the fdw_private list of the resulting path.  (We
+	 * re-estimate the costs of sorting the underlying relation, if
+	 * has_final_sort.)
 	 */
-	fpinfo->local_conds_sel = clauselist_selectivity(root,
-													 fpinfo->local_conds,
-													 0,
-													 JOIN_INNER,
-													 NULL);
-	cost_qual_eval(&fpinfo->local_conds_cost, fpinfo->local_conds, root);
 
 	/*
-	 * If we are going to estimate costs locally, estimate the join clause
-	 * selectivity here while we have special join info.
+	 * Assess if it is safe to push down the LIMIT and OFFSET to the remote
+	 * server
 	 */
-	if (!fpinfo->use_remote_estimate)
-		fpinfo->joinclause_sel = clauselist_selectivity(root, fpinfo->joinclauses,
-														0, fpinfo->jointype,
-														extra->sjinfo);
-
-	/* Estimate costs for bare join relation */
-	estimate_path_cost_size(root, joinrel, NIL, NIL, NULL,
-							&rows, &width, &startup_cost, &total_cost);
-	/* Now update this information in the joinrel */
-	joinrel->rows = rows;
-	joinrel->reltarget->width = width;
-	fpinfo->rows = rows;
-	fpinfo->width = width;
-	fpinfo->startup_cost = startup_cost;
-	fpinfo->total_cost = total_cost;
 
 	/*
-	 * Create a new join path and add it to the joinrel which represents a
-	 * join between foreign tables.
+	 * If the underlying relation has any local conditions, the LIMIT/OFFSET
+	 * cannot be pushed down.
 	 */
-	joinpath = create_foreign_join_path(root,
-										joinrel,
-										NULL,	/* default pathtarget */
-										rows,
-										startup_cost,
-										total_cost,
-										NIL,	/* no pathkeys */
-										joinrel->lateral_relids,
-										epq_path,
-										NIL);	/* no fdw_private */
-
-	/* Add generated path into joinrel by add_path(). */
-	add_path(joinrel, (Path *) joinpath);
-
-	/* Consider pathkeys for the join relation */
-	add_paths_with_pathkeys_for_rel(root, joinrel, epq_path);
-
-	/* XXX Consider parameterized paths for the join relation */
-}
+	if (ifpinfo->local_conds)
+		return;
 
-/*
- * Assess whether the aggregation, grouping and having operations can be pushed
- * down to the foreign server.  As a side effect, save information we obtain in
- * this function to PgFdwRelationInfo of the input relation.
- */
-static bool
-foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
-					Node *havingQual)
-{
-	Query	   *query = root->parse;
-	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) grouped_rel->fdw_private;
-	PathTarget *grouping_target = grouped_rel->reltarget;
-	PgFdwRelationInfo *ofpinfo;
-	ListCell   *lc;
-	int			i;
-	List	   *tlist = NIL;
+	/*
+	 * Also, the LIMIT/OFFSET cannot be pushed down, if their expressions are
+	 * not safe to remote.
+	 */
+	if (!is_foreign_expr(root, input_rel, (Expr *) parse->limitOffset) ||
+		!is_foreign_expr(root, input_rel, (Expr *) parse->limitCount))
+		return;
 
-	/* We currently don't support pushing Grouping Sets. */
-	if (query->groupingSets)
-		return false;
+	/* Safe to push down */
+	fpinfo->pushdown_safe = true;
 
-	/* Get the fpinfo of the underlying scan relation. */
-	ofpinfo = (PgFdwRelationInfo *) fpinfo->outerrel->fdw_private;
+	/* Construct PgFdwPathExtraData */
+	fpextra = (PgFdwPathExtraData *) palloc0(sizeof(PgFdwPathExtraData));
+	fpextra->target = root->upper_targets[UPPERREL_FINAL];
+	fpextra->has_final_sort = has_final_sort;
+	fpextra->has_limit = extra->limit_needed;
+	fpextra->limit_tuples = extra->limit_tuples;
+	fpextra->count_est = extra->count_est;
+	fpextra->offset_est = extra->offset_est;
 
 	/*
-	 * If underlying scan relation has any local conditions, those conditions
-	 * are required to be applied before performing aggregation.  Hence the
-	 * aggregate cannot be pushed down.
+	 * Estimate the costs of performing the final sort and the LIMIT
+	 * restriction remotely.  If has_final_sort is false, we wouldn't need to
+	 * execute EXPLAIN anymore if use_remote_estimate, since the costs can be
+	 * roughly estimated using the costs we already have for the underlying
+	 * relation, in the same way as when use_remote_estimate is false.  Since
+	 * it's pretty expensive to execute EXPLAIN, force use_remote_estimate to
+	 * false in that case.
 	 */
-	if (ofpinfo->local_conds)
-		return false;
+	if (!fpextra->has_final_sort)
+	{
+		save_use_remote_estimate = ifpinfo->use_remote_estimate;
+		ifpinfo->use_remote_estimate = false;
+	}
+	estimate_path_cost_size(root, input_rel, NIL, pathkeys, fpextra,
+							&rows, &width, &startup_cost, &total_cost);
+	if (!fpextra->has_final_sort)
+		ifpinfo->use_remote_estimate = save_use_remote_estimate;
 
 	/*
-	 * Examine grouping expressions, as well as other expressions we'd need to
-	 * compute, and check whether they are safe to push down to the foreign
-	 * server.  All GROUP BY expressions will be part of the grouping target
-	 * and thus there is no need to search for them separately.  Add grouping
-	 * expressions into target list which will be passed to foreign server.
-	 *
-	 * A tricky fine point is that we must not put any expression into the
-	 * target list that is just a foreign param (that is, something that
-	 * deparse.c would conclude has to be sent to the foreign server).  If we
-	 * do, the expression will also appear in the fdw_exprs list of the plan
-	 * node, and setrefs.c will get confused and decide that the fdw_exprs
-	 * entry is actually a reference to the fdw_scan_tlist entry, resulting in
-	 * a broken plan.  Somewhat oddly, it's OK if the expression contains such
-	 * a node, as long as it's not at top level; then no match is possible.
+	 * Build the fdw_private list that will be used by postgresGetForeignPlan.
+	 * Items in the list must match order in enum FdwPathPrivateIndex.
 	 */
-	i = 0;
-	foreach(lc, grouping_target->exprs)
-	{
-		Expr	   *expr = (Expr *) lfirst(lc);
-		Index		sgref = get_pathtarget_sortgroupref(grouping_target, i);
-		ListCell   *l;
-
-		/* Check whether this expression is part of GROUP BY clause */
-		if (sgref && get_sortgroupref_clause_noerr(sgref, query->groupClause))
-		{
-			TargetEntry *tle;
-
-			/*
-			 * If any GROUP BY expression is not shippable, then we cannot
-			 * push down aggregation to the foreign server.
-			 */
-			if (!is_foreign_expr(root, grouped_rel, expr))
-				return false;
-
-			/*
-			 * If it would be a foreign param, we can't put it into the tlist,
-			 * so we have to fail.
-			 */
-			if (is_foreign_param(root, grouped_rel, expr))
-				return false;
-
-			/*
-			 * Pushable, so add to tlist.  We need to create a TLE for this
-			 * expression and apply the sortgroupref to it.  We cannot use
-			 * add_to_flat_tlist() here because that avoids making duplicate
-			 * entries in the tlist.  If there are duplicate entries with
-			 * distinct sortgrouprefs, we have to duplicate that situation in
-			 * the output tlist.
-			 */
-			tle = makeTargetEntry(expr, list_length(tlist) + 1, NULL, false);
-			tle->ressortgroupref = sgref;
-			tlist = lappend(tlist, tle);
-		}
-		else
-		{
-			/*
-			 * Non-grouping expression we need to compute.  Can we ship it
-			 * as-is to the foreign server?
-			 */
-			if (is_foreign_expr(root, grouped_rel, expr) &&
-				!is_foreign_param(root, grouped_rel, expr))
-			{
-				/* Yes, so add to tlist as-is; OK to suppress duplicates */
-				tlist = add_to_flat_tlist(tlist, list_make1(expr));
-			}
-			else
-			{
-				/* Not pushable as a whole; extract its Vars and aggregates */
-				List	   *aggvars;
-
-				aggvars = pull_var_clause((Node *) expr,
-										  PVC_INCLUDE_AGGREGATES);
+	fdw_private = list_make2(makeInteger(has_final_sort),
+							 makeInteger(extra->limit_needed));
 
-				/*
-				 * If any aggregate expression is not shippable, then we
-				 * cannot push down aggregation to the foreign server.  (We
-				 * don't have to check is_foreign_param, since that certainly
-				 * won't return true for any such expression.)
-				 */
-				if (!is_foreign_expr(root, grouped_rel, (Expr *) aggvars))
-					return false;
+	/*
+	 * Create foreign final path; this gets rid of a no-longer-needed outer
+	 * plan (if any), which makes the EXPLAIN output look cleaner
+	 */
+	final_path = create_foreign_upper_path(root,
+										   input_rel,
+										   root->upper_targets[UPPERREL_FINAL],
+										   rows,
+										   startup_cost,
+										   total_cost,
+										   pathkeys,
+										   NULL,	/* no extra plan */
+										   fdw_private);
 
-				/*
-				 * Add aggregates, if any, into the targetlist.  Plain Vars
-				 * outside an aggregate can be ignored, because they should be
-				 * either same as some GROUP BY column or part of some GROUP
-				 * BY expression.  In either case, they are already part of
-				 * the targetlist and thus no need to add them again.  In fact
-				 * including plain Vars in the tlist when they do not match a
-				 * GROUP BY column would cause the foreign server to complain
-				 * that the shipped query is invalid.
-				 */
-				foreach(l, aggvars)
-				{
-					Expr	   *expr = (Expr *) lfirst(l);
+	/* and add it to the final_rel */
+	add_path(final_rel, (Path *) final_path);
+}
 
-					if (IsA(expr, Aggref))
-						tlist = add_to_flat_tlist(tlist, list_make1(expr));
-				}
-			}
-		}
+/*
+ * Create a tuple from the specified row of the PGresult.
+ *
+ * rel is the local representation of the foreign table, attinmeta is
+ * conversion data for the rel's tupdesc, and retrieved_attrs is an
+ * integer list of the table column numbers present in the PGresult.
+ * temp_context is a working context that can be reset after each tuple.
+ */
+static HeapTuple
+make_tuple_from_result_row(PGresult *res,
+						   int row,
+						   Relation rel,
+						   AttInMetadata *attinmeta,
+						   AttRecvMetadata *attrecvmeta,
+						   List *retrieved_attrs,
+						   ForeignScanState *fsstate,
+						   MemoryContext temp_context)
+{
+	HeapTuple	tuple;
+	TupleDesc	tupdesc;
+	Datum	   *values;
+	bool	   *nulls;
+	ItemPointer ctid = NULL;
+	ConversionLocation errpos;
+	ErrorContextCallback errcallback;
+	MemoryContext oldcontext;
+	ListCell   *lc;
+	int			j;
 
-		i++;
-	}
+	Assert(row < PQntuples(res));
 
 	/*
-	 * Classify the pushable and non-pushable HAVING clauses and save them in
-	 * remote_conds and local_conds of the grouped rel's fpinfo.
+	 * Do the following work in a temp context that we reset after each tuple.
+	 * This cleans up not only the data we have direct access to, but any
+	 * cruft the I/O functions might leak.
 	 */
-	if (havingQual)
+	oldcontext = MemoryContextSwitchTo(temp_context);
+
+	if (rel)
+		tupdesc = RelationGetDescr(rel);
+	else
 	{
-		ListCell   *lc;
+		Assert(fsstate);
+		tupdesc = fsstate->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+	}
 
-		foreach(lc, (List *) havingQual)
-		{
-			Expr	   *expr = (Expr *) lfirst(lc);
-			RestrictInfo *rinfo;
+	values = (Datum *) palloc0(tupdesc->natts * sizeof(Datum));
+	nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
+	/* Initialize to nulls for any columns not present in result */
+	memset(nulls, true, tupdesc->natts * sizeof(bool));
 
-			/*
-			 * Currently, the core code doesn't wrap havingQuals in
-			 * RestrictInfos, so we must make our own.
-			 */
-			Assert(!IsA(expr, RestrictInfo));
-			rinfo = make_restrictinfo(expr,
-									  true,
-									  false,
-									  false,
-									  root->qual_security_level,
-									  grouped_rel->relids,
-									  NULL,
-									  NULL);
-			if (is_foreign_expr(root, grouped_rel, expr))
-				fpinfo->remote_conds = lappend(fpinfo->remote_conds, rinfo);
-			else
-				fpinfo->local_conds = lappend(fpinfo->local_conds, rinfo);
-		}
-	}
+	/*
+	 * Set up and install callback to report where conversion error occurs.
+	 */
+	errpos.rel = rel;
+	errpos.cur_attno = 0;
+	errpos.fsstate = fsstate;
+	errcallback.callback = conversion_error_callback;
+	errcallback.arg = (void *) &errpos;
+	errcallback.previous = error_context_stack;
+	error_context_stack = &errcallback;
 
 	/*
-	 * If there are any local conditions, pull Vars and aggregates from it and
-	 * check whether they are safe to pushdown or not.
+	 * i indexes columns in the relation, j indexes columns in the PGresult.
 	 */
-	if (fpinfo->local_conds)
+	j = 0;
+	foreach(lc, retrieved_attrs)
 	{
-		List	   *aggvars = NIL;
-		ListCell   *lc;
+		int			i = lfirst_int(lc);
+		char	   *valstr;
 
-		foreach(lc, fpinfo->local_conds)
+		/* fetch next column's textual value */
+		if (PQgetisnull(res, row, j))
+			valstr = NULL;
+		else
+			valstr = PQgetvalue(res, row, j);
+
+		/*
+		 * convert value to internal representation
+		 *
+		 * Note: we ignore system columns other than ctid and oid in result
+		 */
+		errpos.cur_attno = i;
+		if (PQfformat(res, j) == 1)
 		{
-			RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+			/* binary, see binary_recv_metadata */
+			StringInfoData buf;
 
-			aggvars = list_concat(aggvars,
-								  pull_var_clause((Node *) rinfo->clause,
-												  PVC_INCLUDE_AGGREGATES));
+			if (attrecvmeta == NULL)
+				elog(ERROR, "unexpected binary result from remote server");
+			if (valstr != NULL)
+			{
+				buf.data = valstr;
+				buf.len = PQgetlength(res, row, j);
+				buf.maxlen = buf.len + 1;
+				buf.cursor = 0;
+			}
+			if (i > 0)
+			{
+				Assert(i <= tupdesc->natts);
+				nulls[i - 1] = (valstr == NULL);
+				values[i - 1] = ReceiveFunctionCall(&attrecvmeta->attrecvfuncs[i - 1],
+													valstr ? &buf : NULL,
+													attrecvmeta->attioparams[i - 1],
+													attinmeta->atttypmods[i - 1]);
+			}
+			else if (i == SelfItemPointerAttributeNumber && valstr != NULL)
+				ctid = (ItemPointer) DatumGetPointer(DirectFunctionCall1(tidrecv,
+																		 PointerGetDatum(&buf)));
 		}
-
-		foreach(lc, aggvars)
+		else if (i > 0)
 		{
-			Expr	   *expr = (Expr *) lfirst(lc);
-
-			/*
-			 * If aggregates within local conditions are not safe to push
-			 * down, then we cannot push down the query.  Vars are already
-			 * part of GROUP BY clause which are checked above, so no need to
-			 * access them again here.  Again, we need not check
-			 * is_foreign_param for a foreign aggregate.
-			 */
-			if (IsA(expr, Aggref))
+			/* ordinary column */
+			Assert(i <= tupdesc->natts);
+			nulls[i - 1] = (valstr == NULL);
+			/* Apply the input function even to nulls, to support domains */
+			values[i - 1] = InputFunctionCall(&attinmeta->attinfuncs[i - 1],
+											  valstr,
+											  attinmeta->attioparams[i - 1],
+											  attinmeta->atttypmods[i - 1]);
+		}
+		else if (i == SelfItemPointerAttributeNumber)
+		{
+			/* ctid */
+			if (valstr != NULL)
 			{
-				if (!is_foreign_expr(root, grouped_rel, expr))
-					return false;
+				Datum		datum;
 
-				tlist = add_to_flat_tlist(tlist, list_make1(expr));
+				datum = DirectFunctionCall1(tidin, CStringGetDatum(valstr));
+				ctid = (ItemPointer) DatumGetPointer(datum);
 			}
 		}
+		errpos.cur_attno = 0;
+
+		j++;
 	}
 
-	/* Store generated targetlist */
-	fpinfo->grouped_tlist = tlist;
+	/* Uninstall error context callback. */
+	error_context_stack = errcallback.previous;
 
-	/* Safe to pushdown */
-	fpinfo->pushdown_safe = true;
+	/*
+	 * Check we got the expected number of columns.  Note: j == 0 and
+	 * PQnfields == 1 is expected, since deparse emits a NULL if no columns.
+	 */
+	if (j > 0 && j != PQnfields(res))
+		elog(ERROR, "remote query result does not match the foreign table");
 
 	/*
-	 * Set # of retrieved rows and cached relation costs to some negative
-	 * value, so that we can detect when they are set to some sensible values,
-	 * during one (usually the first) of the calls to estimate_path_cost_size.
+	 * Build the result tuple in caller's memory context.
 	 */
-	fpinfo->retrieved_rows = -1;
-	fpinfo->rel_startup_cost = -1;
-	fpinfo->rel_total_cost = -1;
+	MemoryContextSwitchTo(oldcontext);
+
+	tuple = heap_form_tuple(tupdesc, values, nulls);
 
 	/*
-	 * Set the string describing this grouped relation to be used in EXPLAIN
-	 * output of corresponding ForeignScan.  Note that the decoration we add
-	 * to the base relation name mustn't include any digits, or it'll confuse
-	 * postgresExplainForeignScan.
+	 * If we have a CTID to return, install it in both t_self and t_ctid.
+	 * t_self is the normal place, but if the tuple is converted to a
+	 * composite Datum, t_self will be lost; setting t_ctid allows CTID to be
+	 * preserved during EvalPlanQual re-evaluations (see ROW_MARK_COPY code).
 	 */
-	fpinfo->relation_name = psprintf("Aggregate on (%s)",
-									 ofpinfo->relation_name);
+	if (ctid)
+		tuple->t_self = tuple->t_data->t_ctid = *ctid;
 
-	return true;
+	/*
+	 * Stomp on the xmin, xmax, and cmin fields from the tuple created by
+	 * heap_form_tuple.  heap_form_tuple actually creates the tuple with
+	 * DatumTupleFields, not HeapTupleFields, but the executor expects
+	 * HeapTupleFields and will happily extract system columns on that
+	 * assumption.  If we don't do this then, for example, the tuple length
+	 * ends up in the xmin field, which isn't what we want.
+	 */
+	HeapTupleHeaderSetXmax(tuple->t_data, InvalidTransactionId);
+	HeapTupleHeaderSetXmin(tuple->t_data, InvalidTransactionId);
+	HeapTupleHeaderSetCmin(tuple->t_data, InvalidTransactionId);
+
+	/* Clean up */
+	MemoryContextReset(temp_context);
+
+	return tuple;
 }
 
 /*
- * postgresGetForeignUpperPaths
- *		Add paths for post-join operations like aggregation, grouping etc. if
- *		corresponding operations are safe to push down.
+ * Is typid safe to exchange with the remote server in binary?  That is only
+ * built-in base types, and arrays of them, whose OIDs and binary format the
+ * remote server shares; domains, enums, composites and extension types stay
+ * in text.
+ */
+static bool
+binary_safe_type(Oid typid)
+{
+	HeapTuple	tp;
+	Form_pg_type typ;
+	bool		safe;
+
+	tp = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+	if (!HeapTupleIsValid(tp))
+		return false;
+	typ = (Form_pg_type) GETSTRUCT(tp);
+	safe = is_builtin(typ->oid) && typ->typtype == TYPTYPE_BASE &&
+		OidIsValid(typ->typreceive) && OidIsValid(typ->typsend) &&
+		(!OidIsValid(typ->typelem) || is_builtin(typ->typelem));
+	ReleaseSysCache(tp);
+	return safe;
+}
+
+/*
+ * Receive functions of the retrieved columns, or NULL if any of them is
+ * not safe to fetch in binary, see binary_safe_type.
+ */
+static AttRecvMetadata *
+binary_recv_metadata(TupleDesc tupdesc, List *retrieved_attrs)
+{
+	AttRecvMetadata *meta;
+	ListCell   *lc;
+
+	foreach(lc, retrieved_attrs)
+	{
+		int			i = lfirst_int(lc);
+
+		if (i <= 0)
+			continue;			/* ctid, tidrecv */
+
+		if (!binary_safe_type(TupleDescAttr(tupdesc, i - 1)->atttypid))
+			return NULL;
+	}
+
+	meta = (AttRecvMetadata *) palloc0(sizeof(AttRecvMetadata));
+	meta->attrecvfuncs = (FmgrInfo *) palloc0(tupdesc->natts * sizeof(FmgrInfo));
+	meta->attioparams = (Oid *) palloc0(tupdesc->natts * sizeof(Oid));
+	foreach(lc, retrieved_attrs)
+	{
+		int			i = lfirst_int(lc);
+		Oid			recvfunc;
+
+		if (i <= 0)
+			continue;
+		getTypeBinaryInputInfo(TupleDescAttr(tupdesc, i - 1)->atttypid,
+							   &recvfunc, &meta->attioparams[i - 1]);
+		fmgr_info(recvfunc, &meta->attrecvfuncs[i - 1]);
+	}
+	return meta;
+}
+
+/*
+ * Callback function which is called when error occurs during column value
+ * conversion.  Print names of column and relation.
  */
 static void
-postgresGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
-							 RelOptInfo *input_rel, RelOptInfo *output_rel,
-							 void *extra)
+conversion_error_callback(void *arg)
 {
-	PgFdwRelationInfo *fpinfo;
+	const char *attname = NULL;
+	const char *relname = NULL;
+	bool		is_wholerow = false;
+	ConversionLocation *errpos = (ConversionLocation *) arg;
+
+	if (errpos->rel)
+	{
+		/* error occurred in a scan against a foreign table */
+		TupleDesc	tupdesc = RelationGetDescr(errpos->rel);
+		Form_pg_attribute attr = TupleDescAttr(tupdesc, errpos->cur_attno - 1);
+
+		if (errpos->cur_attno > 0 && errpos->cur_attno <= tupdesc->natts)
+			attname = NameStr(attr->attname);
+		else if (errpos->cur_attno == SelfItemPointerAttributeNumber)
+			attname = "ctid";
+
+		relname = RelationGetRelationName(errpos->rel);
+	}
+	else
+	{
+		/* error occurred in a scan against a foreign join */
+		ForeignScanState *fsstate = errpos->fsstate;
+		ForeignScan *fsplan = castNode(ForeignScan, fsstate->ss.ps.plan);
+		EState	   *estate = fsstate->ss.ps.state;
+		TargetEntry *tle;
+
+		tle = list_nth_node(TargetEntry, fsplan->fdw_scan_tlist,
+							errpos->cur_attno - 1);
 
-	/*
-	 * If input rel is not safe to pushdown, then simply return as we cannot
-	 * perform any post-join operations on the foreign server.
-	 */
-	if (!input_rel->fdw_private ||
-		!((PgFdwRelationInfo *) input_rel->fdw_private)->pushdown_safe)
-		return;
+		/*
+		 * Target list can have Vars and expressions.  For Vars, we can get
+		 * its relation, however for expressions we can't.  Thus for
+		 * expressions, just show generic context message.
+		 */
+		if (IsA(tle->expr, Var))
+		{
+			RangeTblEntry *rte;
+			Var		   *var = (Var *) tle->expr;
 
-	/* Ignore stages we don't support; and skip any duplicate calls. */
-	if ((stage != UPPERREL_GROUP_AGG &&
-		 stage != UPPERREL_ORDERED &&
-		 stage != UPPERREL_FINAL) ||
-		output_rel->fdw_private)
-		return;
+			rte = exec_rt_fetch(var->varno, estate);
 
-	fpinfo = (PgFdwRelationInfo *) palloc0(sizeof(PgFdwRelationInfo));
-	fpinfo->pushdown_safe = false;
-	fpinfo->stage = stage;
-	output_rel->fdw_private = fpinfo;
+			if (var->varattno == 0)
+				is_wholerow = true;
+			else
+				attname = get_attname(rte->relid, var->varattno, false);
 
-	switch (stage)
+			relname = get_rel_name(rte->relid);
+		}
+		else
+			errcontext("processing expression at position %d in select list",
+					   errpos->cur_attno);
+	}
+
+	if (relname)
 	{
-		case UPPERREL_GROUP_AGG:
-			add_foreign_grouping_paths(root, input_rel, output_rel,
-									   (GroupPathExtraData *) extra);
-			break;
-		case UPPERREL_ORDERED:
-			add_foreign_ordered_paths(root, input_rel, output_rel);
-			break;
-		case UPPERREL_FINAL:
-			add_foreign_final_paths(root, input_rel, output_rel,
-									(FinalPathExtraData *) extra);
-			break;
-		default:
-			elog(ERROR, "unexpected upper relation: %d", (int) stage);
-			break;
+		if (is_wholerow)
+			errcontext("whole-row reference to foreign table \"%s\"", relname);
+		else if (attname)
+			errcontext("column \"%s\" of foreign table \"%s\"", attname, relname);
 	}
 }
 
 /*
- * add_foreign_grouping_paths
- *		Add foreign path for grouping and/or aggregation.
- *
- * Given input_rel represents the underlying scan.  The paths are added to the
- * given grouped_rel.
+ * Find an equivalence class member expression to be computed as a sort column
+ * in the given target.
  */
-static void
-add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
-						   RelOptInfo *grouped_rel,
-						   GroupPathExtraData *extra)
+Expr *
+find_em_expr_for_input_target(PlannerInfo *root,
+							  EquivalenceClass *ec,
+							  PathTarget *target)
 {
-	Query	   *parse = root->parse;
-	PgFdwRelationInfo *ifpinfo = input_rel->fdw_private;
-	PgFdwRelationInfo *fpinfo = grouped_rel->fdw_private;
-	ForeignPath *grouppath;
-	double		rows;
-	int			width;
-	Cost		startup_cost;
-	Cost		total_cost;
-
-	/* Nothing to be done, if there is no grouping or aggregation required. */
-	if (!parse->groupClause && !parse->groupingSets && !parse->hasAggs &&
-		!root->hasHavingQual)
-		return;
+	ListCell   *lc1;
+	int			i;
 
-	Assert(extra->patype == PARTITIONWISE_AGGREGATE_NONE ||
-		   extra->patype == PARTITIONWISE_AGGREGATE_FULL);
+	i = 0;
+	foreach(lc1, target->exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc1);
+		Index		sgref = get_pathtarget_sortgroupref(target, i);
+		ListCell   *lc2;
 
-	/* save the input_rel as outerrel in fpinfo */
-	fpinfo->outerrel = input_rel;
+		/* Ignore non-sort expressions */
+		if (sgref == 0 ||
+			get_sortgroupref_clause_noerr(sgref,
+										  root->parse->sortClause) == NULL)
+		{
+			i++;
+			continue;
+		}
 
-	/*
-	 * Copy foreign table, foreign server, user mapping, FDW options etc.
-	 * details from the input relation's fpinfo.
-	 */
-	fpinfo->table = ifpinfo->table;
-	fpinfo->server = ifpinfo->server;
-	fpinfo->user = ifpinfo->user;
-	merge_fdw_options(fpinfo, ifpinfo, NULL);
+		/* We ignore binary-compatible relabeling on both ends */
+		while (expr && IsA(expr, RelabelType))
+			expr = ((RelabelType *) expr)->arg;
 
-	/*
-	 * Assess if it is safe to push down aggregation and grouping.
-	 *
-	 * Use HAVING qual from extra. In case of child partition, it will have
-	 * translated Vars.
-	 */
-	if (!foreign_grouping_ok(root, grouped_rel, extra->havingQual))
-		return;
+		/* Locate an EquivalenceClass member matching this expr, if any */
+		foreach(lc2, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
+			Expr	   *em_expr;
 
-	/*
-	 * Compute the selectivity and cost of the local_conds, so we don't have
-	 * to do it over again for each path.  (Currently we create just a single
-	 * path here, but in future it would be possible that we build more paths
-	 * such as pre-sorted paths as in postgresGetForeignPaths and
-	 * postgresGetForeignJoinPaths.)  The best we can do for these conditions
-	 * is to estimate selectivity on the basis of local statistics.
-	 */
-	fpinfo->local_conds_sel = clauselist_selectivity(root,
-													 fpinfo->local_conds,
-													 0,
-													 JOIN_INNER,
-													 NULL);
+			/* Don't match constants */
+			if (em->em_is_const)
+				continue;
 
-	cost_qual_eval(&fpinfo->local_conds_cost, fpinfo->local_conds, root);
+			/* Ignore child members */
+			if (em->em_is_child)
+				continue;
 
-	/* Estimate the cost of push down */
-	estimate_path_cost_size(root, grouped_rel, NIL, NIL, NULL,
-							&rows, &width, &startup_cost, &total_cost);
+			/* Match if same expression (after stripping relabel) */
+			em_expr = em->em_expr;
+			while (em_expr && IsA(em_expr, RelabelType))
+				em_expr = ((RelabelType *) em_expr)->arg;
 
-	/* Now update this information in the fpinfo */
-	fpinfo->rows = rows;
-	fpinfo->width = width;
-	fpinfo->startup_cost = startup_cost;
-	fpinfo->total_cost = total_cost;
+			if (equal(em_expr, expr))
+				return em->em_expr;
+		}
 
-	/* Create and add foreign path to the grouping relation. */
-	grouppath = create_foreign_upper_path(root,
-										  grouped_rel,
-										  grouped_rel->reltarget,
-										  rows,
-										  startup_cost,
-										  total_cost,
-										  NIL,	/* no pathkeys */
-										  NULL,
-										  NIL); /* no fdw_private */
+		i++;
+	}
 
-	/* Add generated path into grouped_rel by add_path(). */
-	add_path(grouped_rel, (Path *) grouppath);
+	elog(ERROR, "could not find pathkey item to sort");
+	return NULL;				/* keep compiler quiet */
 }
 
-/*
- * add_foreign_ordered_paths
- *		Add foreign paths for performing the final sort remotely.
- *
- * Given input_rel contains the source-data Paths.  The paths are added to the
- * given ordered_rel.
+/* 
+ * pgc_fdw: foundation db cache 
+ *   Here we took an extremely simple and naive approach.   We first
+ *   check if we have a valid cache result, if no, we will simply
+ *   execute the query, cache the data into foundation db as we fetch
+ *   it, and claim we have a valid cache result once it is all there.
+ *   A valid cache result is streamed from foundation db a batch at a 
+ *   time, see cache_fetch_more_data.
  */
-static void
-add_foreign_ordered_paths(PlannerInfo *root, RelOptInfo *input_rel,
-						  RelOptInfo *ordered_rel)
+void cache_create_cursor(ForeignScanState *node)
 {
-	Query	   *parse = root->parse;
-	PgFdwRelationInfo *ifpinfo = input_rel->fdw_private;
-	PgFdwRelationInfo *fpinfo = ordered_rel->fdw_private;
-	PgFdwPathExtraData *fpextra;
-	double		rows;
-	int			width;
-	Cost		startup_cost;
-	Cost		total_cost;
-	List	   *fdw_private;
-	ForeignPath *ordered_path;
-	ListCell   *lc;
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	int			numParams = fsstate->numParams;
+	const char **values = fsstate->param_values;
+	PGconn	   *conn = fsstate->conn;
+	PGresult   *res;
+	MemoryContext oldctxt;
+	StringInfoData buf;
+	int64_t ts;
+	int64_t to;
+	int64_t grace;
+	int64_t start;
+	int32_t status;
 
-	/* Shouldn't get here unless the query has ORDER BY */
-	Assert(parse->sortClause);
+	fsstate->tuples = NULL;
+	fsstate->next_tuple = 0;
+	fsstate->num_tuples = 0;
+	fsstate->cache_filter = NULL;
+	MemoryContextReset(fsstate->batch_cxt);
 
-	/* We don't support cases where there are any SRFs in the targetlist */
-	if (parse->hasTargetSRFs)
+	if (fsstate->pscan && cache_parallel_begin(node)) {
+		fsstate->cursor_exists = true;
 		return;
+	}
+	oldctxt = MemoryContextSwitchTo(fsstate->batch_cxt);
 
-	/* Save the input_rel as outerrel in fpinfo */
-	fpinfo->outerrel = input_rel;
-
-	/*
-	 * Copy foreign table, foreign server, user mapping, FDW options etc.
-	 * details from the input relation's fpinfo.
-	 */
-	fpinfo->table = ifpinfo->table;
-	fpinfo->server = ifpinfo->server;
-	fpinfo->user = ifpinfo->user;
-	merge_fdw_options(fpinfo, ifpinfo, NULL);
+	initStringInfo(&buf);
+	ts = get_ts();
+	to = (int64_t )fsstate->cache_timeout;
+	to *= 1000000;
+	grace = (int64_t) fsstate->cache_stale_grace * 1000000;
 
-	/*
-	 * If the input_rel is a base or join relation, we would already have
-	 * considered pushing down the final sort to the remote server when
-	 * creating pre-sorted foreign paths for that relation, because the
-	 * query_pathkeys is set to the root->sort_pathkeys in that case (see
-	 * standard_qp_callback()).
-	 */
-	if (input_rel->reloptkind == RELOPT_BASEREL ||
-		input_rel->reloptkind == RELOPT_JOINREL)
-	{
-		Assert(root->query_pathkeys == root->sort_pathkeys);
+	if (fsstate->cache_key_prefix == NULL || cache_rels_modified(fsstate->cache_relids) ||
+		(fsstate->pscan && fsstate->pscan->bypass)) {
+		/*
+		 * No key without the epochs, see postgresBeginForeignScan.  And 
+		 * the cache has neither our own uncommitted changes, nor should it
+		 * get them, before we commit or if we roll back.
+		 */
+		status = QRY_FAIL_NO_RETRY;
+	} else {
+		cache_key_text(&buf, fsstate, values);
+		qry_key_build(&fsstate->cache_qk, buf.data);
 
-		/* Safe to push down if the query_pathkeys is safe to push down */
-		fpinfo->pushdown_safe = ifpinfo->qp_is_pushdown_safe;
+		/* 
+		 * On a miss, try a broader cached scan before we claim the entry.
+		 */
+		status = pgcache_get_status(&fsstate->cache_qk, ts, &to, grace, fsstate->cache_fpr, 
+				!fsstate->cache_subsume, buf.data, &fsstate->cache_stats);
+		if (status == QRY_MISS) {
+			status = cache_open_subsuming(node, ts, to);
+			if (status == QRY_MISS) {
+				ts = get_ts();
+				to = (int64_t) fsstate->cache_timeout * 1000000;
+				status = pgcache_get_status(&fsstate->cache_qk, ts, &to, grace, fsstate->cache_fpr, 
+						true, buf.data, &fsstate->cache_stats);
+			}
+		}
+		CHECK_COND(status != QRY_FAIL, "failed to cache query %s", buf.data);
+	}
 
-		return;
+	if (fsstate->cache_rd) {
+		/* tuples come in batches, from cache_fetch_more_data */
+		fsstate->eof_reached = false;
+	} else if (status >= 0) {
+		status = pgcache_reader_open(&fsstate->cache_qk, to, 
+				node->ss.ps.state->es_query_cxt, &fsstate->cache_stats, &fsstate->cache_rd);
+		if (status >= 0) {
+			/* tuples come in batches, from cache_fetch_more_data */
+			fsstate->eof_reached = false;
+		} else {
+			/* Entry changed since we checked, just go remote this time. */
+			status = QRY_FAIL_NO_RETRY;
+		}
 	}
 
-	/* The input_rel should be a grouping relation */
-	Assert(input_rel->reloptkind == RELOPT_UPPER_REL &&
-		   ifpinfo->stage == UPPERREL_GROUP_AGG);
+	if (fsstate->cache_rd) {
+		pgcache_stats_add(&fsstate->cache_stats, PGC_STAT_HITS, 1);
+	} else if (status == QRY_FETCH) {
+		pgcache_stats_add(&fsstate->cache_stats, PGC_STAT_MISSES, 1);
+	} else {
+		pgcache_stats_add(&fsstate->cache_stats, PGC_STAT_BYPASSES, 1);
+	}
 
-	/*
-	 * We try to create a path below by extending a simple foreign path for
-	 * the underlying grouping relation to perform the final sort remotely,
-	 * which is stored into the fdw_private list of the resulting path.
+	/* 
+	 * Before going remote, so that a commit that modifies the tables after
+	 * we read them finds the entry and drops it, or the populate fails.
 	 */
+	if (status == QRY_FETCH) {
+		pgcache_dep_register(fsstate->cache_deps, fsstate->cache_ndep, &fsstate->cache_qk, 1);
+	}
 
-	/* Assess if it is safe to push down the final sort */
-	foreach(lc, root->sort_pathkeys)
-	{
-		PathKey    *pathkey = (PathKey *) lfirst(lc);
-		EquivalenceClass *pathkey_ec = pathkey->pk_eclass;
-		Expr	   *sort_expr;
-
+	/* A parallel worker connects on first use. */
+	if (!fsstate->cache_rd && !fsstate->conn) {
+		fsstate->conn = GetConnection(fsstate->user, false, &fsstate->conn_state);
+		conn = fsstate->conn;
+	}
+	start = get_ts();
+		
+	if (status == QRY_FETCH && fsstate->cache_param_batch > 0 && values[0] != NULL &&
+		cache_fetch_param_batch(node, to, grace)) {
+		/* fetched and populated along with other parameter values */
+	} else if (status == QRY_FETCH || status == QRY_FDB_LIMIT_REACHED || status == QRY_FAIL_NO_RETRY) {
+		fsstate->cursor_number = GetCursorNumber(conn);
+		resetStringInfo(&buf);
+		appendStringInfo(&buf, "DECLARE c%u%s CURSOR FOR\n%s", fsstate->cursor_number, 
+				fsstate->attrecvmeta ? " BINARY" : "", fsstate->query);
 		/*
-		 * is_foreign_expr would detect volatile expressions as well, but
-		 * checking ec_has_volatile here saves some cycles.
+		 * Notice that we pass NULL for paramTypes, thus forcing the remote server
+		 * to infer types for all parameters.  Since we explicitly cast every
+		 * parameter (see deparse.c), the "inference" is trivial and will produce
+		 * the desired result.  This allows us to avoid assuming that the remote
+		 * server has the same OIDs we do for the parameters' types.
 		 */
-		if (pathkey_ec->ec_has_volatile)
-			return;
+		if (fsstate->conn_state->pendingScan) {
+			process_pending_request(fsstate->conn_state->pendingScan);
+		}
+		if (!PQsendQueryParams(conn, buf.data, numParams,
+					NULL, values, NULL, NULL, 0))
+			pgfdw_report_error(ERROR, NULL, conn, false, buf.data);
 
-		/* Get the sort expression for the pathkey_ec */
-		sort_expr = find_em_expr_for_input_target(root,
-												  pathkey_ec,
-												  input_rel->reltarget);
+		res = pgfdw_get_result(conn, buf.data);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			pgfdw_report_error(ERROR, res, conn, true, fsstate->query);
+		}
+		PQclear(res);
 
-		/* If it's unsafe to remote, we cannot push down the final sort */
-		if (!is_foreign_expr(root, input_rel, sort_expr))
-			return;
+		/* 
+		 * Rows come a batch at a time from fetch_more_data, as they would 
+		 * without the cache, and a miss is populated as they do, see 
+		 * cache_remote_batch.
+		 */
+		fsstate->cache_remote = true;
+		fsstate->cache_remote_us = get_ts() - start;
+		fsstate->fetch_ct_2 = 0;
+		fsstate->eof_reached = false;
+		if (status == QRY_FETCH) {
+			fsstate->cache_wr = pgcache_writer_open(&fsstate->cache_qk, to, fsstate->cache_compression,
+					node->ss.ps.state->es_query_cxt, &fsstate->cache_stats);
+		}
 	}
 
-	/* Safe to push down */
-	fpinfo->pushdown_safe = true;
-
-	/* Construct PgFdwPathExtraData */
-	fpextra = (PgFdwPathExtraData *) palloc0(sizeof(PgFdwPathExtraData));
-	fpextra->target = root->upper_targets[UPPERREL_ORDERED];
-	fpextra->has_final_sort = true;
+	MemoryContextSwitchTo(oldctxt);
+	cache_flush_stats(fsstate);
 
-	/* Estimate the costs of performing the final sort remotely */
-	estimate_path_cost_size(root, input_rel, NIL, root->sort_pathkeys, fpextra,
-							&rows, &width, &startup_cost, &total_cost);
+	/* Now we consider this cursor (from cache) existed. */
+	fsstate->cursor_exists = true;
+}
 
-	/*
-	 * Build the fdw_private list that will be used by postgresGetForeignPlan.
-	 * Items in the list must match order in enum FdwPathPrivateIndex.
-	 */
-	fdw_private = list_make2(makeInteger(true), makeInteger(false));
+/*
+ * Text identifying the result of our query with parameter values values,
+ * the cache key is its SHA.
+ */
+static void
+cache_key_text(StringInfo buf, PgFdwScanState *fsstate, const char **values)
+{
+	appendStringInfo(buf, "%s%s", fsstate->cache_key_prefix, fsstate->query);
 
-	/* Create foreign ordering path */
-	ordered_path = create_foreign_upper_path(root,
-											 input_rel,
-											 root->upper_targets[UPPERREL_ORDERED],
-											 rows,
-											 startup_cost,
-											 total_cost,
-											 root->sort_pathkeys,
-											 NULL,	/* no extra plan */
-											 fdw_private);
+	for (int i = 0; i < fsstate->numParams; i++) {
+		if (values[i] == NULL) {
+			appendStringInfo(buf, " ,PARAM %d: NULL", i);
+		} else {
+			appendStringInfo(buf, " ,PARAM %d: {%s}", i, values[i]);
+		}
+	}
+}
 
-	/* and add it to the ordered_rel */
-	add_path(ordered_rel, (Path *) ordered_path);
+/*
+ * Tuples of a remote result, in current memory context.
+ */
+static HeapTuple *
+cache_result_tuples(ForeignScanState *node, PGresult *res, int *ntuples)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	int			n = PQntuples(res);
+	HeapTuple  *tuples;
+
+	tuples = (HeapTuple *) palloc0(Max(n, 1) * sizeof(HeapTuple));
+	for (int i = 0; i < n; i++)
+		tuples[i] = make_tuple_from_result_row(res, i,
+											   fsstate->rel,
+											   fsstate->attinmeta,
+											   fsstate->attrecvmeta,
+											   fsstate->retrieved_attrs,
+											   node,
+											   fsstate->temp_cxt);
+	*ntuples = n;
+	return tuples;
 }
 
 /*
- * add_foreign_final_paths
- *		Add foreign paths for performing the final processing remotely.
+ * We claimed generation gen of the entry of our single parameter value.
+ * Claim the entries of other values the query was recently run with that
+ * are missing too, fetch them all in one round trip, and populate each.
+ * Return false, leaving the fetch to the caller, if there are none.  Our
+ * tuples are left in fsstate->tuples.
  *
- * Given input_rel contains the source-data Paths.  The paths are added to the
- * given final_rel.
+ * Each value executes the same prepared statement, in one multi-statement
+ * query, so that each gets a result of its own and the remote query stays
+ * as deparsed.
  */
-static void
-add_foreign_final_paths(PlannerInfo *root, RelOptInfo *input_rel,
-						RelOptInfo *final_rel,
-						FinalPathExtraData *extra)
+static bool
+cache_fetch_param_batch(ForeignScanState *node, int64_t gen, int64_t grace)
 {
-	Query	   *parse = root->parse;
-	PgFdwRelationInfo *ifpinfo = (PgFdwRelationInfo *) input_rel->fdw_private;
-	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) final_rel->fdw_private;
-	bool		has_final_sort = false;
-	List	   *pathkeys = NIL;
-	PgFdwPathExtraData *fpextra;
-	bool		save_use_remote_estimate = false;
-	double		rows;
-	int			width;
-	Cost		startup_cost;
-	Cost		total_cost;
-	List	   *fdw_private;
-	ForeignPath *final_path;
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	PGconn	   *conn = fsstate->conn;
+	const char *value = fsstate->param_values[0];
+	int64_t		timeout = (int64_t) fsstate->cache_timeout * 1000000;
+	char		tplsha[20];
+	List	   *recalled;
+	const char **vals;
+	const char **qstrs;
+	qry_key_t  *qks;
+	bool	   *claimed;
+	int			nval = 1;
+	unsigned int prep_number;
+	StringInfoData buf;
+	StringInfoData sql;
+	MemoryContext peer_cxt;
+	pgcache_stats_t peer_stats;
+	PGresult   *volatile res = NULL;
+	ListCell   *lc;
 
-	/*
-	 * Currently, we only support this for SELECT commands
-	 */
-	if (parse->commandType != CMD_SELECT)
-		return;
+	Assert(fsstate->numParams == 1 && value != NULL);
 
-	/*
-	 * No work if there is no FOR UPDATE/SHARE clause and if there is no need
-	 * to add a LIMIT node
-	 */
-	if (!parse->rowMarks && !extra->limit_needed)
-		return;
+	initStringInfo(&buf);
+	/* Key text without the parameters, see cache_key_text. */
+	appendStringInfo(&buf, "%s%s", fsstate->cache_key_prefix, fsstate->query);
+	SHA1((const unsigned char *) buf.data, buf.len, (unsigned char *) tplsha);
+	recalled = pgcache_params_recall(tplsha);
+	pgcache_params_remember(tplsha, value, gen, timeout);
+
+	vals = (const char **) palloc((list_length(recalled) + 1) * sizeof(char *));
+	qstrs = (const char **) palloc((list_length(recalled) + 1) * sizeof(char *));
+	qks = (qry_key_t *) palloc((list_length(recalled) + 1) * sizeof(qry_key_t));
+	claimed = (bool *) palloc((list_length(recalled) + 1) * sizeof(bool));
+	vals[0] = value;
+	qks[0] = fsstate->cache_qk;
+	claimed[0] = true;
+
+	foreach(lc, recalled)
+	{
+		const char *v = (const char *) lfirst(lc);
 
-	/* We don't support cases where there are any SRFs in the targetlist */
-	if (parse->hasTargetSRFs)
-		return;
+		if (nval >= fsstate->cache_param_batch)
+			break;
+		if (strcmp(v, value) == 0)
+			continue;
 
-	/* Save the input_rel as outerrel in fpinfo */
-	fpinfo->outerrel = input_rel;
+		resetStringInfo(&buf);
+		cache_key_text(&buf, fsstate, &v);
+		vals[nval] = v;
+		qstrs[nval] = pstrdup(buf.data);
+		qry_key_build(&qks[nval], buf.data);
+		nval++;
+	}
 
-	/*
-	 * Copy foreign table, foreign server, user mapping, FDW options etc.
-	 * details from the input relation's fpinfo.
-	 */
-	fpinfo->table = ifpinfo->table;
-	fpinfo->server = ifpinfo->server;
-	fpinfo->user = ifpinfo->user;
-	merge_fdw_options(fpinfo, ifpinfo, NULL);
+	if (pgcache_claim_many(nval - 1, qks + 1, qstrs + 1, gen, timeout, grace,
+						   fsstate->cache_fpr, claimed + 1) == 0)
+		return false;
 
-	/*
-	 * If there is no need to add a LIMIT node, there might be a ForeignPath
-	 * in the input_rel's pathlist that implements all behavior of the query.
-	 * Note: we would already have accounted for the query's FOR UPDATE/SHARE
-	 * (if any) before we get here.
-	 */
-	if (!extra->limit_needed)
+	peer_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "pgc_fdw parameter batch",
+									 ALLOCSET_DEFAULT_SIZES);
+	memset(&peer_stats, 0, sizeof(peer_stats));
+	PG_TRY();
 	{
-		ListCell   *lc;
+		int			i = -1;
+		int64_t		start;
+		int64_t		remote_us = 0;
 
-		Assert(parse->rowMarks);
+		/* Our own entry's dependencies are registered already. */
+		{
+			qry_key_t  *depqks = (qry_key_t *) palloc(nval * sizeof(qry_key_t));
+			int			ndep = 0;
+
+			for (int k = 1; k < nval; k++)
+				if (claimed[k])
+					depqks[ndep++] = qks[k];
+			pgcache_dep_register(fsstate->cache_deps, fsstate->cache_ndep,
+								 depqks, ndep);
+			pfree(depqks);
+		}
 
 		/*
-		 * Grouping and aggregation are not supported with FOR UPDATE/SHARE,
-		 * so the input_rel should be a base, join, or ordered relation; and
-		 * if it's an ordered relation, its input relation should be a base or
-		 * join relation.
+		 * The scan got its connection without prepared statements in mind.
+		 * Say we have some now, so that if an EXECUTE fails before our
+		 * DEALLOCATE runs, the end of the transaction deallocates them.
 		 */
-		Assert(input_rel->reloptkind == RELOPT_BASEREL ||
-			   input_rel->reloptkind == RELOPT_JOINREL ||
-			   (input_rel->reloptkind == RELOPT_UPPER_REL &&
-				ifpinfo->stage == UPPERREL_ORDERED &&
-				(ifpinfo->outerrel->reloptkind == RELOPT_BASEREL ||
-				 ifpinfo->outerrel->reloptkind == RELOPT_JOINREL)));
+		(void) GetConnection(fsstate->user, true, &fsstate->conn_state);
 
-		foreach(lc, input_rel->pathlist)
+		prep_number = GetPrepStmtNumber(conn);
+		initStringInfo(&sql);
+		appendStringInfo(&sql, "PREPARE pgc_b%u AS\n%s;\n", prep_number, fsstate->query);
+		for (int k = 0; k < nval; k++)
 		{
-			Path	   *path = (Path *) lfirst(lc);
+			char	   *lit;
 
-			/*
-			 * apply_scanjoin_target_to_paths() uses create_projection_path()
-			 * to adjust each of its input paths if needed, whereas
-			 * create_ordered_paths() uses apply_projection_to_path() to do
-			 * that.  So the former might have put a ProjectionPath on top of
-			 * the ForeignPath; look through ProjectionPath and see if the
-			 * path underneath it is ForeignPath.
-			 */
-			if (IsA(path, ForeignPath) ||
-				(IsA(path, ProjectionPath) &&
-				 IsA(((ProjectionPath *) path)->subpath, ForeignPath)))
-			{
-				/*
-				 * Create foreign final path; this gets rid of a
-				 * no-longer-needed outer plan (if any), which makes the
-				 * EXPLAIN output look cleaner
-				 */
-				final_path = create_foreign_upper_path(root,
-													   path->parent,
-													   path->pathtarget,
-													   path->rows,
-													   path->startup_cost,
-													   path->total_cost,
-													   path->pathkeys,
-													   NULL,	/* no extra plan */
-													   NULL);	/* no fdw_private */
+			if (!claimed[k])
+				continue;
+			lit = PQescapeLiteral(conn, vals[k], strlen(vals[k]));
+			if (lit == NULL)
+				pgfdw_report_error(ERROR, NULL, conn, false, fsstate->query);
+			appendStringInfo(&sql, "EXECUTE pgc_b%u(%s);\n", prep_number, lit);
+			PQfreemem(lit);
+		}
+		appendStringInfo(&sql, "DEALLOCATE pgc_b%u", prep_number);
 
-				/* and add it to the final_rel */
-				add_path(final_rel, (Path *) final_path);
+		if (fsstate->conn_state->pendingScan)
+			process_pending_request(fsstate->conn_state->pendingScan);
+		if (!PQsendQuery(conn, sql.data))
+			pgfdw_report_error(ERROR, NULL, conn, false, sql.data);
 
-				/* Safe to push down */
-				fpinfo->pushdown_safe = true;
+		start = get_ts();
 
-				return;
-			}
-		}
+		/* PREPARE, one result per claimed value in order, DEALLOCATE */
+		while ((res = pgfdw_get_next_result(conn, sql.data)) != NULL)
+		{
+			ExecStatusType st = PQresultStatus(res);
 
-		/*
-		 * If we get here it means no ForeignPaths; since we would already
-		 * have considered pushing down all operations for the query to the
-		 * remote server, give up on it.
-		 */
-		return;
-	}
+			/* time spent waiting for the remote, not populating */
+			remote_us += get_ts() - start;
 
-	Assert(extra->limit_needed);
+			if (st == PGRES_TUPLES_OK)
+			{
+				do
+				{
+					i++;
+				} while (i < nval && !claimed[i]);
+				if (i >= nval)
+					elog(ERROR, "unexpected result of parameter batch");
 
-	/*
-	 * If the input_rel is an ordered relation, replace the input_rel with its
-	 * input relation
-	 */
-	if (input_rel->reloptkind == RELOPT_UPPER_REL &&
-		ifpinfo->stage == UPPERREL_ORDERED)
-	{
-		input_rel = ifpinfo->outerrel;
-		ifpinfo = (PgFdwRelationInfo *) input_rel->fdw_private;
-		has_final_sort = true;
-		pathkeys = root->sort_pathkeys;
-	}
+				if (i == 0)
+				{
+					fsstate->tuples = cache_result_tuples(node, res, &fsstate->num_tuples);
+					pgcache_populate(&fsstate->cache_qk, gen, fsstate->num_tuples,
+									 fsstate->tuples, fsstate->cache_compression,
+									 &fsstate->cache_stats);
+					claimed[i] = false;
+				}
+				else
+				{
+					MemoryContext oldcxt = MemoryContextSwitchTo(peer_cxt);
+					HeapTuple  *tuples;
+					int			ntuples;
+
+					tuples = cache_result_tuples(node, res, &ntuples);
+					pgcache_populate(&qks[i], gen, ntuples, tuples,
+									 fsstate->cache_compression, &peer_stats);
+					pgcache_stats_flush(fsstate->rel ? RelationGetRelid(fsstate->rel) : InvalidOid,
+										&qks[i], &peer_stats);
+					claimed[i] = false;
+					MemoryContextSwitchTo(oldcxt);
+					MemoryContextReset(peer_cxt);
+				}
+			}
+			else if (st != PGRES_COMMAND_OK)
+				pgfdw_report_error(ERROR, res, conn, false, sql.data);
 
-	/* The input_rel should be a base, join, or grouping relation */
-	Assert(input_rel->reloptkind == RELOPT_BASEREL ||
-		   input_rel->reloptkind == RELOPT_JOINREL ||
-		   (input_rel->reloptkind == RELOPT_UPPER_REL &&
-			ifpinfo->stage == UPPERREL_GROUP_AGG));
+			PQclear(res);
+			res = NULL;
+			start = get_ts();
+		}
+		fsstate->eof_reached = true;
+		pgcache_stats_add(&fsstate->cache_stats, PGC_STAT_REMOTE_US, remote_us);
+		pgcache_stats_latency(fsstate->cache_stats.remote_hist, remote_us);
+	}
+	PG_CATCH();
+	{
+		if (res)
+			PQclear(res);
+		res = NULL;
 
-	/*
-	 * We try to create a path below by extending a simple foreign path for
-	 * the underlying base, join, or grouping relation to perform the final
-	 * sort (if has_final_sort) and the LIMIT restriction remotely, which is
-	 * stored into the fdw_private list of the resulting path.  (We
-	 * re-estimate the costs of sorting the underlying relation, if
-	 * has_final_sort.)
-	 */
+		/*
+		 * Entries we claimed but did not populate would keep others waiting
+		 * for our lease, hand them over right away.
+		 */
+		for (int j = 0; j < nval; j++)
+			if (claimed[j])
+				pgcache_release_lease(&qks[j], gen);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-	/*
-	 * Assess if it is safe to push down the LIMIT and OFFSET to the remote
-	 * server
-	 */
+	MemoryContextDelete(peer_cxt);
+	return true;
+}
 
-	/*
-	 * If the underlying relation has any local conditions, the LIMIT/OFFSET
-	 * cannot be pushed down.
-	 */
-	if (ifpinfo->local_conds)
-		return;
+/*
+ * Start of the cache key text of a scan of the foreign tables relids (Oid)
+ * of server serverid: the database, and the epochs of the tables and the
+ * server, so that pgc_fdw_invalidate_table and pgc_fdw_invalidate_server
+ * retire its entries.  False if the epochs cannot be read, the scan should
+ * not use the cache then.
+ */
+static bool
+cache_key_prefix(StringInfo buf, List *relids, Oid serverid)
+{
+	char	   *shas = palloc(20 * (list_length(relids) + 1));
+	int			n = 0;
+	int			err;
+	ListCell   *lc;
 
-	/*
-	 * Also, the LIMIT/OFFSET cannot be pushed down, if their expressions are
-	 * not safe to remote.
-	 */
-	if (!is_foreign_expr(root, input_rel, (Expr *) parse->limitOffset) ||
-		!is_foreign_expr(root, input_rel, (Expr *) parse->limitCount))
-		return;
+	foreach(lc, relids)
+		pgcache_rel_sha(lfirst_oid(lc), shas + 20 * n++);
+	pgcache_server_sha(serverid, shas + 20 * n++);
 
-	/* Safe to push down */
-	fpinfo->pushdown_safe = true;
+	appendStringInfo(buf, "Dbid: %d, ", MyDatabaseId);
+	err = pgcache_epoch_text(buf, shas, n);
+	appendStringInfoString(buf, "Query: ");
+	pfree(shas);
+	return err == 0;
+}
 
-	/* Construct PgFdwPathExtraData */
-	fpextra = (PgFdwPathExtraData *) palloc0(sizeof(PgFdwPathExtraData));
-	fpextra->target = root->upper_targets[UPPERREL_FINAL];
-	fpextra->has_final_sort = has_final_sort;
-	fpextra->has_limit = extra->limit_needed;
-	fpextra->limit_tuples = extra->limit_tuples;
-	fpextra->count_est = extra->count_est;
-	fpextra->offset_est = extra->offset_est;
+/*
+ * Remember that the current transaction modified foreign table relid.
+ */
+static void
+cache_note_modified(Oid relid)
+{
+	MemoryContext oldcxt;
 
-	/*
-	 * Estimate the costs of performing the final sort and the LIMIT
-	 * restriction remotely.  If has_final_sort is false, we wouldn't need to
-	 * execute EXPLAIN anymore if use_remote_estimate, since the costs can be
-	 * roughly estimated using the costs we already have for the underlying
-	 * relation, in the same way as when use_remote_estimate is false.  Since
-	 * it's pretty expensive to execute EXPLAIN, force use_remote_estimate to
-	 * false in that case.
-	 */
-	if (!fpextra->has_final_sort)
+	if (!cache_xact_callback_registered)
 	{
-		save_use_remote_estimate = ifpinfo->use_remote_estimate;
-		ifpinfo->use_remote_estimate = false;
+		RegisterXactCallback(cache_xact_callback, NULL);
+		cache_xact_callback_registered = true;
 	}
-	estimate_path_cost_size(root, input_rel, NIL, pathkeys, fpextra,
-							&rows, &width, &startup_cost, &total_cost);
-	if (!fpextra->has_final_sort)
-		ifpinfo->use_remote_estimate = save_use_remote_estimate;
-
-	/*
-	 * Build the fdw_private list that will be used by postgresGetForeignPlan.
-	 * Items in the list must match order in enum FdwPathPrivateIndex.
-	 */
-	fdw_private = list_make2(makeInteger(has_final_sort),
-							 makeInteger(extra->limit_needed));
 
-	/*
-	 * Create foreign final path; this gets rid of a no-longer-needed outer
-	 * plan (if any), which makes the EXPLAIN output look cleaner
-	 */
-	final_path = create_foreign_upper_path(root,
-										   input_rel,
-										   root->upper_targets[UPPERREL_FINAL],
-										   rows,
-										   startup_cost,
-										   total_cost,
-										   pathkeys,
-										   NULL,	/* no extra plan */
-										   fdw_private);
+	/* fdb is started now, an error once we have committed would be fatal */
+	(void) get_fdb();
 
-	/* and add it to the final_rel */
-	add_path(final_rel, (Path *) final_path);
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	cache_modified_rels = list_append_unique_oid(cache_modified_rels, relid);
+	MemoryContextSwitchTo(oldcxt);
 }
 
 /*
- * Create a tuple from the specified row of the PGresult.
- *
- * rel is the local representation of the foreign table, attinmeta is
- * conversion data for the rel's tupdesc, and retrieved_attrs is an
- * integer list of the table column numbers present in the PGresult.
- * temp_context is a working context that can be reset after each tuple.
+ * Did the current transaction modify any of the foreign tables relids?
  */
-static HeapTuple
-make_tuple_from_result_row(PGresult *res,
-						   int row,
-						   Relation rel,
-						   AttInMetadata *attinmeta,
-						   List *retrieved_attrs,
-						   ForeignScanState *fsstate,
-						   MemoryContext temp_context)
+static bool
+cache_rels_modified(List *relids)
 {
-	HeapTuple	tuple;
-	TupleDesc	tupdesc;
-	Datum	   *values;
-	bool	   *nulls;
-	ItemPointer ctid = NULL;
-	ConversionLocation errpos;
-	ErrorContextCallback errcallback;
-	MemoryContext oldcontext;
 	ListCell   *lc;
-	int			j;
 
-	Assert(row < PQntuples(res));
+	foreach(lc, relids)
+		if (list_member_oid(cache_modified_rels, lfirst_oid(lc)))
+			return true;
+	return false;
+}
 
-	/*
-	 * Do the following work in a temp context that we reset after each tuple.
-	 * This cleans up not only the data we have direct access to, but any
-	 * cruft the I/O functions might leak.
-	 */
-	oldcontext = MemoryContextSwitchTo(temp_context);
+/*
+ * Drop the cache entries that depend on the foreign tables the transaction
+ * modified, once it has committed, and so have the remote transactions.
+ * Entries of a transaction that aborted are still good.
+ */
+static void
+cache_xact_callback(XactEvent event, void *arg)
+{
+	ListCell   *lc;
 
-	if (rel)
-		tupdesc = RelationGetDescr(rel);
-	else
+	switch (event)
 	{
-		Assert(fsstate);
-		tupdesc = fsstate->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
-	}
+		case XACT_EVENT_COMMIT:
+			foreach(lc, cache_modified_rels)
+			{
+				char		relsha[20];
 
-	values = (Datum *) palloc0(tupdesc->natts * sizeof(Datum));
-	nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
-	/* Initialize to nulls for any columns not present in result */
-	memset(nulls, true, tupdesc->natts * sizeof(bool));
+				pgcache_rel_sha(lfirst_oid(lc), relsha);
+				pgcache_dep_invalidate(relsha);
+			}
+			cache_modified_rels = NIL;
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			cache_modified_rels = NIL;
+			break;
+		default:
+			break;
+	}
+}
 
-	/*
-	 * Set up and install callback to report where conversion error occurs.
-	 */
-	errpos.rel = rel;
-	errpos.cur_attno = 0;
-	errpos.fsstate = fsstate;
-	errcallback.callback = conversion_error_callback;
-	errcallback.arg = (void *) &errpos;
-	errcallback.previous = error_context_stack;
-	error_context_stack = &errcallback;
+/*
+ * Open a reader on a fresh cached scan of the same relation that subsumes
+ * ours, setting up cache_filter with the conditions it does not apply.
+ * Its tuples have the row type of the relation, the columns we do not 
+ * need are simply not projected.  Return its number of tuples, or QRY_MISS.
+ */
+static int32_t
+cache_open_subsuming(ForeignScanState *node, int64_t now, int64_t timeout)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+	Index		scanrelid = fsplan->scan.scanrelid;
+	char		relsha[20];
+	qry_key_t	qk;
+	int64_t		gen;
+	Bitmapset  *retattrs = NULL;
+	List	   *condattrs = NIL;
+	List	   *residual = NIL;
+	List	   *filter = NIL;
+	ListCell   *lc;
+	int32_t		status;
+	MemoryContext oldcxt;
 
-	/*
-	 * i indexes columns in the relation, j indexes columns in the PGresult.
-	 */
-	j = 0;
-	foreach(lc, retrieved_attrs)
+	foreach(lc, fsstate->retrieved_attrs)
+		retattrs = bms_add_member(retattrs,
+								  lfirst_int(lc) - FirstLowInvalidHeapAttributeNumber);
+	foreach(lc, fsplan->fdw_recheck_quals)
 	{
-		int			i = lfirst_int(lc);
-		char	   *valstr;
+		Bitmapset  *attrs = NULL;
 
-		/* fetch next column's textual value */
-		if (PQgetisnull(res, row, j))
-			valstr = NULL;
-		else
-			valstr = PQgetvalue(res, row, j);
+		pull_varattnos((Node *) lfirst(lc), scanrelid, &attrs);
+		condattrs = lappend(condattrs, attrs);
+	}
+	Assert(list_length(condattrs) == list_length(fsstate->cache_conds));
 
-		/*
-		 * convert value to internal representation
-		 *
-		 * Note: we ignore system columns other than ctid and oid in result
-		 */
-		errpos.cur_attno = i;
-		if (i > 0)
-		{
-			/* ordinary column */
-			Assert(i <= tupdesc->natts);
-			nulls[i - 1] = (valstr == NULL);
-			/* Apply the input function even to nulls, to support domains */
-			values[i - 1] = InputFunctionCall(&attinmeta->attinfuncs[i - 1],
-											  valstr,
-											  attinmeta->attioparams[i - 1],
-											  attinmeta->atttypmods[i - 1]);
-		}
-		else if (i == SelfItemPointerAttributeNumber)
-		{
-			/* ctid */
-			if (valstr != NULL)
-			{
-				Datum		datum;
+	pgcache_rel_sha(RelationGetRelid(fsstate->rel), relsha);
+	status = pgcache_shape_lookup(relsha, fsstate->cache_conds, condattrs, retattrs,
+								  fsstate->tupdesc, fsstate->cache_key_prefix,
+								  now, timeout, &qk, &gen, &residual);
+	if (status < 0)
+		return QRY_MISS;
 
-				datum = DirectFunctionCall1(tidin, CStringGetDatum(valstr));
-				ctid = (ItemPointer) DatumGetPointer(datum);
-			}
-		}
-		errpos.cur_attno = 0;
+	status = pgcache_reader_open(&qk, gen, node->ss.ps.state->es_query_cxt,
+								 &fsstate->cache_stats, &fsstate->cache_rd);
+	if (status < 0)
+		return QRY_MISS;
 
-		j++;
-	}
+	foreach(lc, residual)
+		filter = lappend(filter, list_nth(fsplan->fdw_recheck_quals, lfirst_int(lc)));
 
-	/* Uninstall error context callback. */
-	error_context_stack = errcallback.previous;
+	oldcxt = MemoryContextSwitchTo(node->ss.ps.state->es_query_cxt);
+	fsstate->cache_filter = ExecInitQual(filter, (PlanState *) node);
+	MemoryContextSwitchTo(oldcxt);
 
-	/*
-	 * Check we got the expected number of columns.  Note: j == 0 and
-	 * PQnfields == 1 is expected, since deparse emits a NULL if no columns.
-	 */
-	if (j > 0 && j != PQnfields(res))
-		elog(ERROR, "remote query result does not match the foreign table");
+	return status;
+}
 
-	/*
-	 * Build the result tuple in caller's memory context.
-	 */
-	MemoryContextSwitchTo(oldcontext);
+/*
+ * Leader of a parallel scan: find out whether the entry of the current
+ * parameter values is fresh, in which case participants split its blocks.
+ * A stale entry, a miss or a broader cached scan is left to a single
+ * participant, which goes through cache_create_cursor as usual.
+ */
+static void
+cache_parallel_decide(ForeignScanState *node, PgFdwParallelScan *pscan)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	StringInfoData buf;
+	int32_t		ntup;
 
-	tuple = heap_form_tuple(tupdesc, values, nulls);
+	if (fsstate->numParams > 0)
+	{
+		MemoryContext oldcontext;
 
-	/*
-	 * If we have a CTID to return, install it in both t_self and t_ctid.
-	 * t_self is the normal place, but if the tuple is converted to a
-	 * composite Datum, t_self will be lost; setting t_ctid allows CTID to be
-	 * preserved during EvalPlanQual re-evaluations (see ROW_MARK_COPY code).
-	 */
-	if (ctid)
-		tuple->t_self = tuple->t_data->t_ctid = *ctid;
+		oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+		process_query_params(econtext,
+							 fsstate->param_flinfo,
+							 fsstate->param_exprs,
+							 fsstate->param_values);
+		MemoryContextSwitchTo(oldcontext);
+	}
 
-	/*
-	 * Stomp on the xmin, xmax, and cmin fields from the tuple created by
-	 * heap_form_tuple.  heap_form_tuple actually creates the tuple with
-	 * DatumTupleFields, not HeapTupleFields, but the executor expects
-	 * HeapTupleFields and will happily extract system columns on that
-	 * assumption.  If we don't do this then, for example, the tuple length
-	 * ends up in the xmin field, which isn't what we want.
+	pscan->split = false;
+	pscan->taken = false;
+	pg_atomic_write_u32(&pscan->next_chunk, 0);
+
+	/*
+	 * Without the epochs, or if we modified the tables, one participant goes
+	 * remote.  Workers do not know what the leader modified.
 	 */
-	HeapTupleHeaderSetXmax(tuple->t_data, InvalidTransactionId);
-	HeapTupleHeaderSetXmin(tuple->t_data, InvalidTransactionId);
-	HeapTupleHeaderSetCmin(tuple->t_data, InvalidTransactionId);
+	pscan->bypass = cache_rels_modified(fsstate->cache_relids);
+	if (fsstate->cache_key_prefix == NULL || pscan->bypass)
+		return;
 
-	/* Clean up */
-	MemoryContextReset(temp_context);
+	initStringInfo(&buf);
+	cache_key_text(&buf, fsstate, fsstate->param_values);
+	qry_key_build(&pscan->qk, buf.data);
+	pfree(buf.data);
+	fsstate->cache_qk = pscan->qk;
 
-	return tuple;
+	ntup = pgcache_fresh(&pscan->qk, get_ts(),
+						 (int64_t) fsstate->cache_timeout * 1000000,
+						 fsstate->cache_fpr, &pscan->gen, &fsstate->cache_stats);
+	pscan->split = (ntup >= 0);
+
+	/* one hit for the whole scan, whoever reads it */
+	if (pscan->split)
+	{
+		pgcache_stats_add(&fsstate->cache_stats, PGC_STAT_HITS, 1);
+		pgcache_touch(&pscan->qk, get_ts());
+	}
+	cache_flush_stats(fsstate);
 }
 
 /*
- * Callback function which is called when error occurs during column value
- * conversion.  Print names of column and relation.
+ * Start a participant of a parallel scan.  Return true if it is set up to
+ * read its share, possibly nothing, and false if it is the one participant
+ * to do the scan the usual way.
  */
-static void
-conversion_error_callback(void *arg)
+static bool
+cache_parallel_begin(ForeignScanState *node)
 {
-	const char *attname = NULL;
-	const char *relname = NULL;
-	bool		is_wholerow = false;
-	ConversionLocation *errpos = (ConversionLocation *) arg;
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	PgFdwParallelScan *pscan = fsstate->pscan;
+	int32_t		status;
+	bool		taken;
 
-	if (errpos->rel)
+	if (pscan->split)
 	{
-		/* error occurred in a scan against a foreign table */
-		TupleDesc	tupdesc = RelationGetDescr(errpos->rel);
-		Form_pg_attribute attr = TupleDescAttr(tupdesc, errpos->cur_attno - 1);
+		fsstate->cache_qk = pscan->qk;
+		status = pgcache_reader_open_ranged(&pscan->qk, pscan->gen,
+											node->ss.ps.state->es_query_cxt,
+											&fsstate->cache_stats,
+											&fsstate->cache_nblk,
+											&fsstate->cache_rd);
+		CHECK_COND(status >= 0, "cache entry changed during parallel scan");
+		if (!cache_parallel_seek(fsstate))
+			cache_close_reader(fsstate);
+		fsstate->eof_reached = (fsstate->cache_rd == NULL);
+		return true;
+	}
 
-		if (errpos->cur_attno > 0 && errpos->cur_attno <= tupdesc->natts)
-			attname = NameStr(attr->attname);
-		else if (errpos->cur_attno == SelfItemPointerAttributeNumber)
-			attname = "ctid";
+	SpinLockAcquire(&pscan->mutex);
+	taken = pscan->taken;
+	pscan->taken = true;
+	SpinLockRelease(&pscan->mutex);
 
-		relname = RelationGetRelationName(errpos->rel);
-	}
-	else
+	if (taken)
 	{
-		/* error occurred in a scan against a foreign join */
-		ForeignScanState *fsstate = errpos->fsstate;
-		ForeignScan *fsplan = castNode(ForeignScan, fsstate->ss.ps.plan);
-		EState	   *estate = fsstate->ss.ps.state;
-		TargetEntry *tle;
-
-		tle = list_nth_node(TargetEntry, fsplan->fdw_scan_tlist,
-							errpos->cur_attno - 1);
+		fsstate->eof_reached = true;
+		return true;
+	}
+	return false;
+}
 
-		/*
-		 * Target list can have Vars and expressions.  For Vars, we can get
-		 * its relation, however for expressions we can't.  Thus for
-		 * expressions, just show generic context message.
-		 */
-		if (IsA(tle->expr, Var))
-		{
-			RangeTblEntry *rte;
-			Var		   *var = (Var *) tle->expr;
+/*
+ * Point the ranged reader of a parallel scan at the next chunk of blocks
+ * nobody has taken yet.  False if there are none left.
+ */
+static bool
+cache_parallel_seek(PgFdwScanState *fsstate)
+{
+	int64		first;
 
-			rte = exec_rt_fetch(var->varno, estate);
+	first = (int64) pg_atomic_fetch_add_u32(&fsstate->pscan->next_chunk, 1) *
+		PGC_PARALLEL_CHUNK;
+	if (first >= fsstate->cache_nblk)
+		return false;
 
-			if (var->varattno == 0)
-				is_wholerow = true;
-			else
-				attname = get_attname(rte->relid, var->varattno, false);
+	pgcache_reader_seek(fsstate->cache_rd, (int32_t) first,
+						(int32_t) Min(first + PGC_PARALLEL_CHUNK, fsstate->cache_nblk));
+	return true;
+}
 
-			relname = get_rel_name(rte->relid);
-		}
-		else
-			errcontext("processing expression at position %d in select list",
-					   errpos->cur_attno);
-	}
+/*
+ * Drop tuples of the batch that fail cache_filter, return how many are left.
+ */
+static int
+cache_filter_batch(ForeignScanState *node, HeapTuple *tuples, int ntuples)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	int			n = 0;
 
-	if (relname)
+	for (int i = 0; i < ntuples; i++)
 	{
-		if (is_wholerow)
-			errcontext("whole-row reference to foreign table \"%s\"", relname);
-		else if (attname)
-			errcontext("column \"%s\" of foreign table \"%s\"", attname, relname);
+		ExecStoreHeapTuple(tuples[i], slot, false);
+		econtext->ecxt_scantuple = slot;
+		if (ExecQual(fsstate->cache_filter, econtext))
+			tuples[n++] = tuples[i];
+		ResetExprContext(econtext);
 	}
+	ExecClearTuple(slot);
+	return n;
 }
 
 /*
- * Find an equivalence class member expression to be computed as a sort column
- * in the given target.
+ * Get next batch of a cache hit, replacing the previous batch in batch_cxt.
  */
-Expr *
-find_em_expr_for_input_target(PlannerInfo *root,
-							  EquivalenceClass *ec,
-							  PathTarget *target)
+static void
+cache_fetch_more_data(ForeignScanState *node)
 {
-	ListCell   *lc1;
-	int			i;
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	MemoryContext oldcontext;
 
-	i = 0;
-	foreach(lc1, target->exprs)
+	fsstate->tuples = NULL;
+	MemoryContextReset(fsstate->batch_cxt);
+	oldcontext = MemoryContextSwitchTo(fsstate->batch_cxt);
+
+	for (;;)
 	{
-		Expr	   *expr = (Expr *) lfirst(lc1);
-		Index		sgref = get_pathtarget_sortgroupref(target, i);
-		ListCell   *lc2;
+		int			ntuples;
 
-		/* Ignore non-sort expressions */
-		if (sgref == 0 ||
-			get_sortgroupref_clause_noerr(sgref,
-										  root->parse->sortClause) == NULL)
+		ntuples = pgcache_reader_next(fsstate->cache_rd, &fsstate->tuples);
+		fsstate->num_tuples = ntuples;
+		if (ntuples == 0 && fsstate->pscan && fsstate->pscan->split &&
+			cache_parallel_seek(fsstate))
 		{
-			i++;
+			/* done with our chunk, on to the next one */
+			MemoryContextReset(fsstate->batch_cxt);
 			continue;
 		}
+		if (ntuples == 0 || !fsstate->cache_filter)
+			break;
 
-		/* We ignore binary-compatible relabeling on both ends */
-		while (expr && IsA(expr, RelabelType))
-			expr = ((RelabelType *) expr)->arg;
-
-		/* Locate an EquivalenceClass member matching this expr, if any */
-		foreach(lc2, ec->ec_members)
-		{
-			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
-			Expr	   *em_expr;
+		fsstate->num_tuples = cache_filter_batch(node, fsstate->tuples, ntuples);
+		if (fsstate->num_tuples > 0)
+			break;
+		/* nothing left of this batch, on to the next one */
+		MemoryContextReset(fsstate->batch_cxt);
+	}
+	fsstate->next_tuple = 0;
+	fsstate->eof_reached = (fsstate->num_tuples == 0);
 
-			/* Don't match constants */
-			if (em->em_is_const)
-				continue;
+	MemoryContextSwitchTo(oldcontext);
 
-			/* Ignore child members */
-			if (em->em_is_child)
-				continue;
+	if (fsstate->eof_reached)
+		cache_close_reader(fsstate);
+}
 
-			/* Match if same expression (after stripping relabel) */
-			em_expr = em->em_expr;
-			while (em_expr && IsA(em_expr, RelabelType))
-				em_expr = ((RelabelType *) em_expr)->arg;
+/*
+ * Close the cache reader of the scan, if any.
+ */
+static void
+cache_close_reader(PgFdwScanState *fsstate)
+{
+	if (fsstate->cache_rd)
+	{
+		pgcache_reader_close(fsstate->cache_rd);
+		fsstate->cache_rd = NULL;
+		cache_flush_stats(fsstate);
+	}
+}
 
-			if (equal(em_expr, expr))
-				return em->em_expr;
-		}
+/*
+ * A batch of a cached scan gone remote, fetched in us.  Add it to the 
+ * populate of a miss, and finish up at the end of the result.  If the 
+ * populate fails, we just go on without it.
+ */
+static void
+cache_remote_batch(ForeignScanState *node, int64_t us)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
 
-		i++;
+	fsstate->cache_remote_us += us;
+	if (fsstate->cache_wr &&
+		pgcache_writer_add(fsstate->cache_wr, fsstate->num_tuples, fsstate->tuples) < 0)
+	{
+		(void) pgcache_writer_close(fsstate->cache_wr);
+		fsstate->cache_wr = NULL;
 	}
 
-	elog(ERROR, "could not find pathkey item to sort");
-	return NULL;				/* keep compiler quiet */
+	if (fsstate->eof_reached)
+		cache_finish_remote(node);
 }
 
-/* 
- * pgc_fdw: foundation db cache 
- *   Here we took an extremely simple and naive approach.   We first
- *   check if we have a valid cache result, if no, we will simply
- *   execute the query, cache all data into foundation db, and claim
- *   we have a valid cache result.   Next, we simply pull the whole 
- *   result set into batch memory context.
- *
- *   It will be ugly if the query result is huge -- but, this will 
- *   be ugly for pg fdw anyway regardless how we do cache.
+/*
+ * End of the result of a cached scan gone remote: publish the entry we
+ * populated, and close the remote cursor.
  */
-void cache_create_cursor(ForeignScanState *node)
+static void
+cache_finish_remote(ForeignScanState *node)
 {
 	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
-	int			numParams = fsstate->numParams;
-	const char **values = fsstate->param_values;
-	PGconn	   *conn = fsstate->conn;
-	PGresult   *res;
-	MemoryContext oldctxt;
-	StringInfoData buf;
-	int64_t ts;
-	int64_t to;
-	int32_t status;
-	unsigned cursor_number;
 
-	fsstate->tuples = NULL;
-	fsstate->next_tuple = 0;
-	fsstate->num_tuples = 0;
-	MemoryContextReset(fsstate->batch_cxt);
-	oldctxt = MemoryContextSwitchTo(fsstate->batch_cxt);
+	pgcache_stats_add(&fsstate->cache_stats, PGC_STAT_REMOTE_US, fsstate->cache_remote_us);
+	pgcache_stats_latency(fsstate->cache_stats.remote_hist, fsstate->cache_remote_us);
 
-	initStringInfo(&buf);
-	/*
-	 * XXX: 
-	 * We should have put in a uniqifier for each foreign server.
-	 */
-	appendStringInfo(&buf, "Dbid: %d, Query: %s", MyDatabaseId, fsstate->query);
+	if (fsstate->cache_wr)
+	{
+		pgcache_writer_t *wr = fsstate->cache_wr;
 
-	for (int i = 0; i < numParams; i++) {
-		if (values[i] == NULL) {
-			appendStringInfo(&buf, " ,PARAM %d: NULL", i);
-		} else {
-			appendStringInfo(&buf, " ,PARAM %d: {%s}", i, values[i]);
+		/*
+		 * we don't care about return status, if it fail, it is marked in
+		 * cache metadata, but the data we fetched this time is still good.
+		 */
+		fsstate->cache_wr = NULL;
+		if (pgcache_writer_close(wr) >= 0 && fsstate->cache_subsume)
+		{
+			char		relsha[20];
+
+			pgcache_rel_sha(RelationGetRelid(fsstate->rel), relsha);
+			pgcache_shape_register(relsha, &fsstate->cache_qk,
+								   fsstate->retrieved_attrs, fsstate->cache_conds);
 		}
 	}
 
-	ts = get_ts();
-	to = (int64_t )fsstate->cache_timeout;
-	to *= 1000000;
-	qry_key_build(&fsstate->cache_qk, buf.data);
+	fsstate->cache_remote = false;
+	close_cursor(fsstate->conn, fsstate->cursor_number, fsstate->conn_state);
+	cache_flush_stats(fsstate);
+}
 
-	status = pgcache_get_status(&fsstate->cache_qk, ts, &to, buf.data);
-	CHECK_COND(status != QRY_FAIL, "failed to cache query %s", buf.data);
+/*
+ * ReScan or End of a cached scan, which may have gone remote.  The 
+ * populate of a miss gets the rest of the result first, so that the entry
+ * is there for the next scan even if this one stopped early.
+ */
+static void
+cache_end_remote(ForeignScanState *node)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
 
-	if (status >= 0) {
-		status = pgcache_retrieve(&fsstate->cache_qk, to, &fsstate->num_tuples, &fsstate->tuples);
-		if (status >= 0) {
-			fsstate->eof_reached = true;
-		}
-		CHECK_COND(status != QRY_FAIL, "failed to cache query %s", buf.data);
-	}
-		
-	if (status == QRY_FETCH || status == QRY_FDB_LIMIT_REACHED) {
-		char sql[64];
-		cursor_number = GetCursorNumber(conn);
-		snprintf(sql, sizeof(sql), "FETCH ALL FROM C%u", cursor_number);
-		resetStringInfo(&buf);
-		appendStringInfo(&buf, "DECLARE c%u CURSOR FOR\n%s", cursor_number, fsstate->query);
-		/*
-		 * Notice that we pass NULL for paramTypes, thus forcing the remote server
-		 * to infer types for all parameters.  Since we explicitly cast every
-		 * parameter (see deparse.c), the "inference" is trivial and will produce
-		 * the desired result.  This allows us to avoid assuming that the remote
-		 * server has the same OIDs we do for the parameters' types.
-		 */
-		if (!PQsendQueryParams(conn, buf.data, numParams,
-					NULL, values, NULL, NULL, 0))
-			pgfdw_report_error(ERROR, NULL, conn, false, buf.data);
+	while (fsstate->cache_wr && !fsstate->eof_reached)
+		fetch_more_data(node);
 
-		res = pgfdw_get_result(conn, buf.data);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-			pgfdw_report_error(ERROR, res, conn, true, fsstate->query);
-		}
-		PQclear(res);
+	if (fsstate->cache_remote)
+		cache_finish_remote(node);
+}
 
-		res = 0;
-		PG_TRY();
-		{
-			res = pgfdw_exec_query(conn, sql);
-			if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-				pgfdw_report_error(ERROR, res, conn, false, fsstate->query);
-			}
+/*
+ * EXPLAIN ANALYZE output of the cache, totals over all rescans.  The cache
+ * key is that of the last one, a parameterized scan has one per value.
+ */
+static void
+cache_explain(PgFdwScanState *fsstate, ExplainState *es)
+{
+	const int64_t *c;
+	char		shahex[41];
 
-			fsstate->num_tuples = PQntuples(res);
-			fsstate->tuples = (HeapTuple *) palloc0(fsstate->num_tuples * sizeof(HeapTuple));
-			for (int i = 0; i < fsstate->num_tuples; i++) {
-				fsstate->tuples[i] = make_tuple_from_result_row(res, i, 
-						fsstate->rel,
-						fsstate->attinmeta,
-						fsstate->retrieved_attrs,
-						node,
-						fsstate->temp_cxt);
-			}
-			fsstate->eof_reached = true;
-			close_cursor(conn, cursor_number);
-		}
-		PG_FINALLY(); 
+	/* a reader still open has not flushed what it read yet */
+	cache_flush_stats(fsstate);
+	c = fsstate->cache_totals.counters;
+
+	if (c[PGC_STAT_HITS] + c[PGC_STAT_MISSES] + c[PGC_STAT_BYPASSES] == 0)
+		return;
+
+	hex_encode(fsstate->cache_qk.SHA, 20, shahex);
+	shahex[40] = '\0';
+	ExplainPropertyText("Cache Key", shahex, es);
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		StringInfoData buf;
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "hits=" INT64_FORMAT, c[PGC_STAT_HITS]);
+		if (c[PGC_STAT_STALE_HITS] > 0)
+			appendStringInfo(&buf, " stale=" INT64_FORMAT, c[PGC_STAT_STALE_HITS]);
+		if (c[PGC_STAT_L1_HITS] > 0)
+			appendStringInfo(&buf, " shared=" INT64_FORMAT, c[PGC_STAT_L1_HITS]);
+		appendStringInfo(&buf, " misses=" INT64_FORMAT, c[PGC_STAT_MISSES]);
+		if (c[PGC_STAT_WAITS] > 0)
+			appendStringInfo(&buf, " waits=" INT64_FORMAT, c[PGC_STAT_WAITS]);
+		if (c[PGC_STAT_BYPASSES] > 0)
+			appendStringInfo(&buf, " bypasses=" INT64_FORMAT, c[PGC_STAT_BYPASSES]);
+		if (c[PGC_STAT_POPULATES] > 0)
+			appendStringInfo(&buf, " populates=" INT64_FORMAT, c[PGC_STAT_POPULATES]);
+		if (c[PGC_STAT_POPULATE_FAILS] + c[PGC_STAT_LIMIT_REACHED] > 0)
+			appendStringInfo(&buf, " failed=" INT64_FORMAT,
+							 c[PGC_STAT_POPULATE_FAILS] + c[PGC_STAT_LIMIT_REACHED]);
+		ExplainPropertyText("Cache", buf.data, es);
+
+		resetStringInfo(&buf);
+		appendStringInfo(&buf, "round trips=" INT64_FORMAT " read=" INT64_FORMAT "kB written=" INT64_FORMAT "kB",
+						 c[PGC_STAT_FDB_ROUND_TRIPS],
+						 (c[PGC_STAT_BYTES_READ] + 1023) / 1024,
+						 (c[PGC_STAT_BYTES_WRITTEN] + 1023) / 1024);
+		ExplainPropertyText("Cache FDB", buf.data, es);
+
+		if (es->timing)
 		{
-			if (res) {
-				PQclear(res);
-			}
-			res = 0;
+			resetStringInfo(&buf);
+			appendStringInfo(&buf, "status=%.3f read=%.3f populate=%.3f remote=%.3f",
+							 c[PGC_STAT_STATUS_US] / 1000.0,
+							 c[PGC_STAT_READ_US] / 1000.0,
+							 c[PGC_STAT_POPULATE_US] / 1000.0,
+							 c[PGC_STAT_REMOTE_US] / 1000.0);
+			ExplainPropertyText("Cache Time", buf.data, es);
 		}
-		PG_END_TRY();
-
-		if (status == QRY_FETCH) {
-			/* 
-		 	 * we don't care about return status, if it fail, we will mark it in cache metadata
-		 	 * but the data we fectched this time is still good.
-		 	 */
-			pgcache_populate(&fsstate->cache_qk, to, fsstate->num_tuples, fsstate->tuples);
+		pfree(buf.data);
+	}
+	else
+	{
+		ExplainPropertyInteger("Cache Hits", NULL, c[PGC_STAT_HITS], es);
+		ExplainPropertyInteger("Cache Stale Hits", NULL, c[PGC_STAT_STALE_HITS], es);
+		ExplainPropertyInteger("Cache Shared Memory Hits", NULL, c[PGC_STAT_L1_HITS], es);
+		ExplainPropertyInteger("Cache Misses", NULL, c[PGC_STAT_MISSES], es);
+		ExplainPropertyInteger("Cache Waits", NULL, c[PGC_STAT_WAITS], es);
+		ExplainPropertyInteger("Cache Bypasses", NULL, c[PGC_STAT_BYPASSES], es);
+		ExplainPropertyInteger("Cache Populates", NULL, c[PGC_STAT_POPULATES], es);
+		ExplainPropertyInteger("Cache Populate Failures", NULL,
+							   c[PGC_STAT_POPULATE_FAILS] + c[PGC_STAT_LIMIT_REACHED], es);
+		ExplainPropertyInteger("FDB Round Trips", NULL, c[PGC_STAT_FDB_ROUND_TRIPS], es);
+		ExplainPropertyInteger("Cache Bytes Read", "bytes", c[PGC_STAT_BYTES_READ], es);
+		ExplainPropertyInteger("Cache Bytes Written", "bytes", c[PGC_STAT_BYTES_WRITTEN], es);
+		if (es->timing)
+		{
+			ExplainPropertyFloat("Cache Status Time", "ms",
+								 c[PGC_STAT_STATUS_US] / 1000.0, 3, es);
+			ExplainPropertyFloat("Cache Read Time", "ms",
+								 c[PGC_STAT_READ_US] / 1000.0, 3, es);
+			ExplainPropertyFloat("Cache Populate Time", "ms",
+								 c[PGC_STAT_POPULATE_US] / 1000.0, 3, es);
+			ExplainPropertyFloat("Remote Time", "ms",
+								 c[PGC_STAT_REMOTE_US] / 1000.0, 3, es);
 		}
 	}
+}
 
-	MemoryContextSwitchTo(oldctxt);
-
-	/* Now we consider this cursor (from cache) existed. */
-	fsstate->cursor_exists = true;
+/*
+ * Add what the scan counted so far to the shared cache statistics, under
+ * its foreign table, if it is a base relation scan, and its cache entry.
+ */
+static void
+cache_flush_stats(PgFdwScanState *fsstate)
+{
+	pgcache_stats_accum(&fsstate->cache_totals, &fsstate->cache_stats);
+	pgcache_stats_flush(fsstate->rel ? RelationGetRelid(fsstate->rel) : InvalidOid,
+						fsstate->cache_key_prefix ? &fsstate->cache_qk : NULL,
+						&fsstate->cache_stats);
 }
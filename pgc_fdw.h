@@ -16,6 +16,7 @@
 #include "foreign/foreign.h"
 #include "lib/stringinfo.h"
 #include "libpq-fe.h"
+#include "nodes/execnodes.h"
 #include "nodes/pathnodes.h"
 #include "utils/relcache.h"
 
@@ -75,8 +76,12 @@ typedef struct PgFdwRelationInfo
 
 	/* Options extracted from catalogs. */
 	bool		use_remote_estimate;
+	bool		use_binary_format;	/* fetch results in binary */
+	bool		async_capable;	/* start the remote query at executor startup */
 	Cost		fdw_startup_cost;
 	Cost		fdw_tuple_cost;
+	Cost		cache_startup_cost;
+	Cost		cache_tuple_cost;
 	List	   *shippable_extensions;	/* OIDs of whitelisted extensions */
 
 	/* Cached catalog information. */
@@ -87,6 +92,12 @@ typedef struct PgFdwRelationInfo
 	int			fetch_size;		/* fetch size for this remote table */
 
 	int			cache_timeout;
+	int			cache_stale_grace;	/* seconds stale entries are still served */
+	int			cache_compression;	/* codec of cached blocks */
+	int			cache_param_batch;	/* parameter values fetched together */
+	double		cache_rows[2];	/* fresh cached rows without and with LIMIT,
+								 * see cache_plan_rows */
+	int			cache_rows_done;	/* bits of those looked up already */
 
 	/*
 	 * Name of the relation, for use while EXPLAINing ForeignScan.  It is used
@@ -126,17 +137,29 @@ typedef struct PgFdwRelationInfo
 	int			relation_index;
 } PgFdwRelationInfo;
 
+/*
+ * Extra control information relating to a connection.
+ */
+typedef struct PgFdwConnState
+{
+	ForeignScanState *pendingScan;	/* scan with a FETCH in flight, if any */
+} PgFdwConnState;
+
 /* in pgc_fdw.c */
 extern int	set_transmission_modes(void);
 extern void reset_transmission_modes(int nestlevel);
+extern void process_pending_request(ForeignScanState *node);
 
 /* in connection.c */
-extern PGconn *GetConnection(UserMapping *user, bool will_prep_stmt);
+extern PGconn *GetConnection(UserMapping *user, bool will_prep_stmt,
+							 PgFdwConnState **state);
 extern void ReleaseConnection(PGconn *conn);
 extern unsigned int GetCursorNumber(PGconn *conn);
 extern unsigned int GetPrepStmtNumber(PGconn *conn);
 extern PGresult *pgfdw_get_result(PGconn *conn, const char *query);
-extern PGresult *pgfdw_exec_query(PGconn *conn, const char *query);
+extern PGresult *pgfdw_get_next_result(PGconn *conn, const char *query);
+extern PGresult *pgfdw_exec_query(PGconn *conn, const char *query,
+								  PgFdwConnState *state);
 extern void pgfdw_report_error(int elevel, PGresult *res, PGconn *conn,
 							   bool clear, const char *sql);
 
@@ -163,7 +186,16 @@ extern void deparseInsertSql(StringInfo buf, RangeTblEntry *rte,
 							 Index rtindex, Relation rel,
 							 List *targetAttrs, bool doNothing,
 							 List *withCheckOptionList, List *returningList,
-							 List **retrieved_attrs);
+							 List **retrieved_attrs, int *values_end_len);
+extern void rebuildInsertSql(StringInfo buf, const char *orig_query,
+							 int values_end_len, int num_params, int num_rows);
+extern void deparseBatchUpdateSql(StringInfo buf, RangeTblEntry *rte,
+								  Index rtindex, Relation rel,
+								  List *targetAttrs);
+extern void deparseBatchDeleteSql(StringInfo buf, Relation rel);
+extern void deparseCopyFromSql(StringInfo buf, RangeTblEntry *rte,
+							   Index rtindex, Relation rel,
+							   List *targetAttrs, bool binary);
 extern void deparseUpdateSql(StringInfo buf, RangeTblEntry *rte,
 							 Index rtindex, Relation rel,
 							 List *targetAttrs,
@@ -204,6 +236,8 @@ extern void deparseSelectStmtForRel(StringInfo buf, PlannerInfo *root,
 									bool has_final_sort, bool has_limit,
 									bool is_subquery,
 									List **retrieved_attrs, List **params_list);
+extern void deparseRemoteCondition(StringInfo buf, PlannerInfo *root,
+								   RelOptInfo *baserel, Expr *expr);
 extern const char *get_jointype_name(JoinType jointype);
 
 /* in shippable.c */
@@ -216,5 +250,6 @@ extern void _PG_fini(void);
 /* cache.c */
 extern void pgcache_init(void);
 extern void pgcache_fini(void);
+extern int	pgcache_codec_by_name(const char *name);
 
 #endif							/* pgc_fdw_H */
@@ -2634,3 +2634,264 @@ SELECT count(*) FROM ft1;
 -- error here
 PREPARE TRANSACTION 'fdw_tpc';
 ROLLBACK;
+
+-- ===================================================================
+-- cache_compression
+-- ===================================================================
+CREATE TABLE "S 1".codec_t (c1 int PRIMARY KEY, c2 text, c3 numeric, c4 date);
+INSERT INTO "S 1".codec_t
+	SELECT id, repeat(to_char(id, 'FM00000'), id % 20), id / 7.0, '2000-01-01'::date + id
+	FROM generate_series(1, 2000) id;
+UPDATE "S 1".codec_t SET c2 = NULL, c3 = NULL WHERE c1 % 100 = 0;
+CREATE FOREIGN TABLE ft_codec (c1 int, c2 text, c3 numeric, c4 date)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'codec_t', cache_compression 'pglz');
+-- The first scan populates compressed blocks, the second reads them back
+SELECT count(*) FROM ((SELECT * FROM ft_codec EXCEPT SELECT * FROM "S 1".codec_t)
+  UNION ALL (SELECT * FROM "S 1".codec_t EXCEPT SELECT * FROM ft_codec)) d;
+SELECT count(*) FROM ((SELECT * FROM ft_codec EXCEPT SELECT * FROM "S 1".codec_t)
+  UNION ALL (SELECT * FROM "S 1".codec_t EXCEPT SELECT * FROM ft_codec)) d;
+-- Clean-up
+DROP FOREIGN TABLE ft_codec;
+DROP TABLE "S 1".codec_t;
+
+-- ===================================================================
+-- cache_stale_grace
+-- ===================================================================
+CREATE TABLE "S 1".stale_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".stale_t SELECT id, 's' || id FROM generate_series(1, 500) id;
+CREATE FOREIGN TABLE ft_stale (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'stale_t',
+                           cache_timeout '1', cache_stale_grace '3600');
+SELECT count(*) FROM ((SELECT * FROM ft_stale EXCEPT SELECT * FROM "S 1".stale_t)
+  UNION ALL (SELECT * FROM "S 1".stale_t EXCEPT SELECT * FROM ft_stale)) d;
+DO $$ BEGIN PERFORM pg_sleep(1.5); END $$;
+-- Expired but within grace: one scan refreshes it, the other is served stale
+SELECT count(*) FROM ((SELECT * FROM ft_stale EXCEPT SELECT * FROM "S 1".stale_t)
+  UNION ALL (SELECT * FROM "S 1".stale_t EXCEPT SELECT * FROM ft_stale)) d;
+SELECT count(*) FROM ((SELECT * FROM ft_stale EXCEPT SELECT * FROM "S 1".stale_t)
+  UNION ALL (SELECT * FROM "S 1".stale_t EXCEPT SELECT * FROM ft_stale)) d;
+-- Clean-up
+DROP FOREIGN TABLE ft_stale;
+DROP TABLE "S 1".stale_t;
+
+-- ===================================================================
+-- cache_param_batch
+-- ===================================================================
+CREATE TABLE "S 1".param_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".param_t SELECT id, 'p' || id FROM generate_series(1, 100) id;
+CREATE FOREIGN TABLE ft_param (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'param_t',
+                           cache_timeout '1', cache_param_batch '10');
+-- One entry per parameter value, and the values are remembered
+SELECT count(*) FROM (
+  SELECT t.c1, (SELECT c2 FROM ft_param f WHERE f.c1 = t.c1) FROM generate_series(1, 30) t(c1)
+  EXCEPT SELECT c1, c2 FROM "S 1".param_t WHERE c1 <= 30) d;
+DO $$ BEGIN PERFORM pg_sleep(1.5); END $$;
+-- All expired: each miss fetches the remembered values that are missing too
+SELECT count(*) FROM (
+  SELECT t.c1, (SELECT c2 FROM ft_param f WHERE f.c1 = t.c1) FROM generate_series(1, 30) t(c1)
+  EXCEPT SELECT c1, c2 FROM "S 1".param_t WHERE c1 <= 30) d;
+-- Clean-up
+DROP FOREIGN TABLE ft_param;
+DROP TABLE "S 1".param_t;
+
+-- ===================================================================
+-- use_binary_format
+-- ===================================================================
+CREATE TABLE "S 1".bin_t (c1 int PRIMARY KEY, c2 text, c3 numeric, c4 timestamptz,
+	c5 bool, c6 int[], c7 user_enum);
+INSERT INTO "S 1".bin_t
+	SELECT id, 'b' || id, id / 3.0, '1970-01-01'::timestamptz + (id || ' hours')::interval,
+	       id % 2 = 0, ARRAY[id, -id], 'bar'::user_enum
+	FROM generate_series(1, 500) id;
+UPDATE "S 1".bin_t SET c2 = NULL, c6 = NULL WHERE c1 % 50 = 0;
+CREATE FOREIGN TABLE ft_bin (c1 int, c2 text, c3 numeric, c4 timestamptz,
+	c5 bool, c6 int[], c7 user_enum)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'bin_t', use_binary_format 'true');
+-- Populated from a binary cursor, then read back from the cache
+SELECT count(*) FROM ((SELECT * FROM ft_bin EXCEPT SELECT * FROM "S 1".bin_t)
+  UNION ALL (SELECT * FROM "S 1".bin_t EXCEPT SELECT * FROM ft_bin)) d;
+SELECT count(*) FROM ((SELECT * FROM ft_bin EXCEPT SELECT * FROM "S 1".bin_t)
+  UNION ALL (SELECT * FROM "S 1".bin_t EXCEPT SELECT * FROM ft_bin)) d;
+-- And straight from the remote cursor
+ALTER FOREIGN TABLE ft_bin OPTIONS (ADD cache_timeout '0');
+SELECT count(*) FROM ((SELECT * FROM ft_bin EXCEPT SELECT * FROM "S 1".bin_t)
+  UNION ALL (SELECT * FROM "S 1".bin_t EXCEPT SELECT * FROM ft_bin)) d;
+-- Clean-up
+DROP FOREIGN TABLE ft_bin;
+DROP TABLE "S 1".bin_t;
+
+-- ===================================================================
+-- async_capable
+-- ===================================================================
+CREATE TABLE "S 1".async_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".async_t SELECT id, 'a' || id FROM generate_series(1, 600) id;
+CREATE VIEW "S 1".async_v1 AS SELECT * FROM "S 1".async_t WHERE c1 <= 300;
+CREATE VIEW "S 1".async_v2 AS SELECT * FROM "S 1".async_t WHERE c1 > 300;
+-- Not cached, so both remote queries start when the Append starts up
+CREATE FOREIGN TABLE ft_async1 (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'async_v1',
+                           cache_timeout '0', async_capable 'true');
+CREATE FOREIGN TABLE ft_async2 (c1 int, c2 text)
+  SERVER loopback2 OPTIONS (schema_name 'S 1', table_name 'async_v2',
+                            cache_timeout '0', async_capable 'true');
+SELECT count(*) FROM (
+  (SELECT * FROM ft_async1 UNION ALL SELECT * FROM ft_async2)
+  EXCEPT ALL
+  (SELECT * FROM "S 1".async_t WHERE c1 <= 300 UNION ALL SELECT * FROM "S 1".async_t WHERE c1 > 300)) d;
+SELECT count(*) FROM (SELECT * FROM ft_async1 UNION ALL SELECT * FROM ft_async2) d;
+-- Clean-up
+DROP FOREIGN TABLE ft_async1;
+DROP FOREIGN TABLE ft_async2;
+DROP VIEW "S 1".async_v1;
+DROP VIEW "S 1".async_v2;
+DROP TABLE "S 1".async_t;
+
+-- ===================================================================
+-- batch_size
+-- ===================================================================
+CREATE TABLE "S 1".batch_t (c1 int PRIMARY KEY, c2 text);
+CREATE FOREIGN TABLE ft_batch (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'batch_t', batch_size '3');
+-- Three batches of 3, and the last row flushed at the end
+INSERT INTO ft_batch SELECT id, 'b' || id FROM generate_series(1, 10) id;
+SELECT * FROM "S 1".batch_t ORDER BY c1;
+-- Clean-up
+DROP FOREIGN TABLE ft_batch;
+DROP TABLE "S 1".batch_t;
+
+-- ===================================================================
+-- use_remote_copy
+-- ===================================================================
+CREATE TABLE "S 1".copy_t (c1 int PRIMARY KEY, c2 text);
+CREATE FOREIGN TABLE ft_copy (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'copy_t', use_remote_copy 'true');
+INSERT INTO ft_copy SELECT id, 'c' || id FROM generate_series(1, 5) id;
+-- Values COPY text format has to escape
+INSERT INTO ft_copy VALUES (6, E'tab\there'), (7, NULL), (8, E'back\\slash'), (9, E'new\nline');
+SELECT * FROM "S 1".copy_t WHERE c1 <= 5 ORDER BY c1;
+SELECT count(*) FROM "S 1".copy_t t
+  JOIN (VALUES (6, E'tab\there'), (8, E'back\\slash'), (9, E'new\nline')) v(c1, c2)
+  ON t.c1 = v.c1 AND t.c2 = v.c2;
+SELECT c1 FROM "S 1".copy_t WHERE c2 IS NULL;
+-- Clean-up
+DROP FOREIGN TABLE ft_copy;
+DROP TABLE "S 1".copy_t;
+
+-- ===================================================================
+-- updates and deletes batched by ctid
+-- ===================================================================
+CREATE TABLE "S 1".ctid_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".ctid_t SELECT id, 'u' || id FROM generate_series(1, 10) id;
+CREATE FOREIGN TABLE ft_ctid (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'ctid_t', batch_size '2');
+-- random() keeps the quals local, so rows are modified one by one
+UPDATE ft_ctid SET c2 = c2 || 'x' WHERE c1 % 2 = 0 AND random() >= 0;
+DELETE FROM ft_ctid WHERE c1 > 7 AND random() >= 0;
+SELECT * FROM "S 1".ctid_t ORDER BY c1;
+-- Clean-up
+DROP FOREIGN TABLE ft_ctid;
+DROP TABLE "S 1".ctid_t;
+
+-- ===================================================================
+-- invalidation on commit
+-- ===================================================================
+CREATE TABLE "S 1".inval_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".inval_t VALUES (1, 'a'), (2, 'b'), (3, 'c');
+-- A short timeout, entries of an earlier run are keyed by the old table oid
+CREATE FOREIGN TABLE ft_inval (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'inval_t', cache_timeout '5');
+SELECT * FROM ft_inval ORDER BY c1;
+-- Modifications through the foreign table drop its entries when they commit
+UPDATE ft_inval SET c2 = 'x' WHERE c1 = 1;
+SELECT * FROM ft_inval ORDER BY c1;
+BEGIN;
+INSERT INTO ft_inval VALUES (4, 'd');
+DELETE FROM ft_inval WHERE c1 = 2;
+COMMIT;
+SELECT * FROM ft_inval ORDER BY c1;
+-- Clean-up
+DROP FOREIGN TABLE ft_inval;
+DROP TABLE "S 1".inval_t;
+
+-- ===================================================================
+-- epochs
+-- ===================================================================
+CREATE TABLE "S 1".epoch_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".epoch_t VALUES (1, 'a'), (2, 'b'), (3, 'c');
+CREATE FOREIGN TABLE ft_epoch (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'epoch_t');
+-- Start from an epoch no earlier run has cached anything in
+SELECT pgc_fdw_invalidate_table('ft_epoch');
+SELECT * FROM ft_epoch ORDER BY c1;
+-- A change behind the cache's back is not seen
+UPDATE "S 1".epoch_t SET c2 = 'aa' WHERE c1 = 1;
+SELECT * FROM ft_epoch ORDER BY c1;
+-- until the epoch of the table is bumped
+SELECT pgc_fdw_invalidate_table('ft_epoch');
+SELECT * FROM ft_epoch ORDER BY c1;
+-- or that of its server
+UPDATE "S 1".epoch_t SET c2 = 'bb' WHERE c1 = 2;
+SELECT * FROM ft_epoch ORDER BY c1;
+SELECT pgc_fdw_invalidate_server('loopback');
+SELECT * FROM ft_epoch ORDER BY c1;
+-- Clean-up
+DROP FOREIGN TABLE ft_epoch;
+DROP TABLE "S 1".epoch_t;
+
+-- ===================================================================
+-- cache bypass in transactions that modified the table
+-- ===================================================================
+CREATE TABLE "S 1".inval2_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".inval2_t VALUES (1, 'a'), (2, 'b');
+CREATE FOREIGN TABLE ft_inval2 (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'inval2_t', cache_timeout '5');
+SELECT * FROM ft_inval2 ORDER BY c1;
+-- The transaction sees its own changes, and does not cache them
+BEGIN;
+DELETE FROM ft_inval2 WHERE c1 = 2;
+SELECT * FROM ft_inval2 ORDER BY c1;
+SELECT c2 FROM ft_inval2 WHERE c1 < 10 ORDER BY c2;
+ROLLBACK;
+SELECT * FROM ft_inval2 ORDER BY c1;
+SELECT c2 FROM ft_inval2 WHERE c1 < 10 ORDER BY c2;
+-- Clean-up
+DROP FOREIGN TABLE ft_inval2;
+DROP TABLE "S 1".inval2_t;
+
+-- ===================================================================
+-- batched updates of rows a join reaches twice
+-- ===================================================================
+CREATE TABLE "S 1".ctid2_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".ctid2_t SELECT id, 'u' || id FROM generate_series(1, 4) id;
+CREATE FOREIGN TABLE ft_ctid2 (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'ctid2_t', batch_size '2');
+CREATE TEMP TABLE ctid2_keys (k int);
+INSERT INTO ctid2_keys VALUES (2), (2), (4);
+-- Each row is updated once, as row by row
+UPDATE ft_ctid2 SET c2 = c2 || 'x' FROM ctid2_keys WHERE c1 = k;
+SELECT * FROM "S 1".ctid2_t ORDER BY c1;
+-- Clean-up
+DROP FOREIGN TABLE ft_ctid2;
+DROP TABLE "S 1".ctid2_t;
+DROP TABLE ctid2_keys;
+
+-- ===================================================================
+-- populate of a miss as batches arrive
+-- ===================================================================
+CREATE TABLE "S 1".stream_t (c1 int PRIMARY KEY, c2 text);
+INSERT INTO "S 1".stream_t SELECT id, 's' || id FROM generate_series(1, 3000) id;
+CREATE FOREIGN TABLE ft_stream (c1 int, c2 text)
+  SERVER loopback OPTIONS (schema_name 'S 1', table_name 'stream_t', fetch_size '100');
+-- Start from an epoch no earlier run has cached anything in
+SELECT pgc_fdw_invalidate_table('ft_stream');
+-- random() keeps the LIMIT local, the executor stops after 5 rows
+SELECT count(*) FROM (SELECT c1 FROM ft_stream WHERE random() >= 0 LIMIT 5) s;
+-- The populate got the rest of the result anyway: the same remote query is a hit
+DELETE FROM "S 1".stream_t;
+SELECT count(c1) FROM ft_stream WHERE random() >= 0;
+SELECT pgc_fdw_invalidate_table('ft_stream');
+SELECT count(c1) FROM ft_stream WHERE random() >= 0;
+-- Clean-up
+DROP FOREIGN TABLE ft_stream;
+DROP TABLE "S 1".stream_t;